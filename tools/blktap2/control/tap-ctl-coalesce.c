@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+static int
+tap_ctl_coalesce_message(const int id, const int minor, int type,
+			 tapdisk_message_coalesce_t *coalesce)
+{
+	int err;
+	tapdisk_message_t message;
+
+	memset(&message, 0, sizeof(message));
+	message.type = type;
+	message.cookie = minor;
+	message.u.coalesce = *coalesce;
+
+	err = tap_ctl_connect_send_and_receive(id, &message, 5);
+	if (err)
+		return err;
+
+	if (message.type == TAPDISK_MESSAGE_COALESCE_RSP)
+		*coalesce = message.u.coalesce;
+	else if (message.type == TAPDISK_MESSAGE_ERROR)
+		err = message.u.response.error;
+	else {
+		err = EINVAL;
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+	}
+
+	return err;
+}
+
+int
+tap_ctl_coalesce(const int id, const int minor, const char *path,
+		 const int threads, tapdisk_message_coalesce_t *status)
+{
+	memset(status, 0, sizeof(*status));
+
+	if (strlen(path) >= sizeof(status->path))
+		return ENAMETOOLONG;
+
+	strcpy(status->path, path);
+	status->threads = threads;
+
+	return tap_ctl_coalesce_message(id, minor,
+					TAPDISK_MESSAGE_COALESCE, status);
+}
+
+int
+tap_ctl_coalesce_status(const int id, const int minor,
+			tapdisk_message_coalesce_t *status)
+{
+	memset(status, 0, sizeof(*status));
+
+	return tap_ctl_coalesce_message(id, minor,
+					TAPDISK_MESSAGE_COALESCE_STATUS,
+					status);
+}
+
+int
+tap_ctl_coalesce_cancel(const int id, const int minor,
+			tapdisk_message_coalesce_t *status)
+{
+	memset(status, 0, sizeof(*status));
+
+	return tap_ctl_coalesce_message(id, minor,
+					TAPDISK_MESSAGE_COALESCE_CANCEL,
+					status);
+}
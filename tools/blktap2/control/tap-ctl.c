@@ -247,7 +247,8 @@ usage:
 static void
 tap_cli_create_usage(FILE *stream)
 {
-	fprintf(stream, "usage: create <-a args> [-d device name]\n");
+	fprintf(stream, "usage: create <-a args> [-d device name] "
+		"[-I rwio|lio|uring[,poll][,sqpoll]]\n");
 }
 
 static int
@@ -260,7 +261,7 @@ tap_cli_create(int argc, char **argv)
 	devname = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:d:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:d:I:h")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -268,6 +269,11 @@ tap_cli_create(int argc, char **argv)
 		case 'd':
 			devname = optarg;
 			break;
+		case 'I':
+			/* picked up by the tapdisk we are about to spawn */
+			if (setenv("TAPDISK2_IO", optarg, 1))
+				return errno;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -702,6 +708,257 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_cache_stats_usage(FILE *stream)
+{
+	fprintf(stream, "usage: cache-stats <-p pid> <-m minor>\n");
+}
+
+static int
+tap_cli_cache_stats(int argc, char **argv)
+{
+	int c, err, pid, minor;
+	tapdisk_message_cache_stats_t stats;
+
+	pid   = -1;
+	minor = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_cache_stats_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_cache_stats(pid, minor, &stats);
+	if (err)
+		return err;
+
+	printf("reads=%"PRIu64" hits=%"PRIu64" misses=%"PRIu64"\n",
+	       stats.reads, stats.hits, stats.misses);
+
+	if (stats.shared)
+		printf("shared: size=%"PRIu64" pages=%"PRIu64" used=%"PRIu64
+		       " hits=%"PRIu64" misses=%"PRIu64" inserts=%"PRIu64
+		       " evictions=%"PRIu64"\n",
+		       stats.size, stats.pages, stats.used,
+		       stats.shared_hits, stats.shared_misses,
+		       stats.inserts, stats.evictions);
+
+	return 0;
+
+usage:
+	tap_cli_cache_stats_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_coalesce_usage(FILE *stream)
+{
+	fprintf(stream, "usage: coalesce <-p pid> <-m minor> "
+		"[-n image [-j threads]] [-s status] [-c cancel]\n");
+}
+
+static int
+tap_cli_coalesce(int argc, char **argv)
+{
+	int c, err, pid, minor, threads, cancel;
+	const char *name;
+	tapdisk_message_coalesce_t status;
+	static const char *states[] = {
+		[TAPDISK_COALESCE_IDLE]    = "idle",
+		[TAPDISK_COALESCE_RUNNING] = "running",
+		[TAPDISK_COALESCE_DONE]    = "done",
+		[TAPDISK_COALESCE_FAILED]  = "failed",
+	};
+
+	pid     = -1;
+	minor   = -1;
+	threads = 0;
+	cancel  = 0;
+	name    = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:n:j:sch")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			break;
+		case 'c':
+			cancel = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_coalesce_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || (name && cancel))
+		goto usage;
+
+	if (name)
+		err = tap_ctl_coalesce(pid, minor, name, threads, &status);
+	else if (cancel)
+		err = tap_ctl_coalesce_cancel(pid, minor, &status);
+	else
+		err = tap_ctl_coalesce_status(pid, minor, &status);
+	if (err)
+		return err;
+
+	printf("state=%s", status.state <= TAPDISK_COALESCE_FAILED ?
+	       states[status.state] : "unknown");
+	if (status.state != TAPDISK_COALESCE_IDLE)
+		printf(" image=%s error=%d blocks=%"PRIu64"/%"PRIu64
+		       " written=%"PRIu64" skipped=%"PRIu64" usecs=%"PRIu64,
+		       status.path, status.error,
+		       status.blocks_done, status.blocks,
+		       status.bytes_written, status.bytes_skipped,
+		       status.usecs);
+	printf("\n");
+
+	return 0;
+
+usage:
+	tap_cli_coalesce_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_stats_usage(FILE *stream)
+{
+	fprintf(stream, "usage: stats <-p pid> <-m minor> [-r reset] "
+		"[-v histograms]\n");
+}
+
+static void
+tap_cli_stats_histogram(const char *name, const uint64_t *lat)
+{
+	int i;
+
+	printf("  %s:", name);
+	for (i = 0; i < TAPDISK_STATS_LAT_BUCKETS; i++)
+		if (lat[i]) {
+			if (i == TAPDISK_STATS_LAT_BUCKETS - 1)
+				printf(" >=%lu:%"PRIu64, 1UL << (i - 1), lat[i]);
+			else
+				printf(" <%lu:%"PRIu64, 1UL << i, lat[i]);
+		}
+	printf("\n");
+}
+
+static int
+tap_cli_stats(int argc, char **argv)
+{
+	int c, i, err, pid, minor, reset, verbose;
+	tapdisk_message_stats_t stats;
+	static const char *ops[] = {
+		[TAPDISK_STATS_READ]  = "read",
+		[TAPDISK_STATS_WRITE] = "write",
+		[TAPDISK_STATS_FLUSH] = "flush",
+	};
+
+	pid     = -1;
+	minor   = -1;
+	reset   = 0;
+	verbose = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:rvh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'r':
+			reset = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_stats_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_stats(pid, minor, reset, &stats);
+	if (err)
+		return err;
+
+	printf("usecs=%"PRIu64" errors=%"PRIu64" retries=%"PRIu64
+	       " max_depth=%u\n", stats.usecs, stats.errors, stats.retries,
+	       stats.max_depth);
+
+	for (i = 0; i < TAPDISK_STATS_OPS; i++) {
+		uint64_t n = stats.requests[i];
+
+		printf("%s: requests=%"PRIu64" sectors=%"PRIu64
+		       " ring_avg_usecs=%"PRIu64" backend_avg_usecs=%"PRIu64
+		       "\n", ops[i], n, stats.sectors[i],
+		       n ? stats.ring_usecs[i] / n : 0,
+		       n ? stats.backend_usecs[i] / n : 0);
+
+		if (verbose && n) {
+			tap_cli_stats_histogram("ring", stats.ring_lat[i]);
+			tap_cli_stats_histogram("backend",
+						stats.backend_lat[i]);
+		}
+	}
+
+	if (verbose) {
+		printf("depth:");
+		for (i = 0; i < TAPDISK_STATS_DEPTH_BUCKETS; i++)
+			if (stats.depth[i])
+				printf(" %d%s:%"PRIu64, i,
+				       i == TAPDISK_STATS_DEPTH_BUCKETS - 1 ?
+				       "+" : "", stats.depth[i]);
+		printf("\n");
+	}
+
+	printf("queue: batches=%"PRIu64" iocbs=%"PRIu64" merged=%"PRIu64
+	       " deferrals=%"PRIu64"\n", stats.queue_batches,
+	       stats.queue_iocbs, stats.queue_merged, stats.queue_deferrals);
+
+	return 0;
+
+usage:
+	tap_cli_stats_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +974,9 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "cache-stats",  .func = tap_cli_cache_stats   },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
+	{ .name = "stats",        .func = tap_cli_stats         },
 };
 
 #define print_commands()					\
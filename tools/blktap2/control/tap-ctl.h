@@ -96,6 +96,19 @@ int tap_ctl_close(const int id, const int minor, const int force);
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+int tap_ctl_cache_stats(const int id, const int minor,
+			tapdisk_message_cache_stats_t *stats);
+
+int tap_ctl_coalesce(const int id, const int minor, const char *path,
+		     const int threads, tapdisk_message_coalesce_t *status);
+int tap_ctl_coalesce_status(const int id, const int minor,
+			    tapdisk_message_coalesce_t *status);
+int tap_ctl_coalesce_cancel(const int id, const int minor,
+			    tapdisk_message_coalesce_t *status);
+
+int tap_ctl_stats(const int id, const int minor, const int reset,
+		  tapdisk_message_stats_t *stats);
+
 int tap_ctl_blk_major(void);
 
 #endif
@@ -154,6 +154,7 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
         prv->fd = fd;
+	td_register_file(driver, fd);
 
 done:
 	return ret;	
@@ -228,6 +229,7 @@ int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	td_unregister_file(driver, prv->fd);
 	close(prv->fd);
 
 	return 0;
@@ -36,6 +36,8 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shm-cache.h"
+#include "block-cache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -106,6 +108,8 @@ struct block_cache_request {
 	int                             err;
 	char                           *buf;
 	uint64_t                        secs;
+	uint64_t                        start;
+	uint64_t                        count;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
 };
@@ -123,6 +127,13 @@ struct block_cache {
 
 	uint64_t                        sectors;
 
+	/*
+	 * if set, reads are served from the host-wide cache (see
+	 * tapdisk-shm-cache.h) rather than the private radix tree.
+	 */
+	int                             shared;
+	td_shm_cache_id_t               id;
+
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
@@ -536,15 +547,24 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
+	cache->requests_free = BLOCK_CACHE_REQUESTS;
+	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
+		cache->request_free_list[i] = cache->requests + i;
+
+	if (!td_shm_cache_image_id(cache->name, &cache->id) &&
+	    !td_shm_cache_get()) {
+		cache->shared = 1;
+		DPRINTF("opening shared cache for %s, sectors: %"PRIu64"\n",
+			cache->name, cache->sectors);
+		goto out;
+	}
+
 	tree = &cache->tree;
 	err  = radix_tree_initialize(tree, cache->sectors);
 	if (err)
 		goto fail;
 
 	tree->cache = cache;
-	cache->requests_free = BLOCK_CACHE_REQUESTS;
-	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
-		cache->request_free_list[i] = cache->requests + i;
 
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
@@ -558,6 +578,7 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
 
+out:
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
 
@@ -580,8 +601,12 @@ block_cache_close(td_driver_t *driver)
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	if (cache->shared)
+		td_shm_cache_put();
+	else {
+		tapdisk_server_unregister_event(cache->timeout_id);
+		radix_tree_free(tree);
+	}
 	free(cache->name);
 
 	return 0;
@@ -706,6 +731,85 @@ out:
 	td_forward_request(clone);
 }
 
+static void
+block_cache_populate_shared(td_request_t clone, int err)
+{
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	if (!breq->err) {
+		memcpy(breq->treq.buf,
+		       breq->buf + ((breq->treq.sec - breq->start) <<
+				    RADIX_TREE_NODE_SHIFT),
+		       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+		td_shm_cache_insert(&cache->id, breq->start,
+				    breq->count, breq->buf);
+	}
+
+	free(breq->buf);
+	td_complete_request(breq->treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+static void
+block_cache_shared_read(block_cache_t *cache, td_request_t treq)
+{
+	char *buf;
+	uint64_t start, end;
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	if (!td_shm_cache_lookup(&cache->id, treq.sec, treq.secs, treq.buf)) {
+		cache->stats.hits += treq.secs;
+		return td_complete_request(treq, 0);
+	}
+
+	cache->stats.misses += treq.secs;
+
+	/* read whole pages, so the next VBD asking finds them */
+	start = treq.sec - treq.sec % TD_SHM_CACHE_PAGE_SECS;
+	end   = treq.sec + treq.secs + TD_SHM_CACHE_PAGE_SECS - 1;
+	end  -= end % TD_SHM_CACHE_PAGE_SECS;
+
+	if (end > cache->sectors)
+		return td_forward_request(treq);
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return td_forward_request(treq);
+
+	if (posix_memalign((void **)&buf, TD_SHM_CACHE_PAGE_SIZE,
+			   (end - start) << RADIX_TREE_NODE_SHIFT)) {
+		block_cache_put_request(cache, breq);
+		return td_forward_request(treq);
+	}
+
+	breq->treq    = treq;
+	breq->secs    = end - start;
+	breq->start   = start;
+	breq->count   = end - start;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+
+	clone         = treq;
+	clone.sec     = start;
+	clone.secs    = end - start;
+	clone.buf     = buf;
+	clone.cb      = block_cache_populate_shared;
+	clone.cb_data = breq;
+
+	td_forward_request(clone);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -719,6 +823,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	cache->stats.reads += treq.secs;
 
+	if (cache->shared)
+		return block_cache_shared_read(cache, treq);
+
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
@@ -771,6 +878,48 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+
+	if (cache->shared) {
+		td_shm_cache_stats_t shm;
+
+		if (td_shm_cache_get_stats(&shm))
+			return;
+
+		WARN("shared: pages: %"PRIu64", used: %"PRIu64", "
+		     "hits: %"PRIu64", misses: %"PRIu64", "
+		     "evictions: %"PRIu64", resets: %"PRIu64"\n",
+		     shm.pages, shm.used, shm.hits, shm.misses,
+		     shm.evictions, shm.resets);
+	}
+}
+
+int
+block_cache_get_stats(td_driver_t *driver,
+		      tapdisk_message_cache_stats_t *stats)
+{
+	block_cache_t *cache;
+	td_shm_cache_stats_t shm;
+
+	cache = (block_cache_t *)driver->data;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->reads  = cache->stats.reads;
+	stats->hits   = cache->stats.hits;
+	stats->misses = cache->stats.misses;
+
+	if (!cache->shared || td_shm_cache_get_stats(&shm))
+		return 0;
+
+	stats->shared        = 1;
+	stats->size          = shm.size;
+	stats->pages         = shm.pages;
+	stats->used          = shm.used;
+	stats->shared_hits   = shm.hits;
+	stats->shared_misses = shm.misses;
+	stats->inserts       = shm.inserts;
+	stats->evictions     = shm.evictions;
+
+	return 0;
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -73,13 +73,35 @@ struct pending_aio {
 
 #define ZERO_TEST(_b) (_b | 0x00)
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 struct qcow_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdqcow_state  *state;
+	struct list_head     next;     /* waiting for metadata */
+};
+
+/* a partial write to a new qcow2 cluster, filling the rest from below */
+struct qcow_cow {
+	struct tdqcow_state *state;
+	uint64_t             cluster;  /* guest cluster index */
+	uint64_t             entry;    /* the L2 entry being replaced */
+	td_request_t         treq;     /* the write, within the cluster */
+	char                *buf;      /* NULL if treq is written as is */
+	int                  secs_left;
+	int                  err;
+	uint64_t             offset;   /* of the new cluster */
+	struct qcow_cache_entry *l2;   /* pinned until the L2 update */
+	struct tiocb         tiocb;
+	struct list_head     waiters;
+	struct list_head     next;
 };
 
 static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
+void tdqcow_queue_read(td_driver_t *driver, td_request_t treq);
+void tdqcow_queue_write(td_driver_t *driver, td_request_t treq);
 
 uint32_t gen_cksum(char *ptr, int len)
 {
@@ -127,6 +149,169 @@ static int init_aio_state(td_driver_t *driver)
 	return -1;
 }
 
+static int qcow_cache_init(struct qcow_cache *c, int size, int table_bytes,
+			   void *owner)
+{
+	int i, buckets;
+	struct qcow_cache_entry *e;
+
+	memset(c, 0, sizeof(*c));
+	INIT_LIST_HEAD(&c->lru);
+
+	for (buckets = 1; buckets < size; buckets <<= 1)
+		;
+
+	c->size        = size;
+	c->table_bytes = table_bytes;
+	c->hash_mask   = buckets - 1;
+	c->owner       = owner;
+
+	if (posix_memalign((void **)&c->tables, 4096,
+			   (size_t)size * table_bytes)) {
+		c->tables = NULL;
+		return -ENOMEM;
+	}
+
+	c->entries = calloc(size, sizeof(*c->entries));
+	c->hash    = calloc(buckets, sizeof(*c->hash));
+	if (!c->entries || !c->hash) {
+		free(c->tables);
+		free(c->entries);
+		free(c->hash);
+		memset(c, 0, sizeof(*c));
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < size; i++) {
+		e        = c->entries + i;
+		e->table = c->tables + (size_t)i * table_bytes;
+		e->cache = c;
+		INIT_LIST_HEAD(&e->waiters);
+		list_add_tail(&e->lru, &c->lru);
+	}
+
+	return 0;
+}
+
+static void qcow_cache_free(struct qcow_cache *c)
+{
+	free(c->tables);
+	free(c->entries);
+	free(c->hash);
+	memset(c, 0, sizeof(*c));
+}
+
+static inline uint32_t qcow_cache_hash(struct qcow_cache *c, uint64_t offset)
+{
+	return ((offset >> 9) * 0x9e3779b97f4a7c15ULL >> 32) & c->hash_mask;
+}
+
+static void qcow_cache_unhash(struct qcow_cache *c, struct qcow_cache_entry *e)
+{
+	struct qcow_cache_entry **p;
+
+	if (!e->offset)
+		return;
+
+	for (p = &c->hash[qcow_cache_hash(c, e->offset)]; *p;
+	     p = &(*p)->hash_next)
+		if (*p == e) {
+			*p = e->hash_next;
+			break;
+		}
+
+	e->offset    = 0;
+	e->hash_next = NULL;
+}
+
+static struct qcow_cache_entry *qcow_cache_lookup(struct qcow_cache *c,
+						  uint64_t offset)
+{
+	struct qcow_cache_entry *e;
+
+	for (e = c->hash[qcow_cache_hash(c, offset)]; e; e = e->hash_next)
+		if (e->offset == offset) {
+			list_del(&e->lru);
+			list_add(&e->lru, &c->lru);
+			c->hits++;
+			return e;
+		}
+
+	c->misses++;
+	return NULL;
+}
+
+/*
+ * Claim the least recently used slot that nobody is waiting on for the
+ * table at @offset.  The caller fills in the table.
+ */
+static struct qcow_cache_entry *qcow_cache_insert(struct qcow_cache *c,
+						  uint64_t offset)
+{
+	struct list_head *pos;
+	struct qcow_cache_entry *e;
+	uint32_t h;
+
+	for (pos = c->lru.prev; pos != &c->lru; pos = pos->prev) {
+		e = list_entry(pos, struct qcow_cache_entry, lru);
+		if (!e->loading && !e->pinned && list_empty(&e->waiters))
+			break;
+	}
+
+	if (pos == &c->lru)
+		return NULL;
+
+	qcow_cache_unhash(c, e);
+
+	h            = qcow_cache_hash(c, offset);
+	e->offset    = offset;
+	e->hash_next = c->hash[h];
+	c->hash[h]   = e;
+
+	list_del(&e->lru);
+	list_add(&e->lru, &c->lru);
+
+	return e;
+}
+
+static void qcow_cache_invalidate(struct qcow_cache *c,
+				  struct qcow_cache_entry *e)
+{
+	qcow_cache_unhash(c, e);
+	list_del(&e->lru);
+	list_add_tail(&e->lru, &c->lru);
+}
+
+static void qcow_cache_reset(struct qcow_cache *c)
+{
+	int i;
+
+	for (i = 0; i < c->size; i++)
+		qcow_cache_unhash(c, c->entries + i);
+}
+
+/* a cached table, reading it in synchronously on a miss */
+static struct qcow_cache_entry *qcow_cache_get(struct qcow_cache *c,
+					       int fd, uint64_t offset)
+{
+	struct qcow_cache_entry *e;
+
+	e = qcow_cache_lookup(c, offset);
+	if (e)
+		return (e->loading ? NULL : e);
+
+	e = qcow_cache_insert(c, offset);
+	if (!e)
+		return NULL;
+
+	if (pread(fd, e->table, c->table_bytes, offset) != c->table_bytes) {
+		qcow_cache_invalidate(c, e);
+		return NULL;
+	}
+
+	return e;
+}
+
 int get_filesize(char *filename, uint64_t *size, struct stat *st)
 {
 	int fd;
@@ -306,8 +491,9 @@ int qtruncate(int fd, off_t length, int sparse)
 	char *buf;
 
 	/* If length is greater than the current file len
-	 * we synchronously write zeroes to the end of the 
-	 * file, otherwise we truncate the length down
+	 * we reserve (or failing that, synchronously write zeroes
+	 * to) the end of the file, otherwise we truncate the
+	 * length down
 	 */
 	ret = fstat(fd, &st);
 	if (ret == -1) 
@@ -324,7 +510,11 @@ int qtruncate(int fd, off_t length, int sparse)
 	 * contiguous on disk.
 	 */
 	if(st.st_size < sectors * DEFAULT_SECTOR_SIZE) {
-		/*We are extending the file*/
+		/*We are extending the file: reserve the extents if we can*/
+		if (!fallocate(fd, 0, st.st_size,
+			       sectors * DEFAULT_SECTOR_SIZE - st.st_size))
+			return 0;
+
 		if ((ret = posix_memalign((void **)&buf, 
 					  512, DEFAULT_SECTOR_SIZE))) {
 			DPRINTF("posix_memalign failed: %d\n", ret);
@@ -382,11 +572,11 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
                                    int compressed_size,
                                    int n_start, int n_end)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
+	int i, l1_index, l2_index, l2_sector, l1_sector;
 	char *tmp_ptr2, *l2_ptr, *l1_ptr;
 	uint64_t *tmp_ptr;
 	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
+	struct qcow_cache_entry *e;
 	int new_l2_table;
 
 	/*Check L1 table for the extent offset*/
@@ -458,30 +648,21 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 	}
 
 	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
-		}
+	e = qcow_cache_lookup(&s->l2_cache, l2_offset);
+	if (e) {
+		/* the I/O path waits for tables being read in */
+		if (e->loading)
+			return 0;
+		l2_table = (uint64_t *)e->table;
+		goto found;
 	}
 
 cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
+	/* not found: load a new entry in the least recently used one */
+	e = qcow_cache_insert(&s->l2_cache, l2_offset);
+	if (!e)
+		return 0;
+	l2_table = (uint64_t *)e->table;
 
 	/*If extent pre-allocated, read table from disk, 
 	 *otherwise write new table to disk*/
@@ -496,6 +677,7 @@ cache_miss:
 				  (s->cluster_size * s->l2_size), 
 				      s->sparse) != 0) {
 				DPRINTF("ERROR truncating file\n");
+				qcow_cache_invalidate(&s->l2_cache, e);
 				return 0;
 			}
 			s->fd_end = cluster_offset + 
@@ -506,20 +688,18 @@ cache_miss:
 			}  
 		} else memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
 
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (write(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) !=
-		   s->l2_size * sizeof(uint64_t))
+		if (pwrite(s->fd, l2_table, s->l2_size * sizeof(uint64_t),
+			   l2_offset) != s->l2_size * sizeof(uint64_t)) {
+			qcow_cache_invalidate(&s->l2_cache, e);
 			return 0;
+		}
 	} else {
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (read(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) != 
-		    s->l2_size * sizeof(uint64_t))
+		if (pread(s->fd, l2_table, s->l2_size * sizeof(uint64_t),
+			  l2_offset) != s->l2_size * sizeof(uint64_t)) {
+			qcow_cache_invalidate(&s->l2_cache, e);
 			return 0;
+		}
 	}
-	
-	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
 
 found:
 	/*The extent is split into 's->l2_size' blocks of 
@@ -864,170 +1044,1294 @@ out:
 	return err;
 }
 
-/* Open the disk file and initialize qcow state. */
-int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
+static int tdqcow_init_l2_cache(struct tdqcow_state *s, int table_bytes)
 {
-	int fd, len, i, ret, size, o_flags;
-	td_disk_info_t *bs = &(driver->info);
-	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
-	QCowHeader header;
-	uint64_t final_cluster = 0;
+	char *env;
+	uint64_t kb, n;
+
+	kb  = QCOW_L2_CACHE_KB;
+	env = getenv(QCOW_L2_CACHE_ENV);
+	if (env)
+		kb = strtoull(env, NULL, 0);
+
+	n = (kb << 10) / table_bytes;
+	if (n < QCOW_L2_CACHE_MIN)
+		n = QCOW_L2_CACHE_MIN;
+	if (n > s->l1_size)
+		n = s->l1_size;
+	if (!n)
+		n = 1;
+
+	DPRINTF("QCOW: caching %"PRIu64" L2 tables of %d bytes\n",
+		n, table_bytes);
+
+	return qcow_cache_init(&s->l2_cache, n, table_bytes, s);
+}
 
- 	DPRINTF("QCOW: Opening %s\n", name);
+static void tdqcow_l2_load_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow_cache_entry *e = (struct qcow_cache_entry *)arg;
+	struct tdqcow_state *s = (struct tdqcow_state *)e->cache->owner;
+	struct qcow_request *aio, *tmp;
+	struct list_head waiters;
+	td_request_t treq;
 
-	o_flags = O_DIRECT | O_LARGEFILE | 
-		((flags == TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
-	fd = open(name, o_flags);
-	if (fd < 0) {
-		DPRINTF("Unable to open %s (%d)\n", name, -errno);
-		return -1;
+	e->loading = 0;
+	if (err)
+		qcow_cache_invalidate(&s->l2_cache, e);
+
+	INIT_LIST_HEAD(&waiters);
+	list_splice(&e->waiters, &waiters);
+	INIT_LIST_HEAD(&e->waiters);
+
+	list_for_each_entry_safe(aio, tmp, &waiters, next) {
+		list_del(&aio->next);
+		treq = aio->treq;
+		s->aio_free_list[s->aio_free_count++] = aio;
+
+		if (err)
+			td_complete_request(treq, err);
+		else if (treq.op == TD_OP_WRITE)
+			tdqcow_queue_write(s->driver, treq);
+		else
+			tdqcow_queue_read(s->driver, treq);
 	}
+}
 
-	s->fd = fd;
-	s->name = strdup(name);
-	if (!s->name)
-		goto fail;
+static int tdqcow_park_request(struct tdqcow_state *s, td_request_t treq,
+			       struct list_head *waiters)
+{
+	struct qcow_request *aio;
 
-	if (tdqcow_read_header(fd, &header))
-		goto fail;
+	if (s->aio_free_count == 0)
+		return -EBUSY;
 
-	if (header.magic != QCOW_MAGIC)
-		goto fail;
+	aio        = s->aio_free_list[--s->aio_free_count];
+	aio->treq  = treq;
+	aio->state = s;
+	list_add_tail(&aio->next, waiters);
 
-	switch (header.version) {
-	case QCOW_VERSION:
-		break;
-	case 2:
-	  //TODO: Port qcow2 to new blktap framework.
-	  //		close(fd);
-	  //		dd->drv = &tapdisk_qcow2;
-	  //		return dd->drv->td_open(dd, name, flags);
-	  goto fail;
-	default:
-		goto fail;
+	return 0;
+}
+
+/*
+ * Make sure the L2 table covering @treq's first sector is in the cache,
+ * so get_cluster_offset need not block on it.  If it is not, read it in
+ * through the tapdisk queue and park @treq (what is left of a request)
+ * until it arrives.  Returns 1 if the caller may go ahead.
+ */
+static int tdqcow_l2_ready(td_driver_t *driver, struct tdqcow_state *s,
+			   td_request_t treq)
+{
+	int l1_index, err;
+	uint64_t l2_offset;
+	struct qcow_cache_entry *e;
+
+	l1_index  = (treq.sec << 9) >> (s->l2_bits + s->cluster_bits);
+	l2_offset = s->l1_table[l1_index];
+	if (s->version > QCOW_VERSION)
+		l2_offset &= QCOW2_OFFSET_MASK;
+
+	if (!l2_offset)
+		return 1;
+
+	if (s->version == QCOW_VERSION &&
+	    s->min_cluster_alloc == s->l2_size)
+		return 1;
+
+	e = qcow_cache_lookup(&s->l2_cache, l2_offset);
+	if (e && !e->loading)
+		return 1;
+
+	if (!e) {
+		e = qcow_cache_insert(&s->l2_cache, l2_offset);
+		if (!e) {
+			err = -EBUSY;
+			goto fail;
+		}
+
+		e->loading = 1;
+		td_prep_read(&e->tiocb, s->fd, (char *)e->table,
+			     s->l2_cache.table_bytes, l2_offset,
+			     tdqcow_l2_load_complete, e);
+		td_queue_tiocb(driver, &e->tiocb);
 	}
 
-	if (header.size <= 1 || header.cluster_bits < 9)
-		goto fail;
-	if (header.crypt_method > QCOW_CRYPT_AES)
+	err = tdqcow_park_request(s, treq, &e->waiters);
+	if (err)
 		goto fail;
-	s->crypt_method_header = header.crypt_method;
-	if (s->crypt_method_header)
-		s->encrypted = 1;
-	s->cluster_bits = header.cluster_bits;
-	s->cluster_size = 1 << s->cluster_bits;
-	s->cluster_sectors = 1 << (s->cluster_bits - 9);
-	s->l2_bits = header.l2_bits;
-	s->l2_size = 1 << s->l2_bits;
-	s->cluster_alloc = s->l2_size;
-	bs->size = header.size / 512;
-	s->cluster_offset_mask = (1LL << (63 - s->cluster_bits)) - 1;
-	s->backing_file_offset = header.backing_file_offset;
-	s->backing_file_size   = header.backing_file_size;
 
-	/* allocate and load l1 table */
-	if (tdqcow_load_l1_table(s, &header))
-		goto fail;
+	return 0;
 
-	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+fail:
+	td_complete_request(treq, err);
+	return 0;
+}
 
-	size = s->cluster_size;
-	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
-	if(ret != 0) goto fail;
+/*
+ * qcow2
+ *
+ * Clusters are reference counted.  New clusters come from a range
+ * reserved at the end of the file QCOW2_PREALLOC_SIZE at a time, so the
+ * refcounts of a whole range are written together; whatever is left of
+ * it is given back on close.  A cluster's refcount is always written
+ * before anything points at it, so a crash can leak clusters but never
+ * hand out one that is in use.
+ */
 
-	ret = posix_memalign((void **)&s->cluster_data, 4096, size);
-	if(ret != 0) goto fail;
-	s->cluster_cache_offset = -1;
+static inline uint64_t qcow2_cluster_align(struct tdqcow_state *s,
+					   uint64_t offset)
+{
+	return (offset + s->cluster_size - 1) & ~((uint64_t)s->cluster_size - 1);
+}
 
-	if (s->backing_file_offset != 0)
-		s->cluster_alloc = 1; /*Cannot use pre-alloc*/
+/* metadata is written in the smallest aligned piece O_DIRECT allows */
+static inline int qcow2_chunk_size(struct tdqcow_state *s)
+{
+	return MIN(4096, s->cluster_size);
+}
 
-        bs->sector_size = 512;
-        bs->info = 0;
+static int qcow2_write_chunk(struct tdqcow_state *s, uint64_t table_offset,
+			     const void *table, int first, int last)
+{
+	int chunk = qcow2_chunk_size(s);
+	int start = first & ~(chunk - 1);
+	int end   = (last + chunk) & ~(chunk - 1);
 
-	for(i = 0; i < s->l1_size; i++)
-		if (s->l1_table[i] > final_cluster)
-			final_cluster = s->l1_table[i];
+	if (pwrite(s->fd, (const char *)table + start, end - start,
+		   table_offset + start) != end - start)
+		return -errno ? : -EIO;
 
-	if (init_aio_state(driver)!=0) {
-	  DPRINTF("Unable to initialise AIO state\n");
-	  free_aio_state(s);
-	  goto fail;
+	return 0;
+}
+
+/* L1 and refcount tables are kept in native byte order */
+static int qcow2_write_native_chunk(struct tdqcow_state *s,
+				    uint64_t table_offset,
+				    const uint64_t *table, int entries,
+				    int index)
+{
+	int i, err, chunk, first;
+	uint64_t *buf;
+
+	chunk = qcow2_chunk_size(s);
+	first = (index * sizeof(uint64_t)) & ~(chunk - 1);
+
+	if (posix_memalign((void **)&buf, 4096, chunk))
+		return -ENOMEM;
+
+	for (i = 0; i < chunk / sizeof(uint64_t); i++) {
+		int idx = first / sizeof(uint64_t) + i;
+		buf[i] = cpu_to_be64(idx < entries ? table[idx] : 0);
 	}
 
-	if (!final_cluster)
-		s->fd_end = s->l1_table_offset +
-			((s->l1_size * sizeof(uint64_t) + 4095) & ~4095);
-	else {
-		s->fd_end = lseek(fd, 0, SEEK_END);
-		if (s->fd_end == (off_t)-1)
-			goto fail;
+	err = 0;
+	if (pwrite(s->fd, buf, chunk, table_offset + first) != chunk)
+		err = -errno ? : -EIO;
+
+	free(buf);
+	return err;
+}
+
+/* set the refcounts of @n clusters from @cluster, whose blocks exist */
+static int qcow2_set_refcounts(struct tdqcow_state *s, uint64_t cluster,
+			       uint64_t n, uint16_t value)
+{
+	int err, first, last;
+	uint64_t rt_index, end, mask;
+	uint16_t *block;
+	struct qcow_cache_entry *e;
+
+	mask = (1ULL << s->refcount_block_bits) - 1;
+	end  = cluster + n;
+
+	while (cluster < end) {
+		rt_index = cluster >> s->refcount_block_bits;
+		if (rt_index >= s->refcount_table_size ||
+		    !s->refcount_table[rt_index])
+			return -EIO;
+
+		e = qcow_cache_get(&s->rc_cache, s->fd,
+				   s->refcount_table[rt_index]);
+		if (!e)
+			return -EIO;
+
+		block = (uint16_t *)e->table;
+		first = cluster & mask;
+		for (last = first; cluster < end && (cluster & mask) == last;
+		     cluster++, last++)
+			block[last] = cpu_to_be16(value);
+
+		err = qcow2_write_chunk(s, e->offset, block,
+					first * sizeof(uint16_t),
+					(last - 1) * sizeof(uint16_t));
+		if (err)
+			return err;
 	}
 
 	return 0;
-	
-fail:
-	DPRINTF("QCOW Open failed\n");
-
-	free_aio_state(s);
-	free(s->l1_table);
-	free(s->l2_cache);
-	free(s->cluster_cache);
-	free(s->cluster_data);
-	close(fd);
-	return -1;
 }
 
-void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
+/* drop a reference to each of @n clusters from @cluster */
+static int qcow2_put_refcounts(struct tdqcow_state *s, uint64_t cluster,
+			       uint64_t n)
 {
-	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
-	int ret = 0, index_in_cluster, n, i;
-	uint64_t cluster_offset, sector, nb_sectors;
-	struct qcow_prv* prv;
-	td_request_t clone = treq;
-	char* buf = treq.buf;
+	int err, first, last;
+	uint64_t rt_index, end, mask;
+	uint16_t *block, refcount;
+	struct qcow_cache_entry *e;
+
+	mask = (1ULL << s->refcount_block_bits) - 1;
+	end  = cluster + n;
+
+	while (cluster < end) {
+		rt_index = cluster >> s->refcount_block_bits;
+		if (rt_index >= s->refcount_table_size ||
+		    !s->refcount_table[rt_index])
+			return -EIO;
+
+		e = qcow_cache_get(&s->rc_cache, s->fd,
+				   s->refcount_table[rt_index]);
+		if (!e)
+			return -EIO;
+
+		block = (uint16_t *)e->table;
+		first = cluster & mask;
+		for (last = first; cluster < end && (cluster & mask) == last;
+		     cluster++, last++) {
+			refcount = be16_to_cpu(block[last]);
+			if (refcount)
+				block[last] = cpu_to_be16(refcount - 1);
+		}
 
-	sector     = treq.sec;
-	nb_sectors = treq.secs;
+		err = qcow2_write_chunk(s, e->offset, block,
+					first * sizeof(uint16_t),
+					(last - 1) * sizeof(uint16_t));
+		if (err)
+			return err;
+	}
 
-	/*We store a local record of the request*/
-	while (nb_sectors > 0) {
-		cluster_offset = 
-			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
-		index_in_cluster = sector & (s->cluster_sectors - 1);
-		n = s->cluster_sectors - index_in_cluster;
-		if (n > nb_sectors)
-			n = nb_sectors;
+	return 0;
+}
 
-		if (s->aio_free_count == 0) {
-			td_complete_request(treq, -EBUSY);
-			return;
+/*
+ * Reserve @n clusters at the end of the file, along with any refcount
+ * blocks needed to cover them (which go first, and cover themselves).
+ */
+static int qcow2_prealloc(struct tdqcow_state *s, uint64_t n)
+{
+	int err;
+	char *zero;
+	uint64_t start, total, need, rt, first, last, next;
+
+	start = qcow2_cluster_align(s, s->fd_end) >> s->cluster_bits;
+	total = n;
+
+	for (;;) {
+		first = start >> s->refcount_block_bits;
+		last  = (start + total - 1) >> s->refcount_block_bits;
+		if (last >= s->refcount_table_size) {
+			DPRINTF("QCOW2: refcount table full\n");
+			return -ENOSPC;
 		}
-		
-		if(!cluster_offset) {
-            int i;
-            /* Forward entire request if possible. */
-            for(i=0; i<nb_sectors; i++)
-                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
-                    goto coalesce_failed;
-            treq.buf  = buf;
-            treq.sec  = sector;
-            treq.secs = nb_sectors;
-			td_forward_request(treq);
-            return;
-coalesce_failed:            
-			treq.buf  = buf;
-			treq.sec  = sector;
-			treq.secs = n;
-			td_forward_request(treq);
 
-		} else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
-			if (decompress_cluster(s, cluster_offset) < 0) {
-				td_complete_request(treq, -EIO);
-				goto done;
+		for (need = 0, rt = first; rt <= last; rt++)
+			if (!s->refcount_table[rt])
+				need++;
+
+		if (n + need == total)
+			break;
+		total = n + need;
+	}
+
+	if (fallocate(s->fd, 0, start << s->cluster_bits,
+		      total << s->cluster_bits))
+		if (ftruncate(s->fd, (start + total) << s->cluster_bits))
+			return -errno;
+
+	s->fd_end = (start + total) << s->cluster_bits;
+
+	if (need) {
+		if (posix_memalign((void **)&zero, 4096, s->cluster_size))
+			return -ENOMEM;
+		memset(zero, 0, s->cluster_size);
+
+		next = start;
+		for (rt = first; rt <= last; rt++) {
+			if (s->refcount_table[rt])
+				continue;
+
+			if (pwrite(s->fd, zero, s->cluster_size,
+				   next << s->cluster_bits) != s->cluster_size) {
+				err = -errno ? : -EIO;
+				free(zero);
+				return err;
+			}
+
+			s->refcount_table[rt] = next << s->cluster_bits;
+			err = qcow2_write_native_chunk(s,
+						       s->refcount_table_offset,
+						       s->refcount_table,
+						       s->refcount_table_size,
+						       rt);
+			if (err) {
+				free(zero);
+				return err;
+			}
+
+			next++;
+		}
+
+		free(zero);
+	}
+
+	err = qcow2_set_refcounts(s, start, total, 1);
+	if (err)
+		return err;
+
+	s->prealloc_next = (start + need) << s->cluster_bits;
+	s->prealloc_end  = (start + total) << s->cluster_bits;
+
+	return 0;
+}
+
+static uint64_t qcow2_alloc_cluster(struct tdqcow_state *s)
+{
+	uint64_t offset;
+
+	if (s->prealloc_next == s->prealloc_end &&
+	    qcow2_prealloc(s, MAX(1, QCOW2_PREALLOC_SIZE / s->cluster_size)))
+		return 0;
+
+	offset = s->prealloc_next;
+	s->prealloc_next += s->cluster_size;
+
+	return offset;
+}
+
+/* give back what is left of the reserved range */
+static void qcow2_release_prealloc(struct tdqcow_state *s)
+{
+	uint64_t first, n;
+
+	if (s->prealloc_next == s->prealloc_end)
+		return;
+
+	first = s->prealloc_next >> s->cluster_bits;
+	n     = (s->prealloc_end - s->prealloc_next) >> s->cluster_bits;
+
+	if (qcow2_set_refcounts(s, first, n, 0))
+		return;
+
+	if (s->prealloc_end == s->fd_end &&
+	    !ftruncate(s->fd, s->prealloc_next))
+		s->fd_end = s->prealloc_next;
+
+	s->prealloc_next = s->prealloc_end = 0;
+}
+
+/*
+ * The L2 table covering guest @offset, or NULL if there is none and
+ * @allocate is not set.
+ */
+static struct qcow_cache_entry *qcow2_get_l2(struct tdqcow_state *s,
+					     uint64_t offset, int allocate)
+{
+	int l1_index, err;
+	uint64_t l2_offset;
+	struct qcow_cache_entry *e;
+
+	l1_index  = offset >> (s->l2_bits + s->cluster_bits);
+	l2_offset = s->l1_table[l1_index] & QCOW2_OFFSET_MASK;
+
+	if (l2_offset)
+		return qcow_cache_get(&s->l2_cache, s->fd, l2_offset);
+
+	if (!allocate)
+		return NULL;
+
+	l2_offset = qcow2_alloc_cluster(s);
+	if (!l2_offset)
+		return NULL;
+
+	e = qcow_cache_insert(&s->l2_cache, l2_offset);
+	if (!e)
+		return NULL;
+
+	memset(e->table, 0, s->cluster_size);
+	if (pwrite(s->fd, e->table, s->cluster_size, l2_offset) !=
+	    s->cluster_size) {
+		qcow_cache_invalidate(&s->l2_cache, e);
+		return NULL;
+	}
+
+	s->l1_table[l1_index] = l2_offset | QCOW2_OFLAG_COPIED;
+	err = qcow2_write_native_chunk(s, s->l1_table_offset, s->l1_table,
+				       s->l1_size, l1_index);
+	if (err) {
+		s->l1_table[l1_index] = 0;
+		qcow_cache_invalidate(&s->l2_cache, e);
+		return NULL;
+	}
+
+	return e;
+}
+
+static inline uint64_t qcow2_l2_entry(struct tdqcow_state *s,
+				      struct qcow_cache_entry *e,
+				      uint64_t offset)
+{
+	int l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+	return be64_to_cpu(((uint64_t *)e->table)[l2_index]);
+}
+
+static int qcow2_set_l2_entry(struct tdqcow_state *s,
+			      struct qcow_cache_entry *e,
+			      uint64_t offset, uint64_t entry)
+{
+	int l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+
+	((uint64_t *)e->table)[l2_index] = cpu_to_be64(entry);
+
+	return qcow2_write_chunk(s, e->offset, e->table,
+				 l2_index * sizeof(uint64_t),
+				 l2_index * sizeof(uint64_t));
+}
+
+static inline int qcow2_entry_plain(struct tdqcow_state *s, uint64_t entry)
+{
+	if (!(entry & QCOW2_OFFSET_MASK))
+		return 0;
+	if (entry & QCOW2_OFLAG_COMPRESSED)
+		return 0;
+	if (s->version >= QCOW3_VERSION && (entry & QCOW2_OFLAG_ZERO))
+		return 0;
+	return 1;
+}
+
+static int qcow2_decompress_cluster(struct tdqcow_state *s, uint64_t entry)
+{
+	int shift, nb_csectors;
+	uint64_t coffset, start;
+	size_t size;
+
+	shift       = 62 - (s->cluster_bits - 8);
+	coffset     = entry & ((1ULL << shift) - 1);
+	nb_csectors = ((entry >> shift) & ((1 << (s->cluster_bits - 8)) - 1)) + 1;
+
+	if (s->cluster_cache_offset == coffset)
+		return 0;
+
+	/* O_DIRECT: read whole sectors, the data need not start on one */
+	start = coffset & ~511ULL;
+	size  = (size_t)nb_csectors * 512 + 512;
+	if (size > 2 * s->cluster_size)
+		return -EIO;
+
+	if (pread(s->fd, s->cluster_data, size, start) <
+	    (ssize_t)(coffset - start + nb_csectors * 512 - 511))
+		return -EIO;
+
+	if (decompress_buffer(s->cluster_cache, s->cluster_size,
+			      s->cluster_data + (coffset - start),
+			      nb_csectors * 512 - (coffset & 511)) < 0)
+		return -EIO;
+
+	s->cluster_cache_offset = coffset;
+	return 0;
+}
+
+/*
+ * Drop the references an L2 entry held, once nothing points at it: the
+ * clusters compressed data spans, or the cluster preallocated for a zero
+ * cluster.
+ */
+static int qcow2_put_entry(struct tdqcow_state *s, uint64_t entry)
+{
+	int shift, nb_csectors;
+	uint64_t coffset, start, end;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		shift       = 62 - (s->cluster_bits - 8);
+		coffset     = entry & ((1ULL << shift) - 1);
+		nb_csectors = ((entry >> shift) &
+			       ((1 << (s->cluster_bits - 8)) - 1)) + 1;
+
+		if (s->cluster_cache_offset == coffset)
+			s->cluster_cache_offset = -1;
+
+		start = coffset & ~511ULL;
+		end   = start + (uint64_t)nb_csectors * 512;
+	} else {
+		start = entry & QCOW2_OFFSET_MASK;
+		end   = start + 1;
+		if (!start)
+			return 0;
+	}
+
+	start >>= s->cluster_bits;
+	end     = (end - 1) >> s->cluster_bits;
+
+	return qcow2_put_refcounts(s, start, end - start + 1);
+}
+
+static void tdqcow2_queue_read(td_driver_t *driver, struct tdqcow_state *s,
+			       td_request_t treq)
+{
+	int index_in_cluster, n;
+	uint64_t entry, next, sector, nb_sectors;
+	struct qcow_cache_entry *e;
+	td_request_t clone = treq;
+	char *buf = treq.buf;
+
+	sector     = treq.sec;
+	nb_sectors = treq.secs;
+
+	while (nb_sectors > 0) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+		if (!tdqcow_l2_ready(driver, s, clone))
+			return;
+
+		index_in_cluster = sector & (s->cluster_sectors - 1);
+		n = s->cluster_sectors - index_in_cluster;
+		if (n > nb_sectors)
+			n = nb_sectors;
+
+		e     = qcow2_get_l2(s, sector << 9, 0);
+		entry = e ? qcow2_l2_entry(s, e, sector << 9) : 0;
+
+		/* merge clusters that follow each other on disk */
+		if (qcow2_entry_plain(s, entry))
+			while (n < nb_sectors &&
+			       ((sector + n) & ((s->l2_size *
+				 (uint64_t)s->cluster_sectors) - 1))) {
+				next = qcow2_l2_entry(s, e, (sector + n) << 9);
+				if (!qcow2_entry_plain(s, next) ||
+				    (next & QCOW2_OFFSET_MASK) !=
+				    (entry & QCOW2_OFFSET_MASK) +
+				    ((uint64_t)(index_in_cluster + n) << 9))
+					break;
+				n = MIN(nb_sectors, n + s->cluster_sectors);
+			}
+
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = n;
+
+		if (!(entry & ~QCOW2_OFLAG_COPIED)) {
+			td_forward_request(clone);
+		} else if (entry & QCOW2_OFLAG_COMPRESSED) {
+			if (qcow2_decompress_cluster(s, entry) < 0)
+				td_complete_request(clone, -EIO);
+			else {
+				memcpy(buf, s->cluster_cache +
+				       index_in_cluster * 512, n * 512);
+				td_complete_request(clone, 0);
+			}
+		} else if (!qcow2_entry_plain(s, entry)) {
+			memset(buf, 0, n * 512);
+			td_complete_request(clone, 0);
+		} else {
+			clone.sec = ((entry & QCOW2_OFFSET_MASK) >> 9) +
+				index_in_cluster;
+			async_read(driver, clone);
+		}
+
+		nb_sectors -= n;
+		sector     += n;
+		buf        += n * 512;
+	}
+}
+
+static struct qcow_cow *qcow2_find_cow(struct tdqcow_state *s,
+				       uint64_t cluster)
+{
+	struct qcow_cow *cow;
+
+	list_for_each_entry(cow, &s->cows, next)
+		if (cow->cluster == cluster)
+			return cow;
+
+	return NULL;
+}
+
+static void qcow2_cow_finish(struct qcow_cow *cow, int err)
+{
+	struct tdqcow_state *s = cow->state;
+	struct qcow_request *aio, *tmp;
+	td_request_t treq;
+
+	list_del(&cow->next);
+	cow->l2->pinned--;
+	td_complete_request(cow->treq, err);
+
+	list_for_each_entry_safe(aio, tmp, &cow->waiters, next) {
+		list_del(&aio->next);
+		treq = aio->treq;
+		s->aio_free_list[s->aio_free_count++] = aio;
+
+		if (err)
+			td_complete_request(treq, err);
+		else
+			tdqcow_queue_write(s->driver, treq);
+	}
+
+	free(cow->buf);
+	free(cow);
+}
+
+/*
+ * The new cluster is on disk: only now may the L2 table point at it, and
+ * only then are the clusters of the entry it replaces let go (should that
+ * fail, they leak).
+ */
+static void qcow2_cow_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow_cow *cow = (struct qcow_cow *)arg;
+	struct tdqcow_state *s = cow->state;
+	uint64_t offset;
+
+	offset = cow->cluster << s->cluster_bits;
+
+	if (!err)
+		err = qcow2_set_l2_entry(s, cow->l2, offset,
+					 cow->offset | QCOW2_OFLAG_COPIED);
+	if (!err && qcow2_put_entry(s, cow->entry))
+		DPRINTF("QCOW2: leaked the clusters of L2 entry 0x%"PRIx64"\n",
+			cow->entry);
+
+	qcow2_cow_finish(cow, err);
+}
+
+static void qcow2_cow_write(struct qcow_cow *cow)
+{
+	struct tdqcow_state *s = cow->state;
+	int index;
+
+	if (cow->err)
+		goto fail;
+
+	index = cow->treq.sec & (s->cluster_sectors - 1);
+	memcpy(cow->buf + index * 512, cow->treq.buf, cow->treq.secs * 512);
+
+	cow->offset = qcow2_alloc_cluster(s);
+	if (!cow->offset) {
+		cow->err = -ENOSPC;
+		goto fail;
+	}
+
+	td_prep_write(&cow->tiocb, s->fd, cow->buf, s->cluster_size,
+		      cow->offset, qcow2_cow_complete, cow);
+	td_queue_tiocb(s->driver, &cow->tiocb);
+	return;
+
+fail:
+	qcow2_cow_finish(cow, cow->err);
+}
+
+static void qcow2_cow_read_complete(td_request_t treq, int err)
+{
+	struct qcow_cow *cow = (struct qcow_cow *)treq.cb_data;
+
+	if (err)
+		cow->err = err;
+
+	cow->secs_left -= treq.secs;
+	if (!cow->secs_left)
+		qcow2_cow_write(cow);
+}
+
+/* later writes to the cluster wait until its L2 entry is written */
+static struct qcow_cow *qcow2_new_cow(struct tdqcow_state *s,
+				      td_request_t treq,
+				      struct qcow_cache_entry *l2,
+				      uint64_t entry)
+{
+	struct qcow_cow *cow;
+
+	cow = calloc(1, sizeof(*cow));
+	if (!cow)
+		return NULL;
+
+	cow->state   = s;
+	cow->cluster = treq.sec >> (s->cluster_bits - 9);
+	cow->entry   = entry;
+	cow->treq    = treq;
+	cow->l2      = l2;
+	l2->pinned++;
+	INIT_LIST_HEAD(&cow->waiters);
+	list_add_tail(&cow->next, &s->cows);
+
+	return cow;
+}
+
+/*
+ * A write to a cluster that is not allocated yet, which needs nothing
+ * from below: written straight to a new cluster, which the L2 table
+ * points at once the data is on disk.
+ */
+static void qcow2_alloc_write(struct tdqcow_state *s, td_request_t treq,
+			      struct qcow_cache_entry *l2, uint64_t entry)
+{
+	struct qcow_cow *cow;
+	int index;
+
+	cow = qcow2_new_cow(s, treq, l2, entry);
+	if (!cow) {
+		td_complete_request(treq, -ENOMEM);
+		return;
+	}
+
+	cow->offset = qcow2_alloc_cluster(s);
+	if (!cow->offset) {
+		qcow2_cow_finish(cow, -ENOSPC);
+		return;
+	}
+
+	index = treq.sec & (s->cluster_sectors - 1);
+	td_prep_write(&cow->tiocb, s->fd, treq.buf, treq.secs * 512,
+		      cow->offset + index * 512, qcow2_cow_complete, cow);
+	td_queue_tiocb(s->driver, &cow->tiocb);
+}
+
+/*
+ * A write covering only part of a cluster that is not allocated yet.
+ * The rest of the cluster is read from wherever it comes from now (the
+ * backing image, or a compressed cluster), merged with the write and
+ * written to a new cluster.  Later writes to the cluster wait for it.
+ */
+static void qcow2_start_cow(td_driver_t *driver, struct tdqcow_state *s,
+			    td_request_t treq, struct qcow_cache_entry *l2,
+			    uint64_t entry)
+{
+	struct qcow_cow *cow;
+	td_request_t rreq;
+	uint64_t start;
+	char *buf;
+
+	if (posix_memalign((void **)&buf, 4096, s->cluster_size))
+		goto fail;
+
+	cow = qcow2_new_cow(s, treq, l2, entry);
+	if (!cow) {
+		free(buf);
+		goto fail;
+	}
+	cow->buf = buf;
+	s->cow_count++;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		cow->err = qcow2_decompress_cluster(s, entry);
+		if (!cow->err)
+			memcpy(cow->buf, s->cluster_cache, s->cluster_size);
+		qcow2_cow_write(cow);
+		return;
+	}
+
+	if (entry) {
+		/* a zero cluster */
+		memset(cow->buf, 0, s->cluster_size);
+		qcow2_cow_write(cow);
+		return;
+	}
+
+	start = cow->cluster << (s->cluster_bits - 9);
+
+	rreq         = treq;
+	rreq.op      = TD_OP_READ;
+	rreq.buf     = cow->buf;
+	rreq.sec     = start;
+	rreq.secs    = MIN((uint64_t)s->cluster_sectors,
+			   s->driver->info.size - start);
+	rreq.cb      = qcow2_cow_read_complete;
+	rreq.cb_data = cow;
+
+	memset(cow->buf, 0, s->cluster_size);
+	cow->secs_left = rreq.secs;
+	td_forward_request(rreq);
+	return;
+
+fail:
+	td_complete_request(treq, -ENOMEM);
+}
+
+static void tdqcow2_queue_write(td_driver_t *driver, struct tdqcow_state *s,
+				td_request_t treq)
+{
+	int err, index_in_cluster, n;
+	uint64_t entry, next, sector, nb_sectors;
+	struct qcow_cache_entry *e;
+	struct qcow_cow *cow;
+	td_request_t clone = treq;
+	char *buf = treq.buf;
+
+	sector     = treq.sec;
+	nb_sectors = treq.secs;
+
+	while (nb_sectors > 0) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+		if (!tdqcow_l2_ready(driver, s, clone))
+			return;
+
+		cow = qcow2_find_cow(s, sector >> (s->cluster_bits - 9));
+		if (cow) {
+			err = tdqcow_park_request(s, clone, &cow->waiters);
+			if (err)
+				td_complete_request(clone, err);
+			return;
+		}
+
+		index_in_cluster = sector & (s->cluster_sectors - 1);
+		n = s->cluster_sectors - index_in_cluster;
+		if (n > nb_sectors)
+			n = nb_sectors;
+
+		clone.secs = n;
+
+		if (s->aio_free_count == 0) {
+			td_complete_request(clone, -EBUSY);
+			goto next;
+		}
+
+		e = qcow2_get_l2(s, sector << 9, 1);
+		if (!e) {
+			td_complete_request(clone, -EIO);
+			goto next;
+		}
+
+		entry = qcow2_l2_entry(s, e, sector << 9);
+
+		if (qcow2_entry_plain(s, entry)) {
+			/* merge clusters that follow each other on disk */
+			while (n < nb_sectors &&
+			       ((sector + n) & ((s->l2_size *
+				 (uint64_t)s->cluster_sectors) - 1))) {
+				next = qcow2_l2_entry(s, e, (sector + n) << 9);
+				if (!qcow2_entry_plain(s, next) ||
+				    qcow2_find_cow(s, (sector + n) >>
+						   (s->cluster_bits - 9)) ||
+				    (next & QCOW2_OFFSET_MASK) !=
+				    (entry & QCOW2_OFFSET_MASK) +
+				    ((uint64_t)(index_in_cluster + n) << 9))
+					break;
+				n = MIN(nb_sectors, n + s->cluster_sectors);
+			}
+
+			clone.secs = n;
+			clone.sec  = ((entry & QCOW2_OFFSET_MASK) >> 9) +
+				index_in_cluster;
+			async_write(driver, clone);
+			goto next;
+		}
+
+		/* a new cluster: anything not written must come from below */
+		if (n < s->cluster_sectors &&
+		    (entry || s->backing_file_offset)) {
+			qcow2_start_cow(driver, s, clone, e, entry);
+			goto next;
+		}
+
+		qcow2_alloc_write(s, clone, e, entry);
+
+	next:
+		nb_sectors -= n;
+		sector     += n;
+		buf        += n * 512;
+	}
+}
+
+static int tdqcow2_read_header(int fd, QCow2Header *header)
+{
+	char *buf;
+	int err;
+
+	if (posix_memalign((void **)&buf, 512, 512))
+		return -ENOMEM;
+
+	err = 0;
+	if (pread(fd, buf, 512, 0) < (ssize_t)QCOW2_V2_HEADER_SIZE) {
+		err = -EIO;
+		goto out;
+	}
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header, buf, QCOW2_V2_HEADER_SIZE);
+	if (be32_to_cpu(header->version) >= QCOW3_VERSION)
+		memcpy(header, buf, sizeof(*header));
+
+	be32_to_cpus(&header->magic);
+	be32_to_cpus(&header->version);
+	be64_to_cpus(&header->backing_file_offset);
+	be32_to_cpus(&header->backing_file_size);
+	be32_to_cpus(&header->cluster_bits);
+	be64_to_cpus(&header->size);
+	be32_to_cpus(&header->crypt_method);
+	be32_to_cpus(&header->l1_size);
+	be64_to_cpus(&header->l1_table_offset);
+	be64_to_cpus(&header->refcount_table_offset);
+	be32_to_cpus(&header->refcount_table_clusters);
+	be32_to_cpus(&header->nb_snapshots);
+	be64_to_cpus(&header->snapshots_offset);
+
+	if (header->version >= QCOW3_VERSION) {
+		be64_to_cpus(&header->incompatible_features);
+		be64_to_cpus(&header->compatible_features);
+		be64_to_cpus(&header->autoclear_features);
+		be32_to_cpus(&header->refcount_order);
+		be32_to_cpus(&header->header_length);
+	} else
+		header->refcount_order = 4;
+
+out:
+	free(buf);
+	return err;
+}
+
+/*
+ * A writer which does not know the autoclear features must clear them
+ * before changing the image, so that nobody trusts what they describe
+ * (persistent dirty bitmaps, for instance) once it has.
+ */
+static int tdqcow2_clear_autoclear(int fd)
+{
+	char *buf;
+	int err;
+
+	if (posix_memalign((void **)&buf, 512, 512))
+		return -ENOMEM;
+
+	err = 0;
+	if (pread(fd, buf, 512, 0) != 512) {
+		err = -EIO;
+		goto out;
+	}
+
+	memset(buf + offsetof(QCow2Header, autoclear_features), 0,
+	       sizeof(uint64_t));
+
+	if (pwrite(fd, buf, 512, 0) != 512 || fsync(fd))
+		err = -errno ? : -EIO;
+
+out:
+	free(buf);
+	return err;
+}
+
+/* read a big endian table of @entries u64s into native order */
+static int tdqcow2_read_table(int fd, uint64_t offset, int entries,
+			      uint64_t **table)
+{
+	size_t size;
+	int i;
+
+	size = ((size_t)entries * sizeof(uint64_t) + 4095) & ~4095;
+	if (posix_memalign((void **)table, 4096, size)) {
+		*table = NULL;
+		return -ENOMEM;
+	}
+
+	memset(*table, 0, size);
+	if (pread(fd, *table, size, offset) <
+	    (ssize_t)(entries * sizeof(uint64_t))) {
+		free(*table);
+		*table = NULL;
+		return -EIO;
+	}
+
+	for (i = 0; i < entries; i++)
+		be64_to_cpus(&(*table)[i]);
+
+	return 0;
+}
+
+static int tdqcow2_open(td_driver_t *driver, struct tdqcow_state *s,
+			td_flag_t flags)
+{
+	int err;
+	QCow2Header header;
+
+	err = tdqcow2_read_header(s->fd, &header);
+	if (err)
+		return err;
+
+	if (header.cluster_bits < 9 || header.cluster_bits > 21 ||
+	    header.size <= 1) {
+		DPRINTF("QCOW2: bad header\n");
+		return -EINVAL;
+	}
+
+	if (header.crypt_method != QCOW_CRYPT_NONE) {
+		DPRINTF("QCOW2: encrypted images are not supported\n");
+		return -EINVAL;
+	}
+
+	if (header.incompatible_features || header.refcount_order != 4) {
+		DPRINTF("QCOW2: unsupported features 0x%"PRIx64
+			", refcount order %u\n",
+			header.incompatible_features, header.refcount_order);
+		return -EINVAL;
+	}
+
+	/* clusters shared with snapshots would need copying on write */
+	if (header.nb_snapshots && !td_flag_test(flags, TD_OPEN_RDONLY)) {
+		DPRINTF("QCOW2: images with snapshots open read-only\n");
+		return -EINVAL;
+	}
+
+	if (header.autoclear_features && !td_flag_test(flags, TD_OPEN_RDONLY)) {
+		DPRINTF("QCOW2: clearing autoclear features 0x%"PRIx64"\n",
+			header.autoclear_features);
+		err = tdqcow2_clear_autoclear(s->fd);
+		if (err)
+			return err;
+	}
+
+	s->version             = header.version;
+	s->cluster_bits        = header.cluster_bits;
+	s->cluster_size        = 1 << s->cluster_bits;
+	s->cluster_sectors     = 1 << (s->cluster_bits - 9);
+	s->l2_bits             = s->cluster_bits - 3;
+	s->l2_size             = 1 << s->l2_bits;
+	s->l1_size             = header.l1_size;
+	s->l1_table_offset     = header.l1_table_offset;
+	s->backing_file_offset = header.backing_file_offset;
+	s->backing_file_size   = header.backing_file_size;
+	s->refcount_block_bits = s->cluster_bits - 1;
+	s->refcount_table_offset = header.refcount_table_offset;
+	s->refcount_table_size = (header.refcount_table_clusters <<
+				  s->cluster_bits) / sizeof(uint64_t);
+	driver->info.size      = header.size >> 9;
+
+	if ((uint64_t)s->l1_size << (s->l2_bits + s->cluster_bits) <
+	    header.size) {
+		DPRINTF("QCOW2: L1 table too small\n");
+		return -EINVAL;
+	}
+
+	err = tdqcow2_read_table(s->fd, s->l1_table_offset, s->l1_size,
+				 &s->l1_table);
+	if (err)
+		return err;
+
+	err = tdqcow2_read_table(s->fd, s->refcount_table_offset,
+				 s->refcount_table_size, &s->refcount_table);
+	if (err)
+		return err;
+
+	err = tdqcow_init_l2_cache(s, s->cluster_size);
+	if (err)
+		return err;
+
+	err = qcow_cache_init(&s->rc_cache, QCOW_RC_CACHE_SIZE,
+			      s->cluster_size, s);
+	if (err)
+		return err;
+
+	/* compressed clusters may straddle a sector boundary */
+	if (posix_memalign((void **)&s->cluster_cache, 4096, s->cluster_size) ||
+	    posix_memalign((void **)&s->cluster_data, 4096,
+			   2 * s->cluster_size))
+		return -ENOMEM;
+	s->cluster_cache_offset = -1;
+
+	s->fd_end = lseek(s->fd, 0, SEEK_END);
+	if (s->fd_end == (off_t)-1)
+		return -errno;
+
+	DPRINTF("QCOW2: version %d, %d byte clusters, %"PRIu64" sectors\n",
+		s->version, s->cluster_size, driver->info.size);
+
+	return 0;
+}
+
+/* Open the disk file and initialize qcow state. */
+int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	int fd, len, i, ret, size, o_flags;
+	td_disk_info_t *bs = &(driver->info);
+	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
+	QCowHeader header;
+	uint64_t final_cluster = 0;
+
+ 	DPRINTF("QCOW: Opening %s\n", name);
+
+	o_flags = O_DIRECT | O_LARGEFILE | 
+		((flags == TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	fd = open(name, o_flags);
+	if (fd < 0) {
+		DPRINTF("Unable to open %s (%d)\n", name, -errno);
+		return -1;
+	}
+
+	s->fd = fd;
+	s->driver = driver;
+	INIT_LIST_HEAD(&s->cows);
+	s->name = strdup(name);
+	if (!s->name)
+		goto fail;
+
+	if (tdqcow_read_header(fd, &header))
+		goto fail;
+
+	if (header.magic != QCOW_MAGIC)
+		goto fail;
+
+	bs->sector_size = 512;
+	bs->info = 0;
+
+	switch (header.version) {
+	case QCOW_VERSION:
+		s->version = QCOW_VERSION;
+		break;
+	case QCOW2_VERSION:
+	case QCOW3_VERSION:
+		if (tdqcow2_open(driver, s, flags))
+			goto fail;
+		goto out;
+	default:
+		goto fail;
+	}
+
+	if (header.size <= 1 || header.cluster_bits < 9)
+		goto fail;
+	if (header.crypt_method > QCOW_CRYPT_AES)
+		goto fail;
+	s->crypt_method_header = header.crypt_method;
+	if (s->crypt_method_header)
+		s->encrypted = 1;
+	s->cluster_bits = header.cluster_bits;
+	s->cluster_size = 1 << s->cluster_bits;
+	s->cluster_sectors = 1 << (s->cluster_bits - 9);
+	s->l2_bits = header.l2_bits;
+	s->l2_size = 1 << s->l2_bits;
+	s->cluster_alloc = s->l2_size;
+	bs->size = header.size / 512;
+	s->cluster_offset_mask = (1LL << (63 - s->cluster_bits)) - 1;
+	s->backing_file_offset = header.backing_file_offset;
+	s->backing_file_size   = header.backing_file_size;
+
+	/* allocate and load l1 table */
+	if (tdqcow_load_l1_table(s, &header))
+		goto fail;
+
+	/* alloc L2 cache */
+	if (tdqcow_init_l2_cache(s, s->l2_size * sizeof(uint64_t)))
+		goto fail;
+
+	size = s->cluster_size;
+	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
+	if(ret != 0) goto fail;
+
+	ret = posix_memalign((void **)&s->cluster_data, 4096, size);
+	if(ret != 0) goto fail;
+	s->cluster_cache_offset = -1;
+
+	if (s->backing_file_offset != 0)
+		s->cluster_alloc = 1; /*Cannot use pre-alloc*/
+
+	for(i = 0; i < s->l1_size; i++)
+		if (s->l1_table[i] > final_cluster)
+			final_cluster = s->l1_table[i];
+
+	if (!final_cluster)
+		s->fd_end = s->l1_table_offset +
+			((s->l1_size * sizeof(uint64_t) + 4095) & ~4095);
+	else {
+		s->fd_end = lseek(fd, 0, SEEK_END);
+		if (s->fd_end == (off_t)-1)
+			goto fail;
+	}
+
+out:
+	if (init_aio_state(driver)!=0) {
+	  DPRINTF("Unable to initialise AIO state\n");
+	  free_aio_state(s);
+	  goto fail;
+	}
+
+	return 0;
+	
+fail:
+	DPRINTF("QCOW Open failed\n");
+
+	free_aio_state(s);
+	free(s->l1_table);
+	free(s->refcount_table);
+	qcow_cache_free(&s->l2_cache);
+	qcow_cache_free(&s->rc_cache);
+	free(s->cluster_cache);
+	free(s->cluster_data);
+	close(fd);
+	return -1;
+}
+
+void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
+	int ret = 0, index_in_cluster, n, i;
+	uint64_t cluster_offset, sector, nb_sectors;
+	struct qcow_prv* prv;
+	td_request_t clone = treq;
+	char* buf = treq.buf;
+
+	if (s->version > QCOW_VERSION) {
+		tdqcow2_queue_read(driver, s, treq);
+		return;
+	}
+
+	sector     = treq.sec;
+	nb_sectors = treq.secs;
+
+	/*We store a local record of the request*/
+	while (nb_sectors > 0) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+		if (!tdqcow_l2_ready(driver, s, clone))
+			return;
+
+		cluster_offset = 
+			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
+		index_in_cluster = sector & (s->cluster_sectors - 1);
+		n = s->cluster_sectors - index_in_cluster;
+		if (n > nb_sectors)
+			n = nb_sectors;
+
+		if (s->aio_free_count == 0) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+		
+		if(!cluster_offset) {
+            uint64_t span;
+            /* Forward the rest of this L2 table's range if possible. */
+            span = (s->l2_size * (uint64_t)s->cluster_sectors) -
+                (sector & (s->l2_size * (uint64_t)s->cluster_sectors - 1));
+            if (span > nb_sectors)
+                span = nb_sectors;
+            for(i=0; i<span; i++)
+                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
+                    goto coalesce_failed;
+            treq.buf  = buf;
+            treq.sec  = sector;
+            treq.secs = span;
+			td_forward_request(treq);
+            n = span;
+            goto next;
+coalesce_failed:            
+			treq.buf  = buf;
+			treq.sec  = sector;
+			treq.secs = n;
+			td_forward_request(treq);
+
+		} else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
+			if (decompress_cluster(s, cluster_offset) < 0) {
+				td_complete_request(treq, -EIO);
+				goto done;
 			}
 			memcpy(buf, s->cluster_cache + index_in_cluster * 512, 
 			       512 * n);
@@ -1042,6 +2346,7 @@ coalesce_failed:
 		  clone.secs = n;
 		  async_read(driver, clone);
 		}
+next:
 		nb_sectors -= n;
 		sector += n;
 		buf += n * 512;
@@ -1060,11 +2365,22 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 	char* buf = treq.buf;
 	td_request_t clone=treq;
 
+	if (s->version > QCOW_VERSION) {
+		tdqcow2_queue_write(driver, s, treq);
+		return;
+	}
+
 	sector     = treq.sec;
 	nb_sectors = treq.secs;
 		   
 	/*We store a local record of the request*/
 	while (nb_sectors > 0) {
+		clone.buf  = buf;
+		clone.sec  = sector;
+		clone.secs = nb_sectors;
+		if (!tdqcow_l2_ready(driver, s, clone))
+			return;
+
 		index_in_cluster = sector & (s->cluster_sectors - 1);
 		n = s->cluster_sectors - index_in_cluster;
 		if (n > nb_sectors)
@@ -1166,10 +2482,15 @@ int tdqcow_close(td_driver_t *driver)
 	/*Update the hdr cksum*/
 	tdqcow_update_checksum(s);
 
+	if (s->version > QCOW_VERSION)
+		qcow2_release_prealloc(s);
+
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	free(s->refcount_table);
+	qcow_cache_free(&s->l2_cache);
+	qcow_cache_free(&s->rc_cache);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1319,6 +2640,122 @@ int qcow_create(const char *filename, uint64_t total_size,
 	return 0;
 }
 
+/*
+ * A qcow2 (version 2) image: the header and backing file name in the
+ * first cluster, then the refcount table, a single refcount block and
+ * the L1 table.  @cluster_bits of 0 picks 64 KB clusters.
+ */
+int qcow2_create(const char *filename, uint64_t total_size,
+		 const char *backing_file, int cluster_bits)
+{
+	int fd, err, i, cluster_size, backing_len;
+	uint64_t size, clusters, l1_size, l1_clusters, rt_entries;
+	uint64_t rt_clusters, meta, offset;
+	char backing_filename[PATH_MAX], *buf;
+	QCow2Header header;
+	struct stat st;
+	uint64_t *table;
+	uint16_t *block;
+
+	if (!cluster_bits)
+		cluster_bits = 16;
+	if (cluster_bits < 12 || cluster_bits > 21)
+		return -EINVAL;
+	cluster_size = 1 << cluster_bits;
+
+	size        = total_size;
+	backing_len = 0;
+	if (backing_file) {
+		if (realpath(backing_file, backing_filename) == NULL ||
+		    stat(backing_filename, &st) != 0)
+			return -errno;
+		if (get_filesize(backing_filename, &size, &st))
+			return -EINVAL;
+		size <<= SECTOR_SHIFT;
+		backing_len = strlen(backing_filename);
+		if (sizeof(header) + backing_len > cluster_size)
+			return -ENAMETOOLONG;
+	}
+
+	DPRINTF("Qcow2_create: size %"PRIu64", %d byte clusters\n",
+		size, cluster_size);
+
+	clusters    = (size + cluster_size - 1) >> cluster_bits;
+	l1_size     = (clusters + (cluster_size / 8) - 1) /
+		(cluster_size / 8);
+	l1_clusters = (l1_size * 8 + cluster_size - 1) >> cluster_bits;
+
+	/* enough refcount blocks for the data and its L2 tables, twice */
+	rt_entries  = (2 * (clusters + l1_size) + (cluster_size / 2) - 1) /
+		(cluster_size / 2) + 1;
+	rt_clusters = (rt_entries * 8 + cluster_size - 1) >> cluster_bits;
+
+	meta = 1 + rt_clusters + 1 + l1_clusters;
+	if (meta > cluster_size / 2)
+		return -EINVAL;
+
+	buf = calloc(1, cluster_size);
+	if (!buf)
+		return -ENOMEM;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0) {
+		free(buf);
+		return -errno;
+	}
+
+	err = -EIO;
+	if (ftruncate(fd, meta << cluster_bits))
+		goto out;
+
+	memset(&header, 0, sizeof(header));
+	header.magic                   = cpu_to_be32(QCOW_MAGIC);
+	header.version                 = cpu_to_be32(QCOW2_VERSION);
+	header.cluster_bits            = cpu_to_be32(cluster_bits);
+	header.size                    = cpu_to_be64(size);
+	header.crypt_method            = cpu_to_be32(QCOW_CRYPT_NONE);
+	header.l1_size                 = cpu_to_be32(l1_size);
+	header.l1_table_offset         = cpu_to_be64((2 + rt_clusters) <<
+						     cluster_bits);
+	header.refcount_table_offset   = cpu_to_be64((uint64_t)cluster_size);
+	header.refcount_table_clusters = cpu_to_be32(rt_clusters);
+	if (backing_file) {
+		header.backing_file_offset = cpu_to_be64(QCOW2_V2_HEADER_SIZE);
+		header.backing_file_size   = cpu_to_be32(backing_len);
+	}
+
+	memcpy(buf, &header, QCOW2_V2_HEADER_SIZE);
+	if (backing_file)
+		memcpy(buf + QCOW2_V2_HEADER_SIZE,
+		       backing_filename, backing_len);
+	if (pwrite(fd, buf, cluster_size, 0) != cluster_size)
+		goto out;
+
+	/* the refcount table's first entry is the block after it */
+	memset(buf, 0, cluster_size);
+	table    = (uint64_t *)buf;
+	offset   = (1 + rt_clusters) << cluster_bits;
+	table[0] = cpu_to_be64(offset);
+	if (pwrite(fd, buf, cluster_size, cluster_size) != cluster_size)
+		goto out;
+
+	memset(buf, 0, cluster_size);
+	block = (uint16_t *)buf;
+	for (i = 0; i < meta; i++)
+		block[i] = cpu_to_be16(1);
+	if (pwrite(fd, buf, cluster_size, offset) != cluster_size)
+		goto out;
+
+	err = 0;
+
+out:
+	if (err)
+		err = errno ? -errno : err;
+	close(fd);
+	free(buf);
+	return err;
+}
+
 static int qcow_make_empty(struct tdqcow_state *s)
 {
 	uint32_t l1_length = s->l1_size * sizeof(uint64_t);
@@ -1332,9 +2769,7 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	qcow_cache_reset(&s->l2_cache);
 
 	return 0;
 }
@@ -1487,6 +2922,23 @@ int tdqcow_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+void tdqcow_debug(td_driver_t *driver)
+{
+	struct tdqcow_state *s = (struct tdqcow_state *)driver->data;
+
+	DPRINTF("%s: version %d, %d byte clusters, %d/%d aio free\n",
+		s->name, s->version, s->cluster_size,
+		s->aio_free_count, s->max_aio_reqs);
+	DPRINTF("L2 cache: %d tables, hits %"PRIu64", misses %"PRIu64"\n",
+		s->l2_cache.size, s->l2_cache.hits, s->l2_cache.misses);
+
+	if (s->version > QCOW_VERSION)
+		DPRINTF("refcount cache: hits %"PRIu64", misses %"PRIu64", "
+			"copies on write %"PRIu64", reserved 0x%"PRIx64
+			"-0x%"PRIx64"\n", s->rc_cache.hits, s->rc_cache.misses,
+			s->cow_count, s->prealloc_next, s->prealloc_end);
+}
+
 struct tap_disk tapdisk_qcow = {
 	.disk_type           = "tapdisk_qcow",
 	.flags              = 0,
@@ -1497,5 +2949,5 @@ struct tap_disk tapdisk_qcow = {
 	.td_queue_write      = tdqcow_queue_write,
 	.td_get_parent_id    = tdqcow_get_parent_id,
 	.td_validate_parent  = tdqcow_validate_parent,
-	.td_debug           = NULL,
+	.td_debug           = tdqcow_debug,
 };
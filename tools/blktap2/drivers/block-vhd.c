@@ -41,6 +41,28 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *
+ * A note on block allocation:
+ * Up to VHD_ALLOC_MAX blocks may be allocated at once.  Space for a new
+ * block is reserved from next_db as soon as it is first written, and the
+ * BAT entry for it becomes ready to be written once its bitmap is zeroed
+ * on disk.  Ready BAT entries are written in batches, one write per BAT
+ * sector, and a new batch is only started once the previous one has
+ * completed, so two writes to the same BAT sector are never in flight.
+ *
+ * A note on parent chains:
+ * Reads that miss in a differencing disk are normally forwarded to the
+ * parent image, which repeats the BAT and bitmap lookup, and so on down
+ * the chain.  The topmost VHD of a deep chain instead opens its own
+ * read-only view of every ancestor and keeps a map of which ancestor
+ * owns each sector, so forwarded reads go straight to the right file.
+ * The map is built lazily, one block at a time, reading that block's
+ * bitmap from all ancestors at once.  The top image itself is always
+ * checked first and never appears in the map, so its writes cannot make
+ * the map stale; ancestors are read-only while they are open, and the
+ * map is rebuilt whenever the chain is reopened (e.g. on pause/resume
+ * around a coalesce).  VBDs with a block cache over their ancestors
+ * don't use the map, so that parent reads go through the cache.
  */
 
 #include <errno.h>
@@ -68,14 +90,20 @@ unsigned int SPB;
 
 #define VHD_BATMAP_MAX_RETRIES 10
 
+/* number of blocks to reserve file space for ahead of allocation */
+#define VHD_PREALLOCATE_ENV    "TAPDISK2_VHD_PREALLOCATE"
+/* build the chain map for chains at least this deep; 0 disables it */
+#define VHD_CHAIN_MAP_ENV      "TAPDISK2_VHD_CHAIN_MAP"
+#define VHD_CHAIN_MIN_DEPTH    2
+
 #define __TRACE(s)							\
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, ALLOCS: %d\n",					\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.allocs);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -110,17 +138,30 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_ALLOC_MAX                (VHD_CACHE_SIZE / 2)
+#define VHD_BAT_WRITES               VHD_ALLOC_MAX
+#define VHD_BAT_ENTRIES_PER_SEC      (VHD_SECTOR_SIZE / sizeof(u32))
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_REQS_META                (2 * VHD_CACHE_SIZE + VHD_BAT_WRITES)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
+#define VHD_CHAIN_MAX_DEPTH          250
+#define VHD_CHAIN_LOADS              8         /* blocks resolved at once */
+
+/* chain map owners: 1..depth is an ancestor, nearest first */
+#define VHD_CHAIN_UNKNOWN            0
+#define VHD_CHAIN_NONE               0xfd      /* no ancestor: zeros */
+#define VHD_CHAIN_MIXED              0xfe      /* see chain->runs */
+#define VHD_CHAIN_LOADING            0xff
+
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
 #define VHD_OP_DATA_WRITE            2
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_CHAIN_BITMAP_READ     6
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -135,14 +176,16 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_STRICT         8
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
-
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_OPEN_CHAIN          64
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOC            16
+#define VHD_FLAG_BM_BAT_READY        32
+#define VHD_FLAG_BM_BAT_WRITE        64
+#define VHD_FLAG_BM_ALLOC_FAILED     128
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -151,6 +194,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_BM_WRITTEN       4
 
 typedef uint8_t vhd_flag_t;
 
@@ -182,14 +226,18 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_bat_write {
+	uint32_t                  sector;      /* bat sector being written */
+	char                     *buf;
+	struct vhd_request        req;
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
-	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
-	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
+	int                       allocs;      /* blocks being allocated */
+	int                       writes;      /* bat writes in flight */
+	struct vhd_bat_write      batch[VHD_BAT_WRITES];
 	char                     *bat_buf;
 };
 
@@ -213,6 +261,52 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+
+	uint64_t                  pbw_offset;  /* file offset of block being
+						* allocated */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+};
+
+struct vhd_chain_level {
+	vhd_context_t             vhd;
+	int                       batmap;      /* vhd.batmap is valid */
+	u64                       size;        /* in sectors */
+};
+
+struct vhd_chain_run {
+	u32                       start;       /* first sector in block */
+	uint8_t                   owner;
+};
+
+struct vhd_chain_runs {
+	int                       n;
+	struct vhd_chain_run      run[0];
+};
+
+struct vhd_chain_load {
+	u32                       blk;
+	int                       busy;
+	int                       pending;     /* bitmap reads in flight */
+	int                       error;
+	char                     *maps;        /* one bitmap per level */
+	struct vhd_request       *reqs;        /* one read per level */
+	struct vhd_req_list       waiting;     /* reads waiting for the map */
+};
+
+struct vhd_chain {
+	int                       depth;
+	struct vhd_chain_level   *levels;      /* levels[0] is our parent */
+
+	u32                       blocks;
+	uint8_t                  *owner;       /* per block */
+	struct vhd_chain_runs   **runs;        /* per block, if mixed */
+	struct vhd_chain_run     *scratch;
+
+	struct vhd_chain_load     loads[VHD_CHAIN_LOADS];
+
+	uint64_t                  direct;      /* reads sent to an ancestor */
+	uint64_t                  resolved;    /* blocks mapped */
+	uint64_t                  fallback;    /* reads forwarded regardless */
 };
 
 struct vhd_state {
@@ -224,8 +318,12 @@ struct vhd_state {
         u32                       spb;         /* sectors per block */
         u64                       next_db;     /* pointer to the next 
 						* (unallocated) datablock */
+	u64                       prealloc_end; /* file space reserved
+						 * up to here */
+	int                       prealloc_blocks;
 
 	struct vhd_bat_state      bat;
+	struct vhd_chain         *chain;
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
@@ -258,6 +356,7 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void vhd_preallocate(struct vhd_state *);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -392,7 +491,7 @@ vhd_free_bat(struct vhd_state *s)
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
 }
 
 static int
@@ -400,7 +499,7 @@ vhd_initialize_bat(struct vhd_state *s)
 {
 	int err, psize, batmap_required, i;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(struct vhd_bat_state));
 
 	psize = getpagesize();
 
@@ -436,13 +535,16 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign((void **)&s->bat.bat_buf, VHD_SECTOR_SIZE,
+			     VHD_SECTOR_SIZE * VHD_BAT_WRITES);
 	if (err) {
 		s->bat.bat_buf = NULL;
 		goto fail;
 	}
 
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		s->bat.batch[i].buf = s->bat.bat_buf + i * VHD_SECTOR_SIZE;
+
 	return 0;
 
 fail:
@@ -593,6 +695,139 @@ vhd_log_open(struct vhd_state *s)
 		allocated, full, s->next_db);
 }
 
+static void
+vhd_chain_close(struct vhd_state *s)
+{
+	int i;
+	struct vhd_chain *c = s->chain;
+
+	if (!c)
+		return;
+
+	for (i = 0; i < VHD_CHAIN_LOADS; i++) {
+		free(c->loads[i].maps);
+		free(c->loads[i].reqs);
+	}
+
+	if (c->runs)
+		for (i = 0; i < c->blocks; i++)
+			free(c->runs[i]);
+
+	for (i = 0; i < c->depth; i++) {
+		td_unregister_file(s->driver, c->levels[i].vhd.fd);
+		vhd_close(&c->levels[i].vhd);
+	}
+
+	free(c->runs);
+	free(c->owner);
+	free(c->scratch);
+	free(c->levels);
+	free(c);
+	s->chain = NULL;
+}
+
+/*
+ * open our own view of every ancestor.  Chains we cannot map (raw
+ * parents, differing block sizes) are left to the generic path.
+ */
+static int
+vhd_chain_open(struct vhd_state *s)
+{
+	int i, err, min;
+	char *env, *parent;
+	vhd_context_t *child;
+	struct vhd_chain *c;
+	struct vhd_chain_level *l;
+
+	env = getenv(VHD_CHAIN_MAP_ENV);
+	min = env ? atoi(env) : VHD_CHAIN_MIN_DEPTH;
+	if (min <= 0)
+		return 0;
+
+	c = calloc(1, sizeof(struct vhd_chain));
+	if (!c)
+		return -ENOMEM;
+
+	s->chain = c;
+	err      = -ENOMEM;
+
+	c->levels = calloc(VHD_CHAIN_MAX_DEPTH, sizeof(struct vhd_chain_level));
+	if (!c->levels)
+		goto fail;
+
+	for (child = &s->vhd; child->footer.type == HD_TYPE_DIFF;
+	     child = &l->vhd) {
+		err = 0;
+		if (c->depth == VHD_CHAIN_MAX_DEPTH || vhd_parent_raw(child))
+			goto fail;
+
+		err = vhd_parent_locator_get(child, &parent);
+		if (err)
+			goto fail;
+
+		l   = c->levels + c->depth;
+		err = vhd_open(&l->vhd, parent, VHD_OPEN_RDONLY);
+		free(parent);
+		if (err)
+			goto fail;
+
+		c->depth++;
+		l->size = l->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
+
+		if (!vhd_type_dynamic(&l->vhd))
+			continue;
+
+		err = 0;
+		if (l->vhd.header.block_size != s->vhd.header.block_size)
+			goto fail;
+
+		err = vhd_get_bat(&l->vhd);
+		if (err)
+			goto fail;
+
+		if (vhd_has_batmap(&l->vhd) && !vhd_get_batmap(&l->vhd))
+			l->batmap = 1;
+	}
+
+	err = 0;
+	if (c->depth < min)
+		goto fail;
+
+	err        = -ENOMEM;
+	c->blocks  = s->bat.bat.entries;
+	c->owner   = calloc(c->blocks, sizeof(uint8_t));
+	c->scratch = calloc(s->spb, sizeof(struct vhd_chain_run));
+	if (!c->owner || !c->scratch)
+		goto fail;
+
+	for (i = 0; i < VHD_CHAIN_LOADS; i++) {
+		struct vhd_chain_load *load = c->loads + i;
+
+		err = posix_memalign((void **)&load->maps, VHD_SECTOR_SIZE,
+				     c->depth * vhd_sectors_to_bytes(s->bm_secs));
+		if (err) {
+			load->maps = NULL;
+			err = -err;
+			goto fail;
+		}
+
+		err        = -ENOMEM;
+		load->reqs = calloc(c->depth, sizeof(struct vhd_request));
+		if (!load->reqs)
+			goto fail;
+	}
+
+	for (i = 0; i < c->depth; i++)
+		td_register_file(s->driver, c->levels[i].vhd.fd);
+
+	DPRINTF("%s: mapping %d ancestors\n", s->vhd.file, c->depth);
+	return 0;
+
+fail:
+	vhd_chain_close(s);
+	return err;
+}
+
 static int
 __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 {
@@ -664,6 +899,27 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_PREALLOCATE) &&
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY) &&
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_NO_CACHE) &&
+	    vhd_type_dynamic(&s->vhd)) {
+		char *env = getenv(VHD_PREALLOCATE_ENV);
+
+		s->prealloc_blocks = env ? MAX(atoi(env), 0) : 0;
+		vhd_preallocate(s);
+	}
+
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_CHAIN) &&
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_NO_CACHE) &&
+	    s->vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_chain_open(s);
+		if (err)
+			DPRINTF("%s: not mapping parent chain: %d\n",
+				s->vhd.file, err);
+	}
+
+	td_register_file(driver, s->vhd.fd);
+
         return 0;
 
  fail:
@@ -691,6 +947,14 @@ _vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
 			      VHD_FLAG_OPEN_RDONLY |
 			      VHD_FLAG_OPEN_NO_CACHE);
 
+	/*
+	 * ancestors are opened shareable, only the top image maps them.
+	 * a block cache over the ancestors wants to see their reads, so
+	 * leave them to the normal forwarding path in that case.
+	 */
+	if (!(flags & (TD_OPEN_SHAREABLE | TD_OPEN_ADD_CACHE)))
+		vhd_flags |= VHD_FLAG_OPEN_CHAIN;
+
 	/* pre-allocate for all but NFS and LVM storage */
 	if (driver->storage != TAPDISK_STORAGE_TYPE_NFS &&
 	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
@@ -758,8 +1022,10 @@ _vhd_close(td_driver_t *driver)
 
  free:
 	vhd_log_close(s);
+	vhd_chain_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	td_unregister_file(driver, s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -925,35 +1191,6 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
-{
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
-
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline int
-bat_locked(struct vhd_state *s)
-{
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
@@ -966,6 +1203,8 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->zero_req);
+	bm->pbw_offset = 0;
 }
 
 static inline struct vhd_bitmap *
@@ -1007,11 +1246,18 @@ bitmap_valid(struct vhd_bitmap *bm)
 	return !test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
 }
 
+static inline int
+bitmap_allocating(struct vhd_bitmap *bm)
+{
+	return test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC);
+}
+
 static inline int
 bitmap_in_use(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
+		bitmap_allocating(bm)                                ||
 		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
@@ -1135,6 +1381,25 @@ free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
+/*
+ * writes to an unallocated block must wait if it cannot join an
+ * allocation already in progress and no new one can be started.
+ */
+static int
+alloc_blocked(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap *bm = get_bitmap(s, blk);
+
+	if (bm && bitmap_allocating(bm))
+		return test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_FAILED);
+
+	/* a failed allocation is still draining its transaction */
+	if (bm && test_vhd_flag(bm->tx.status, VHD_FLAG_TX_LIVE))
+		return 1;
+
+	return s->bat.allocs >= VHD_ALLOC_MAX;
+}
+
 static int
 read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 {
@@ -1155,8 +1420,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		if (op == VHD_OP_DATA_WRITE && alloc_blocked(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1233,11 +1497,12 @@ free_vhd_request(struct vhd_state *s, struct vhd_request *req)
 }
 
 static inline void
-aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+__aio_read(struct vhd_state *s, int fd,
+	   struct vhd_request *req, uint64_t offset)
 {
 	struct tiocb *tiocb = &req->tiocb;
 
-	td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
+	td_prep_read(tiocb, fd, req->treq.buf,
 		     vhd_sectors_to_bytes(req->treq.secs),
 		     offset, vhd_complete, req);
 	td_queue_tiocb(s->driver, tiocb);
@@ -1248,6 +1513,12 @@ aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+static inline void
+aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+{
+	__aio_read(s, s->vhd.fd, req, offset);
+}
+
 static inline void
 aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
@@ -1265,58 +1536,118 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 }
 
 static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int gap = 0;
+	uint64_t lb_end = s->next_db;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(!bitmap_allocating(bm));
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	bm->pbw_offset = s->next_db + gap;
+	s->next_db     = bm->pbw_offset + s->bm_secs + s->spb;
+
+	s->bat.allocs++;
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC);
+	lock_bitmap(bm);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", allocs: %d\n",
+	    bm->blk, bm->pbw_offset, s->bat.allocs);
 
-	return s->next_db;
+	return lb_end;
 }
 
-static int
-schedule_bat_write(struct vhd_state *s)
+static inline void
+release_block(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	ASSERT(bitmap_allocating(bm) && s->bat.allocs > 0);
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC | VHD_FLAG_BM_BAT_READY |
+		       VHD_FLAG_BM_BAT_WRITE | VHD_FLAG_BM_ALLOC_FAILED);
+	s->bat.allocs--;
+}
+
+static struct vhd_bat_write *
+get_bat_write(struct vhd_state *s, uint32_t sector, int *n)
 {
 	int i;
-	u32 blk;
-	char *buf;
+	struct vhd_bat_write *w;
+
+	for (i = 0; i < *n; i++)
+		if (s->bat.batch[i].sector == sector)
+			return s->bat.batch + i;
+
+	if (*n == VHD_BAT_WRITES)
+		return NULL;
+
+	w         = s->bat.batch + (*n)++;
+	w->sector = sector;
+	memcpy(w->buf, &bat_entry(s, sector * VHD_BAT_ENTRIES_PER_SEC),
+	       VHD_SECTOR_SIZE);
+
+	return w;
+}
+
+/*
+ * write out the bat entries of all blocks whose bitmaps have been
+ * zeroed, one write per bat sector.  entries becoming ready while a
+ * batch is in flight go out with the next one.
+ */
+static void
+schedule_bat_write(struct vhd_state *s)
+{
+	int i, j, n;
 	u64 offset;
+	struct vhd_bitmap *bm;
 	struct vhd_request *req;
+	struct vhd_bat_write *w;
 
-	ASSERT(bat_locked(s));
+	if (s->bat.writes)
+		return;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	n = 0;
+	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		bm = s->bitmap[i];
+		if (!bm || !test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY))
+			continue;
 
-	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+		w = get_bat_write(s, bm->blk / VHD_BAT_ENTRIES_PER_SEC, &n);
+		if (!w)
+			continue;
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+		((u32 *)w->buf)[bm->blk % VHD_BAT_ENTRIES_PER_SEC] =
+			bm->pbw_offset;
 
-	for (i = 0; i < 128; i++)
-		BE32_OUT(&((u32 *)buf)[i]);
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE);
+	}
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
-	req->treq.buf  = buf;
-	req->op        = VHD_OP_BAT_WRITE;
-	req->next      = NULL;
+	for (i = 0; i < n; i++) {
+		w   = s->bat.batch + i;
+		req = &w->req;
 
-	aio_write(s, req, offset);
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+		for (j = 0; j < VHD_BAT_ENTRIES_PER_SEC; j++)
+			BE32_OUT(&((u32 *)w->buf)[j]);
+
+		init_vhd_request(s, req);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+		offset         = s->vhd.header.table_offset +
+			w->sector * VHD_SECTOR_SIZE;
+		req->treq.secs = 1;
+		req->treq.buf  = w->buf;
+		req->op        = VHD_OP_BAT_WRITE;
+		req->next      = NULL;
 
-	return 0;
+		aio_write(s, req, offset);
+
+		DBG(TLOG_DBG, "bat sector: 0x%04x, table_offset: 0x%08"PRIx64
+		    "\n", w->sector, offset);
+	}
+
+	s->bat.writes = n;
 }
 
 static void
@@ -1324,19 +1655,19 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = (bm->pbw_offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1344,19 +1675,11 @@ schedule_zero_bm_write(struct vhd_state *s,
 }
 
 static int
-update_bat(struct vhd_state *s, uint32_t blk)
+get_alloc_bitmap(struct vhd_state *s, uint32_t blk, struct vhd_bitmap **bitmap)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
-
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
@@ -1369,77 +1692,123 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
-	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
-
+	*bitmap = bm;
 	return 0;
 }
 
 static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+update_bat(struct vhd_state *s, uint32_t blk)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t lb_end;
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
+	err = get_alloc_bitmap(s, blk, &bm);
+	if (err)
+		return err;
+
+	if (bitmap_allocating(bm)) {
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_FAILED))
 			return -EBUSY;
 		return 0;
 	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	lb_end = reserve_new_block(s, bm);
+	schedule_zero_bm_write(s, bm, lb_end);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
+	return 0;
+}
+
+/*
+ * reserve file space for the next prealloc_blocks blocks, so that
+ * allocate_block() need not zero them synchronously.
+ */
+static void
+vhd_preallocate(struct vhd_state *s)
+{
+	int err;
+	uint64_t start, end, window;
+
+	if (!s->prealloc_blocks)
+		return;
+
+	window = (uint64_t)s->prealloc_blocks * (s->spb + s->bm_secs + s->spp);
+	start  = MAX(s->prealloc_end, s->next_db);
+	end    = s->next_db + window;
+
+	/* top up once half the window has been used */
+	if (start >= s->next_db + window / 2)
+		return;
+
+	err = fallocate(s->vhd.fd, FALLOC_FL_KEEP_SIZE,
+			vhd_sectors_to_bytes(start),
+			vhd_sectors_to_bytes(end - start));
+	if (err) {
+		EPRINTF("%s: disabling preallocation: %d\n",
+			s->vhd.file, -errno);
+		s->prealloc_blocks = 0;
+		return;
 	}
 
-	s->bat.pbw_offset = s->next_db;
+	s->prealloc_end = end;
+}
+
+static int
+allocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	uint64_t offset, size, lb_end;
+	struct vhd_bitmap *bm;
+
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+
+	/* already reserved: only the bitmap needs zeroing */
+	if (s->next_db + s->spp + s->bm_secs + s->spb <= s->prealloc_end)
+		return update_bat(s, blk);
+
+	err = get_alloc_bitmap(s, blk, &bm);
+	if (err)
+		return err;
+
+	if (bitmap_allocating(bm)) {
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_FAILED))
+			return -EBUSY;
+		return 0;
+	}
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	lb_end = reserve_new_block(s, bm);
+	offset = vhd_sectors_to_bytes(lb_end);
+	size   = vhd_sectors_to_bytes(s->next_db - lb_end);
 
 	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
+		err = -errno;
+		ERR(err, "lseek failed\n");
+		goto fail;
 	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
+	err = write(s->vhd.fd, vhd_zeros(size), size);
 	if (err != size) {
 		err = (err == -1 ? -errno : -EIO);
 		ERR(err, "write failed");
-		return err;
-	}
-
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
-
-		install_bitmap(s, bm);
+		goto fail;
 	}
 
-	lock_bat(s);
-	lock_bitmap(bm);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
 
 	return 0;
+
+fail:
+	/* nothing else can have been reserved since */
+	s->next_db = lb_end;
+	release_block(s, bm);
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
+	return err;
 }
 
 static int 
@@ -1513,7 +1882,8 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		bm     = get_bitmap(s, blk);
+		offset = bm->pbw_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1608,8 +1978,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bitmap_allocating(bm));
+		offset = bm->pbw_offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1670,6 +2040,295 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+static uint8_t
+vhd_chain_sector_owner(struct vhd_state *s,
+		       struct vhd_chain_load *load, u32 sec)
+{
+	int i;
+	u32 blk;
+	u64 sector;
+	char *map;
+	struct vhd_chain_level *l;
+	struct vhd_chain *c = s->chain;
+
+	blk    = load->blk;
+	sector = (u64)blk * s->spb + sec;
+
+	for (i = 0; i < c->depth; i++) {
+		l = c->levels + i;
+
+		/* reads past the end of an ancestor return zeros */
+		if (sector >= l->size)
+			break;
+
+		if (!vhd_type_dynamic(&l->vhd))
+			return i + 1;
+
+		if (blk >= l->vhd.bat.entries ||
+		    l->vhd.bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (l->batmap && vhd_batmap_test(&l->vhd, &l->vhd.batmap, blk))
+			return i + 1;
+
+		map = load->maps + i * vhd_sectors_to_bytes(s->bm_secs);
+		if (vhd_bitmap_test(&l->vhd, map, sec))
+			return i + 1;
+	}
+
+	return VHD_CHAIN_NONE;
+}
+
+static int
+vhd_chain_resolve(struct vhd_state *s, struct vhd_chain_load *load)
+{
+	int n;
+	u32 sec;
+	uint8_t owner;
+	struct vhd_chain_runs *runs;
+	struct vhd_chain *c = s->chain;
+
+	for (sec = 0, n = 0; sec < s->spb; sec++) {
+		owner = vhd_chain_sector_owner(s, load, sec);
+		if (n && c->scratch[n - 1].owner == owner)
+			continue;
+
+		c->scratch[n].start = sec;
+		c->scratch[n].owner = owner;
+		n++;
+	}
+
+	if (n == 1) {
+		c->owner[load->blk] = owner;
+		c->resolved++;
+		return 0;
+	}
+
+	if (!c->runs) {
+		c->runs = calloc(c->blocks, sizeof(struct vhd_chain_runs *));
+		if (!c->runs)
+			return -ENOMEM;
+	}
+
+	runs = malloc(sizeof(struct vhd_chain_runs) +
+		      n * sizeof(struct vhd_chain_run));
+	if (!runs)
+		return -ENOMEM;
+
+	runs->n = n;
+	memcpy(runs->run, c->scratch, n * sizeof(struct vhd_chain_run));
+
+	c->runs[load->blk]  = runs;
+	c->owner[load->blk] = VHD_CHAIN_MIXED;
+	c->resolved++;
+	return 0;
+}
+
+/*
+ * returns the owner of @sector, and trims @secs to the sectors
+ * following it that have the same owner.
+ */
+static uint8_t
+vhd_chain_lookup(struct vhd_state *s, uint64_t sector, int *secs)
+{
+	u32 blk, sec, end;
+	int lo, hi, mid;
+	struct vhd_chain_runs *runs;
+	struct vhd_chain *c = s->chain;
+
+	blk = sector / s->spb;
+	if (c->owner[blk] != VHD_CHAIN_MIXED)
+		return c->owner[blk];
+
+	sec  = sector % s->spb;
+	runs = c->runs[blk];
+
+	for (lo = 0, hi = runs->n - 1; lo < hi; ) {
+		mid = (lo + hi + 1) / 2;
+		if (runs->run[mid].start <= sec)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	end   = (lo + 1 < runs->n ? runs->run[lo + 1].start : s->spb);
+	*secs = MIN(*secs, end - sec);
+
+	return runs->run[lo].owner;
+}
+
+static int
+schedule_chain_read(struct vhd_state *s, int level, td_request_t treq)
+{
+	u64 offset;
+	struct vhd_request *req;
+	struct vhd_chain_level *l = s->chain->levels + level;
+
+	if (vhd_type_dynamic(&l->vhd)) {
+		offset  = l->vhd.bat.bat[treq.sec / s->spb];
+		offset += s->bm_secs + treq.sec % s->spb;
+	} else
+		offset  = treq.sec;
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->op    = VHD_OP_DATA_READ;
+	req->next  = NULL;
+
+	__aio_read(s, l->vhd.fd, req, vhd_sectors_to_bytes(offset));
+	s->chain->direct++;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", nr_secs: 0x%04x, "
+	    "offset: 0x%08"PRIx64"\n", l->vhd.file, treq.sec, treq.secs,
+	    offset);
+
+	return 0;
+}
+
+/* @treq lies within one block, and that block is mapped */
+static void
+vhd_chain_dispatch(struct vhd_state *s, td_request_t treq)
+{
+	int err;
+	uint8_t owner;
+	td_request_t clone;
+
+	while (treq.secs) {
+		clone = treq;
+		owner = vhd_chain_lookup(s, clone.sec, &clone.secs);
+
+		if (owner == VHD_CHAIN_NONE) {
+			memset(clone.buf, 0, vhd_sectors_to_bytes(clone.secs));
+			td_complete_request(clone, 0);
+		} else {
+			err = schedule_chain_read(s, owner - 1, clone);
+			if (err) {
+				clone.secs = treq.secs;
+				td_complete_request(clone, err);
+				return;
+			}
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+	}
+}
+
+/*
+ * read the bitmap of every ancestor which has the block allocated, down
+ * to the first one that owns all of it.
+ */
+static int
+vhd_chain_load_block(struct vhd_state *s, u32 blk)
+{
+	int i;
+	u64 sector;
+	struct vhd_request *req;
+	struct vhd_chain_level *l;
+	struct vhd_chain *c = s->chain;
+	struct vhd_chain_load *load = NULL;
+
+	for (i = 0; i < VHD_CHAIN_LOADS && !load; i++)
+		if (!c->loads[i].busy)
+			load = c->loads + i;
+
+	if (!load)
+		return -EBUSY;
+
+	load->blk     = blk;
+	load->pending = 0;
+	load->error   = 0;
+	clear_req_list(&load->waiting);
+
+	sector = (u64)blk * s->spb;
+
+	for (i = 0; i < c->depth; i++) {
+		l = c->levels + i;
+
+		if (sector >= l->size || !vhd_type_dynamic(&l->vhd))
+			break;
+
+		if (blk >= l->vhd.bat.entries ||
+		    l->vhd.bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (l->batmap && vhd_batmap_test(&l->vhd, &l->vhd.batmap, blk))
+			break;
+
+		req = load->reqs + i;
+		init_vhd_request(s, req);
+
+		req->treq.sec     = sector;
+		req->treq.secs    = s->bm_secs;
+		req->treq.buf     = load->maps +
+			i * vhd_sectors_to_bytes(s->bm_secs);
+		req->treq.cb_data = load;
+		req->op           = VHD_OP_CHAIN_BITMAP_READ;
+		req->next         = NULL;
+
+		__aio_read(s, l->vhd.fd, req,
+			   vhd_sectors_to_bytes(l->vhd.bat.bat[blk]));
+		load->pending++;
+	}
+
+	if (!load->pending)
+		return vhd_chain_resolve(s, load);
+
+	load->busy    = 1;
+	c->owner[blk] = VHD_CHAIN_LOADING;
+	return 0;
+}
+
+/* hand a read the top image does not have to whichever ancestor does */
+static void
+vhd_chain_forward(struct vhd_state *s, td_request_t treq)
+{
+	int i, err;
+	u32 blk;
+	struct vhd_request *req;
+	struct vhd_chain *c = s->chain;
+
+	if (!c)
+		return td_forward_request(treq);
+
+	blk = treq.sec / s->spb;
+	if (blk >= c->blocks)
+		goto forward;
+
+	if (c->owner[blk] == VHD_CHAIN_UNKNOWN) {
+		err = vhd_chain_load_block(s, blk);
+		if (err)
+			goto forward;
+	}
+
+	if (c->owner[blk] != VHD_CHAIN_LOADING)
+		return vhd_chain_dispatch(s, treq);
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		goto forward;
+
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_READ;
+	req->next = NULL;
+
+	for (i = 0; i < VHD_CHAIN_LOADS; i++)
+		if (c->loads[i].busy && c->loads[i].blk == blk)
+			break;
+
+	ASSERT(i < VHD_CHAIN_LOADS);
+	add_to_tail(&c->loads[i].waiting, req);
+	return;
+
+forward:
+	c->fallback++;
+	td_forward_request(treq);
+}
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -1692,12 +2351,12 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			td_forward_request(clone);
+			vhd_chain_forward(s, clone);
 			break;
 
 		case VHD_BM_BIT_CLEAR:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			td_forward_request(clone);
+			vhd_chain_forward(s, clone);
 			break;
 
 		case VHD_BM_BIT_SET:
@@ -1899,32 +2558,6 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		finish_data_transaction(s, bm);
 }
 
-static void
-finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
-{
-	struct vhd_transaction *tx = &bm->tx;
-
-	if (!bat_locked(s))
-		return;
-
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
-		goto release;
-
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
-
-	tx->closed = 1;
-	return;
-
- release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
-}
-
 static void
 finish_bitmap_transaction(struct vhd_state *s,
 			  struct vhd_bitmap *bm, int error)
@@ -1936,15 +2569,11 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		ASSERT(bitmap_allocating(bm));
+		set_vhd_flag(tx->status, VHD_FLAG_TX_BM_WRITTEN);
+		return;
 	}
 
 	if (tx->error) {
@@ -1960,12 +2589,17 @@ finish_bitmap_transaction(struct vhd_state *s,
 	/* transaction done; signal completions */
 	signal_completion(tx->requests.head, tx->error);
 	init_tx(tx);
+
+	/* a failed allocation is given up once its writes have drained */
+	if (bitmap_allocating(bm)) {
+		ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_FAILED));
+		release_block(s, bm);
+	}
+
 	start_new_bitmap_transaction(s, bm);
 
 	if (!bitmap_in_use(bm))
 		unlock_bitmap(bm);
-
-	finish_bat_transaction(s, bm);
 }
 
 static void
@@ -1983,45 +2617,78 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return finish_bitmap_transaction(s, bm, 0);
 }
 
+static void
+finish_bat_entry(struct vhd_state *s, struct vhd_bitmap *bm, int error)
+{
+	struct vhd_transaction *tx = &bm->tx;
+
+	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
+	    bm->blk, bm->pbw_offset, error);
+	ASSERT(bitmap_valid(bm) &&
+	       test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE));
+	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE);
+	clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+
+	if (!error) {
+		bat_entry(s, bm->blk) = bm->pbw_offset;
+		release_block(s, bm);
+	} else {
+		tx->error = error;
+		set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_FAILED);
+	}
+
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_BM_WRITTEN)) {
+		finish_bitmap_transaction(s, bm, error);
+		return;
+	}
+
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE)) {
+		/* keep further writes out until this one has drained */
+		if (error)
+			tx->closed = 1;
+		return;
+	}
+
+	if (error)
+		release_block(s, bm);
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
+}
+
 static void
 finish_bat_write(struct vhd_request *req)
 {
+	int i;
 	struct vhd_bitmap *bm;
-	struct vhd_transaction *tx;
+	struct vhd_bat_write *w;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
-
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		if (&s->bat.batch[i].req == req)
+			break;
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	ASSERT(i < VHD_BAT_WRITES && s->bat.writes > 0);
+	w = s->bat.batch + i;
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	DBG(TLOG_DBG, "bat sector: 0x%04x, err %d\n", w->sector, req->error);
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+		bm = s->bitmap[i];
+		if (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE) &&
+		    bm->blk / VHD_BAT_ENTRIES_PER_SEC == w->sector)
+			finish_bat_entry(s, bm, req->error);
 	}
 
-	finish_bat_transaction(s, bm);
+	if (--s->bat.writes)
+		return;
+
+	schedule_bat_write(s);
+	vhd_preallocate(s);
 }
 
 static void
@@ -2039,20 +2706,20 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(bitmap_allocating(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
 		tx->error = req->error;
+		set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_FAILED);
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
+	} else {
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
 		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2110,6 +2777,51 @@ finish_bitmap_read(struct vhd_request *req)
 		unlock_bitmap(bm);
 }
 
+static void
+finish_chain_bitmap_read(struct vhd_request *req)
+{
+	int err;
+	td_request_t treq;
+	struct vhd_request *r, *next;
+	struct vhd_state *s = req->state;
+	struct vhd_chain *c = s->chain;
+	struct vhd_chain_load *load = req->treq.cb_data;
+
+	s->returned++;
+	TRACE(s);
+
+	if (req->error)
+		load->error = req->error;
+
+	if (--load->pending)
+		return;
+
+	err = load->error;
+	if (!err)
+		err = vhd_chain_resolve(s, load);
+	if (err)
+		c->owner[load->blk] = VHD_CHAIN_UNKNOWN;
+
+	r = load->waiting.head;
+	clear_req_list(&load->waiting);
+	load->busy = 0;
+
+	while (r) {
+		treq = r->treq;
+		next = r->next;
+		free_vhd_request(s, r);
+
+		/* on error, let the ancestors themselves report it */
+		if (err) {
+			c->fallback++;
+			td_forward_request(treq);
+		} else
+			vhd_chain_dispatch(s, treq);
+
+		r = next;
+	}
+}
+
 static void
 finish_bitmap_write(struct vhd_request *req)
 {
@@ -2230,6 +2942,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_CHAIN_BITMAP_READ:
+		finish_chain_bitmap_read(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2292,15 +3008,23 @@ vhd_debug(td_driver_t *driver)
 
 		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
 		    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
-		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
+		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d, "
+		    "pbwo: 0x%08"PRIx64"\n",
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
-		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		    tx->started, tx->finished, tx->status, tx->requests.head, rnum,
+		    bm->pbw_offset);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: allocs: %d, writes: %d, next_db: 0x%08"PRIx64
+	    ", prealloc_end: 0x%08"PRIx64"\n", s->bat.allocs, s->bat.writes,
+	    s->next_db, s->prealloc_end);
+
+	if (s->chain)
+		DBG(TLOG_WARN, "CHAIN: depth: %d, resolved: %"PRIu64", "
+		    "direct: %"PRIu64", fallback: %"PRIu64"\n",
+		    s->chain->depth, s->chain->resolved,
+		    s->chain->direct, s->chain->fallback);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -238,6 +238,10 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 #endif
 
+	ctx->batches++;
+	ctx->iocbs_in  += num;
+	ctx->iocbs_out += on_queue + 1;
+
 	return ++on_queue;
 }
 
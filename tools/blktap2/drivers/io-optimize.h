@@ -57,6 +57,11 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+
+	/* io_merge calls, iocbs passed in and iocbs left after merging */
+	uint64_t            batches;
+	uint64_t            iocbs_in;
+	uint64_t            iocbs_out;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -53,20 +53,20 @@ void help(void)
 {
 	fprintf(stderr, "Qcow-utils: v1.0.0\n");
 	fprintf(stderr, 
-		"usage: qcow-create [-h help] [-r reserve] <SIZE(MB)> <FILENAME> "
-		"[<BACKING_FILENAME>]\n"); 
+		"usage: qcow-create [-h help] [-r reserve] [-2 qcow2] "
+		"<SIZE(MB)> <FILENAME> [<BACKING_FILENAME>]\n"); 
 	exit(-1);
 }
 
 int main(int argc, char *argv[])
 {
 	int ret = -1, c, backed = 0;
-	int sparse =  1;
+	int sparse =  1, qcow2 = 0;
 	uint64_t size;
 	char filename[MAX_NAME_LEN], bfilename[MAX_NAME_LEN];
 
         for(;;) {
-                c = getopt(argc, argv, "hr");
+                c = getopt(argc, argv, "hr2");
                 if (c == -1)
                         break;
                 switch(c) {
@@ -77,6 +77,9 @@ int main(int argc, char *argv[])
                 case 'r':
 			sparse = 0;
 			break;
+		case '2':
+			qcow2 = 1;
+			break;
 		default:
 			fprintf(stderr, "Unknown option\n");
 			help();
@@ -107,7 +110,10 @@ int main(int argc, char *argv[])
 	}
 
 	DFPRINTF("Creating file size %"PRIu64", name %s\n",(uint64_t)size, filename);
-	if (!backed)
+	if (qcow2)
+		ret = qcow2_create(filename, size,
+				   backed ? bfilename : NULL, 0);
+	else if (!backed)
 		ret = qcow_create(filename,size,NULL,sparse);
 	else
 		ret = qcow_create(filename,size,bfilename,sparse);
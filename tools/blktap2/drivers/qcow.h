@@ -29,13 +29,20 @@
 #ifndef _QCOW_H_
 #define _QCOW_H_
 
+#include <stddef.h>
+
 #include "aes.h"
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-queue.h"
 /**************************************************************/
 /* QEMU COW block driver with compression and encryption support */
 
 #define QCOW_MAGIC (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 #define XEN_MAGIC  (('X' << 24) | ('E' << 16) | ('N' << 8) | 0xfb)
 #define QCOW_VERSION 1
+#define QCOW2_VERSION 2
+#define QCOW3_VERSION 3
 
 #define QCOW_CRYPT_NONE 0x00
 #define QCOW_CRYPT_AES  0x01
@@ -44,6 +51,11 @@
 #define SPARSE_FILE 0x01
 #define EXTHDR_L1_BIG_ENDIAN 0x02
 
+#define QCOW2_OFLAG_COPIED     (1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW2_OFLAG_ZERO       (1ULL << 0)
+#define QCOW2_OFFSET_MASK      0x00fffffffffffe00ULL
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -67,6 +79,31 @@ typedef struct QCowHeader {
 	uint64_t l1_table_offset;
 } QCowHeader;
 
+typedef struct QCow2Header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t backing_file_offset;
+	uint32_t backing_file_size;
+	uint32_t cluster_bits;
+	uint64_t size; /* in bytes */
+	uint32_t crypt_method;
+	uint32_t l1_size;
+	uint64_t l1_table_offset;
+	uint64_t refcount_table_offset;
+	uint32_t refcount_table_clusters;
+	uint32_t nb_snapshots;
+	uint64_t snapshots_offset;
+
+	/* version 3 only */
+	uint64_t incompatible_features;
+	uint64_t compatible_features;
+	uint64_t autoclear_features;
+	uint32_t refcount_order;
+	uint32_t header_length;
+} QCow2Header;
+
+#define QCOW2_V2_HEADER_SIZE offsetof(QCow2Header, incompatible_features)
+
 /*Extended header for Xen enhancements*/
 typedef struct QCowHeader_ext {
         uint32_t xmagic;
@@ -79,7 +116,46 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+/*
+ * L2 tables (and qcow2 refcount blocks) are cached in a hash table of
+ * fixed size slots, recycled least recently used first.  A slot whose
+ * table is being read in holds the requests waiting for it.
+ */
+#define QCOW_L2_CACHE_ENV      "TAPDISK2_QCOW_L2_CACHE_KB"
+#define QCOW_L2_CACHE_KB       8192
+#define QCOW_L2_CACHE_MIN      64
+#define QCOW_RC_CACHE_SIZE     16
+
+/* qcow2 clusters are reserved (and refcounted) this many bytes at once */
+#define QCOW2_PREALLOC_SIZE    (4 << 20)
+
+struct qcow_cache;
+
+struct qcow_cache_entry {
+	uint64_t                 offset;   /* of the table, 0 if unused */
+	uint8_t                 *table;    /* as on disk (big endian) */
+	int                      loading;
+	int                      pinned;   /* by copies on write */
+	struct qcow_cache       *cache;
+	struct qcow_cache_entry *hash_next;
+	struct list_head         lru;
+	struct list_head         waiters;
+	struct tiocb             tiocb;
+};
+
+struct qcow_cache {
+	int                      size;
+	int                      table_bytes;
+	uint32_t                 hash_mask;
+	uint8_t                 *tables;
+	struct qcow_cache_entry *entries;
+	struct qcow_cache_entry **hash;
+	struct list_head         lru;
+	void                    *owner;
+
+	uint64_t                 hits;
+	uint64_t                 misses;
+};
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +180,7 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	struct qcow_cache l2_cache;    /*Hashed cache of L2 tables*/
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
@@ -117,6 +190,20 @@ struct tdqcow_state {
 	AES_KEY aes_encrypt_key;       /*AES key*/
 	AES_KEY aes_decrypt_key;       /*AES key*/
 
+	/* qcow2 */
+	int version;                   /*1, or 2/3 for qcow2*/
+	uint64_t *refcount_table;      /*Refcount block offsets*/
+	uint64_t refcount_table_offset;
+	int refcount_table_size;       /*Entries*/
+	int refcount_block_bits;       /*log2 of entries per block*/
+	struct qcow_cache rc_cache;    /*Cached refcount blocks*/
+	uint64_t prealloc_next;        /*Reserved, unused clusters*/
+	uint64_t prealloc_end;
+	struct list_head cows;         /*Copy on write in flight*/
+	uint64_t cow_count;
+
+	td_driver_t *driver;
+
         /* libaio state */
 	int                  aio_free_count;	
 	int                  max_aio_reqs;
@@ -127,5 +214,7 @@ struct tdqcow_state {
 
 int qcow_create(const char *filename, uint64_t total_size,
 		const char *backing_file, int sparse);
+int qcow2_create(const char *filename, uint64_t total_size,
+		 const char *backing_file, int cluster_bits);
 
 #endif //_QCOW_H_
@@ -29,7 +29,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -37,6 +39,7 @@
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_EVENTS         64
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -44,120 +47,470 @@
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
-#define scheduler_for_each_event(s, event, tmp)	\
-	list_for_each_entry_safe(event, tmp, &(s)->events, next)
-
 typedef struct event {
 	char                         mode;
 	event_id_t                   id;
 
 	int                          fd;
 	int                          timeout;
-	int                          deadline;
+	uint64_t                     deadline;     /* ms, CLOCK_MONOTONIC */
 
 	event_cb_t                   cb;
 	void                        *private;
 
-	struct list_head             next;
+	int                          heap_idx;     /* -1 if not in timers */
+	int                          unpollable;
+	int                          dead;
+	unsigned int                 pass;
+
+	struct list_head             next;         /* all, or dead events */
+	struct list_head             fd_next;      /* sched_fd/unpollable */
+	struct list_head             expired;
 } event_t;
 
+/*
+ * All events registered on one fd share a single epoll registration,
+ * polling for the union of their modes.
+ */
+struct sched_fd {
+	int                          fd;
+	uint32_t                     mask;
+	struct list_head             events;
+};
+
+static unsigned int scheduler_pass;
+
+static uint64_t
+scheduler_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * timer heap
+ */
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_heap_set(scheduler_t *s, int idx, event_t *event)
 {
-	int diff;
-	struct timeval now;
-	event_t *event, *tmp;
+	s->timers[idx]   = event;
+	event->heap_idx  = idx;
+}
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+static void
+scheduler_heap_up(scheduler_t *s, int idx)
+{
+	event_t *event = s->timers[idx];
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
 
-	gettimeofday(&now, NULL);
+		if (s->timers[parent]->deadline <= event->deadline)
+			break;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		scheduler_heap_set(s, idx, s->timers[parent]);
+		idx = parent;
+	}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	scheduler_heap_set(s, idx, event);
+}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static void
+scheduler_heap_down(scheduler_t *s, int idx)
+{
+	event_t *event = s->timers[idx];
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
+	for (;;) {
+		int child = 2 * idx + 1;
+
+		if (child >= s->nr_timers)
+			break;
+
+		if (child + 1 < s->nr_timers &&
+		    s->timers[child + 1]->deadline < s->timers[child]->deadline)
+			child++;
+
+		if (event->deadline <= s->timers[child]->deadline)
+			break;
+
+		scheduler_heap_set(s, idx, s->timers[child]);
+		idx = child;
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	scheduler_heap_set(s, idx, event);
+}
+
+static int
+scheduler_heap_insert(scheduler_t *s, event_t *event)
+{
+	if (s->nr_timers == s->max_timers) {
+		int max = MAX(2 * s->max_timers, 16);
+		event_t **timers;
+
+		timers = realloc(s->timers, max * sizeof(event_t *));
+		if (!timers)
+			return -ENOMEM;
+
+		s->timers     = timers;
+		s->max_timers = max;
+	}
+
+	scheduler_heap_set(s, s->nr_timers++, event);
+	scheduler_heap_up(s, event->heap_idx);
+
+	return 0;
+}
+
+static void
+scheduler_heap_remove(scheduler_t *s, event_t *event)
+{
+	int idx = event->heap_idx;
+	event_t *last;
+
+	if (idx < 0)
+		return;
+
+	event->heap_idx = -1;
+	last = s->timers[--s->nr_timers];
+	if (last == event)
+		return;
+
+	scheduler_heap_set(s, idx, last);
+	scheduler_heap_up(s, idx);
+	scheduler_heap_down(s, last->heap_idx);
+}
+
+static void
+scheduler_heap_reschedule(scheduler_t *s, event_t *event, uint64_t now)
+{
+	event->deadline = now + (uint64_t)event->timeout * 1000;
+
+	if (event->heap_idx >= 0) {
+		scheduler_heap_up(s, event->heap_idx);
+		scheduler_heap_down(s, event->heap_idx);
+	} else if (scheduler_heap_insert(s, event))
+		DBG("event %d: no memory to rearm timeout\n", event->id);
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_arm_timer(scheduler_t *s)
+{
+	struct itimerspec its;
+	uint64_t deadline;
+
+	/* 0 disarms the timerfd; no deadline can fall on it */
+	deadline = s->nr_timers ? MAX(s->timers[0]->deadline, 1) : 0;
+	if (deadline == s->timer_armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = deadline / 1000;
+	its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+	if (timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		DBG("timerfd_settime failed: %d\n", errno);
+		return;
+	}
+
+	s->timer_armed = deadline;
+}
+
+/*
+ * fd table
+ */
+
+static uint32_t
+scheduler_fd_mask(struct sched_fd *sfd)
+{
+	uint32_t mask = 0;
+	event_t *event;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->dead)
+			continue;
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			mask |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			mask |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			mask |= EPOLLPRI;
+	}
+
+	return mask;
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, struct sched_fd *sfd)
+{
+	struct epoll_event ev;
+	uint32_t mask;
+	int op, err;
+
+	mask = scheduler_fd_mask(sfd);
+	if (mask == sfd->mask)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = mask;
+	ev.data.fd = sfd->fd;
+
+	if (!mask) {
+		/* EBADF if the fd was closed before we heard about it */
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, sfd->fd, &ev);
+		sfd->mask = 0;
+		return 0;
+	}
+
+	op  = sfd->mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	if (err && op == EPOLL_CTL_MOD && errno == ENOENT)
+		/* closed and reopened under us */
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, sfd->fd, &ev);
+	else if (err && op == EPOLL_CTL_ADD && errno == EEXIST)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+	if (err)
+		return -errno;
+
+	sfd->mask = mask;
+	return 0;
+}
+
+static struct sched_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
 {
-	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
+	struct sched_fd *sfd;
+
+	if (fd >= s->nr_fds) {
+		int i, nr = MAX(fd + 1, MAX(2 * s->nr_fds, 64));
+		struct sched_fd **fds;
+
+		fds = realloc(s->fds, nr * sizeof(struct sched_fd *));
+		if (!fds)
+			return NULL;
+
+		for (i = s->nr_fds; i < nr; i++)
+			fds[i] = NULL;
+
+		s->fds    = fds;
+		s->nr_fds = nr;
 	}
 
+	sfd = s->fds[fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return NULL;
+
+		sfd->fd = fd;
+		INIT_LIST_HEAD(&sfd->events);
+		s->fds[fd] = sfd;
+	}
+
+	return sfd;
+}
+
+static void
+scheduler_put_fd(scheduler_t *s, struct sched_fd *sfd)
+{
+	if (!list_empty(&sfd->events))
+		return;
+
+	s->fds[sfd->fd] = NULL;
+	free(sfd);
+}
+
+static int
+scheduler_add_fd_event(scheduler_t *s, event_t *event)
+{
+	struct sched_fd *sfd;
+	int err;
+
+	if (event->fd < 0)
+		return -EINVAL;
+
+	sfd = scheduler_get_fd(s, event->fd);
+	if (!sfd)
+		return -ENOMEM;
+
+	list_add_tail(&event->fd_next, &sfd->events);
+
+	err = scheduler_update_fd(s, sfd);
+	if (!err)
+		return 0;
+
+	list_del(&event->fd_next);
+	scheduler_put_fd(s, sfd);
+
+	if (err != -EPERM)
+		return err;
+
+	/*
+	 * Regular files cannot be polled; select() always reported
+	 * them ready, and so do we.
+	 */
+	event->unpollable = 1;
+	list_add_tail(&event->fd_next, &s->unpollable);
+
+	return 0;
+}
+
+static void
+scheduler_free_event(scheduler_t *s, event_t *event)
+{
+	list_del(&event->next);
+
+	if (event->mode & SCHEDULER_POLL_FD) {
+		list_del(&event->fd_next);
+		if (!event->unpollable)
+			scheduler_put_fd(s, s->fds[event->fd]);
+	}
+
+	free(event);
+}
+
+/*
+ * dispatch
+ */
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event,
+			 char mode, uint64_t now)
+{
+	event->pass = scheduler_pass;
+
+	if (event->mode & SCHEDULER_POLL_TIMEOUT)
+		scheduler_heap_reschedule(s, event, now);
+
 	event->cb(event->id, mode, event->private);
 }
 
+/*
+ * epoll reports hangups and errors whatever was asked for, and keeps
+ * reporting them: each event on the fd sees them, or epoll_wait() would
+ * spin on an fd nobody handles.
+ */
+static char
+scheduler_event_mode(event_t *event, uint32_t revents)
+{
+	if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+	    (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_READ_FD;
+
+	if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+	    (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_WRITE_FD;
+
+	if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+	    (revents & (EPOLLPRI | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_EXCEPT_FD;
+
+	return 0;
+}
+
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_fd(scheduler_t *s, struct sched_fd *sfd,
+		 uint32_t revents, uint64_t now)
 {
-	struct timeval now;
+	event_t *event;
+	char mode;
+
+	/* unregistered events stay on the list until we are done */
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (event->dead || event->pass == scheduler_pass)
+			continue;
+
+		mode = scheduler_event_mode(event, revents);
+		if (mode)
+			scheduler_event_callback(s, event, mode, now);
+	}
+}
+
+static void
+scheduler_run_unpollable(scheduler_t *s, uint64_t now)
+{
+	event_t *event;
+
+	list_for_each_entry(event, &s->unpollable, fd_next) {
+		if (event->dead || event->pass == scheduler_pass)
+			continue;
+
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_READ_FD, now);
+		else if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_WRITE_FD, now);
+	}
+}
+
+static void
+scheduler_run_timers(scheduler_t *s, uint64_t now)
+{
+	struct list_head expired;
+	event_t *event;
+
+	INIT_LIST_HEAD(&expired);
+
+	/*
+	 * Pull everything that is due off the heap first, so that
+	 * callbacks rearming with a zero timeout run once per pass.
+	 */
+	while (s->nr_timers && s->timers[0]->deadline <= now) {
+		event = s->timers[0];
+		scheduler_heap_remove(s, event);
+		list_add_tail(&event->expired, &expired);
+	}
+
+	list_for_each_entry(event, &expired, expired) {
+		if (event->dead)
+			continue;
+
+		/* an fd event fired this pass; that resets its timeout */
+		if (event->pass == scheduler_pass)
+			scheduler_heap_reschedule(s, event, now);
+		else
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_TIMEOUT, now);
+	}
+}
+
+static void
+scheduler_run_events(scheduler_t *s, struct epoll_event *evs, int nr)
+{
+	struct sched_fd *sfd;
 	event_t *event, *tmp;
+	uint64_t now;
+	uint64_t ticks;
+	int i, fd;
 
-	gettimeofday(&now, NULL);
+	now = scheduler_now();
+	scheduler_pass++;
+	s->dispatching = 1;
 
- again:
-	s->restart = 0;
+	for (i = 0; i < nr; i++) {
+		fd = evs[i].data.fd;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
+		if (fd == s->timer_fd) {
+			if (read(fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+				s->timer_armed = 0;
+			continue;
 		}
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+		sfd = fd < s->nr_fds ? s->fds[fd] : NULL;
+		if (sfd)
+			scheduler_run_fd(s, sfd, evs[i].events, now);
+	}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+	scheduler_run_unpollable(s, now);
+	scheduler_run_timers(s, now);
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+	s->dispatching = 0;
 
-	next:
-		if (s->restart)
-			goto again;
-	}
+	list_for_each_entry_safe(event, tmp, &s->dead, next)
+		scheduler_free_event(s, event);
 }
 
 int
@@ -165,7 +518,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
 	event_t *event;
-	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -177,41 +530,70 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!event)
 		return -ENOMEM;
 
-	gettimeofday(&now, NULL);
-
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
+	event->deadline = scheduler_now() + (uint64_t)timeout * 1000;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+	event->heap_idx = -1;
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		err = scheduler_heap_insert(s, event);
+		if (err)
+			goto fail;
+	}
 
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_add_fd_event(s, event);
+		if (err) {
+			scheduler_heap_remove(s, event);
+			goto fail;
+		}
+	}
+
+	event->id = s->uuid++;
 	if (!s->uuid)
 		s->uuid++;
 
 	list_add_tail(&event->next, &s->events);
 
 	return event->id;
+
+fail:
+	free(event);
+	return err;
 }
 
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
-	event_t *event, *tmp;
+	event_t *event;
 
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event, tmp)
-		if (event->id == id) {
-			list_del(&event->next);
-			free(event);
-			s->restart = 1;
-			break;
-		}
+	list_for_each_entry(event, &s->events, next)
+		if (event->id == id)
+			goto found;
+
+	return;
+
+found:
+	event->dead = 1;
+	scheduler_heap_remove(s, event);
+
+	if ((event->mode & SCHEDULER_POLL_FD) && !event->unpollable)
+		scheduler_update_fd(s, s->fds[event->fd]);
+
+	if (s->dispatching) {
+		list_del(&event->next);
+		list_add_tail(&event->next, &s->dead);
+	} else
+		scheduler_free_event(s, event);
 }
 
 void
@@ -224,42 +606,67 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
-	int ret;
-	struct timeval tv;
+	struct epoll_event evs[SCHEDULER_MAX_EVENTS];
+	int ret, timeout;
 
-	scheduler_prepare_events(s);
+	scheduler_arm_timer(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	timeout = list_empty(&s->unpollable) ? s->max_timeout * 1000 : 0;
 
-	DBG("timeout: %d, max_timeout: %d\n",
-	    s->timeout, s->max_timeout);
+	DBG("timers: %d, max_timeout: %d\n",
+	    s->nr_timers, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = epoll_wait(s->epoll_fd, evs, SCHEDULER_MAX_EVENTS, timeout);
 
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	if (ret < 0)
 		return ret;
 
-	scheduler_run_events(s);
+	scheduler_run_events(s, evs, ret);
 
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
-	memset(s, 0, sizeof(scheduler_t));
+	struct epoll_event ev;
+	int err;
 
-	s->uuid = 1;
+	memset(s, 0, sizeof(scheduler_t));
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->uuid        = 1;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->unpollable);
+	INIT_LIST_HEAD(&s->dead);
+
+	s->timer_fd = -1;
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd == -1)
+		return -errno;
+
+	s->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->timer_fd == -1)
+		goto fail;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = EPOLLIN;
+	ev.data.fd = s->timer_fd;
+
+	if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->timer_fd, &ev))
+		goto fail;
+
+	return 0;
+
+fail:
+	err = -errno;
+	if (s->timer_fd != -1)
+		close(s->timer_fd);
+	close(s->epoll_fd);
+	return err;
 }
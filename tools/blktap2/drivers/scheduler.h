@@ -28,7 +28,7 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
+#include <stdint.h>
 
 #include "list.h"
 
@@ -40,21 +40,33 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct sched_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
+	int                          timer_fd;
+	uint64_t                     timer_armed;
+
+	/* per-fd event lists, indexed by fd */
+	struct sched_fd            **fds;
+	int                          nr_fds;
+
+	/* min-heap of timeout events, ordered by deadline */
+	struct event               **timers;
+	int                          nr_timers;
+	int                          max_timers;
 
 	struct list_head             events;
+	struct list_head             unpollable;
+	struct list_head             dead;
 
 	int                          uuid;
-	int                          max_fd;
-	int                          timeout;
-	int                          restart;
+	int                          dispatching;
 	int                          max_timeout;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
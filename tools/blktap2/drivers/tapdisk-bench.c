@@ -0,0 +1,356 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Drive the tapdisk I/O queue directly against a file or block device,
+ * fio style, and compare the queue drivers (rwio, lio, uring, ...) at a
+ * given block size, queue depth and read/write mix.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "blk.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-server.h"
+#include "tapdisk-utils.h"
+
+#define BENCH_DEFAULT_DRIVERS   "rwio lio uring uring,poll"
+#define BENCH_MAX_DEPTH         256
+/* latency histogram: log2 buckets of microseconds */
+#define BENCH_LAT_BUCKETS       24
+
+extern tapdisk_server_t server;
+
+struct bench_io {
+	struct tiocb             tiocb;
+	char                    *buf;
+	struct timespec          start;
+	int                      busy;
+};
+
+struct bench {
+	int                      fd;
+	uint64_t                 size;
+	size_t                   bs;
+	int                      depth;
+	int                      write_pct;
+	int                      seq;
+	int                      secs;
+
+	uint64_t                 next_off;
+	char                    *bufs;
+	struct bench_io          ios[BENCH_MAX_DEPTH];
+
+	uint64_t                 done;
+	uint64_t                 errors;
+	uint64_t                 lat_total;
+	uint64_t                 lat_hist[BENCH_LAT_BUCKETS];
+};
+
+static uint64_t
+bench_usecs(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void
+bench_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct bench *b = arg;
+	struct bench_io *io = (struct bench_io *)tiocb;
+	struct timespec now;
+	uint64_t lat;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lat = bench_usecs(&now) - bench_usecs(&io->start);
+
+	for (i = 0; i < BENCH_LAT_BUCKETS - 1 && (lat >> i); i++)
+		;
+
+	b->lat_hist[i]++;
+	b->lat_total += lat;
+	b->done++;
+	if (err)
+		b->errors++;
+
+	io->busy = 0;
+}
+
+static void
+bench_queue(struct bench *b, struct bench_io *io)
+{
+	uint64_t blocks = b->size / b->bs;
+	uint64_t off;
+	int write;
+
+	if (b->seq) {
+		off = b->next_off;
+		b->next_off = (b->next_off + b->bs) % (blocks * b->bs);
+	} else
+		off = ((uint64_t)random() * RAND_MAX + random()) % blocks * b->bs;
+
+	write = b->write_pct && (random() % 100) < b->write_pct;
+
+	tapdisk_prep_tiocb(&io->tiocb, b->fd, write, io->buf, b->bs, off,
+			   bench_complete, b);
+	clock_gettime(CLOCK_MONOTONIC, &io->start);
+	io->busy = 1;
+
+	tapdisk_server_queue_tiocb(&io->tiocb);
+}
+
+static uint64_t
+bench_percentile(const struct bench *b, int pct)
+{
+	uint64_t seen = 0, want = (b->done * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < BENCH_LAT_BUCKETS - 1; i++) {
+		seen += b->lat_hist[i];
+		if (seen >= want)
+			break;
+	}
+
+	return 1ULL << i;
+}
+
+static int
+bench_run(struct bench *b, const char *driver)
+{
+	struct timespec start, now;
+	uint64_t elapsed;
+	int i, err;
+
+	b->done = b->errors = b->lat_total = 0;
+	memset(b->lat_hist, 0, sizeof(b->lat_hist));
+
+	err = tapdisk_server_init();
+	if (err) {
+		fprintf(stderr, "failed to initialize server: %d\n", err);
+		return err;
+	}
+
+	err = tapdisk_server_set_io_driver(driver);
+	if (err) {
+		fprintf(stderr, "invalid I/O driver '%s'\n", driver);
+		return err;
+	}
+
+	err = tapdisk_server_complete();
+	if (err) {
+		fprintf(stderr, "%s: failed to set up queue: %d\n",
+			driver, err);
+		return err;
+	}
+
+	tapdisk_server_register_buffer(b->bufs, b->bs * b->depth);
+	tapdisk_server_register_file(b->fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	do {
+		for (i = 0; i < b->depth; i++)
+			if (!b->ios[i].busy)
+				bench_queue(b, &b->ios[i]);
+
+		tapdisk_submit_all_tiocbs(&server.aio_queue);
+
+		/* synchronous drivers leave nothing to wait for */
+		if (!server.aio_queue.iocbs_pending)
+			tapdisk_server_set_max_timeout(0);
+		tapdisk_server_iterate();
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = bench_usecs(&now) - bench_usecs(&start);
+	} while (elapsed < (uint64_t)b->secs * 1000000);
+
+	/* drain */
+	while (server.aio_queue.iocbs_pending)
+		tapdisk_server_iterate();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = bench_usecs(&now) - bench_usecs(&start);
+
+	/* uring falls back to lio where the kernel lacks it */
+	printf("%-16s %10.0f %10.1f %10.1f %8"PRIu64" %8"PRIu64" %8"PRIu64
+	       "%s\n", driver,
+	       b->done * 1e6 / elapsed,
+	       b->done * b->bs / (double)elapsed,
+	       b->done ? (double)b->lat_total / b->done : 0.0,
+	       bench_percentile(b, 50), bench_percentile(b, 99),
+	       b->errors,
+	       strncmp(driver, server.aio_queue.tio->name,
+		       strlen(server.aio_queue.tio->name)) ?
+	       " (fell back to lio)" : "");
+
+	tapdisk_server_unregister_file(b->fd);
+	tapdisk_server_unregister_buffer(b->bufs);
+	tapdisk_free_queue(&server.aio_queue);
+
+	return 0;
+}
+
+static void
+usage(const char *app, int err)
+{
+	fprintf(stderr, "usage: %s [-b block size] [-q queue depth] "
+		"[-t seconds] [-w write %%] [-s] [-d drivers] <file>\n"
+		"\n"
+		"  -b  bytes per request (default 4096)\n"
+		"  -q  requests in flight (default 32, max %d)\n"
+		"  -t  run time per driver in seconds (default 10)\n"
+		"  -w  percentage of writes (default 0); DESTROYS DATA\n"
+		"  -s  sequential rather than random offsets\n"
+		"  -d  space separated list of queue drivers to compare\n"
+		"      (default \"%s\")\n",
+		app, BENCH_MAX_DEPTH, BENCH_DEFAULT_DRIVERS);
+	exit(err);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b;
+	const char *drivers, *path;
+	char *list, *drv, *save;
+	struct stat st;
+	int c, i, err;
+
+	memset(&b, 0, sizeof(b));
+	b.bs      = 4096;
+	b.depth   = 32;
+	b.secs    = 10;
+	drivers   = BENCH_DEFAULT_DRIVERS;
+
+	while ((c = getopt(argc, argv, "b:q:t:w:sd:h")) != -1) {
+		switch (c) {
+		case 'b':
+			b.bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			b.depth = atoi(optarg);
+			break;
+		case 't':
+			b.secs = atoi(optarg);
+			break;
+		case 'w':
+			b.write_pct = atoi(optarg);
+			break;
+		case 's':
+			b.seq = 1;
+			break;
+		case 'd':
+			drivers = optarg;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (optind != argc - 1 || !b.bs || b.bs % 512 ||
+	    b.depth < 1 || b.depth > BENCH_MAX_DEPTH || b.secs < 1 ||
+	    b.write_pct < 0 || b.write_pct > 100)
+		usage(argv[0], EINVAL);
+
+	path = argv[optind];
+
+	b.fd = open(path, (b.write_pct ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (b.fd == -1) {
+		err = errno;
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(err));
+		return err;
+	}
+
+	if (fstat(b.fd, &st)) {
+		err = errno;
+		fprintf(stderr, "failed to stat %s: %s\n", path, strerror(err));
+		return err;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		/* in 512 byte sectors */
+		err = blk_getimagesize(b.fd, &b.size);
+		b.size <<= 9;
+	} else {
+		b.size = st.st_size;
+		err = 0;
+	}
+
+	if (err || b.size < b.bs) {
+		fprintf(stderr, "%s: too small or unknown size\n", path);
+		return EINVAL;
+	}
+
+	err = posix_memalign((void **)&b.bufs, 4096, b.bs * b.depth);
+	if (err) {
+		fprintf(stderr, "out of memory\n");
+		return err;
+	}
+	memset(b.bufs, 0x5a, b.bs * b.depth);
+	for (i = 0; i < b.depth; i++)
+		b.ios[i].buf = b.bufs + i * b.bs;
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	printf("%s: %zu byte %s %s, queue depth %d, %ds per driver\n",
+	       path, b.bs, b.seq ? "sequential" : "random",
+	       b.write_pct == 0 ? "reads" :
+	       b.write_pct == 100 ? "writes" : "reads/writes",
+	       b.depth, b.secs);
+	printf("%-16s %10s %10s %10s %8s %8s %8s\n",
+	       "driver", "IOPS", "MB/s", "avg(us)", "p50(us)", "p99(us)",
+	       "errors");
+
+	list = strdup(drivers);
+	if (!list)
+		return ENOMEM;
+
+	err = 0;
+	for (drv = strtok_r(list, " ", &save); drv;
+	     drv = strtok_r(NULL, " ", &save))
+		if (bench_run(&b, drv))
+			err = 1;
+
+	free(list);
+	free(b.bufs);
+	close(b.fd);
+	tapdisk_stop_logging();
+
+	return err;
+}
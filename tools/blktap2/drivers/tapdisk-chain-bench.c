@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Build a synthetic VHD snapshot chain and measure random read latency
+ * through a tapdisk VBD on top of it, with and without the block-vhd
+ * chain map.  Each run reads the same offsets twice: the first pass
+ * includes building the map, the second shows the steady state.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "libvhd.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define CHAIN_MAP_ENV           "TAPDISK2_VHD_CHAIN_MAP"
+#define CHAIN_MAX_DEPTH         64
+#define CHAIN_EXTENT            (64 << 10)
+#define CHAIN_MAX_QDEPTH        32
+/* latency histogram: log2 buckets of microseconds */
+#define CHAIN_LAT_BUCKETS       24
+
+extern tapdisk_server_t server;
+
+struct chain_io {
+	uint64_t                 sec;
+	struct timespec          start;
+	int                      busy;
+};
+
+struct chain_bench {
+	int                      depth;
+	uint64_t                 size;
+	int                      alloc_pct;
+	int                      reads;
+	int                      qdepth;
+	int                      bs;
+	unsigned int             seed;
+	const char              *dir;
+	char                    *names[CHAIN_MAX_DEPTH + 1];
+
+	td_vbd_t                *vbd;
+	struct chain_io          ios[CHAIN_MAX_QDEPTH];
+	int                      issued;
+	int                      done;
+	uint64_t                 errors;
+	uint64_t                 csum;
+	uint64_t                 lat_total;
+	uint64_t                 lat_hist[CHAIN_LAT_BUCKETS];
+};
+
+static uint64_t
+chain_usecs(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void
+chain_pattern(char *buf, size_t bytes, uint64_t off, int level)
+{
+	uint64_t *p = (uint64_t *)buf;
+	size_t i;
+
+	for (i = 0; i < bytes / sizeof(*p); i++)
+		p[i] = (off + i * sizeof(*p)) ^ ((uint64_t)level << 56);
+}
+
+/* level 0 is the base image, level depth the (empty) leaf */
+static int
+chain_create(struct chain_bench *b)
+{
+	int i, l, err, extents;
+	uint64_t off;
+	vhd_context_t vhd;
+	char *buf;
+
+	err = posix_memalign((void **)&buf, 4096, CHAIN_EXTENT);
+	if (err)
+		return -err;
+
+	extents = (b->size / CHAIN_EXTENT) * b->alloc_pct / 100;
+
+	for (l = 0; l <= b->depth; l++) {
+		if (asprintf(&b->names[l], "%s/chain-bench-%d.vhd",
+			     b->dir, l) == -1) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		unlink(b->names[l]);
+
+		if (!l)
+			err = vhd_create(b->names[l], b->size,
+					 HD_TYPE_DYNAMIC, 0);
+		else
+			err = vhd_snapshot(b->names[l], b->size,
+					   b->names[l - 1], 0);
+		if (err) {
+			fprintf(stderr, "failed to create %s: %d\n",
+				b->names[l], err);
+			goto out;
+		}
+
+		if (l == b->depth)
+			break;
+
+		err = vhd_open(&vhd, b->names[l], VHD_OPEN_RDWR);
+		if (err)
+			goto out;
+
+		err = vhd_get_bat(&vhd);
+		for (i = 0; !err && i < extents; i++) {
+			off  = random() % (b->size / 4096);
+			off *= 4096;
+			off  = MIN(off, b->size - CHAIN_EXTENT);
+
+			chain_pattern(buf, CHAIN_EXTENT, off, l);
+			err = vhd_io_write(&vhd, buf, off >> VHD_SECTOR_SHIFT,
+					   CHAIN_EXTENT >> VHD_SECTOR_SHIFT);
+		}
+
+		vhd_close(&vhd);
+		if (err) {
+			fprintf(stderr, "failed to fill %s: %d\n",
+				b->names[l], err);
+			goto out;
+		}
+	}
+
+	err = 0;
+out:
+	free(buf);
+	return err;
+}
+
+static void
+chain_remove(struct chain_bench *b)
+{
+	int l;
+
+	for (l = 0; l <= b->depth; l++)
+		if (b->names[l]) {
+			unlink(b->names[l]);
+			free(b->names[l]);
+		}
+}
+
+static void
+chain_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct chain_bench *b = arg;
+	struct chain_io *io = b->ios + rsp->id;
+	struct timespec now;
+	uint64_t lat, h;
+	char *buf;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lat = chain_usecs(&now) - chain_usecs(&io->start);
+
+	for (i = 0; i < CHAIN_LAT_BUCKETS - 1 && (lat >> i); i++)
+		;
+
+	b->lat_hist[i]++;
+	b->lat_total += lat;
+	b->done++;
+
+	if (rsp->status != BLKIF_RSP_OKAY)
+		b->errors++;
+
+	/* order independent, so passes and modes can be compared */
+	buf = (char *)MMAP_VADDR(b->vbd->ring.vstart, rsp->id, 0);
+	for (h = io->sec, i = 0; i < b->bs; i++)
+		h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+	b->csum += h;
+
+	io->busy = 0;
+}
+
+static void
+chain_enqueue(struct chain_bench *b, int idx)
+{
+	struct chain_io *io = b->ios + idx;
+	td_vbd_t *vbd = b->vbd;
+	td_vbd_request_t *vreq;
+	blkif_request_t *breq;
+	int i, psize, secs;
+
+	psize   = getpagesize();
+	io->sec = (random() % (b->size / b->bs)) * (b->bs >> SECTOR_SHIFT);
+
+	vreq = vbd->request_list + idx;
+	breq = &vreq->req;
+
+	memset(breq, 0, sizeof(*breq));
+	breq->id            = idx;
+	breq->operation     = BLKIF_OP_READ;
+	breq->sector_number = io->sec;
+
+	for (secs = b->bs >> SECTOR_SHIFT, i = 0; secs; i++) {
+		int n = MIN(secs, psize >> SECTOR_SHIFT);
+
+		breq->seg[i].first_sect = 0;
+		breq->seg[i].last_sect  = n - 1;
+		breq->nr_segments++;
+		secs -= n;
+	}
+
+	vbd->received++;
+	vreq->vbd = vbd;
+
+	clock_gettime(CLOCK_MONOTONIC, &io->start);
+	io->busy = 1;
+	b->issued++;
+
+	tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+}
+
+static uint64_t
+chain_percentile(const struct chain_bench *b, int pct)
+{
+	uint64_t seen = 0, want = ((uint64_t)b->done * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < CHAIN_LAT_BUCKETS - 1; i++) {
+		seen += b->lat_hist[i];
+		if (seen >= want)
+			break;
+	}
+
+	return 1ULL << i;
+}
+
+static int
+chain_open_vbd(struct chain_bench *b, int id)
+{
+	int err, psize;
+	char *params;
+
+	err = tapdisk_vbd_initialize(id);
+	if (err)
+		return err;
+
+	b->vbd = tapdisk_server_get_vbd(id);
+	if (!b->vbd)
+		return -ENODEV;
+
+	tapdisk_vbd_set_callback(b->vbd, chain_dequeue, b);
+
+	/* as tapdisk-stream does: have tapdisk_vbd use our buffers */
+	psize = getpagesize();
+	err = posix_memalign((void **)&b->vbd->ring.vstart, psize,
+			     psize * BLKTAP_MMAP_REGION_SIZE);
+	if (err) {
+		b->vbd->ring.vstart = 0;
+		return -err;
+	}
+
+	/* as tapdisk-control does: parse the driver stack, then open it */
+	if (asprintf(&params, "vhd:%s", b->names[b->depth]) == -1)
+		return -ENOMEM;
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	free(params);
+	if (err)
+		return err;
+
+	err = tapdisk_vbd_open_stack(b->vbd, TAPDISK_STORAGE_TYPE_DEFAULT,
+				     TD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	b->vbd->reopened = 1;
+	return 0;
+}
+
+static void
+chain_close_vbd(struct chain_bench *b, int id)
+{
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(id);
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free((void *)vbd->ring.vstart);
+		free(vbd->name);
+		free(vbd);
+	}
+
+	b->vbd = NULL;
+}
+
+static int
+chain_pass(struct chain_bench *b, const char *mode, int pass)
+{
+	struct timespec start, now;
+	uint64_t elapsed;
+	int i;
+
+	b->issued = b->done = 0;
+	b->errors = b->csum = b->lat_total = 0;
+	memset(b->lat_hist, 0, sizeof(b->lat_hist));
+	srandom(b->seed);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (b->done < b->reads) {
+		for (i = 0; i < b->qdepth && b->issued < b->reads; i++)
+			if (!b->ios[i].busy)
+				chain_enqueue(b, i);
+
+		tapdisk_vbd_issue_requests(b->vbd);
+		tapdisk_submit_all_tiocbs(&server.aio_queue);
+
+		/* reads of unallocated sectors complete without any I/O */
+		if (!server.aio_queue.iocbs_pending)
+			tapdisk_server_set_max_timeout(0);
+		tapdisk_server_iterate();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = chain_usecs(&now) - chain_usecs(&start);
+
+	printf("%-6s %-6s %10.0f %10.1f %8"PRIu64" %8"PRIu64" %8"PRIu64
+	       "  %016"PRIx64"\n", mode, pass ? "warm" : "cold",
+	       b->done * 1e6 / elapsed,
+	       (double)b->lat_total / b->done,
+	       chain_percentile(b, 50), chain_percentile(b, 99),
+	       b->errors, b->csum);
+
+	return b->errors ? -EIO : 0;
+}
+
+static int
+chain_run(struct chain_bench *b, int map, int id)
+{
+	const char *mode = map ? "map" : "nomap";
+	int err, pass;
+
+	setenv(CHAIN_MAP_ENV, map ? "1" : "0", 1);
+
+	err = chain_open_vbd(b, id);
+	if (err) {
+		fprintf(stderr, "failed to open %s: %d\n",
+			b->names[b->depth], err);
+		goto out;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		err = chain_pass(b, mode, pass);
+		if (err)
+			break;
+	}
+
+out:
+	chain_close_vbd(b, id);
+	return err;
+}
+
+static void
+usage(const char *app, int err)
+{
+	fprintf(stderr, "usage: %s [-d depth] [-s size MB] [-a alloc %%] "
+		"[-n reads] [-q queue depth] [-b block size] [-i driver] [-k] "
+		"[dir]\n"
+		"\n"
+		"  -d  snapshots above the base image (default 16, max %d)\n"
+		"  -s  virtual size in MB (default 1024)\n"
+		"  -a  percentage of each level written, in 64K extents "
+		"(default 2)\n"
+		"  -n  reads per pass (default 10000)\n"
+		"  -q  reads in flight (default 1, max %d)\n"
+		"  -b  bytes per read (default 4096)\n"
+		"  -i  I/O queue driver (default lio)\n"
+		"  -k  keep the chain rather than deleting it\n"
+		"  dir must support O_DIRECT (default .)\n",
+		app, CHAIN_MAX_DEPTH, CHAIN_MAX_QDEPTH);
+	exit(err);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct chain_bench b;
+	const char *driver;
+	int c, err, keep, psize;
+
+	memset(&b, 0, sizeof(b));
+	b.depth     = 16;
+	b.size      = 1024;
+	b.alloc_pct = 2;
+	b.reads     = 10000;
+	b.qdepth    = 1;
+	b.bs        = 4096;
+	b.seed      = getpid();
+	b.dir       = ".";
+	driver      = NULL;
+	keep        = 0;
+	psize       = getpagesize();
+
+	while ((c = getopt(argc, argv, "d:s:a:n:q:b:i:kh")) != -1) {
+		switch (c) {
+		case 'd':
+			b.depth = atoi(optarg);
+			break;
+		case 's':
+			b.size = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':
+			b.alloc_pct = atoi(optarg);
+			break;
+		case 'n':
+			b.reads = atoi(optarg);
+			break;
+		case 'q':
+			b.qdepth = atoi(optarg);
+			break;
+		case 'b':
+			b.bs = atoi(optarg);
+			break;
+		case 'i':
+			driver = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (optind < argc - 1)
+		usage(argv[0], EINVAL);
+	if (optind == argc - 1)
+		b.dir = argv[optind];
+
+	b.size <<= 20;
+
+	if (b.depth < 1 || b.depth > CHAIN_MAX_DEPTH ||
+	    b.size < CHAIN_EXTENT || b.alloc_pct < 0 || b.alloc_pct > 100 ||
+	    b.reads < 1 || b.qdepth < 1 || b.qdepth > CHAIN_MAX_QDEPTH ||
+	    b.bs < psize || b.bs % psize ||
+	    b.bs > psize * BLKIF_MAX_SEGMENTS_PER_REQUEST)
+		usage(argv[0], EINVAL);
+
+	tapdisk_start_logging("tapdisk-chain-bench");
+
+	printf("creating %d-deep chain of %"PRIu64"MB images in %s\n",
+	       b.depth, b.size >> 20, b.dir);
+
+	err = chain_create(&b);
+	if (err)
+		goto out;
+
+	err = tapdisk_server_init();
+	if (err) {
+		fprintf(stderr, "failed to initialize server: %d\n", err);
+		goto out;
+	}
+
+	if (driver) {
+		err = tapdisk_server_set_io_driver(driver);
+		if (err) {
+			fprintf(stderr, "invalid I/O driver '%s'\n", driver);
+			goto out;
+		}
+	}
+
+	err = tapdisk_server_complete();
+	if (err) {
+		fprintf(stderr, "failed to set up queue: %d\n", err);
+		goto out;
+	}
+
+	printf("%d byte random reads, queue depth %d, %d reads per pass\n",
+	       b.bs, b.qdepth, b.reads);
+	printf("%-6s %-6s %10s %10s %8s %8s %8s  %-16s\n",
+	       "mode", "pass", "IOPS", "avg(us)", "p50(us)", "p99(us)",
+	       "errors", "checksum");
+
+	err = chain_run(&b, 0, 0);
+	if (!err)
+		err = chain_run(&b, 1, 1);
+
+out:
+	if (!keep)
+		chain_remove(&b);
+	tapdisk_stop_logging();
+	return err ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-coalesce.h"
+
+#define TD_COALESCE_POLL_INTERVAL  1 /* seconds */
+
+struct td_coalesce {
+	char                       *name;
+	int                         threads;
+	int                         state;
+	int                         error;
+
+	vhd_coalesce_t             *engine;
+	vhd_coalesce_stats_t        stats;
+	event_id_t                  timeout_id;
+};
+
+static void
+tapdisk_coalesce_complete(td_vbd_t *vbd, int cancel)
+{
+	struct td_coalesce *c = vbd->coalesce;
+
+	tapdisk_server_unregister_event(c->timeout_id);
+	c->timeout_id = -1;
+
+	if (cancel) {
+		vhd_coalesce_poll(c->engine, &c->stats);
+		c->error = vhd_coalesce_cancel(c->engine);
+	} else
+		c->error = vhd_coalesce_finish(c->engine, &c->stats);
+
+	c->engine = NULL;
+	c->state  = (c->error ?
+		     TAPDISK_COALESCE_FAILED : TAPDISK_COALESCE_DONE);
+
+	DPRINTF("%s: coalesce of %s %s: %d, %"PRIu64" bytes written, "
+		"%"PRIu64" skipped in %"PRIu64" us\n", vbd->name, c->name,
+		cancel ? "cancelled" : "finished", c->error,
+		c->stats.bytes_written, c->stats.bytes_skipped,
+		c->stats.usecs);
+}
+
+static void
+tapdisk_coalesce_poll_event(event_id_t id, char mode, void *private)
+{
+	td_vbd_t *vbd = private;
+	struct td_coalesce *c = vbd->coalesce;
+
+	vhd_coalesce_poll(c->engine, &c->stats);
+	if (c->stats.finished)
+		tapdisk_coalesce_complete(vbd, 0);
+}
+
+/*
+ * @name must be a read-only VHD in the middle of the VBD's chain: never
+ * the leaf, which the guest writes, and not the last image, which has
+ * no parent to merge into.
+ */
+static int
+tapdisk_coalesce_check_image(td_vbd_t *vbd, const char *name)
+{
+	td_image_t *image, *tmp;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (strcmp(image->name, name))
+			continue;
+
+		if (image->type != DISK_TYPE_VHD ||
+		    !td_flag_test(image->flags, TD_OPEN_RDONLY) ||
+		    image == tapdisk_vbd_first_image(vbd) ||
+		    tapdisk_vbd_is_last_image(vbd, image))
+			return -EINVAL;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+int
+tapdisk_coalesce_start(td_vbd_t *vbd, const char *name, int threads)
+{
+	int err;
+	struct td_coalesce *c;
+
+	c = vbd->coalesce;
+	if (c && c->state == TAPDISK_COALESCE_RUNNING)
+		return -EBUSY;
+
+	err = tapdisk_coalesce_check_image(vbd, name);
+	if (err)
+		return err;
+
+	tapdisk_coalesce_free(vbd);
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->timeout_id = -1;
+	c->threads    = threads;
+	c->name       = strdup(name);
+	if (!c->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = vhd_coalesce_start(c->name, threads, &c->engine);
+	if (err)
+		goto fail;
+
+	c->timeout_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					      -1, /* dummy fd */
+					      TD_COALESCE_POLL_INTERVAL,
+					      tapdisk_coalesce_poll_event,
+					      vbd);
+	if (c->timeout_id < 0) {
+		err = c->timeout_id;
+		vhd_coalesce_cancel(c->engine);
+		goto fail;
+	}
+
+	c->state = TAPDISK_COALESCE_RUNNING;
+	vbd->coalesce = c;
+
+	DPRINTF("%s: coalescing %s with %d threads\n",
+		vbd->name, c->name, threads);
+	return 0;
+
+fail:
+	free(c->name);
+	free(c);
+	return err;
+}
+
+int
+tapdisk_coalesce_status(td_vbd_t *vbd, tapdisk_message_coalesce_t *msg)
+{
+	struct td_coalesce *c = vbd->coalesce;
+
+	memset(msg, 0, sizeof(*msg));
+
+	if (!c) {
+		msg->state = TAPDISK_COALESCE_IDLE;
+		return 0;
+	}
+
+	if (c->engine)
+		vhd_coalesce_poll(c->engine, &c->stats);
+
+	msg->state         = c->state;
+	msg->threads       = c->threads;
+	msg->error         = c->error;
+	msg->blocks        = c->stats.blocks;
+	msg->blocks_done   = c->stats.blocks_done;
+	msg->bytes_written = c->stats.bytes_written;
+	msg->bytes_skipped = c->stats.bytes_skipped;
+	msg->usecs         = c->stats.usecs;
+	snprintf(msg->path, sizeof(msg->path), "%s", c->name);
+
+	return 0;
+}
+
+int
+tapdisk_coalesce_cancel(td_vbd_t *vbd)
+{
+	struct td_coalesce *c = vbd->coalesce;
+
+	if (!c || c->state != TAPDISK_COALESCE_RUNNING)
+		return -ENOENT;
+
+	tapdisk_coalesce_complete(vbd, 1);
+	return 0;
+}
+
+void
+tapdisk_coalesce_free(td_vbd_t *vbd)
+{
+	struct td_coalesce *c = vbd->coalesce;
+
+	if (!c)
+		return;
+
+	tapdisk_coalesce_cancel(vbd);
+
+	vbd->coalesce = NULL;
+	free(c->name);
+	free(c);
+}
@@ -47,6 +47,8 @@
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
+#include "block-cache.h"
+#include "tapdisk-coalesce.h"
 
 struct tapdisk_control {
 	char              *path;
@@ -627,6 +629,129 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_cache_stats(struct tapdisk_control_connection *connection,
+			    tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	td_image_t *image, *tmp;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_CACHE_STATS_RSP;
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = -ENOENT;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (image->type == DISK_TYPE_BLOCK_CACHE && image->driver) {
+			err = block_cache_get_stats(image->driver,
+						    &response.u.cache_stats);
+			break;
+		}
+
+out:
+	if (err) {
+		memset(&response.u, 0, sizeof(response.u));
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
+	}
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_coalesce(struct tapdisk_control_connection *connection,
+			 tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_coalesce_t *msg;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_COALESCE_RSP;
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	switch (request->type) {
+	case TAPDISK_MESSAGE_COALESCE:
+		msg = &request->u.coalesce;
+		msg->path[sizeof(msg->path) - 1] = '\0';
+		err = tapdisk_coalesce_start(vbd, msg->path, msg->threads);
+		break;
+	case TAPDISK_MESSAGE_COALESCE_CANCEL:
+		err = tapdisk_coalesce_cancel(vbd);
+		break;
+	default:
+		err = 0;
+		break;
+	}
+
+	if (!err)
+		err = tapdisk_coalesce_status(vbd, &response.u.coalesce);
+
+out:
+	if (err) {
+		memset(&response.u, 0, sizeof(response.u));
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
+	}
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_stats(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_STATS_RSP;
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	tapdisk_vbd_get_stats(vbd, &response.u.stats);
+	tapdisk_server_get_queue_stats(&response.u.stats);
+	if (request->u.stats.reset)
+		tapdisk_vbd_reset_stats(vbd);
+	err = 0;
+
+out:
+	if (err) {
+		memset(&response.u, 0, sizeof(response.u));
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
+	}
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -664,6 +789,14 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_CACHE_STATS:
+		return tapdisk_control_cache_stats(connection, &message);
+	case TAPDISK_MESSAGE_COALESCE:
+	case TAPDISK_MESSAGE_COALESCE_STATUS:
+	case TAPDISK_MESSAGE_COALESCE_CANCEL:
+		return tapdisk_control_coalesce(connection, &message);
+	case TAPDISK_MESSAGE_STATS:
+		return tapdisk_control_stats(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
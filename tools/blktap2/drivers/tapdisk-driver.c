@@ -93,6 +93,18 @@ tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_server_queue_tiocb(tiocb);
 }
 
+void
+tapdisk_driver_register_file(td_driver_t *driver, int fd)
+{
+	tapdisk_server_register_file(fd);
+}
+
+void
+tapdisk_driver_unregister_file(td_driver_t *driver, int fd)
+{
+	tapdisk_server_unregister_file(fd);
+}
+
 void
 tapdisk_driver_debug(td_driver_t *driver)
 {
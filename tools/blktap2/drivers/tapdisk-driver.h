@@ -56,6 +56,8 @@ td_driver_t *tapdisk_driver_allocate(int, char *, td_flag_t, int);
 void tapdisk_driver_free(td_driver_t *);
 
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
+void tapdisk_driver_register_file(td_driver_t *, int fd);
+void tapdisk_driver_unregister_file(td_driver_t *, int fd);
 
 void tapdisk_driver_debug(td_driver_t *);
 
@@ -231,6 +231,22 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+/*
+ * Image files an I/O queue may keep a reference to, for cheaper lookups.
+ * Unregister before closing the file.
+ */
+void
+td_register_file(td_driver_t *driver, int fd)
+{
+	tapdisk_driver_register_file(driver, fd);
+}
+
+void
+td_unregister_file(td_driver_t *driver, int fd)
+{
+	tapdisk_driver_unregister_file(driver, fd);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
@@ -28,8 +28,13 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -44,6 +49,10 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -262,9 +271,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +556,612 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * io_uring
+ *
+ * Requests are written straight into the shared submission ring and
+ * handed to the kernel with a single io_uring_enter() per batch (none at
+ * all with a polling kernel thread); completions are read straight off
+ * the shared completion ring, with a registered eventfd to wake us up.
+ * Files and data buffers which live as long as a VBD can be registered
+ * with the ring, saving the kernel their lookup and pinning on every I/O.
+ */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter     426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register  427
+#endif
+
+#define URING_MAX_FILES         64
+#define URING_MAX_BUFFERS       16
+/* how long to spin for completions in polling mode */
+#define URING_POLL_USECS        50
+#define URING_SQ_IDLE_MSECS     1000
+
+#define uring_load_acquire(p)					\
+	({ typeof(*(p)) __v = *(volatile typeof(*(p)) *)(p);	\
+	   __sync_synchronize(); __v; })
+#define uring_store_release(p, v)				\
+	do { __sync_synchronize();				\
+	     *(volatile typeof(*(p)) *)(p) = (v); } while (0)
+
+struct uring {
+	int                   ring_fd;
+
+	void                 *sq_ring;
+	size_t                sq_ring_size;
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_mask;
+	unsigned             *sq_flags;
+	unsigned             *sq_array;
+	struct io_uring_sqe  *sqes;
+	size_t                sqes_size;
+
+	void                 *cq_ring;
+	size_t                cq_ring_size;
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned             *cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	struct io_event      *aio_events;
+
+	int                   event_fd;
+	int                   event_id;
+
+	int                   files[URING_MAX_FILES];
+	int                   files_registered;
+
+	struct iovec          buffers[URING_MAX_BUFFERS];
+	int                   nr_buffers;
+	int                   buffers_registered;
+};
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned int to_submit,
+	    unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void
+tapdisk_uring_unmap(struct uring *ur)
+{
+	if (ur->sqes) {
+		munmap(ur->sqes, ur->sqes_size);
+		ur->sqes = NULL;
+	}
+
+	if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_size);
+	ur->cq_ring = NULL;
+
+	if (ur->sq_ring) {
+		munmap(ur->sq_ring, ur->sq_ring_size);
+		ur->sq_ring = NULL;
+	}
+}
+
+static int
+tapdisk_uring_map(struct uring *ur, struct io_uring_params *p)
+{
+	int single = !!(p->features & IORING_FEAT_SINGLE_MMAP);
+	char *sq, *cq;
+
+	ur->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ur->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	if (single && ur->cq_ring_size > ur->sq_ring_size)
+		ur->sq_ring_size = ur->cq_ring_size;
+
+	sq = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+	ur->sq_ring = sq;
+
+	if (single)
+		cq = sq;
+	else {
+		cq = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -errno;
+	}
+	ur->cq_ring = cq;
+
+	ur->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		return -errno;
+	}
+
+	ur->sq_head  = (unsigned *)(sq + p->sq_off.head);
+	ur->sq_tail  = (unsigned *)(sq + p->sq_off.tail);
+	ur->sq_mask  = (unsigned *)(sq + p->sq_off.ring_mask);
+	ur->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+	ur->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+	ur->cq_head  = (unsigned *)(cq + p->cq_off.head);
+	ur->cq_tail  = (unsigned *)(cq + p->cq_off.tail);
+	ur->cq_mask  = (unsigned *)(cq + p->cq_off.ring_mask);
+	ur->cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (!ur)
+		return;
+
+	if (ur->event_id >= 0) {
+		tapdisk_server_unregister_event(ur->event_id);
+		ur->event_id = -1;
+	}
+
+	tapdisk_uring_unmap(ur);
+
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+	}
+
+	if (ur->event_fd >= 0) {
+		close(ur->event_fd);
+		ur->event_fd = -1;
+	}
+
+	free(ur->aio_events);
+	ur->aio_events = NULL;
+}
+
+static void tapdisk_uring_event(event_id_t, char, void *);
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_params p;
+	int i, err;
+
+	ur->ring_fd  = -1;
+	ur->event_fd = -1;
+	ur->event_id = -1;
+	for (i = 0; i < URING_MAX_FILES; i++)
+		ur->files[i] = -1;
+
+	memset(&p, 0, sizeof(p));
+	/* never let completions overflow, whatever the merging did */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 2 * qlen;
+	if (queue->tio_flags & TIO_DRV_URING_SQPOLL) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_IDLE_MSECS;
+	}
+
+	ur->ring_fd = uring_setup(qlen, &p);
+	if (ur->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* we use IORING_OP_{READ,WRITE}, which came with 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_uring_map(ur, &p);
+	if (err)
+		goto fail;
+
+	ur->event_fd = tapdisk_sys_eventfd(0);
+	if (ur->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (uring_register(ur->ring_fd, IORING_REGISTER_EVENTFD,
+			   &ur->event_fd, 1)) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* a sparse file table, filled in as images get opened */
+	ur->files_registered =
+		!uring_register(ur->ring_fd, IORING_REGISTER_FILES,
+				ur->files, URING_MAX_FILES);
+	if (!ur->files_registered)
+		DPRINTF("io_uring: no registered files: %d\n", -errno);
+
+	ur->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ur->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ur->event_id;
+	if (err < 0)
+		goto fail;
+
+	ur->aio_events = calloc(p.cq_entries, sizeof(struct io_event));
+	if (!ur->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_file(struct uring *ur, int fd)
+{
+	int i;
+
+	if (ur->files_registered)
+		for (i = 0; i < URING_MAX_FILES; i++)
+			if (ur->files[i] == fd)
+				return i;
+
+	return -1;
+}
+
+static int
+tapdisk_uring_buffer(struct uring *ur, const char *buf, size_t size)
+{
+	int i;
+
+	if (ur->buffers_registered)
+		for (i = 0; i < ur->nr_buffers; i++) {
+			const char *base = ur->buffers[i].iov_base;
+
+			if (buf >= base &&
+			    buf + size <= base + ur->buffers[i].iov_len)
+				return i;
+		}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *ur, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	int file, buffer;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	buffer = tapdisk_uring_buffer(ur, iocb->u.c.buf, iocb->u.c.nbytes);
+	if (buffer >= 0) {
+		sqe->opcode    = write ? IORING_OP_WRITE_FIXED :
+			IORING_OP_READ_FIXED;
+		sqe->buf_index = buffer;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	file = tapdisk_uring_file(ur, iocb->aio_fildes);
+	if (file >= 0) {
+		sqe->fd     = file;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd     = iocb->aio_fildes;
+
+	sqe->addr      = (unsigned long)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (unsigned long)iocb;
+}
+
+/*
+ * td_complete may queue more tiocbs
+ */
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	unsigned int head, tail, mask;
+	int i, n, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	head = *ur->cq_head;
+	tail = uring_load_acquire(ur->cq_tail);
+	mask = *ur->cq_mask;
+
+	for (n = 0; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & mask];
+
+		ep       = ur->aio_events + n;
+		ep->obj  = (struct iocb *)(unsigned long)cqe->user_data;
+		ep->res  = (long)cqe->res;
+		ep->res2 = 0;
+	}
+
+	uring_store_release(ur->cq_head, head);
+
+	if (!n)
+		return 0;
+
+	split = io_split(&queue->opioctx, ur->aio_events, n);
+	tapdisk_filter_events(queue->filter, ur->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", n, split);
+
+	queue->iocbs_pending  -= n;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = ur->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+
+	return split;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ur = queue->tio_data;
+	uint64_t val;
+
+	read_exact(ur->event_fd, &val, sizeof(val));
+
+	tapdisk_uring_reap(queue);
+}
+
+static uint64_t
+tapdisk_uring_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Fast devices often complete within a few microseconds: rather than
+ * going back to sleep for the eventfd, briefly spin on the completion
+ * ring.  The eventfd gets acked whenever the scheduler next sees it.
+ */
+static void
+tapdisk_uring_poll(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	uint64_t deadline = tapdisk_uring_usecs() + URING_POLL_USECS;
+
+	while (queue->iocbs_pending) {
+		if (*ur->cq_head != uring_load_acquire(ur->cq_tail))
+			tapdisk_uring_reap(queue);
+		else if (tapdisk_uring_usecs() >= deadline)
+			break;
+	}
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned int tail, mask;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *ur->sq_tail;
+	mask = *ur->sq_mask;
+
+	for (i = 0; i < merged; i++, tail++) {
+		unsigned int idx = tail & mask;
+
+		tapdisk_uring_prep_sqe(ur, &ur->sqes[idx], queue->iocbs[i]);
+		ur->sq_array[idx] = idx;
+	}
+
+	uring_store_release(ur->sq_tail, tail);
+
+	if (queue->tio_flags & TIO_DRV_URING_SQPOLL) {
+		submitted = merged;
+		/*
+		 * the kernel thread sets NEED_WAKEUP and then looks at the
+		 * tail once more: the tail store must be visible before the
+		 * flag is read, or the wakeup can be missed.
+		 */
+		__sync_synchronize();
+		if (uring_load_acquire(ur->sq_flags) & IORING_SQ_NEED_WAKEUP)
+			uring_enter(ur->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+	} else {
+		submitted = uring_enter(ur->ring_fd, merged, 0, 0);
+		if (submitted < 0) {
+			err = -errno;
+			submitted = 0;
+		} else if (submitted < merged)
+			err = -EIO;
+
+		/* take back whatever the kernel did not consume */
+		if (err)
+			uring_store_release(ur->sq_tail, *ur->sq_head);
+	}
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	if (queue->tio_flags & TIO_DRV_URING_POLL)
+		tapdisk_uring_poll(queue);
+
+	return submitted;
+}
+
+static int
+tapdisk_uring_update_file(struct uring *ur, int idx, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = idx;
+	up.fds    = (unsigned long)&fd;
+
+	if (uring_register(ur->ring_fd, IORING_REGISTER_FILES_UPDATE,
+			   &up, 1) != 1)
+		return -errno;
+
+	ur->files[idx] = fd;
+	return 0;
+}
+
+static int
+tapdisk_uring_register_file(struct tqueue *queue, int fd)
+{
+	struct uring *ur = queue->tio_data;
+	int idx;
+
+	if (!ur->files_registered)
+		return -EOPNOTSUPP;
+
+	if (tapdisk_uring_file(ur, fd) >= 0)
+		return 0;
+
+	idx = tapdisk_uring_file(ur, -1);
+	if (idx < 0)
+		return -ENOSPC;
+
+	return tapdisk_uring_update_file(ur, idx, fd);
+}
+
+static void
+tapdisk_uring_unregister_file(struct tqueue *queue, int fd)
+{
+	struct uring *ur = queue->tio_data;
+	int idx;
+
+	/* must happen before the fd gets closed, and maybe reused */
+	idx = tapdisk_uring_file(ur, fd);
+	if (idx >= 0 && tapdisk_uring_update_file(ur, idx, -1))
+		ERR(-errno, "failed to unregister fd %d", fd);
+}
+
+/*
+ * The kernel only takes the whole buffer table at once, so every change
+ * re-registers it.  That happens as VBDs come and go, not per request.
+ */
+static int
+tapdisk_uring_update_buffers(struct uring *ur)
+{
+	if (ur->buffers_registered) {
+		uring_register(ur->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		ur->buffers_registered = 0;
+	}
+
+	if (!ur->nr_buffers)
+		return 0;
+
+	if (uring_register(ur->ring_fd, IORING_REGISTER_BUFFERS,
+			   ur->buffers, ur->nr_buffers))
+		return -errno;
+
+	ur->buffers_registered = 1;
+	return 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *ur = queue->tio_data;
+	int err;
+
+	if (ur->nr_buffers == URING_MAX_BUFFERS)
+		return -ENOSPC;
+
+	ur->buffers[ur->nr_buffers].iov_base = buf;
+	ur->buffers[ur->nr_buffers].iov_len  = size;
+	ur->nr_buffers++;
+
+	err = tapdisk_uring_update_buffers(ur);
+	if (err) {
+		/* e.g. memory which cannot be pinned: do without */
+		ur->nr_buffers--;
+		tapdisk_uring_update_buffers(ur);
+	}
+
+	return err;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *ur = queue->tio_data;
+	int i;
+
+	for (i = 0; i < ur->nr_buffers; i++)
+		if (ur->buffers[i].iov_base == buf) {
+			ur->buffers[i] = ur->buffers[--ur->nr_buffers];
+			tapdisk_uring_update_buffers(ur);
+			break;
+		}
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_file     = tapdisk_uring_register_file,
+	.tio_unregister_file   = tapdisk_uring_unregister_file,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -568,13 +1183,18 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	const struct tio *tio;
 	int err;
 
-	switch (drv) {
+	switch (drv & TIO_DRV_MASK) {
 	case TIO_DRV_LIO:
 		tio = &td_tio_lio;
 		break;
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_LINUX_IO_URING_H
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -588,6 +1208,7 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	}
 
 	queue->tio = tio;
+	queue->tio_flags = drv & ~TIO_DRV_MASK;
 
 	if (tio->tio_setup) {
 		err = tio->tio_setup(queue, queue->size);
@@ -673,6 +1294,75 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+/*
+ * "rwio", "lio" or "uring", the latter optionally followed by ",poll"
+ * and/or ",sqpoll".
+ */
+int
+tapdisk_queue_driver(const char *name)
+{
+	const char *opt;
+	int drv;
+	size_t len;
+
+	len = strcspn(name, ",");
+	if (len == 4 && !strncmp(name, "rwio", len))
+		drv = TIO_DRV_RWIO;
+	else if (len == 3 && !strncmp(name, "lio", len))
+		drv = TIO_DRV_LIO;
+	else if (len == 5 && !strncmp(name, "uring", len))
+		drv = TIO_DRV_URING;
+	else
+		return -EINVAL;
+
+	for (opt = name + len; *opt; opt += len) {
+		opt++;
+		len = strcspn(opt, ",");
+		if ((drv & TIO_DRV_MASK) != TIO_DRV_URING)
+			return -EINVAL;
+		if (len == 4 && !strncmp(opt, "poll", len))
+			drv |= TIO_DRV_URING_POLL;
+		else if (len == 6 && !strncmp(opt, "sqpoll", len))
+			drv |= TIO_DRV_URING_SQPOLL;
+		else
+			return -EINVAL;
+	}
+
+	return drv;
+}
+
+int
+tapdisk_queue_register_file(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_file)
+		return 0;
+
+	return queue->tio->tio_register_file(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_file(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_file)
+		queue->tio->tio_unregister_file(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return 0;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
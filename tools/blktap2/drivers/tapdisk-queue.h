@@ -58,6 +58,7 @@ struct tqueue {
 
 	const struct tio     *tio;
 	void                 *tio_data;
+	int                   tio_flags;
 
 	struct opioctx        opioctx;
 
@@ -91,13 +92,27 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: pre-register long-lived files and data buffers */
+	int  (*tio_register_file)     (struct tqueue *queue, int fd);
+	void (*tio_unregister_file)   (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
+#define TIO_DRV_MASK          0xff
+/* io_uring: spin on the completion ring after submitting */
+#define TIO_DRV_URING_POLL    (1<<8)
+/* io_uring: let a kernel thread poll the submission ring */
+#define TIO_DRV_URING_SQPOLL  (1<<9)
+
 /*
  * Interface for request producer (i.e., tapdisk)
  * NB: the following functions may cause additional tiocbs to be queued:
@@ -114,6 +129,11 @@ enum {
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
+int tapdisk_queue_driver(const char *name);
+int tapdisk_queue_register_file(struct tqueue *, int fd);
+void tapdisk_queue_unregister_file(struct tqueue *, int fd);
+int tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t size);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
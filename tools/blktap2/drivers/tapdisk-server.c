@@ -101,6 +101,46 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+void
+tapdisk_server_get_queue_stats(tapdisk_message_stats_t *stats)
+{
+	struct tqueue *queue = &server.aio_queue;
+
+	stats->queue_batches   = queue->opioctx.batches;
+	stats->queue_iocbs     = queue->opioctx.iocbs_in;
+	stats->queue_merged    = queue->opioctx.iocbs_in -
+		queue->opioctx.iocbs_out;
+	stats->queue_deferrals = queue->deferrals;
+}
+
+void
+tapdisk_server_register_file(int fd)
+{
+	tapdisk_queue_register_file(&server.aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_file(int fd)
+{
+	tapdisk_queue_unregister_file(&server.aio_queue, fd);
+}
+
+void
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	int err;
+
+	err = tapdisk_queue_register_buffer(&server.aio_queue, buf, size);
+	if (err)
+		DPRINTF("I/O buffer %p not registered: %d\n", buf, err);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, buf);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -208,8 +248,21 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int err, drv;
+
+	drv = server.tio_drv ? : TIO_DRV_LIO;
+
+	err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+				 drv, NULL);
+	if (err && (drv & TIO_DRV_MASK) == TIO_DRV_URING) {
+		/* e.g. an older kernel: don't fail the VBD over it */
+		EPRINTF("io_uring unavailable (%d), falling back to lio\n",
+			err);
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	return err;
 }
 
 static void
@@ -283,8 +336,19 @@ tapdisk_server_init(void)
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
 
-	scheduler_initialize(&server.scheduler);
+	return scheduler_initialize(&server.scheduler);
+}
+
+int
+tapdisk_server_set_io_driver(const char *name)
+{
+	int drv;
+
+	drv = tapdisk_queue_driver(name);
+	if (drv < 0)
+		return drv;
 
+	server.tio_drv = drv;
 	return 0;
 }
 
@@ -311,7 +375,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
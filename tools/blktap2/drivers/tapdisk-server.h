@@ -42,6 +42,11 @@ void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_get_queue_stats(tapdisk_message_stats_t *);
+void tapdisk_server_register_file(int fd);
+void tapdisk_server_unregister_file(int fd);
+void tapdisk_server_register_buffer(void *buf, size_t size);
+void tapdisk_server_unregister_buffer(void *buf);
 
 void tapdisk_server_check_state(void);
 
@@ -50,6 +55,7 @@ void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
 int tapdisk_server_init(void);
+int tapdisk_server_set_io_driver(const char *name);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
 int tapdisk_server_run(void);
@@ -62,6 +68,7 @@ typedef struct tapdisk_server {
 	struct list_head             vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+	int                          tio_drv;
 } tapdisk_server_t;
 
 #endif
@@ -0,0 +1,685 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Layout of the shared segment:
+ *
+ *   header | slots[pages] | buckets[2^n] | data[pages * 4K]
+ *
+ * Each slot describes one cached page.  Slots hang off a hash bucket
+ * (singly linked, by hnext) and off the LRU list (doubly linked, most
+ * recently used at lru_head); unused slots are chained on free_head.
+ * Everything is protected by one process-shared mutex: holders only
+ * walk a short hash chain and copy a few pages.
+ *
+ * The mutex is robust.  If a tapdisk dies holding it the index may be
+ * half updated, so the next locker simply empties the cache.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk.h"
+#include "tapdisk-shm-cache.h"
+
+#define TD_SHM_CACHE_MAGIC       0x74647363 /* "tdsc" */
+#define TD_SHM_CACHE_VERSION     1
+#define TD_SHM_CACHE_NONE        ((uint32_t)-1)
+#define TD_SHM_CACHE_MAX_PAGES   32
+/* how long to wait for another tapdisk to finish creating the segment */
+#define TD_SHM_CACHE_WAIT_MS     1000
+
+#define TD_SHM_CACHE_ALIGN(_x, _a) (((_x) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+
+typedef struct td_shm_cache              td_shm_cache_t;
+typedef struct td_shm_cache_slot         td_shm_cache_slot_t;
+typedef struct td_shm_cache_header       td_shm_cache_header_t;
+
+struct td_shm_cache_slot {
+	td_shm_cache_id_t                id;
+	uint64_t                         page;
+	uint32_t                         hnext;
+	uint32_t                         prev;
+	uint32_t                         next;
+};
+
+struct td_shm_cache_header {
+	uint32_t                         magic;
+	uint32_t                         version;
+	uint64_t                         size;
+	uint32_t                         pages;
+	uint32_t                         buckets;
+	uint64_t                         slots_off;
+	uint64_t                         buckets_off;
+	uint64_t                         data_off;
+
+	pthread_mutex_t                  lock;
+
+	uint32_t                         lru_head;
+	uint32_t                         lru_tail;
+	uint32_t                         free_head;
+	uint32_t                         used;
+
+	uint64_t                         hits;
+	uint64_t                         misses;
+	uint64_t                         inserts;
+	uint64_t                         evictions;
+	uint64_t                         resets;
+};
+
+struct td_shm_cache {
+	int                              refcnt;
+	int                              fd;
+	size_t                           size;
+	char                            *map;
+
+	td_shm_cache_header_t           *hdr;
+	td_shm_cache_slot_t             *slots;
+	uint32_t                        *buckets;
+	char                            *data;
+};
+
+static td_shm_cache_t td_shm_cache;
+
+static inline uint32_t
+td_shm_cache_hash(const td_shm_cache_header_t *hdr,
+		  const td_shm_cache_id_t *id, uint64_t page)
+{
+	uint64_t h;
+
+	h  = id->dev * 0x9e3779b97f4a7c15ULL;
+	h ^= id->ino + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	h ^= id->gen + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	h ^= page * 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h & (hdr->buckets - 1);
+}
+
+static inline int
+td_shm_cache_match(const td_shm_cache_slot_t *slot,
+		   const td_shm_cache_id_t *id, uint64_t page)
+{
+	return (slot->page == page &&
+		slot->id.ino == id->ino &&
+		slot->id.dev == id->dev &&
+		slot->id.gen == id->gen);
+}
+
+static inline char *
+td_shm_cache_page(td_shm_cache_t *cache, uint32_t idx)
+{
+	return cache->data + ((size_t)idx << TD_SHM_CACHE_PAGE_SHIFT);
+}
+
+static void
+td_shm_cache_layout(td_shm_cache_header_t *hdr, uint32_t pages)
+{
+	uint32_t buckets;
+
+	for (buckets = 1; buckets < pages; buckets <<= 1)
+		;
+
+	hdr->pages       = pages;
+	hdr->buckets     = buckets;
+	hdr->slots_off   = TD_SHM_CACHE_ALIGN(sizeof(*hdr), 64);
+	hdr->buckets_off = TD_SHM_CACHE_ALIGN(hdr->slots_off +
+					      (uint64_t)pages *
+					      sizeof(td_shm_cache_slot_t), 64);
+	hdr->data_off    = TD_SHM_CACHE_ALIGN(hdr->buckets_off +
+					      (uint64_t)buckets *
+					      sizeof(uint32_t),
+					      TD_SHM_CACHE_PAGE_SIZE);
+	hdr->size        = hdr->data_off +
+		((uint64_t)pages << TD_SHM_CACHE_PAGE_SHIFT);
+}
+
+/* empty the index; caller holds the lock or is creating the segment */
+static void
+td_shm_cache_reset(td_shm_cache_t *cache)
+{
+	uint32_t i;
+	td_shm_cache_header_t *hdr = cache->hdr;
+
+	for (i = 0; i < hdr->buckets; i++)
+		cache->buckets[i] = TD_SHM_CACHE_NONE;
+
+	for (i = 0; i < hdr->pages; i++) {
+		memset(cache->slots + i, 0, sizeof(td_shm_cache_slot_t));
+		cache->slots[i].hnext = TD_SHM_CACHE_NONE;
+		cache->slots[i].prev  = TD_SHM_CACHE_NONE;
+		cache->slots[i].next  = (i + 1 < hdr->pages ?
+					 i + 1 : TD_SHM_CACHE_NONE);
+	}
+
+	hdr->free_head = 0;
+	hdr->lru_head  = TD_SHM_CACHE_NONE;
+	hdr->lru_tail  = TD_SHM_CACHE_NONE;
+	hdr->used      = 0;
+}
+
+static int
+td_shm_cache_lock(td_shm_cache_t *cache)
+{
+	int err;
+
+	err = pthread_mutex_lock(&cache->hdr->lock);
+	if (err == EOWNERDEAD) {
+		EPRINTF("shared cache lock owner died, emptying cache\n");
+		td_shm_cache_reset(cache);
+		cache->hdr->resets++;
+		err = pthread_mutex_consistent(&cache->hdr->lock);
+	}
+
+	return -err;
+}
+
+static inline void
+td_shm_cache_unlock(td_shm_cache_t *cache)
+{
+	pthread_mutex_unlock(&cache->hdr->lock);
+}
+
+static uint32_t
+td_shm_cache_find(td_shm_cache_t *cache,
+		  const td_shm_cache_id_t *id, uint64_t page)
+{
+	uint32_t idx;
+
+	idx = cache->buckets[td_shm_cache_hash(cache->hdr, id, page)];
+	while (idx != TD_SHM_CACHE_NONE) {
+		if (td_shm_cache_match(cache->slots + idx, id, page))
+			break;
+		idx = cache->slots[idx].hnext;
+	}
+
+	return idx;
+}
+
+static void
+td_shm_cache_lru_unlink(td_shm_cache_t *cache, uint32_t idx)
+{
+	td_shm_cache_header_t *hdr = cache->hdr;
+	td_shm_cache_slot_t *slot = cache->slots + idx;
+
+	if (slot->prev != TD_SHM_CACHE_NONE)
+		cache->slots[slot->prev].next = slot->next;
+	else
+		hdr->lru_head = slot->next;
+
+	if (slot->next != TD_SHM_CACHE_NONE)
+		cache->slots[slot->next].prev = slot->prev;
+	else
+		hdr->lru_tail = slot->prev;
+
+	slot->prev = slot->next = TD_SHM_CACHE_NONE;
+}
+
+static void
+td_shm_cache_lru_push(td_shm_cache_t *cache, uint32_t idx)
+{
+	td_shm_cache_header_t *hdr = cache->hdr;
+	td_shm_cache_slot_t *slot = cache->slots + idx;
+
+	slot->prev = TD_SHM_CACHE_NONE;
+	slot->next = hdr->lru_head;
+
+	if (hdr->lru_head != TD_SHM_CACHE_NONE)
+		cache->slots[hdr->lru_head].prev = idx;
+	else
+		hdr->lru_tail = idx;
+
+	hdr->lru_head = idx;
+}
+
+static void
+td_shm_cache_touch(td_shm_cache_t *cache, uint32_t idx)
+{
+	if (cache->hdr->lru_head == idx)
+		return;
+
+	td_shm_cache_lru_unlink(cache, idx);
+	td_shm_cache_lru_push(cache, idx);
+}
+
+static void
+td_shm_cache_unhash(td_shm_cache_t *cache, uint32_t idx)
+{
+	uint32_t *link;
+	td_shm_cache_slot_t *slot = cache->slots + idx;
+
+	link = cache->buckets +
+		td_shm_cache_hash(cache->hdr, &slot->id, slot->page);
+
+	while (*link != TD_SHM_CACHE_NONE && *link != idx)
+		link = &cache->slots[*link].hnext;
+
+	if (*link == idx)
+		*link = slot->hnext;
+
+	slot->hnext = TD_SHM_CACHE_NONE;
+}
+
+/* a free slot, or the least recently used one */
+static uint32_t
+td_shm_cache_alloc(td_shm_cache_t *cache)
+{
+	uint32_t idx;
+	td_shm_cache_header_t *hdr = cache->hdr;
+
+	idx = hdr->free_head;
+	if (idx != TD_SHM_CACHE_NONE) {
+		hdr->free_head = cache->slots[idx].next;
+		cache->slots[idx].next = TD_SHM_CACHE_NONE;
+		hdr->used++;
+		return idx;
+	}
+
+	idx = hdr->lru_tail;
+	if (idx == TD_SHM_CACHE_NONE)
+		return idx;
+
+	td_shm_cache_lru_unlink(cache, idx);
+	td_shm_cache_unhash(cache, idx);
+	hdr->evictions++;
+
+	return idx;
+}
+
+int
+td_shm_cache_lookup(const td_shm_cache_id_t *id,
+		    uint64_t sec, int secs, char *buf)
+{
+	int i, n, err;
+	uint64_t first, end, from, to;
+	uint32_t idx[TD_SHM_CACHE_MAX_PAGES];
+	td_shm_cache_t *cache = &td_shm_cache;
+
+	if (!cache->refcnt || secs <= 0)
+		return -EINVAL;
+
+	first = sec / TD_SHM_CACHE_PAGE_SECS;
+	end   = sec + secs;
+	n     = (end + TD_SHM_CACHE_PAGE_SECS - 1) / TD_SHM_CACHE_PAGE_SECS -
+		first;
+	if (n > TD_SHM_CACHE_MAX_PAGES)
+		return -E2BIG;
+
+	err = td_shm_cache_lock(cache);
+	if (err)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		idx[i] = td_shm_cache_find(cache, id, first + i);
+		if (idx[i] == TD_SHM_CACHE_NONE) {
+			cache->hdr->misses += n;
+			err = -ENOENT;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		from = (first + i) * TD_SHM_CACHE_PAGE_SECS;
+		to   = from + TD_SHM_CACHE_PAGE_SECS;
+		if (from < sec)
+			from = sec;
+		if (to > end)
+			to = end;
+
+		memcpy(buf + ((from - sec) << 9),
+		       td_shm_cache_page(cache, idx[i]) +
+		       ((from % TD_SHM_CACHE_PAGE_SECS) << 9),
+		       (to - from) << 9);
+
+		td_shm_cache_touch(cache, idx[i]);
+	}
+
+	cache->hdr->hits += n;
+
+out:
+	td_shm_cache_unlock(cache);
+	return err;
+}
+
+void
+td_shm_cache_insert(const td_shm_cache_id_t *id,
+		    uint64_t sec, int secs, const char *buf)
+{
+	int i, n;
+	uint32_t idx, bucket;
+	uint64_t page;
+	td_shm_cache_slot_t *slot;
+	td_shm_cache_t *cache = &td_shm_cache;
+
+	if (!cache->refcnt ||
+	    sec % TD_SHM_CACHE_PAGE_SECS || secs % TD_SHM_CACHE_PAGE_SECS)
+		return;
+
+	if (td_shm_cache_lock(cache))
+		return;
+
+	n = secs / TD_SHM_CACHE_PAGE_SECS;
+	for (i = 0; i < n; i++) {
+		page = sec / TD_SHM_CACHE_PAGE_SECS + i;
+
+		/* another tapdisk may have missed on it at the same time */
+		idx = td_shm_cache_find(cache, id, page);
+		if (idx != TD_SHM_CACHE_NONE) {
+			td_shm_cache_touch(cache, idx);
+			continue;
+		}
+
+		idx = td_shm_cache_alloc(cache);
+		if (idx == TD_SHM_CACHE_NONE)
+			break;
+
+		slot       = cache->slots + idx;
+		slot->id   = *id;
+		slot->page = page;
+
+		memcpy(td_shm_cache_page(cache, idx),
+		       buf + ((size_t)i << TD_SHM_CACHE_PAGE_SHIFT),
+		       TD_SHM_CACHE_PAGE_SIZE);
+
+		bucket              = td_shm_cache_hash(cache->hdr, id, page);
+		slot->hnext         = cache->buckets[bucket];
+		cache->buckets[bucket] = idx;
+		td_shm_cache_lru_push(cache, idx);
+
+		cache->hdr->inserts++;
+	}
+
+	td_shm_cache_unlock(cache);
+}
+
+int
+td_shm_cache_image_id(const char *path, td_shm_cache_id_t *id)
+{
+	struct stat st;
+
+	if (stat(path, &st))
+		return -errno;
+
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	id->gen = (uint64_t)st.st_ctim.tv_sec * 1000000000ULL +
+		st.st_ctim.tv_nsec;
+
+	return 0;
+}
+
+int
+td_shm_cache_get_stats(td_shm_cache_stats_t *stats)
+{
+	int err;
+	td_shm_cache_t *cache = &td_shm_cache;
+
+	if (!cache->refcnt)
+		return -ENODEV;
+
+	err = td_shm_cache_lock(cache);
+	if (err)
+		return err;
+
+	stats->size      = (uint64_t)cache->hdr->pages <<
+		TD_SHM_CACHE_PAGE_SHIFT;
+	stats->pages     = cache->hdr->pages;
+	stats->used      = cache->hdr->used;
+	stats->hits      = cache->hdr->hits;
+	stats->misses    = cache->hdr->misses;
+	stats->inserts   = cache->hdr->inserts;
+	stats->evictions = cache->hdr->evictions;
+	stats->resets    = cache->hdr->resets;
+
+	td_shm_cache_unlock(cache);
+	return 0;
+}
+
+static int
+td_shm_cache_map(td_shm_cache_t *cache, size_t size)
+{
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	cache->map  = map;
+	cache->size = size;
+	cache->hdr  = map;
+
+	return 0;
+}
+
+static void
+td_shm_cache_set_pointers(td_shm_cache_t *cache)
+{
+	cache->slots   = (td_shm_cache_slot_t *)
+		(cache->map + cache->hdr->slots_off);
+	cache->buckets = (uint32_t *)(cache->map + cache->hdr->buckets_off);
+	cache->data    = cache->map + cache->hdr->data_off;
+}
+
+static int
+td_shm_cache_create(td_shm_cache_t *cache, unsigned long mb)
+{
+	int err;
+	uint64_t pages;
+	td_shm_cache_header_t layout;
+	pthread_mutexattr_t attr;
+
+	pages = ((uint64_t)mb << 20) >> TD_SHM_CACHE_PAGE_SHIFT;
+	if (!pages || pages >= TD_SHM_CACHE_NONE)
+		return -EINVAL;
+
+	memset(&layout, 0, sizeof(layout));
+	td_shm_cache_layout(&layout, pages);
+
+	if (ftruncate(cache->fd, layout.size))
+		return -errno;
+
+	err = td_shm_cache_map(cache, layout.size);
+	if (err)
+		return err;
+
+	memcpy(cache->hdr, &layout, sizeof(layout));
+	td_shm_cache_set_pointers(cache);
+
+	err = pthread_mutexattr_init(&attr);
+	if (!err)
+		err = pthread_mutexattr_setpshared(&attr,
+						   PTHREAD_PROCESS_SHARED);
+	if (!err)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (!err)
+		err = pthread_mutex_init(&cache->hdr->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
+
+	td_shm_cache_reset(cache);
+	cache->hdr->version = TD_SHM_CACHE_VERSION;
+
+	/* attachers spin on the magic: publish it last */
+	__sync_synchronize();
+	cache->hdr->magic = TD_SHM_CACHE_MAGIC;
+
+	DPRINTF("created shared cache %s: %"PRIu64" pages, %"PRIu64" bytes\n",
+		TD_SHM_CACHE_NAME, pages, layout.size);
+
+	return 0;
+}
+
+static int
+td_shm_cache_attach(td_shm_cache_t *cache)
+{
+	int err, ms;
+	struct stat st;
+
+	for (ms = 0; ; ms++) {
+		if (fstat(cache->fd, &st))
+			return -errno;
+
+		if (st.st_size >= sizeof(td_shm_cache_header_t))
+			break;
+
+		if (ms == TD_SHM_CACHE_WAIT_MS)
+			return -ETIMEDOUT;
+		usleep(1000);
+	}
+
+	err = td_shm_cache_map(cache, st.st_size);
+	if (err)
+		return err;
+
+	for (; cache->hdr->magic != TD_SHM_CACHE_MAGIC; ms++) {
+		if (ms >= TD_SHM_CACHE_WAIT_MS)
+			return -ETIMEDOUT;
+		usleep(1000);
+	}
+	__sync_synchronize();
+
+	if (cache->hdr->version != TD_SHM_CACHE_VERSION ||
+	    cache->hdr->size != st.st_size) {
+		EPRINTF("shared cache %s: version %u, size %"PRIu64
+			" unsupported\n", TD_SHM_CACHE_NAME,
+			cache->hdr->version, cache->hdr->size);
+		return -EINVAL;
+	}
+
+	td_shm_cache_set_pointers(cache);
+
+	DPRINTF("attached to shared cache %s: %u pages\n",
+		TD_SHM_CACHE_NAME, cache->hdr->pages);
+
+	return 0;
+}
+
+static void
+td_shm_cache_unmap(td_shm_cache_t *cache)
+{
+	if (cache->map)
+		munmap(cache->map, cache->size);
+
+	if (cache->fd != -1)
+		close(cache->fd);
+
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = -1;
+}
+
+int
+td_shm_cache_get(void)
+{
+	int err, retried = 0;
+	char *env;
+	unsigned long mb;
+	td_shm_cache_t *cache = &td_shm_cache;
+
+	if (cache->refcnt) {
+		cache->refcnt++;
+		return 0;
+	}
+
+	mb  = TD_SHM_CACHE_DEFAULT_MB;
+	env = getenv(TD_SHM_CACHE_ENV);
+	if (env)
+		mb = strtoul(env, NULL, 0);
+	if (!mb)
+		return -ENOSYS;
+
+retry:
+	cache->fd = shm_open(TD_SHM_CACHE_NAME,
+			     O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (cache->fd != -1) {
+		err = td_shm_cache_create(cache, mb);
+		if (err) {
+			EPRINTF("failed to create shared cache %s: %d\n",
+				TD_SHM_CACHE_NAME, err);
+			shm_unlink(TD_SHM_CACHE_NAME);
+			goto fail;
+		}
+	} else {
+		err = -errno;
+		if (err != -EEXIST)
+			goto fail;
+
+		cache->fd = shm_open(TD_SHM_CACHE_NAME, O_RDWR, 0);
+		if (cache->fd == -1) {
+			err = -errno;
+			goto fail;
+		}
+
+		err = td_shm_cache_attach(cache);
+		if (err) {
+			EPRINTF("failed to attach to shared cache %s: %d\n",
+				TD_SHM_CACHE_NAME, err);
+
+			/*
+			 * left half-made by a tapdisk which died creating it,
+			 * or made by another version: replace it, once.
+			 * Those still attached keep the old one.
+			 */
+			if ((err == -ETIMEDOUT || err == -EINVAL) && !retried) {
+				retried = 1;
+				td_shm_cache_unmap(cache);
+				shm_unlink(TD_SHM_CACHE_NAME);
+				goto retry;
+			}
+			goto fail;
+		}
+	}
+
+	cache->refcnt = 1;
+	return 0;
+
+fail:
+	td_shm_cache_unmap(cache);
+	return err;
+}
+
+void
+td_shm_cache_put(void)
+{
+	td_shm_cache_t *cache = &td_shm_cache;
+
+	if (!cache->refcnt || --cache->refcnt)
+		return;
+
+	/* the segment itself outlives us, for the next tapdisk */
+	td_shm_cache_unmap(cache);
+}
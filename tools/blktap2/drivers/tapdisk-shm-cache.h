@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_SHM_CACHE_H_
+#define _TAPDISK_SHM_CACHE_H_
+
+#include <inttypes.h>
+
+/*
+ * A read cache shared by every tapdisk process on the host, for the
+ * read-only parent images that many VBDs have in common.  Pages are
+ * keyed by the identity of the image file and the page offset, and
+ * evicted least recently used first.
+ *
+ * The segment is sized by its creator from TD_SHM_CACHE_ENV (in MB,
+ * 0 disables it); later tapdisks attach to whatever already exists.
+ */
+
+#define TD_SHM_CACHE_NAME        "/tapdisk-cache"
+#define TD_SHM_CACHE_ENV         "TAPDISK2_SHARED_CACHE_MB"
+#define TD_SHM_CACHE_DEFAULT_MB  256
+
+#define TD_SHM_CACHE_PAGE_SHIFT  12
+#define TD_SHM_CACHE_PAGE_SIZE   (1 << TD_SHM_CACHE_PAGE_SHIFT)
+#define TD_SHM_CACHE_PAGE_SECS   (TD_SHM_CACHE_PAGE_SIZE >> 9)
+
+typedef struct td_shm_cache_id           td_shm_cache_id_t;
+typedef struct td_shm_cache_stats        td_shm_cache_stats_t;
+
+/* device, inode and change time of a read-only image file */
+struct td_shm_cache_id {
+	uint64_t                         dev;
+	uint64_t                         ino;
+	uint64_t                         gen;
+};
+
+struct td_shm_cache_stats {
+	uint64_t                         size;
+	uint64_t                         pages;
+	uint64_t                         used;
+	uint64_t                         hits;
+	uint64_t                         misses;
+	uint64_t                         inserts;
+	uint64_t                         evictions;
+	uint64_t                         resets;
+};
+
+int td_shm_cache_get(void);
+void td_shm_cache_put(void);
+
+int td_shm_cache_image_id(const char *path, td_shm_cache_id_t *id);
+
+/*
+ * @sec and @secs need not be page aligned.  lookups copy into @buf
+ * only if every page covering the range is present.  inserts take a
+ * page aligned range.
+ */
+int td_shm_cache_lookup(const td_shm_cache_id_t *id,
+			uint64_t sec, int secs, char *buf);
+void td_shm_cache_insert(const td_shm_cache_id_t *id,
+			 uint64_t sec, int secs, const char *buf);
+
+int td_shm_cache_get_stats(td_shm_cache_stats_t *stats);
+
+#endif
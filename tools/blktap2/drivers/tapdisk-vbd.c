@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #ifdef MEMSHR
@@ -44,6 +45,7 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-vbd.h"
+#include "tapdisk-coalesce.h"
 #include "blktap2.h"
 
 #define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
@@ -70,6 +72,15 @@
 static void tapdisk_vbd_ring_event(event_id_t, char, void *);
 static void tapdisk_vbd_callback(void *, blkif_response_t *);
 
+static inline uint64_t
+tapdisk_vbd_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /* 
  * initialization
  */
@@ -85,6 +96,7 @@ void
 tapdisk_vbd_free(td_vbd_t *vbd)
 {
 	if (vbd) {
+		tapdisk_coalesce_free(vbd);
 		tapdisk_vbd_free_stack(vbd);
 		list_del_init(&vbd->next);
 		free(vbd->name);
@@ -124,6 +136,7 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
 	gettimeofday(&vbd->ts, NULL);
+	vbd->stats.start = tapdisk_vbd_usecs();
 
 	for (i = 0; i < MAX_REQUESTS; i++)
 		tapdisk_vbd_initialize_vreq(vbd->request_list + i);
@@ -184,6 +197,8 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
 	td_image_t *image, *tmp;
 
+	tapdisk_coalesce_cancel(vbd);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp) {
 		td_close(image);
 		tapdisk_image_free(image);
@@ -629,6 +644,10 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 	ring->vstart =
 		(unsigned long)ring->mem + (BLKTAP_RING_PAGES * psize);
 
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       (BLKTAP_MMAP_REGION_SIZE -
+					BLKTAP_RING_PAGES) * psize);
+
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
 	return 0;
@@ -650,6 +669,8 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	psize = getpagesize();
 
+	if (vbd->ring.mem > 0)
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
 	if (vbd->ring.mem > 0)
@@ -1052,12 +1073,113 @@ tapdisk_vbd_callback(void *arg, blkif_response_t *rsp)
 	tapdisk_vbd_write_response_to_ring(vbd, rsp);
 }
 
+/*
+ * statistics
+ */
+
+static inline int
+tapdisk_vbd_stats_op(int operation)
+{
+	switch (operation) {
+	case BLKIF_OP_READ:
+		return TAPDISK_STATS_READ;
+	case BLKIF_OP_WRITE:
+		return TAPDISK_STATS_WRITE;
+	default:
+		return TAPDISK_STATS_FLUSH;
+	}
+}
+
+static inline int
+tapdisk_vbd_stats_bucket(uint64_t usecs)
+{
+	int bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+	return (bucket < TAPDISK_STATS_LAT_BUCKETS ?
+		bucket : TAPDISK_STATS_LAT_BUCKETS - 1);
+}
+
+static void
+tapdisk_vbd_stats_arrival(td_vbd_t *vbd, td_vbd_request_t *vreq,
+			  uint64_t now)
+{
+	td_vbd_stats_t *stats = &vbd->stats;
+	uint64_t depth;
+
+	vreq->ts_received = now;
+	vreq->ts_issued   = now;
+
+	depth = vbd->received - vbd->returned - 1;
+	if (depth + 1 > stats->max_depth)
+		stats->max_depth = depth + 1;
+	if (depth >= TAPDISK_STATS_DEPTH_BUCKETS)
+		depth = TAPDISK_STATS_DEPTH_BUCKETS - 1;
+	stats->depth[depth]++;
+}
+
+static void
+tapdisk_vbd_stats_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_vbd_stats_t *stats = &vbd->stats;
+	blkif_request_t *req = &vreq->req;
+	uint64_t now, ring, backend;
+	int i, op;
+
+	now     = tapdisk_vbd_usecs();
+	ring    = now - vreq->ts_received;
+	backend = now - vreq->ts_issued;
+	op      = tapdisk_vbd_stats_op(req->operation);
+
+	stats->requests[op]++;
+	for (i = 0; i < req->nr_segments && i < BLKIF_MAX_SEGMENTS_PER_REQUEST;
+	     i++)
+		stats->sectors[op] +=
+			req->seg[i].last_sect - req->seg[i].first_sect + 1;
+
+	if (vreq->status != BLKIF_RSP_OKAY)
+		stats->errors++;
+
+	stats->ring_usecs[op]    += ring;
+	stats->backend_usecs[op] += backend;
+	stats->ring_lat[op][tapdisk_vbd_stats_bucket(ring)]++;
+	stats->backend_lat[op][tapdisk_vbd_stats_bucket(backend)]++;
+}
+
+void
+tapdisk_vbd_get_stats(td_vbd_t *vbd, tapdisk_message_stats_t *msg)
+{
+	td_vbd_stats_t *stats = &vbd->stats;
+
+	msg->usecs   = tapdisk_vbd_usecs() - stats->start;
+	msg->errors  = stats->errors;
+	msg->retries = stats->retries;
+
+	memcpy(msg->requests, stats->requests, sizeof(msg->requests));
+	memcpy(msg->sectors, stats->sectors, sizeof(msg->sectors));
+	memcpy(msg->ring_usecs, stats->ring_usecs, sizeof(msg->ring_usecs));
+	memcpy(msg->backend_usecs, stats->backend_usecs,
+	       sizeof(msg->backend_usecs));
+	memcpy(msg->ring_lat, stats->ring_lat, sizeof(msg->ring_lat));
+	memcpy(msg->backend_lat, stats->backend_lat,
+	       sizeof(msg->backend_lat));
+	memcpy(msg->depth, stats->depth, sizeof(msg->depth));
+	msg->max_depth = stats->max_depth;
+}
+
+void
+tapdisk_vbd_reset_stats(td_vbd_t *vbd)
+{
+	memset(&vbd->stats, 0, sizeof(vbd->stats));
+	vbd->stats.start = tapdisk_vbd_usecs();
+}
+
 static void
 tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	blkif_request_t tmp;
 	blkif_response_t *rsp;
 
+	tapdisk_vbd_stats_response(vbd, vreq);
+
 	tmp = vreq->req;
 	rsp = (blkif_response_t *)&vreq->req;
 
@@ -1372,6 +1494,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	vreq->submitting = 1;
 	gettimeofday(&vbd->ts, NULL);
 	gettimeofday(&vreq->last_try, NULL);
+	vreq->ts_issued = tapdisk_vbd_usecs();
 	tapdisk_vbd_move_request(vreq, &vbd->pending_requests);
 
 #if 0
@@ -1476,6 +1599,7 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 			vreq->blocked = 0;
 		} else {
 			vbd->retries++;
+			vbd->stats.retries++;
 			vreq->num_retries++;
 		}
 		vreq->error  = 0;
@@ -1553,6 +1677,7 @@ static void
 tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 {
 	int idx;
+	uint64_t now;
 	RING_IDX rp, rc;
 	td_ring_t *ring;
 	blkif_request_t *req;
@@ -1565,6 +1690,8 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 	rp   = ring->fe_ring.sring->req_prod;
 	xen_rmb();
 
+	now  = tapdisk_vbd_usecs();
+
 	for (rc = ring->fe_ring.req_cons; rc != rp; rc++) {
 		req = RING_GET_REQUEST(&ring->fe_ring, rc);
 		++ring->fe_ring.req_cons;
@@ -1578,6 +1705,7 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 		memcpy(&vreq->req, req, sizeof(blkif_request_t));
 		vbd->received++;
 		vreq->vbd = vbd;
+		tapdisk_vbd_stats_arrival(vbd, vreq, now);
 
 		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
 
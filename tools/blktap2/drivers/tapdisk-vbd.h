@@ -35,6 +35,7 @@
 #include "tapdisk.h"
 #include "scheduler.h"
 #include "tapdisk-image.h"
+#include "tapdisk-message.h"
 
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
@@ -54,6 +55,7 @@ typedef struct td_ring              td_ring_t;
 typedef struct td_vbd_request       td_vbd_request_t;
 typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
 typedef struct td_vbd_handle        td_vbd_t;
+typedef struct td_vbd_stats         td_vbd_stats_t;
 typedef void (*td_vbd_cb_t)        (void *, blkif_response_t *);
 
 struct td_ring {
@@ -75,10 +77,30 @@ struct td_vbd_request {
 	int                         num_retries;
 	struct timeval              last_try;
 
+	uint64_t                    ts_received; /* usecs, CLOCK_MONOTONIC */
+	uint64_t                    ts_issued;
+
 	td_vbd_t                   *vbd;
 	struct list_head            next;
 };
 
+/* see tapdisk_message_stats */
+struct td_vbd_stats {
+	uint64_t                    start;
+	uint64_t                    requests[TAPDISK_STATS_OPS];
+	uint64_t                    sectors[TAPDISK_STATS_OPS];
+	uint64_t                    errors;
+	uint64_t                    retries;
+	uint64_t                    ring_usecs[TAPDISK_STATS_OPS];
+	uint64_t                    backend_usecs[TAPDISK_STATS_OPS];
+	uint64_t                    ring_lat[TAPDISK_STATS_OPS]
+					    [TAPDISK_STATS_LAT_BUCKETS];
+	uint64_t                    backend_lat[TAPDISK_STATS_OPS]
+					       [TAPDISK_STATS_LAT_BUCKETS];
+	uint64_t                    depth[TAPDISK_STATS_DEPTH_BUCKETS];
+	uint32_t                    max_depth;
+};
+
 struct td_vbd_driver_info {
 	char                       *params;
 	int                         type;
@@ -125,6 +147,10 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+
+	td_vbd_stats_t              stats;
+
+	struct td_coalesce         *coalesce;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -201,6 +227,8 @@ int tapdisk_vbd_kick(td_vbd_t *);
 void tapdisk_vbd_check_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
+void tapdisk_vbd_get_stats(td_vbd_t *, tapdisk_message_stats_t *);
+void tapdisk_vbd_reset_stats(td_vbd_t *);
 
 void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 
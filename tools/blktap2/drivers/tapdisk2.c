@@ -42,7 +42,8 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-I rwio|lio|uring[,poll][,sqpoll]] "
+		"<-u uuid> <-c control socket>\n", app);
 	exit(err);
 }
 
@@ -50,16 +51,21 @@ int
 main(int argc, char *argv[])
 {
 	char *control;
+	const char *io;
 	int c, err, nodaemon;
 
 	control  = NULL;
 	nodaemon = 0;
+	io       = getenv("TAPDISK2_IO");
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:DI:h")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'I':
+			io = optarg;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -79,6 +85,11 @@ main(int argc, char *argv[])
 	if (optind != argc)
 		usage(argv[0], EINVAL);
 
+	if (io && tapdisk_queue_driver(io) < 0) {
+		fprintf(stderr, "invalid I/O driver '%s'\n", io);
+		exit(EINVAL);
+	}
+
 	if (chdir("/")) {
 		DPRINTF("failed to chdir(/): %d\n", errno);
 		err = 1;
@@ -93,6 +104,9 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (io)
+		tapdisk_server_set_io_driver(io);
+
 	if (!nodaemon) {
 		err = daemon(0, 1);
 		if (err) {
@@ -126,6 +126,8 @@ typedef struct dd_batmap_hdr       vhd_batmap_header_t;
 typedef struct prt_loc             vhd_parent_locator_t;
 typedef struct vhd_context         vhd_context_t;
 typedef uint32_t                   vhd_flag_creat_t;
+typedef struct vhd_coalesce        vhd_coalesce_t;
+typedef struct vhd_coalesce_stats  vhd_coalesce_stats_t;
 
 struct vhd_bat {
 	uint32_t                   spb;
@@ -138,6 +140,17 @@ struct vhd_batmap {
 	char                      *map;
 };
 
+/* sizes in bytes; blocks counts the child's allocated blocks */
+struct vhd_coalesce_stats {
+	uint64_t                   blocks;
+	uint64_t                   blocks_done;
+	uint64_t                   bytes_read;
+	uint64_t                   bytes_written;
+	uint64_t                   bytes_skipped;
+	uint64_t                   usecs;
+	int                        finished;
+};
+
 struct vhd_context {
 	int                        fd;
 	char                      *file;
@@ -323,4 +336,15 @@ int vhd_write_block(vhd_context_t *, uint32_t block, char *data);
 int vhd_io_read(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_write(vhd_context_t *, char *, uint64_t, uint32_t);
 
+/*
+ * Merge the allocated sectors of a child into its parent on @threads
+ * worker threads.  vhd_coalesce_start returns once the workers are
+ * running; vhd_coalesce_finish waits for them and commits the parent's
+ * metadata, vhd_coalesce_cancel stops them early first.  Both free @c.
+ */
+int vhd_coalesce_start(const char *child, int threads, vhd_coalesce_t **c);
+void vhd_coalesce_poll(vhd_coalesce_t *c, vhd_coalesce_stats_t *stats);
+int vhd_coalesce_finish(vhd_coalesce_t *c, vhd_coalesce_stats_t *stats);
+int vhd_coalesce_cancel(vhd_coalesce_t *c);
+
 #endif
@@ -50,6 +50,9 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_cache_stats tapdisk_message_cache_stats_t;
+typedef struct tapdisk_message_coalesce  tapdisk_message_coalesce_t;
+typedef struct tapdisk_message_stats     tapdisk_message_stats_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +91,88 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/*
+ * reads, hits and misses are this VBD's, in sectors; the rest describe
+ * the host-wide shared cache (in pages) and are zero if it is not in use.
+ */
+struct tapdisk_message_cache_stats {
+	uint8_t                          shared;
+	uint64_t                         reads;
+	uint64_t                         hits;
+	uint64_t                         misses;
+
+	uint64_t                         size;
+	uint64_t                         pages;
+	uint64_t                         used;
+	uint64_t                         shared_hits;
+	uint64_t                         shared_misses;
+	uint64_t                         inserts;
+	uint64_t                         evictions;
+};
+
+#define TAPDISK_COALESCE_IDLE            0
+#define TAPDISK_COALESCE_RUNNING         1
+#define TAPDISK_COALESCE_DONE            2
+#define TAPDISK_COALESCE_FAILED          3
+
+/*
+ * path names the image, one of the VBD's read-only ancestors, to merge
+ * into its parent; threads may be 0 for the default.  Sizes are in bytes.
+ */
+struct tapdisk_message_coalesce {
+	uint8_t                          state;
+	uint16_t                         threads;
+	int                              error;
+	uint64_t                         blocks;
+	uint64_t                         blocks_done;
+	uint64_t                         bytes_written;
+	uint64_t                         bytes_skipped;
+	uint64_t                         usecs;
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
+#define TAPDISK_STATS_READ               0
+#define TAPDISK_STATS_WRITE              1
+#define TAPDISK_STATS_FLUSH              2
+#define TAPDISK_STATS_OPS                3
+
+/* bucket i counts latencies below 2^i usecs; the last one has the rest */
+#define TAPDISK_STATS_LAT_BUCKETS        24
+/* bucket i counts arrivals finding i requests in flight (the last, more) */
+#define TAPDISK_STATS_DEPTH_BUCKETS      33
+
+/*
+ * Per-VBD request statistics since the VBD was opened or last reset
+ * (set reset in the request to zero them once read).  Ring latency runs
+ * from a request's arrival on the ring to its response, backend latency
+ * from its last issue to the image chain.  The queue fields describe
+ * the tapdisk's I/O queue, which all its VBDs share.
+ */
+struct tapdisk_message_stats {
+	uint8_t                          reset;
+	uint64_t                         usecs;
+
+	uint64_t                         requests[TAPDISK_STATS_OPS];
+	uint64_t                         sectors[TAPDISK_STATS_OPS];
+	uint64_t                         errors;
+	uint64_t                         retries;
+
+	uint64_t                         ring_usecs[TAPDISK_STATS_OPS];
+	uint64_t                         backend_usecs[TAPDISK_STATS_OPS];
+	uint64_t                         ring_lat[TAPDISK_STATS_OPS]
+						 [TAPDISK_STATS_LAT_BUCKETS];
+	uint64_t                         backend_lat[TAPDISK_STATS_OPS]
+						    [TAPDISK_STATS_LAT_BUCKETS];
+
+	uint64_t                         depth[TAPDISK_STATS_DEPTH_BUCKETS];
+	uint32_t                         max_depth;
+
+	uint64_t                         queue_batches;
+	uint64_t                         queue_iocbs;
+	uint64_t                         queue_merged;
+	uint64_t                         queue_deferrals;
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +185,9 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_cache_stats_t cache_stats;
+		tapdisk_message_coalesce_t coalesce;
+		tapdisk_message_stats_t  stats;
 	} u;
 };
 
@@ -126,6 +214,14 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_CACHE_STATS,
+	TAPDISK_MESSAGE_CACHE_STATS_RSP,
+	TAPDISK_MESSAGE_COALESCE,
+	TAPDISK_MESSAGE_COALESCE_STATUS,
+	TAPDISK_MESSAGE_COALESCE_CANCEL,
+	TAPDISK_MESSAGE_COALESCE_RSP,
+	TAPDISK_MESSAGE_STATS,
+	TAPDISK_MESSAGE_STATS_RSP,
 };
 
 static inline char *
@@ -195,6 +291,30 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_CACHE_STATS:
+		return "cache stats";
+
+	case TAPDISK_MESSAGE_CACHE_STATS_RSP:
+		return "cache stats response";
+
+	case TAPDISK_MESSAGE_COALESCE:
+		return "coalesce";
+
+	case TAPDISK_MESSAGE_COALESCE_STATUS:
+		return "coalesce status";
+
+	case TAPDISK_MESSAGE_COALESCE_CANCEL:
+		return "coalesce cancel";
+
+	case TAPDISK_MESSAGE_COALESCE_RSP:
+		return "coalesce response";
+
+	case TAPDISK_MESSAGE_STATS:
+		return "stats";
+
+	case TAPDISK_MESSAGE_STATS_RSP:
+		return "stats response";
+
 	default:
 		return "unknown";
 	}
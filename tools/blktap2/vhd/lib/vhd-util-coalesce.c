@@ -28,191 +28,752 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
+#define COALESCE_DEFAULT_THREADS   4
+#define COALESCE_MAX_THREADS       64
+
+/*
+ * The child's allocated blocks are read in one request each (bitmap and
+ * data together) and handed out to the workers in on-disk order, so the
+ * child is read sequentially however its BAT is laid out.  Each worker
+ * owns a whole block at a time, which keeps the parent's bitmaps free of
+ * locking; only block allocation and the parent's BAT and batmap, which
+ * are written once at the end, are shared.
+ */
+
+struct vhd_coalesce_block {
+	uint64_t                   off;
+	uint32_t                   blk;
+};
+
+struct vhd_coalesce {
+	vhd_context_t              child;
+	vhd_context_t              parent;
+	char                      *pname;
+
+	/* parent data goes to pfd: parent.fd, or a raw image */
+	int                        pfd;
+	int                        pdynamic;
+	int                        pdiff;
+	uint64_t                   psecs;
+
+	struct vhd_coalesce_block *blocks;
+	uint32_t                   nblocks;
+	uint32_t                   next;
+	uint64_t                   eod;
+	int                        bat_dirty;
+	int                        batmap_dirty;
+
+	pthread_mutex_t            lock;
+	pthread_t                 *tids;
+	int                        nthreads;
+	int                        running;
+	int                        cancel;
+	int                        err;
+
+	struct timeval             start;
+	struct timeval             end;
+	vhd_coalesce_stats_t       stats;
+};
+
+struct vhd_coalesce_counts {
+	uint64_t                   read;
+	uint64_t                   written;
+	uint64_t                   skipped;
+};
+
 static int
-__raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
+__coalesce_pread(int fd, char *buf, size_t size, off_t off)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
+
+	while (size) {
+		ret = pread(fd, buf, size, off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
 
-	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
+		buf  += ret;
+		off  += ret;
+		size -= ret;
 	}
 
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
-	if (ret == vhd_sectors_to_bytes(secs))
-		return 0;
+	return 0;
+}
+
+static int
+__coalesce_pwrite(int fd, const char *buf, size_t size, off_t off)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, buf, size, off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+
+		buf  += ret;
+		off  += ret;
+		size -= ret;
+	}
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
-	return (errno ? -errno : -EIO);
+	return 0;
+}
+
+static int
+__coalesce_zero(const char *buf, size_t size)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
 }
 
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * Zeroes in a raw or fixed parent: punch a hole where the filesystem
+ * can, so a mostly empty child does not fill the parent with zeroes.
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+__coalesce_punch(int fd, uint64_t sec, uint32_t secs)
 {
-	int i, err;
-	char *buf, *map;
-	uint64_t sec, secs;
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       vhd_sectors_to_bytes(sec), vhd_sectors_to_bytes(secs)))
+		return 0;
+#endif
+	return -EOPNOTSUPP;
+}
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+static int
+__coalesce_bits_clear(vhd_context_t *vhd, char *map, uint32_t i, uint32_t n)
+{
+	while (n--)
+		if (vhd_bitmap_test(vhd, map, i++))
+			return 0;
+	return 1;
+}
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+static uint64_t
+vhd_coalesce_allocate(vhd_coalesce_t *c, uint32_t blk)
+{
+	uint64_t pblk;
+	int spp;
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	spp = getpagesize() >> VHD_SECTOR_SHIFT;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+	pthread_mutex_lock(&c->lock);
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
-	}
+	/* data region of segment should begin on page boundary */
+	pblk = c->eod;
+	if ((pblk + c->parent.bm_secs) % spp)
+		pblk += spp - ((pblk + c->parent.bm_secs) % spp);
+
+	c->eod = pblk + c->parent.bm_secs + c->parent.spb;
+	c->parent.bat.bat[blk] = pblk;
+	c->bat_dirty = 1;
+
+	pthread_mutex_unlock(&c->lock);
 
-	err = vhd_read_bitmap(vhd, block, &map);
+	return pblk;
+}
+
+static int
+vhd_coalesce_block(vhd_coalesce_t *c, struct vhd_coalesce_block *b,
+		   char *buf, char *pmap, struct vhd_coalesce_counts *cnt)
+{
+	int err, ret, full, dirty, allocated;
+	vhd_context_t *vhd, *parent;
+	uint64_t sec, pblk, off;
+	uint32_t i, n, spb;
+	char *map, *data;
+
+	vhd       = &c->child;
+	parent    = &c->parent;
+	spb       = vhd->spb;
+	sec       = (uint64_t)b->blk * spb;
+	map       = buf;
+	data      = buf + vhd_sectors_to_bytes(vhd->bm_secs);
+	pblk      = DD_BLK_UNUSED;
+	dirty     = 0;
+	allocated = 0;
+
+	err = __coalesce_pread(vhd->fd, buf,
+			       vhd_sectors_to_bytes(vhd->bm_secs + spb),
+			       vhd_sectors_to_bytes(b->off));
 	if (err)
-		goto done;
+		return err;
+
+	cnt->read += vhd_sectors_to_bytes(vhd->bm_secs + spb);
+
+	full = vhd_has_batmap(vhd) &&
+		vhd_batmap_test(vhd, &vhd->batmap, b->blk);
+
+	if (c->pdynamic) {
+		if (b->blk >= parent->bat.entries)
+			return -ERANGE;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
+		pthread_mutex_lock(&c->lock);
+		pblk = parent->bat.bat[b->blk];
+		pthread_mutex_unlock(&c->lock);
+
+		if (pblk == DD_BLK_UNUSED)
+			memset(pmap, 0,
+			       vhd_sectors_to_bytes(parent->bm_secs));
+		else {
+			err = __coalesce_pread(c->pfd, pmap,
+					       vhd_sectors_to_bytes(parent->bm_secs),
+					       vhd_sectors_to_bytes(pblk));
+			if (err)
+				return err;
+		}
+	}
+
+	for (i = 0; i < spb; i += n) {
+		if (!full && !vhd_bitmap_test(vhd, map, i)) {
+			n = 1;
 			continue;
+		}
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
+		for (n = 1; i + n < spb; n++)
+			if (!full && !vhd_bitmap_test(vhd, map, i + n))
 				break;
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+		if (sec + i + n > c->psecs) {
+			err = -ERANGE;
+			goto out;
+		}
+
+		if (__coalesce_zero(data + vhd_sectors_to_bytes(i),
+				    vhd_sectors_to_bytes(n))) {
+			/*
+			 * an empty sector of a dynamic parent already reads
+			 * as zero unless it has a parent of its own.
+			 */
+			if (c->pdynamic) {
+				if (!c->pdiff &&
+				    (pblk == DD_BLK_UNUSED ||
+				     __coalesce_bits_clear(parent, pmap, i, n))) {
+					cnt->skipped += vhd_sectors_to_bytes(n);
+					continue;
+				}
+			} else if (!__coalesce_punch(c->pfd, sec + i, n)) {
+				cnt->skipped += vhd_sectors_to_bytes(n);
+				continue;
+			}
+		}
+
+		if (c->pdynamic) {
+			if (pblk == DD_BLK_UNUSED) {
+				pblk = vhd_coalesce_allocate(c, b->blk);
+				allocated = 1;
+			}
+			off = pblk + parent->bm_secs + i;
+		} else
+			off = sec + i;
+
+		err = __coalesce_pwrite(c->pfd,
+					data + vhd_sectors_to_bytes(i),
+					vhd_sectors_to_bytes(n),
+					vhd_sectors_to_bytes(off));
 		if (err)
-			goto done;
+			goto out;
+
+		cnt->written += vhd_sectors_to_bytes(n);
 
-		i += secs;
+		if (c->pdynamic) {
+			uint32_t j;
+			for (j = i; j < i + n; j++)
+				vhd_bitmap_set(parent, pmap, j);
+			dirty = 1;
+		}
 	}
 
 	err = 0;
 
-done:
-	free(buf);
-	free(map);
+out:
+	if (!dirty)
+		return err;
+
+	/*
+	 * commit whatever made it to disk.  if even the bitmap can't be
+	 * written, forget a block allocated here rather than point the
+	 * BAT at an uninitialized one.
+	 */
+	ret = __coalesce_pwrite(c->pfd, pmap,
+				vhd_sectors_to_bytes(parent->bm_secs),
+				vhd_sectors_to_bytes(pblk));
+	if (ret) {
+		if (allocated) {
+			pthread_mutex_lock(&c->lock);
+			parent->bat.bat[b->blk] = DD_BLK_UNUSED;
+			pthread_mutex_unlock(&c->lock);
+		}
+		return err ? : ret;
+	}
+
+	if (!err && vhd_has_batmap(parent)) {
+		for (i = 0; i < parent->spb; i++)
+			if (!vhd_bitmap_test(parent, pmap, i))
+				break;
+
+		if (i == parent->spb) {
+			pthread_mutex_lock(&c->lock);
+			vhd_batmap_set(parent, &parent->batmap, b->blk);
+			c->batmap_dirty = 1;
+			pthread_mutex_unlock(&c->lock);
+		}
+	}
+
 	return err;
 }
 
-int
-vhd_util_coalesce(int argc, char **argv)
+static void *
+vhd_coalesce_worker(void *private)
 {
-	int err, c;
-	uint64_t i;
-	char *name, *pname;
-	vhd_context_t vhd, parent;
-	int parent_fd = -1;
-
-	name  = NULL;
-	pname = NULL;
-	parent.file = NULL;
+	int err;
+	size_t pad, size;
+	char *buf, *pmap;
+	vhd_coalesce_t *c;
+	struct vhd_coalesce_block *b;
+	struct vhd_coalesce_counts cnt;
+
+	c    = private;
+	buf  = NULL;
+	pmap = NULL;
+
+	/* start the data, not the bitmap, on a page boundary */
+	size = vhd_sectors_to_bytes(c->child.bm_secs);
+	pad  = (4096 - (size % 4096)) % 4096;
+	size = pad + vhd_sectors_to_bytes(c->child.bm_secs + c->child.spb);
+
+	err = posix_memalign((void **)&buf, 4096, size);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto out;
+	}
 
-	if (!argc || !argv)
-		goto usage;
+	if (c->pdynamic) {
+		err = posix_memalign((void **)&pmap, 4096,
+				     vhd_sectors_to_bytes(c->parent.bm_secs));
+		if (err) {
+			pmap = NULL;
+			err  = -err;
+			goto out;
+		}
+	}
 
-	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
-		switch (c) {
-		case 'n':
-			name = optarg;
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		if (c->err || c->cancel || c->next == c->nblocks) {
+			pthread_mutex_unlock(&c->lock);
 			break;
-		case 'h':
-		default:
-			goto usage;
 		}
+		b = &c->blocks[c->next++];
+		pthread_mutex_unlock(&c->lock);
+
+		memset(&cnt, 0, sizeof(cnt));
+		err = vhd_coalesce_block(c, b, buf + pad, pmap, &cnt);
+
+		pthread_mutex_lock(&c->lock);
+		c->stats.blocks_done++;
+		c->stats.bytes_read    += cnt.read;
+		c->stats.bytes_written += cnt.written;
+		c->stats.bytes_skipped += cnt.skipped;
+		if (err && !c->err)
+			c->err = err;
+		pthread_mutex_unlock(&c->lock);
+
+		if (err)
+			break;
 	}
 
-	if (!name || optind != argc)
-		goto usage;
+	err = 0;
 
-	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+out:
+	free(buf);
+	free(pmap);
+
+	pthread_mutex_lock(&c->lock);
+	if (err && !c->err)
+		c->err = err;
+	if (!--c->running)
+		gettimeofday(&c->end, NULL);
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+static int
+vhd_coalesce_block_compare(const void *a, const void *b)
+{
+	const struct vhd_coalesce_block *x = a, *y = b;
+
+	if (x->off < y->off)
+		return -1;
+	return x->off > y->off;
+}
+
+static void
+vhd_coalesce_free(vhd_coalesce_t *c)
+{
+	if (c->parent.file)
+		vhd_close(&c->parent);
+	else if (c->pfd != -1)
+		close(c->pfd);
+
+	if (c->child.file)
+		vhd_close(&c->child);
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->blocks);
+	free(c->tids);
+	free(c->pname);
+	free(c);
+}
+
+static int
+vhd_coalesce_open(vhd_coalesce_t *c, const char *name)
+{
+	int err;
+	off_t eod;
+	uint32_t i;
+	vhd_context_t *vhd, *parent;
+
+	vhd    = &c->child;
+	parent = &c->parent;
+
+	err = vhd_open(vhd, name, VHD_OPEN_RDONLY);
 	if (err) {
-		printf("error opening %s: %d\n", name, err);
+		vhd->file = NULL;
 		return err;
 	}
 
-	err = vhd_parent_locator_get(&vhd, &pname);
+	err = vhd_parent_locator_get(vhd, &c->pname);
 	if (err) {
-		printf("error finding %s parent: %d\n", name, err);
-		vhd_close(&vhd);
+		c->pname = NULL;
 		return err;
 	}
 
-	if (vhd_parent_raw(&vhd)) {
-		parent_fd = open(pname, O_RDWR | O_DIRECT | O_LARGEFILE, 0644);
-		if (parent_fd == -1) {
-			err = -errno;
-			printf("failed to open parent %s: %d\n", pname, err);
-			vhd_close(&vhd);
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_get_batmap(vhd);
+		if (err)
 			return err;
-		}
+	}
+
+	if (vhd_parent_raw(vhd)) {
+		c->pfd = open(c->pname, O_RDWR | O_DIRECT | O_LARGEFILE, 0644);
+		if (c->pfd == -1)
+			return -errno;
+		c->psecs = (uint64_t)-1;
 	} else {
-		err = vhd_open(&parent, pname, VHD_OPEN_RDWR);
+		err = vhd_open(parent, c->pname, VHD_OPEN_RDWR);
 		if (err) {
-			printf("error opening %s: %d\n", pname, err);
-			free(pname);
-			vhd_close(&vhd);
+			parent->file = NULL;
+			return err;
+		}
+
+		c->pfd      = parent->fd;
+		c->psecs    = parent->footer.curr_size >> VHD_SECTOR_SHIFT;
+		c->pdynamic = vhd_type_dynamic(parent);
+		c->pdiff    = parent->footer.type == HD_TYPE_DIFF;
+	}
+
+	if (c->pdynamic) {
+		err = vhd_get_bat(parent);
+		if (err)
 			return err;
+
+		if (vhd_has_batmap(parent)) {
+			err = vhd_get_batmap(parent);
+			if (err)
+				return err;
 		}
+
+		if (parent->spb != vhd->spb)
+			return -EINVAL;
+
+		err = vhd_end_of_data(parent, &eod);
+		if (err)
+			return err;
+
+		c->eod = eod >> VHD_SECTOR_SHIFT;
 	}
 
-	err = vhd_get_bat(&vhd);
+	c->blocks = calloc(vhd->bat.entries ? : 1, sizeof(*c->blocks));
+	if (!c->blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < vhd->bat.entries; i++) {
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		c->blocks[c->nblocks].off = vhd->bat.bat[i];
+		c->blocks[c->nblocks].blk = i;
+		c->nblocks++;
+	}
+
+	qsort(c->blocks, c->nblocks, sizeof(*c->blocks),
+	      vhd_coalesce_block_compare);
+
+	c->stats.blocks = c->nblocks;
+	return 0;
+}
+
+int
+vhd_coalesce_start(const char *name, int threads, vhd_coalesce_t **cp)
+{
+	int i, err;
+	vhd_coalesce_t *c;
+
+	*cp = NULL;
+
+	if (threads <= 0)
+		threads = COALESCE_DEFAULT_THREADS;
+	if (threads > COALESCE_MAX_THREADS)
+		threads = COALESCE_MAX_THREADS;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->pfd = -1;
+	pthread_mutex_init(&c->lock, NULL);
+
+	err = vhd_coalesce_open(c, name);
 	if (err)
-		goto done;
+		goto fail;
 
-	if (vhd_has_batmap(&vhd)) {
-		err = vhd_get_batmap(&vhd);
+	c->tids = calloc(threads, sizeof(pthread_t));
+	if (!c->tids) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	gettimeofday(&c->start, NULL);
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_lock(&c->lock);
+		c->running++;
+		pthread_mutex_unlock(&c->lock);
+
+		err = pthread_create(&c->tids[i], NULL,
+				     vhd_coalesce_worker, c);
+		if (err) {
+			pthread_mutex_lock(&c->lock);
+			c->running--;
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+
+		c->nthreads++;
+	}
+
+	if (!c->nthreads) {
+		err = -err;
+		goto fail;
+	}
+
+	*cp = c;
+	return 0;
+
+fail:
+	vhd_coalesce_free(c);
+	return err;
+}
+
+void
+vhd_coalesce_poll(vhd_coalesce_t *c, vhd_coalesce_stats_t *stats)
+{
+	struct timeval now;
+
+	pthread_mutex_lock(&c->lock);
+
+	*stats = c->stats;
+	stats->finished = !c->running;
+
+	if (c->running)
+		gettimeofday(&now, NULL);
+	else
+		now = c->end;
+
+	pthread_mutex_unlock(&c->lock);
+
+	stats->usecs = (now.tv_sec - c->start.tv_sec) * 1000000ULL +
+		now.tv_usec - c->start.tv_usec;
+}
+
+/*
+ * Parent data is on disk before the BAT that points at it, and the
+ * footer goes last since its position follows from the BAT.
+ */
+static int
+vhd_coalesce_commit(vhd_coalesce_t *c)
+{
+	int err;
+	vhd_context_t *parent = &c->parent;
+
+	if (!c->pdynamic || !(c->bat_dirty || c->batmap_dirty))
+		return fsync(c->pfd) ? -errno : 0;
+
+	if (fsync(c->pfd))
+		return -errno;
+
+	if (c->bat_dirty) {
+		err = vhd_write_bat(parent, &parent->bat);
 		if (err)
-			goto done;
+			return err;
 	}
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
+	if (c->batmap_dirty) {
+		err = vhd_write_batmap(parent, &parent->batmap);
 		if (err)
-			goto done;
+			return err;
 	}
 
-	err = 0;
+	if (c->bat_dirty)
+		return vhd_write_footer(parent, &parent->footer);
 
- done:
-	free(pname);
-	vhd_close(&vhd);
-	if (parent.file)
-		vhd_close(&parent);
-	else
-		close(parent_fd);
+	return 0;
+}
+
+int
+vhd_coalesce_finish(vhd_coalesce_t *c, vhd_coalesce_stats_t *stats)
+{
+	int i, err;
+
+	for (i = 0; i < c->nthreads; i++)
+		pthread_join(c->tids[i], NULL);
+
+	err = vhd_coalesce_commit(c);
+	if (!err)
+		err = c->err;
+	else if (c->err)
+		err = c->err;
+
+	if (!err && c->cancel)
+		err = -EINTR;
+
+	if (stats)
+		vhd_coalesce_poll(c, stats);
+
+	vhd_coalesce_free(c);
 	return err;
+}
+
+int
+vhd_coalesce_cancel(vhd_coalesce_t *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->cancel = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	return vhd_coalesce_finish(c, NULL);
+}
+
+static void
+vhd_util_coalesce_progress(vhd_coalesce_stats_t *stats)
+{
+	double secs, mb;
+
+	secs = stats->usecs / 1000000.0;
+	mb   = stats->bytes_written / (1024.0 * 1024.0);
+
+	printf("%"PRIu64"/%"PRIu64" blocks, %"PRIu64" MB written, "
+	       "%"PRIu64" MB skipped, %.1f MB/s\n",
+	       stats->blocks_done, stats->blocks,
+	       stats->bytes_written >> 20, stats->bytes_skipped >> 20,
+	       secs > 0 ? mb / secs : 0.0);
+	fflush(stdout);
+}
+
+int
+vhd_util_coalesce(int argc, char **argv)
+{
+	int err, c, threads, progress;
+	char *name;
+	vhd_coalesce_t *co;
+	vhd_coalesce_stats_t stats;
+
+	name     = NULL;
+	threads  = COALESCE_DEFAULT_THREADS;
+	progress = 0;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:j:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads <= 0)
+				goto usage;
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc)
+		goto usage;
+
+	err = vhd_coalesce_start(name, threads, &co);
+	if (err) {
+		printf("error coalescing %s: %d\n", name, err);
+		return err;
+	}
+
+	if (progress)
+		for (;;) {
+			vhd_coalesce_poll(co, &stats);
+			if (stats.finished)
+				break;
+			vhd_util_coalesce_progress(&stats);
+			sleep(1);
+		}
+
+	err = vhd_coalesce_finish(co, &stats);
+	if (err) {
+		printf("error coalescing %s: %d\n", name, err);
+		return err;
+	}
+
+	if (progress)
+		vhd_util_coalesce_progress(&stats);
+
+	return 0;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-j threads] [-p progress] [-h help]\n");
 	return -EINVAL;
 }
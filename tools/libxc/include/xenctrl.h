@@ -875,6 +875,74 @@ int xc_shadow_control(xc_interface *xch,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+/**
+ * Report which gfns of an HVM domain have been accessed since their
+ * hardware accessed bit was last cleared.  Requires EPT A/D bits to be
+ * enabled in Xen ("ept=ad").
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to query
+ * @parm start_gfn the first gfn to examine
+ * @parm nr_gfns the number of gfns to examine
+ * @parm bitmap (nr_gfns + 7) / 8 bytes, bit i set if start_gfn + i was
+ *       accessed
+ * @parm clear whether to clear the accessed bits which are reported
+ * @parm nr_accessed if not NULL, returns the number of accessed gfns
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_harvest_accessed(xc_interface *xch,
+                               uint32_t domid,
+                               uint64_t start_gfn,
+                               uint64_t nr_gfns,
+                               uint8_t *bitmap,
+                               int clear,
+                               uint64_t *nr_accessed);
+
+/**
+ * Count the pages of an HVM domain's memory on each NUMA node.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to query
+ * @parm start_gfn the first gfn to examine
+ * @parm nr_gfns the number of gfns to examine
+ * @parm nr_nodes the number of entries in pages
+ * @parm pages returns the number of pages found on each node
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_count_node_pages(xc_interface *xch,
+                               uint32_t domid,
+                               uint64_t start_gfn,
+                               uint64_t nr_gfns,
+                               unsigned int nr_nodes,
+                               uint64_t *pages);
+
+/**
+ * Move the memory of an HVM domain in a range of gfns to a NUMA node.
+ * The guest is paused for short periods while this is in progress.
+ * Pages in use by anyone other than the guest are not moved.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain whose memory to move
+ * @parm node the node to move the memory to
+ * @parm start_gfn the first gfn to examine
+ * @parm nr_gfns IN: the number of gfns to examine.  OUT: the number of
+ *       gfns examined, which is less if max_pages or a failure stopped the
+ *       operation early
+ * @parm max_pages stop once (roughly) this many pages have been moved,
+ *       0 for no limit
+ * @parm nr_moved if not NULL, returns the number of pages moved, also
+ *       on failure
+ * @return 0 on success, -1 on failure (errno ENOMEM if node ran out of
+ *         memory)
+ */
+int xc_domain_migrate_node_pages(xc_interface *xch,
+                                 uint32_t domid,
+                                 unsigned int node,
+                                 uint64_t start_gfn,
+                                 uint64_t *nr_gfns,
+                                 uint64_t max_pages,
+                                 uint64_t *nr_moved);
+
 int xc_sedf_domain_set(xc_interface *xch,
                        uint32_t domid,
                        uint64_t period, uint64_t slice,
@@ -1468,6 +1536,30 @@ int xc_lockprof_query(xc_interface *xch,
                       uint64_t *time,
                       xc_hypercall_buffer_t *data);
 
+/*
+ * Always-on lock contention statistics, one element per lock acquisition
+ * site.  xc_lockstat_query() fills in up to *n_elems elements of @data and
+ * returns the number of sites Xen knows about in *n_elems; @time,
+ * @sample_rate and @overflow may be NULL.
+ */
+typedef xen_sysctl_lockstat_data_t xc_lockstat_data_t;
+int xc_lockstat_reset(xc_interface *xch);
+int xc_lockstat_query(xc_interface *xch,
+                      uint32_t *n_elems,
+                      uint64_t *time,
+                      uint32_t *sample_rate,
+                      uint64_t *overflow,
+                      xc_hypercall_buffer_t *data);
+
+/**
+ * Issue a XENOPROF_* operation (see xen/xenoprof.h) on behalf of the
+ * calling domain.  @arg, of @size bytes, is copied to and back from Xen;
+ * it may be NULL for operations which take no argument.
+ *
+ * @return the (non-negative) result of the operation, or -1 on failure
+ */
+int xc_xenoprof_op(xc_interface *xch, int op, void *arg, size_t size);
+
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size);
 
 /**
@@ -1506,6 +1598,72 @@ void *xc_map_foreign_batch(xc_interface *xch, uint32_t dom, int prot,
 void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
                           const xen_pfn_t *arr, int *err, unsigned int num);
 
+/*
+ * Cache of foreign mappings.
+ *
+ * Callers which map the same frames of a domain over and over (the
+ * receiving end of a migration, device models, introspection) can keep
+ * them mapped instead of paying for mmap(), the privcmd ioctl and the
+ * TLB flush of munmap() every time.  Frames are mapped in aligned
+ * windows of consecutive frames, and the least recently used windows
+ * are unmapped when there are too many of them.
+ *
+ * As the frames are looked up by number, this suits auto-translated
+ * guests, whose frame numbers are stable GFNs.  Whoever changes the
+ * physmap of the domain (populating, ballooning, paging) must tell the
+ * cache about it with xc_map_cache_invalidate(): cached mappings would
+ * otherwise keep pointing at the old pages.  Frames which failed to map
+ * are retried when next looked up, so failures are not cached.  Note
+ * that mapping a window maps all its frames, paging in those which are
+ * paged out.
+ *
+ * A cache is not thread safe.
+ */
+typedef struct xc_map_cache xc_map_cache;
+
+typedef struct xc_map_cache_stats {
+    uint64_t hits;          /* frames found mapped */
+    uint64_t misses;        /* frames for which a window had to be mapped */
+    uint64_t maps;          /* windows mapped */
+    uint64_t evictions;     /* windows unmapped to make room for others */
+    uint64_t invalidations; /* windows unmapped by xc_map_cache_invalidate() */
+} xc_map_cache_stats_t;
+
+/**
+ * Create a cache of mappings of frames of domain @dom with protection
+ * @prot.  Windows are @window_frames frames (a power of two), and up to
+ * @max_windows are kept mapped.  0 selects the defaults of 64 frames and
+ * 256 windows.  Returns NULL on failure.
+ */
+xc_map_cache *xc_map_cache_create(xc_interface *xch, uint32_t dom, int prot,
+                                  unsigned int window_frames,
+                                  unsigned int max_windows);
+
+/* Unmap everything and free the cache. */
+void xc_map_cache_destroy(xc_map_cache *mc);
+
+/**
+ * Look up @num frames, like xc_map_foreign_bulk(): the mapping of
+ * @gfns[i] is returned in @pages[i], or NULL with the error in @err[i].
+ * The mappings remain valid until the next call to xc_map_cache_release(),
+ * even if they are invalidated in the meantime.  Returns 0, or -1 with
+ * errno set if the frames could not be looked up at all.
+ */
+int xc_map_cache_pages(xc_map_cache *mc, const xen_pfn_t *gfns,
+                       void **pages, int *err, unsigned int num);
+
+/* Let go of the mappings returned since the previous release. */
+void xc_map_cache_release(xc_map_cache *mc);
+
+/* Forget the mappings of frames @gfn to @gfn + @nr - 1. */
+void xc_map_cache_invalidate(xc_map_cache *mc, xen_pfn_t gfn,
+                             unsigned long nr);
+
+/* Forget all the mappings. */
+void xc_map_cache_flush(xc_map_cache *mc);
+
+void xc_map_cache_get_stats(xc_map_cache *mc, xc_map_cache_stats_t *stats);
+
 /**
  * Translates a virtual address in the context of a given domain and
  * vcpu returning the GFN containing the address (that is, an MFN for 
@@ -2373,6 +2531,15 @@ int xc_mem_access_disable_emulate(xc_interface *xch, domid_t domain_id);
  * Caller has to unmap this page when done.
  */
 void *xc_monitor_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+/*
+ * Same with a ring of nr_frames pages (up to XEN_VM_EVENT_MAX_FRAMES) rather
+ * than one, for guests with more vcpus than the 8 requests a page holds.
+ * The pages after the first are taken from the guest's memory, which needs
+ * room for nr_frames - 1 pages below its maximum.
+ * Caller has to unmap the nr_frames * XC_PAGE_SIZE bytes when done.
+ */
+void *xc_monitor_enable_frames(xc_interface *xch, domid_t domain_id,
+                               unsigned int nr_frames, uint32_t *port);
 int xc_monitor_disable(xc_interface *xch, domid_t domain_id);
 int xc_monitor_resume(xc_interface *xch, domid_t domain_id);
 int xc_monitor_mov_to_cr0(xc_interface *xch, domid_t domain_id, bool enable,
@@ -2541,6 +2708,23 @@ int xc_memshr_add_to_physmap(xc_interface *xch,
                     domid_t client_domain,
                     unsigned long client_gfn);
 
+/* Turns domid, a freshly created HVM domain with the same number of vCPUs
+ * as parent_domid and no memory, into a fork of parent_domid: it gets the
+ * parent's vCPU, HVM and TSC state, and its memory is filled in lazily from
+ * the parent's, shared copy-on-write.  The parent must be paused, and is
+ * kept paused by Xen until the fork is destroyed.  Sharing is enabled on
+ * both domains.
+ *
+ * May fail with:
+ *  EBUSY if the parent is not paused.
+ *  EEXIST if domid already has memory or is already a fork.
+ *  EINVAL if either domain is not HVM with HAP, or the vCPUs don't match.
+ *  EXDEV if either domain has an IOMMU set up.
+ */
+int xc_memshr_fork(xc_interface *xch,
+                   domid_t parent_domid,
+                   domid_t domid);
+
 /* Debug calls: return the number of pages referencing the shared frame backing
  * the input argument. Should be one or greater. 
  *
@@ -633,6 +633,141 @@ int xc_shadow_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_domain_harvest_accessed(xc_interface *xch,
+                               uint32_t domid,
+                               uint64_t start_gfn,
+                               uint64_t nr_gfns,
+                               uint8_t *bitmap,
+                               int clear,
+                               uint64_t *nr_accessed)
+{
+    int rc = 0;
+    uint64_t processed = 0, accessed = 0;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(bitmap, (nr_gfns + 7) / 8,
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, bitmap) )
+    {
+        PERROR("Could not bounce buffer for harvest_accessed hypercall");
+        return -1;
+    }
+
+    while ( processed < nr_gfns )
+    {
+        memset(&domctl.u.harvest_accessed, 0,
+               sizeof(domctl.u.harvest_accessed));
+        domctl.cmd = XEN_DOMCTL_harvest_accessed;
+        domctl.domain = (domid_t)domid;
+        domctl.u.harvest_accessed.start_gfn = start_gfn + processed;
+        domctl.u.harvest_accessed.nr_gfns = nr_gfns - processed;
+        domctl.u.harvest_accessed.flags =
+            clear ? XEN_DOMCTL_HARVEST_ACCESSED_CLEAR : 0;
+        /* Xen only stops early on a byte boundary of the bitmap. */
+        set_xen_guest_handle_offset(domctl.u.harvest_accessed.bitmap, bitmap,
+                                    processed / 8);
+
+        if ( (rc = do_domctl(xch, &domctl)) != 0 )
+            break;
+
+        processed += domctl.u.harvest_accessed.nr_gfns;
+        accessed += domctl.u.harvest_accessed.nr_accessed;
+    }
+
+    xc_hypercall_bounce_post(xch, bitmap);
+
+    if ( nr_accessed )
+        *nr_accessed = accessed;
+
+    return rc;
+}
+
+int xc_domain_count_node_pages(xc_interface *xch,
+                               uint32_t domid,
+                               uint64_t start_gfn,
+                               uint64_t nr_gfns,
+                               unsigned int nr_nodes,
+                               uint64_t *pages)
+{
+    int rc = 0;
+    unsigned int i;
+    uint64_t processed = 0;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BUFFER(uint64_t, buf);
+
+    buf = xc_hypercall_buffer_alloc(xch, buf, nr_nodes * sizeof(*buf));
+    if ( !buf )
+    {
+        PERROR("Could not allocate buffer for node_pages hypercall");
+        return -1;
+    }
+
+    memset(pages, 0, nr_nodes * sizeof(*pages));
+
+    while ( processed < nr_gfns )
+    {
+        memset(&domctl.u.node_pages, 0, sizeof(domctl.u.node_pages));
+        domctl.cmd = XEN_DOMCTL_node_pages;
+        domctl.domain = (domid_t)domid;
+        domctl.u.node_pages.op = XEN_DOMCTL_NODE_PAGES_COUNT;
+        domctl.u.node_pages.start_gfn = start_gfn + processed;
+        domctl.u.node_pages.nr_gfns = nr_gfns - processed;
+        domctl.u.node_pages.nr_nodes = nr_nodes;
+        set_xen_guest_handle(domctl.u.node_pages.pages, buf);
+
+        if ( (rc = do_domctl(xch, &domctl)) != 0 )
+            break;
+
+        /* Each call reports on just the part of the range it covered. */
+        for ( i = 0; i < nr_nodes; i++ )
+            pages[i] += buf[i];
+        processed += domctl.u.node_pages.nr_gfns;
+    }
+
+    xc_hypercall_buffer_free(xch, buf);
+
+    return rc;
+}
+
+int xc_domain_migrate_node_pages(xc_interface *xch,
+                                 uint32_t domid,
+                                 unsigned int node,
+                                 uint64_t start_gfn,
+                                 uint64_t *nr_gfns,
+                                 uint64_t max_pages,
+                                 uint64_t *nr_moved)
+{
+    int rc = 0;
+    uint64_t processed = 0, moved = 0;
+    DECLARE_DOMCTL;
+
+    while ( processed < *nr_gfns && (!max_pages || moved < max_pages) )
+    {
+        memset(&domctl.u.node_pages, 0, sizeof(domctl.u.node_pages));
+        domctl.cmd = XEN_DOMCTL_node_pages;
+        domctl.domain = (domid_t)domid;
+        domctl.u.node_pages.op = XEN_DOMCTL_NODE_PAGES_MIGRATE;
+        domctl.u.node_pages.node = node;
+        domctl.u.node_pages.start_gfn = start_gfn + processed;
+        domctl.u.node_pages.nr_gfns = *nr_gfns - processed;
+
+        rc = do_domctl(xch, &domctl);
+
+        /* Progress is reported even when the node has run out of memory. */
+        processed += domctl.u.node_pages.nr_gfns;
+        moved += domctl.u.node_pages.nr_moved;
+
+        if ( rc )
+            break;
+    }
+
+    *nr_gfns = processed;
+    if ( nr_moved )
+        *nr_moved = moved;
+
+    return rc;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         unsigned int max_memkb)
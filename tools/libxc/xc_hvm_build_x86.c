@@ -20,6 +20,9 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
 #include <zlib.h>
 
 #include "xg_private.h"
@@ -54,6 +57,11 @@
 
 #define VGA_HOLE_SIZE (0x20)
 
+/* Binding populate threads to a node's CPUs needs the GNU affinity API. */
+#if defined(__linux__) && defined(CPU_SET)
+#define POPULATE_NODE_AFFINITY
+#endif
+
 static int modules_init(struct xc_hvm_build_args *args,
                         uint64_t vend, struct elf_binary *elf,
                         uint64_t *mstart_out, uint64_t *mend_out)
@@ -244,16 +252,307 @@ static int check_mmio_hole(uint64_t start, uint64_t memsize,
         return 1;
 }
 
+static uint64_t build_usecs(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return ((uint64_t)now.tv_sec * 1000000) + now.tv_usec;
+}
+
+/*
+ * Guest RAM is populated one vNUMA node at a time.  With more than one
+ * node each is handed to its own thread, so that Xen scrubs and clears
+ * the nodes' memory concurrently rather than on a single CPU.  Xen does
+ * that work on whichever pCPU issued the hypercall, so each thread is
+ * also bound, where the toolstack domain's vCPU affinities allow it, to
+ * the vCPUs that are confined to the physical node being populated.
+ */
+struct populate_node {
+    xc_interface *xch;
+    uint32_t dom;
+    struct xc_hvm_build_args *args;
+    xen_pfn_t *page_array;
+    uint64_t mmio_start, mmio_size;
+    unsigned int vnode;
+    unsigned int memflags;
+#ifdef POPULATE_NODE_AFFINITY
+    cpu_set_t cpus;
+    int nr_cpus;
+#endif
+    pthread_t thread;
+    int threaded;
+
+    /* Results. */
+    int rc;
+    uint64_t usecs;
+    unsigned long stat_normal_pages, stat_2mb_pages, stat_1gb_pages;
+};
+
+static int populate_vmemrange(struct populate_node *pn, unsigned int vmemid)
+{
+    xc_interface *xch = pn->xch;
+    struct xc_hvm_build_args *args = pn->args;
+    xen_pfn_t *page_array = pn->page_array;
+    unsigned long i, cur_pages, cur_pfn;
+    uint64_t end_pages;
+    int rc = 0;
+
+    end_pages = args->vmemranges[vmemid].end >> PAGE_SHIFT;
+    /*
+     * Consider vga hole belongs to the vmemrange that covers
+     * 0xA0000-0xC0000. Note that 0x00000-0xA0000 is populated
+     * before any vmemrange.
+     */
+    if ( args->vmemranges[vmemid].start == 0 )
+    {
+        cur_pages = 0xc0;
+        pn->stat_normal_pages += 0xc0;
+    }
+    else
+        cur_pages = args->vmemranges[vmemid].start >> PAGE_SHIFT;
+
+    while ( (rc == 0) && (end_pages > cur_pages) )
+    {
+        /* Clip count to maximum 1GB extent. */
+        unsigned long count = end_pages - cur_pages;
+        unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
+
+        if ( count > max_pages )
+            count = max_pages;
+
+        cur_pfn = page_array[cur_pages];
+
+        /* Take care the corner cases of super page tails */
+        if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
+             (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
+            count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
+        else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
+                  (count > SUPERPAGE_1GB_NR_PFNS) )
+            count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
+
+        /* Attemp to allocate 1GB super page. Because in each pass
+         * we only allocate at most 1GB, we don't have to clip
+         * super page boundaries.
+         */
+        if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
+             /* Check if there exists MMIO hole in the 1GB memory
+              * range */
+             !check_mmio_hole(cur_pfn << PAGE_SHIFT,
+                              SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
+                              pn->mmio_start, pn->mmio_size) )
+        {
+            long done;
+            unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
+            xen_pfn_t sp_extents[nr_extents];
+
+            for ( i = 0; i < nr_extents; i++ )
+                sp_extents[i] =
+                    page_array[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
+
+            done = xc_domain_populate_physmap(xch, pn->dom, nr_extents,
+                                              SUPERPAGE_1GB_SHIFT,
+                                              pn->memflags, sp_extents);
+
+            if ( done > 0 )
+            {
+                pn->stat_1gb_pages += done;
+                done <<= SUPERPAGE_1GB_SHIFT;
+                cur_pages += done;
+                count -= done;
+            }
+        }
+
+        if ( count != 0 )
+        {
+            /* Clip count to maximum 8MB extent. */
+            max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
+            if ( count > max_pages )
+                count = max_pages;
+
+            /* Clip partial superpage extents to superpage
+             * boundaries. */
+            if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
+                 (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
+                count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
+            else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
+                      (count > SUPERPAGE_2MB_NR_PFNS) )
+                count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
+
+            /* Attempt to allocate superpage extents. */
+            if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
+            {
+                long done;
+                unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
+                xen_pfn_t sp_extents[nr_extents];
+
+                for ( i = 0; i < nr_extents; i++ )
+                    sp_extents[i] =
+                        page_array[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
+
+                done = xc_domain_populate_physmap(xch, pn->dom, nr_extents,
+                                                  SUPERPAGE_2MB_SHIFT,
+                                                  pn->memflags, sp_extents);
+
+                if ( done > 0 )
+                {
+                    pn->stat_2mb_pages += done;
+                    done <<= SUPERPAGE_2MB_SHIFT;
+                    cur_pages += done;
+                    count -= done;
+                }
+            }
+        }
+
+        /* Fall back to 4kB extents. */
+        if ( count != 0 )
+        {
+            rc = xc_domain_populate_physmap_exact(
+                xch, pn->dom, count, 0, pn->memflags, &page_array[cur_pages]);
+            cur_pages += count;
+            pn->stat_normal_pages += count;
+        }
+    }
+
+    return rc;
+}
+
+static void *populate_node_fn(void *arg)
+{
+    struct populate_node *pn = arg;
+    uint64_t start = build_usecs();
+    unsigned int vmemid;
+
+#ifdef POPULATE_NODE_AFFINITY
+    if ( pn->threaded && pn->nr_cpus &&
+         pthread_setaffinity_np(pthread_self(), sizeof(pn->cpus), &pn->cpus) )
+    {
+        xc_interface *xch = pn->xch;
+
+        DPRINTF("vnode %u: could not bind populate thread to its node\n",
+                pn->vnode);
+    }
+#endif
+
+    pn->rc = 0;
+    for ( vmemid = 0; vmemid < pn->args->nr_vmemranges; vmemid++ )
+    {
+        if ( pn->args->vmemranges[vmemid].nid != pn->vnode )
+            continue;
+        pn->rc = populate_vmemrange(pn, vmemid);
+        if ( pn->rc != 0 )
+            break;
+    }
+
+    pn->usecs = build_usecs() - start;
+    return NULL;
+}
+
+#ifdef POPULATE_NODE_AFFINITY
+/* Is @map non-empty and made up only of pCPUs on @pnode? */
+static int cpumap_on_node(xc_cpumap_t map, int nr_cpus,
+                          const xc_cputopo_t *cputopo, unsigned int pnode)
+{
+    int cpu, found = 0;
+
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        if ( !xc_cpumap_testcpu(cpu, map) )
+            continue;
+        if ( cputopo[cpu].node != pnode )
+            return 0;
+        found = 1;
+    }
+
+    return found;
+}
+
+/*
+ * Bind each node's populate thread to the toolstack domain's vCPUs that
+ * can only run on that node's pCPUs (e.g. with dom0_vcpus_pin, or soft
+ * affinity set by the admin).  A PV or PVH dom0 numbers its CPUs after
+ * its vCPUs, which is what lets a pthread affinity express this.  Nodes
+ * with no such vCPU are left unbound: their memory is still allocated on
+ * the right node, only the clearing may happen remotely.
+ */
+static void populate_node_cpus(xc_interface *xch,
+                               struct populate_node *nodes,
+                               unsigned int nr_nodes)
+{
+    xc_dominfo_t info;
+    xc_cputopo_t *cputopo = NULL;
+    xc_cpumap_t hard = NULL, soft = NULL;
+    unsigned int n, nr_topo;
+    int overlap, cpu, max_cpus, vcpu;
+
+    max_cpus = xc_get_max_cpus(xch);
+    if ( max_cpus <= 0 )
+        return;
+
+    nr_topo = max_cpus;
+    cputopo = calloc(nr_topo, sizeof(*cputopo));
+    hard = xc_cpumap_alloc(xch);
+    soft = xc_cpumap_alloc(xch);
+    if ( !cputopo || !hard || !soft )
+        goto out;
+
+    if ( xc_cputopoinfo(xch, &nr_topo, cputopo) != 0 )
+        goto out;
+    if ( nr_topo < max_cpus )
+        max_cpus = nr_topo;
+
+    if ( xc_domain_getinfo(xch, 0, 1, &info) != 1 || info.domid != 0 )
+        goto out;
+
+    for ( vcpu = 0; vcpu <= info.max_vcpu_id && vcpu < CPU_SETSIZE; vcpu++ )
+    {
+        if ( xc_vcpu_getaffinity(xch, 0, vcpu, hard, soft,
+                                 XEN_VCPUAFFINITY_HARD |
+                                 XEN_VCPUAFFINITY_SOFT) != 0 )
+            continue;
+
+        /* The effective affinity is hard & soft, if they overlap. */
+        for ( cpu = 0, overlap = 0; cpu < max_cpus; cpu++ )
+        {
+            if ( !xc_cpumap_testcpu(cpu, hard) )
+                xc_cpumap_clearcpu(cpu, soft);
+            else if ( xc_cpumap_testcpu(cpu, soft) )
+                overlap = 1;
+        }
+
+        for ( n = 0; n < nr_nodes; n++ )
+        {
+            unsigned int pnode =
+                nodes[n].args->vnode_to_pnode[nodes[n].vnode];
+
+            if ( pnode == XC_NUMA_NO_NODE )
+                continue;
+            if ( cpumap_on_node(hard, max_cpus, cputopo, pnode) ||
+                 (overlap && cpumap_on_node(soft, max_cpus, cputopo, pnode)) )
+            {
+                CPU_SET(vcpu, &nodes[n].cpus);
+                nodes[n].nr_cpus++;
+            }
+        }
+    }
+
+ out:
+    free(soft);
+    free(hard);
+    free(cputopo);
+}
+#endif
+
 static int setup_guest(xc_interface *xch,
                        uint32_t dom, struct xc_hvm_build_args *args,
                        char *image, unsigned long image_size)
 {
     xen_pfn_t *page_array = NULL;
-    unsigned long i, vmemid, nr_pages = args->mem_size >> PAGE_SHIFT;
+    unsigned long i, nr_pages = args->mem_size >> PAGE_SHIFT;
     unsigned long target_pages = args->mem_target >> PAGE_SHIFT;
     uint64_t mmio_start = (1ull << 32) - args->mmio_size;
     uint64_t mmio_size = args->mmio_size;
-    unsigned long entry_eip, cur_pages, cur_pfn;
+    unsigned long entry_eip;
     void *hvm_info_page;
     uint32_t *ident_pt;
     struct elf_binary elf;
@@ -270,6 +569,11 @@ static int setup_guest(xc_interface *xch,
     uint64_t total_pages;
     xen_vmemrange_t dummy_vmemrange;
     unsigned int dummy_vnode_to_pnode;
+    struct populate_node *nodes = NULL;
+    int threaded;
+    uint64_t t_start, t_parse, t_claim, t_populate, t_load, t_end;
+
+    t_start = build_usecs();
 
     memset(&elf, 0, sizeof(elf));
     if ( elf_init(&elf, image, image_size) != 0 )
@@ -309,8 +613,16 @@ static int setup_guest(xc_interface *xch,
 
     total_pages = 0;
     for ( i = 0; i < args->nr_vmemranges; i++ )
+    {
+        if ( args->vmemranges[i].nid >= args->nr_vnodes )
+        {
+            ERROR("vmemrange %lu refers to invalid vnode %u", i,
+                  args->vmemranges[i].nid);
+            goto error_out;
+        }
         total_pages += ((args->vmemranges[i].end - args->vmemranges[i].start)
                         >> PAGE_SHIFT);
+    }
     if ( total_pages != (args->mem_size >> PAGE_SHIFT) )
     {
         PERROR("vNUMA memory pages mismatch (0x%"PRIx64" != 0x%"PRIx64")",
@@ -347,6 +659,8 @@ static int setup_guest(xc_interface *xch,
     for ( i = mmio_start >> PAGE_SHIFT; i < nr_pages; i++ )
         page_array[i] += mmio_size >> PAGE_SHIFT;
 
+    t_parse = build_usecs();
+
     /*
      * Try to claim pages for early warning of insufficient memory available.
      * This should go before xc_domain_set_pod_target, becuase that function
@@ -380,6 +694,8 @@ static int setup_guest(xc_interface *xch,
         }
     }
 
+    t_claim = build_usecs();
+
     /*
      * Allocate memory for HVM guest, skipping VGA hole 0xA0000-0xC0000.
      *
@@ -389,139 +705,63 @@ static int setup_guest(xc_interface *xch,
      * 
      * Under 2MB mode, we allocate pages in batches of no more than 8MB to 
      * ensure that we can be preempted and hence dom0 remains responsive.
+     *
+     * Each vnode is populated from its own thread when there are several,
+     * see struct populate_node.
      */
-    rc = xc_domain_populate_physmap_exact(
-        xch, dom, 0xa0, 0, memflags, &page_array[0x00]);
-
-    stat_normal_pages = 0;
-    for ( vmemid = 0; vmemid < args->nr_vmemranges; vmemid++ )
+    if ( (nodes = calloc(args->nr_vnodes, sizeof(*nodes))) == NULL )
     {
-        unsigned int new_memflags = memflags;
-        uint64_t end_pages;
-        unsigned int vnode = args->vmemranges[vmemid].nid;
-        unsigned int pnode = args->vnode_to_pnode[vnode];
+        PERROR("Could not allocate memory.");
+        goto error_out;
+    }
 
+    for ( i = 0; i < args->nr_vnodes; i++ )
+    {
+        unsigned int pnode = args->vnode_to_pnode[i];
+
+        nodes[i].xch = xch;
+        nodes[i].dom = dom;
+        nodes[i].args = args;
+        nodes[i].page_array = page_array;
+        nodes[i].mmio_start = mmio_start;
+        nodes[i].mmio_size = mmio_size;
+        nodes[i].vnode = i;
+        nodes[i].memflags = memflags;
         if ( pnode != XC_NUMA_NO_NODE )
-            new_memflags |= XENMEMF_exact_node(pnode);
-
-        end_pages = args->vmemranges[vmemid].end >> PAGE_SHIFT;
-        /*
-         * Consider vga hole belongs to the vmemrange that covers
-         * 0xA0000-0xC0000. Note that 0x00000-0xA0000 is populated just
-         * before this loop.
-         */
-        if ( args->vmemranges[vmemid].start == 0 )
-        {
-            cur_pages = 0xc0;
-            stat_normal_pages += 0xc0;
-        }
-        else
-            cur_pages = args->vmemranges[vmemid].start >> PAGE_SHIFT;
-
-        while ( (rc == 0) && (end_pages > cur_pages) )
-        {
-            /* Clip count to maximum 1GB extent. */
-            unsigned long count = end_pages - cur_pages;
-            unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
-
-            if ( count > max_pages )
-                count = max_pages;
-
-            cur_pfn = page_array[cur_pages];
-
-            /* Take care the corner cases of super page tails */
-            if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                 (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
-                count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
-            else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                      (count > SUPERPAGE_1GB_NR_PFNS) )
-                count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
-
-            /* Attemp to allocate 1GB super page. Because in each pass
-             * we only allocate at most 1GB, we don't have to clip
-             * super page boundaries.
-             */
-            if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
-                 /* Check if there exists MMIO hole in the 1GB memory
-                  * range */
-                 !check_mmio_hole(cur_pfn << PAGE_SHIFT,
-                                  SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
-                                  mmio_start, mmio_size) )
-            {
-                long done;
-                unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
-                xen_pfn_t sp_extents[nr_extents];
-
-                for ( i = 0; i < nr_extents; i++ )
-                    sp_extents[i] =
-                        page_array[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
+            nodes[i].memflags |= XENMEMF_exact_node(pnode);
+    }
 
-                done = xc_domain_populate_physmap(xch, dom, nr_extents,
-                                                  SUPERPAGE_1GB_SHIFT,
-                                                  memflags, sp_extents);
+    threaded = args->nr_vnodes > 1 &&
+               !(xch->flags & XC_OPENFLAG_NON_REENTRANT);
+#ifdef POPULATE_NODE_AFFINITY
+    if ( threaded )
+        populate_node_cpus(xch, nodes, args->nr_vnodes);
+#endif
 
-                if ( done > 0 )
-                {
-                    stat_1gb_pages += done;
-                    done <<= SUPERPAGE_1GB_SHIFT;
-                    cur_pages += done;
-                    count -= done;
-                }
-            }
-
-            if ( count != 0 )
-            {
-                /* Clip count to maximum 8MB extent. */
-                max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
-                if ( count > max_pages )
-                    count = max_pages;
-
-                /* Clip partial superpage extents to superpage
-                 * boundaries. */
-                if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                     (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
-                    count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
-                else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                          (count > SUPERPAGE_2MB_NR_PFNS) )
-                    count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
-
-                /* Attempt to allocate superpage extents. */
-                if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
-                {
-                    long done;
-                    unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
-                    xen_pfn_t sp_extents[nr_extents];
-
-                    for ( i = 0; i < nr_extents; i++ )
-                        sp_extents[i] =
-                            page_array[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
-
-                    done = xc_domain_populate_physmap(xch, dom, nr_extents,
-                                                      SUPERPAGE_2MB_SHIFT,
-                                                      memflags, sp_extents);
-
-                    if ( done > 0 )
-                    {
-                        stat_2mb_pages += done;
-                        done <<= SUPERPAGE_2MB_SHIFT;
-                        cur_pages += done;
-                        count -= done;
-                    }
-                }
-            }
+    rc = xc_domain_populate_physmap_exact(
+        xch, dom, 0xa0, 0, memflags, &page_array[0x00]);
 
-            /* Fall back to 4kB extents. */
-            if ( count != 0 )
-            {
-                rc = xc_domain_populate_physmap_exact(
-                    xch, dom, count, 0, new_memflags, &page_array[cur_pages]);
-                cur_pages += count;
-                stat_normal_pages += count;
-            }
-        }
+    for ( i = 0; (rc == 0) && (i < args->nr_vnodes); i++ )
+    {
+        nodes[i].threaded = threaded;
+        if ( threaded &&
+             pthread_create(&nodes[i].thread, NULL,
+                            populate_node_fn, &nodes[i]) == 0 )
+            continue;
+        nodes[i].threaded = 0;
+        populate_node_fn(&nodes[i]);
+    }
 
-        if ( rc != 0 )
-            break;
+    stat_normal_pages = 0;
+    for ( i = 0; i < args->nr_vnodes; i++ )
+    {
+        if ( nodes[i].threaded )
+            pthread_join(nodes[i].thread, NULL);
+        if ( rc == 0 )
+            rc = nodes[i].rc;
+        stat_normal_pages += nodes[i].stat_normal_pages;
+        stat_2mb_pages += nodes[i].stat_2mb_pages;
+        stat_1gb_pages += nodes[i].stat_1gb_pages;
     }
 
     if ( rc != 0 )
@@ -530,10 +770,21 @@ static int setup_guest(xc_interface *xch,
         goto error_out;
     }
 
+    t_populate = build_usecs();
+
     DPRINTF("PHYSICAL MEMORY ALLOCATION:\n");
     DPRINTF("  4KB PAGES: 0x%016lx\n", stat_normal_pages);
     DPRINTF("  2MB PAGES: 0x%016lx\n", stat_2mb_pages);
     DPRINTF("  1GB PAGES: 0x%016lx\n", stat_1gb_pages);
+    for ( i = 0; args->nr_vnodes > 1 && i < args->nr_vnodes; i++ )
+        DPRINTF("  vnode %lu: 4KB 0x%lx 2MB 0x%lx 1GB 0x%lx in %"PRIu64"us"
+                "%s\n", i, nodes[i].stat_normal_pages,
+                nodes[i].stat_2mb_pages, nodes[i].stat_1gb_pages,
+                nodes[i].usecs,
+#ifdef POPULATE_NODE_AFFINITY
+                nodes[i].nr_cpus ? " (node-local)" :
+#endif
+                "");
     
     if ( loadelfimage(xch, &elf, dom, page_array) != 0 )
         goto error_out;
@@ -541,6 +792,8 @@ static int setup_guest(xc_interface *xch,
     if ( loadmodules(xch, args, m_start, m_end, dom, page_array) != 0 )
         goto error_out;    
 
+    t_load = build_usecs();
+
     if ( (hvm_info_page = xc_map_foreign_range(
               xch, dom, PAGE_SIZE, PROT_READ | PROT_WRITE,
               HVM_INFO_PFN)) == NULL )
@@ -630,6 +883,14 @@ static int setup_guest(xc_interface *xch,
         munmap(page0, PAGE_SIZE);
     }
 
+    t_end = build_usecs();
+    DPRINTF("DOMAIN BUILD TIMINGS:\n");
+    DPRINTF("  Parse:    %"PRIu64"us\n", t_parse - t_start);
+    DPRINTF("  Claim:    %"PRIu64"us\n", t_claim - t_parse);
+    DPRINTF("  Populate: %"PRIu64"us\n", t_populate - t_claim);
+    DPRINTF("  Load:     %"PRIu64"us\n", t_load - t_populate);
+    DPRINTF("  Special:  %"PRIu64"us\n", t_end - t_load);
+    DPRINTF("  TOTAL:    %"PRIu64"us\n", t_end - t_start);
     rc = 0;
     goto out;
  error_out:
@@ -641,6 +902,7 @@ static int setup_guest(xc_interface *xch,
     /* ensure no unclaimed pages are left unused */
     xc_domain_claim_pages(xch, dom, 0 /* cancels the claim */);
 
+    free(nodes);
     free(page_array);
     return rc;
 }
@@ -0,0 +1,384 @@
+/******************************************************************************
+ * xc_map_cache.c
+ *
+ * Cache of mappings of foreign domain's memory.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "xc_private.h"
+
+#define DEFAULT_WINDOW_FRAMES 64
+#define DEFAULT_MAX_WINDOWS   256
+#define MAX_WINDOW_FRAMES     1024
+
+struct xc_map_cache_window {
+    xen_pfn_t base;
+    void *addr;
+    int *err;
+
+    /* Hash chain of the live windows. */
+    struct xc_map_cache_window *hnext;
+    /* LRU list of the live windows, most recently used first. */
+    struct xc_map_cache_window *prev, *next;
+    /* Windows whose mappings were returned since the last release. */
+    struct xc_map_cache_window *pin_next;
+    bool pinned;
+    /* Invalidated while pinned: unmapped at the next release. */
+    bool stale;
+
+    /* Release generation the window was mapped in. */
+    unsigned int gen;
+};
+
+struct xc_map_cache {
+    xc_interface *xch;
+    uint32_t dom;
+    int prot;
+
+    unsigned int shift;       /* log2 of the frames per window */
+    unsigned int max_windows;
+    unsigned int nr_windows;  /* live windows */
+
+    struct xc_map_cache_window **hash;
+    unsigned int hash_mask;
+    struct xc_map_cache_window lru;   /* list head */
+    struct xc_map_cache_window *pinned;
+    unsigned int gen;
+
+    xen_pfn_t *gfns;          /* scratch for mapping a window */
+
+    xc_map_cache_stats_t stats;
+};
+
+static unsigned int window_frames(const xc_map_cache *mc)
+{
+    return 1U << mc->shift;
+}
+
+static struct xc_map_cache_window **hash_slot(xc_map_cache *mc,
+                                              xen_pfn_t base)
+{
+    return &mc->hash[(base >> mc->shift) & mc->hash_mask];
+}
+
+static struct xc_map_cache_window *lookup(xc_map_cache *mc, xen_pfn_t base)
+{
+    struct xc_map_cache_window *w;
+
+    for ( w = *hash_slot(mc, base); w; w = w->hnext )
+        if ( w->base == base )
+            return w;
+
+    return NULL;
+}
+
+static void lru_del(struct xc_map_cache_window *w)
+{
+    w->prev->next = w->next;
+    w->next->prev = w->prev;
+}
+
+static void lru_add(xc_map_cache *mc, struct xc_map_cache_window *w)
+{
+    w->prev = &mc->lru;
+    w->next = mc->lru.next;
+    mc->lru.next->prev = w;
+    mc->lru.next = w;
+}
+
+static void unmap_window(xc_map_cache *mc, struct xc_map_cache_window *w)
+{
+    munmap(w->addr, window_frames(mc) * PAGE_SIZE);
+    free(w->err);
+    free(w);
+}
+
+/* Take a window out of the cache, unmapping it unless it is pinned. */
+static void drop_window(xc_map_cache *mc, struct xc_map_cache_window *w)
+{
+    struct xc_map_cache_window **pw = hash_slot(mc, w->base);
+
+    while ( *pw != w )
+        pw = &(*pw)->hnext;
+    *pw = w->hnext;
+
+    lru_del(w);
+    mc->nr_windows--;
+
+    if ( w->pinned )
+        w->stale = true;
+    else
+        unmap_window(mc, w);
+}
+
+/* Evict the least recently used window which is not pinned, if any. */
+static bool evict_one(xc_map_cache *mc)
+{
+    struct xc_map_cache_window *w;
+
+    for ( w = mc->lru.prev; w != &mc->lru; w = w->prev )
+    {
+        if ( w->pinned )
+            continue;
+        drop_window(mc, w);
+        mc->stats.evictions++;
+        return true;
+    }
+
+    return false;
+}
+
+static struct xc_map_cache_window *map_window(xc_map_cache *mc,
+                                              xen_pfn_t base)
+{
+    xc_interface *xch = mc->xch;
+    struct xc_map_cache_window *w;
+    unsigned int i, nr = window_frames(mc);
+
+    /* With every window pinned, go over the limit until the release. */
+    if ( mc->nr_windows >= mc->max_windows )
+        evict_one(mc);
+
+    w = calloc(1, sizeof(*w));
+    if ( !w )
+        return NULL;
+    w->err = malloc(nr * sizeof(*w->err));
+    if ( !w->err )
+        goto err;
+
+    for ( i = 0; i < nr; i++ )
+        mc->gfns[i] = base + i;
+
+    w->addr = xc_map_foreign_bulk(xch, mc->dom, mc->prot, mc->gfns,
+                                  w->err, nr);
+    if ( !w->addr )
+    {
+        PERROR("Failed to map frames %#lx-%#lx of domain %u",
+               (unsigned long)base, (unsigned long)(base + nr - 1), mc->dom);
+        goto err;
+    }
+
+    w->base = base;
+    w->gen = mc->gen;
+    w->hnext = *hash_slot(mc, base);
+    *hash_slot(mc, base) = w;
+    lru_add(mc, w);
+    mc->nr_windows++;
+    mc->stats.maps++;
+
+    return w;
+
+ err:
+    free(w->err);
+    free(w);
+    return NULL;
+}
+
+xc_map_cache *xc_map_cache_create(xc_interface *xch, uint32_t dom, int prot,
+                                  unsigned int window_frames,
+                                  unsigned int max_windows)
+{
+    xc_map_cache *mc;
+    unsigned int hash_size;
+
+    if ( !window_frames )
+        window_frames = DEFAULT_WINDOW_FRAMES;
+    if ( !max_windows )
+        max_windows = DEFAULT_MAX_WINDOWS;
+
+    if ( window_frames & (window_frames - 1) ||
+         window_frames > MAX_WINDOW_FRAMES )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mc = calloc(1, sizeof(*mc));
+    if ( !mc )
+        return NULL;
+
+    mc->xch = xch;
+    mc->dom = dom;
+    mc->prot = prot;
+    mc->shift = ffs(window_frames) - 1;
+    mc->max_windows = max_windows;
+    mc->lru.prev = mc->lru.next = &mc->lru;
+
+    for ( hash_size = 1; hash_size < 2 * max_windows; hash_size <<= 1 )
+        ;
+    mc->hash_mask = hash_size - 1;
+    mc->hash = calloc(hash_size, sizeof(*mc->hash));
+    mc->gfns = malloc(window_frames * sizeof(*mc->gfns));
+    if ( !mc->hash || !mc->gfns )
+    {
+        free(mc->gfns);
+        free(mc->hash);
+        free(mc);
+        return NULL;
+    }
+
+    return mc;
+}
+
+void xc_map_cache_destroy(xc_map_cache *mc)
+{
+    if ( !mc )
+        return;
+
+    xc_map_cache_release(mc);
+    xc_map_cache_flush(mc);
+
+    free(mc->gfns);
+    free(mc->hash);
+    free(mc);
+}
+
+int xc_map_cache_pages(xc_map_cache *mc, const xen_pfn_t *gfns,
+                       void **pages, int *err, unsigned int num)
+{
+    struct xc_map_cache_window *w = NULL;
+    xen_pfn_t mask = window_frames(mc) - 1;
+    unsigned int i, off;
+
+    for ( i = 0; i < num; i++ )
+    {
+        xen_pfn_t base = gfns[i] & ~mask;
+
+        off = gfns[i] & mask;
+
+        if ( !w || w->base != base || w->stale )
+        {
+            w = lookup(mc, base);
+            if ( w )
+            {
+                /* Move it to the front, for the LRU order. */
+                lru_del(w);
+                lru_add(mc, w);
+            }
+        }
+
+        /*
+         * Frames which failed to map may have been paged in or populated
+         * since, so a window mapped before this batch gets a second try.
+         */
+        if ( w && w->err[off] && w->gen != mc->gen )
+        {
+            drop_window(mc, w);
+            w = NULL;
+        }
+
+        if ( w )
+            mc->stats.hits++;
+        else
+        {
+            mc->stats.misses++;
+            w = map_window(mc, base);
+            if ( !w )
+                return -1;
+        }
+
+        if ( !w->pinned )
+        {
+            w->pinned = true;
+            w->pin_next = mc->pinned;
+            mc->pinned = w;
+        }
+
+        err[i] = w->err[off];
+        pages[i] = err[i] ? NULL : w->addr + off * PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+void xc_map_cache_release(xc_map_cache *mc)
+{
+    struct xc_map_cache_window *w, *next;
+
+    for ( w = mc->pinned; w; w = next )
+    {
+        next = w->pin_next;
+        w->pinned = false;
+        if ( w->stale )
+            unmap_window(mc, w);
+    }
+    mc->pinned = NULL;
+    mc->gen++;
+
+    while ( mc->nr_windows > mc->max_windows && evict_one(mc) )
+        ;
+}
+
+void xc_map_cache_invalidate(xc_map_cache *mc, xen_pfn_t gfn,
+                             unsigned long nr)
+{
+    struct xc_map_cache_window *w, *prev;
+    xen_pfn_t mask = window_frames(mc) - 1, base, last;
+
+    if ( !nr )
+        return;
+
+    last = gfn + nr - 1;
+    if ( last < gfn )
+        last = ~(xen_pfn_t)0;
+
+    /* Look the windows up, or go through them all if there are fewer. */
+    if ( ((last - gfn) >> mc->shift) < mc->nr_windows )
+    {
+        for ( base = gfn & ~mask; ; base += mask + 1 )
+        {
+            w = lookup(mc, base);
+            if ( w )
+            {
+                drop_window(mc, w);
+                mc->stats.invalidations++;
+            }
+            if ( last - base <= mask )
+                break;
+        }
+        return;
+    }
+
+    for ( w = mc->lru.prev; w != &mc->lru; w = prev )
+    {
+        prev = w->prev;
+        if ( w->base + mask < gfn || w->base > last )
+            continue;
+        drop_window(mc, w);
+        mc->stats.invalidations++;
+    }
+}
+
+void xc_map_cache_flush(xc_map_cache *mc)
+{
+    while ( mc->lru.next != &mc->lru )
+        drop_window(mc, mc->lru.next);
+}
+
+void xc_map_cache_get_stats(xc_map_cache *mc, xc_map_cache_stats_t *stats)
+{
+    *stats = mc->stats;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -442,6 +442,69 @@ int xc_lockprof_query(xc_interface *xch,
     return rc;
 }
 
+int xc_lockstat_reset(xc_interface *xch)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockstat_op;
+    sysctl.u.lockstat_op.cmd = XEN_SYSCTL_LOCKSTAT_reset;
+    set_xen_guest_handle(sysctl.u.lockstat_op.data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_lockstat_query(xc_interface *xch,
+                      uint32_t *n_elems,
+                      uint64_t *time,
+                      uint32_t *sample_rate,
+                      uint64_t *overflow,
+                      struct xc_hypercall_buffer *data)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(data);
+
+    sysctl.cmd = XEN_SYSCTL_lockstat_op;
+    sysctl.u.lockstat_op.cmd = XEN_SYSCTL_LOCKSTAT_query;
+    sysctl.u.lockstat_op.max_elem = *n_elems;
+    set_xen_guest_handle(sysctl.u.lockstat_op.data, data);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    *n_elems = sysctl.u.lockstat_op.nr_elem;
+    if ( time )
+        *time = sysctl.u.lockstat_op.time;
+    if ( sample_rate )
+        *sample_rate = sysctl.u.lockstat_op.sample_rate;
+    if ( overflow )
+        *overflow = sysctl.u.lockstat_op.overflow;
+
+    return rc;
+}
+
+int xc_xenoprof_op(xc_interface *xch, int op, void *arg, size_t size)
+{
+    DECLARE_HYPERCALL;
+    DECLARE_HYPERCALL_BOUNCE(arg, size, XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+    int rc;
+
+    if ( xc_hypercall_bounce_pre(xch, arg) )
+    {
+        PERROR("Could not bounce buffer for xenoprof op %d", op);
+        return -1;
+    }
+
+    hypercall.op     = __HYPERVISOR_xenoprof_op;
+    hypercall.arg[0] = op;
+    hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
+
+    rc = do_xen_hypercall(xch, &hypercall);
+
+    xc_hypercall_bounce_post(xch, arg);
+
+    return rc;
+}
+
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus)
 {
@@ -445,5 +445,12 @@ int xc_vm_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
  */
 void *xc_vm_event_enable(xc_interface *xch, domid_t domain_id, int param,
                          uint32_t *port);
+/*
+ * Same with a ring of nr_frames pages, nr_frames * XC_PAGE_SIZE bytes to
+ * unmap.
+ */
+void *xc_vm_event_enable_frames(xc_interface *xch, domid_t domain_id,
+                                int param, unsigned int nr_frames,
+                                uint32_t *port);
 
 #endif /* __XC_PRIVATE_H__ */
@@ -221,6 +221,13 @@ struct xc_sr_context
             unsigned long *populated_pfns;
             xen_pfn_t max_populated_pfn;
 
+            /*
+             * Mappings of the guest frames kept across PAGE_DATA records,
+             * for HVM guests, whose frames only change by populate_pfns().
+             * NULL if not in use.
+             */
+            xc_map_cache *map_cache;
+
             /* Sender has invoked verify mode on the stream. */
             bool verify;
         } restore;
@@ -240,6 +240,8 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
             if ( rc )
                 goto err;
             ctx->restore.ops.set_gfn(ctx, pfns[i], mfns[i]);
+            if ( ctx->restore.map_cache )
+                xc_map_cache_invalidate(ctx->restore.map_cache, pfns[i], 1);
         }
     }
 
@@ -261,15 +263,20 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
                              xen_pfn_t *pfns, uint32_t *types, void *page_data)
 {
     xc_interface *xch = ctx->xch;
+    xc_map_cache *map_cache = ctx->restore.map_cache;
     xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
     int *map_errs = malloc(count * sizeof(*map_errs));
+    void **guest_pages = NULL;
     int rc;
     void *mapping = NULL, *guest_page = NULL;
     unsigned i,    /* i indexes the pfns from the record. */
         j,         /* j indexes the subset of pfns we decide to map. */
         nr_pages = 0;
 
-    if ( !mfns || !map_errs )
+    if ( map_cache )
+        guest_pages = malloc(count * sizeof(*guest_pages));
+
+    if ( !mfns || !map_errs || (map_cache && !guest_pages) )
     {
         rc = -1;
         ERROR("Failed to allocate %zu bytes to process page data",
@@ -313,15 +320,29 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
     if ( nr_pages == 0 )
         goto done;
 
-    mapping = guest_page = xc_map_foreign_bulk(
-        xch, ctx->domid, PROT_READ | PROT_WRITE,
-        mfns, map_errs, nr_pages);
-    if ( !mapping )
+    if ( map_cache )
     {
-        rc = -1;
-        PERROR("Unable to map %u mfns for %u pages of data",
-               nr_pages, count);
-        goto err;
+        rc = xc_map_cache_pages(map_cache, mfns, guest_pages, map_errs,
+                                nr_pages);
+        if ( rc )
+        {
+            PERROR("Unable to map %u mfns for %u pages of data",
+                   nr_pages, count);
+            goto err;
+        }
+    }
+    else
+    {
+        mapping = guest_page = xc_map_foreign_bulk(
+            xch, ctx->domid, PROT_READ | PROT_WRITE,
+            mfns, map_errs, nr_pages);
+        if ( !mapping )
+        {
+            rc = -1;
+            PERROR("Unable to map %u mfns for %u pages of data",
+                   nr_pages, count);
+            goto err;
+        }
     }
 
     for ( i = 0, j = 0; i < count; ++i )
@@ -343,6 +364,9 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
             goto err;
         }
 
+        if ( map_cache )
+            guest_page = guest_pages[j];
+
         /* Undo page normalisation done by the saver. */
         rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
         if ( rc )
@@ -376,7 +400,10 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
  err:
     if ( mapping )
         munmap(mapping, nr_pages * PAGE_SIZE);
+    if ( map_cache )
+        xc_map_cache_release(map_cache);
 
+    free(guest_pages);
     free(map_errs);
     free(mfns);
 
@@ -513,6 +540,7 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    const char *map_cache = getenv("XG_MIGRATION_MAP_CACHE");
     int rc;
 
     rc = ctx->restore.ops.setup(ctx);
@@ -529,6 +557,20 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    /*
+     * Pages sent more than once (in later iterations of a live migration,
+     * or in every checkpoint of a checkpointed stream) are written
+     * through mappings kept from earlier records.  XG_MIGRATION_MAP_CACHE=0
+     * maps and unmaps every record instead.
+     */
+    if ( ctx->dominfo.hvm && !(map_cache && !strcmp(map_cache, "0")) )
+    {
+        ctx->restore.map_cache = xc_map_cache_create(
+            xch, ctx->domid, PROT_READ | PROT_WRITE, 0, 0);
+        if ( !ctx->restore.map_cache )
+            PERROR("Unable to create mapping cache, mapping every record");
+    }
+
  err:
     return rc;
 }
@@ -537,6 +579,17 @@ static void cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
 
+    if ( ctx->restore.map_cache )
+    {
+        xc_map_cache_stats_t stats;
+
+        xc_map_cache_get_stats(ctx->restore.map_cache, &stats);
+        DPRINTF("Mapping cache: %"PRIu64" hits, %"PRIu64" misses, "
+                "%"PRIu64" windows mapped, %"PRIu64" evicted",
+                stats.hits, stats.misses, stats.maps, stats.evictions);
+        xc_map_cache_destroy(ctx->restore.map_cache);
+    }
+
     free(ctx->restore.populated_pfns);
     if ( ctx->restore.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
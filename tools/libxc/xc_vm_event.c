@@ -23,33 +23,61 @@
 
 #include "xc_private.h"
 
-int xc_vm_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
-                        unsigned int mode, uint32_t *port)
+static int vm_event_control(xc_interface *xch, domid_t domain_id,
+                            unsigned int op, unsigned int mode,
+                            unsigned int nr_frames, xen_pfn_t *gfns,
+                            uint32_t *port)
 {
     DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(gfns, nr_frames * sizeof(*gfns),
+                             XC_HYPERCALL_BUFFER_BOUNCE_IN);
     int rc;
 
+    if ( xc_hypercall_bounce_pre(xch, gfns) )
+    {
+        PERROR("Could not bounce ring frame list");
+        return -1;
+    }
+
     domctl.cmd = XEN_DOMCTL_vm_event_op;
     domctl.domain = domain_id;
     domctl.u.vm_event_op.op = op;
     domctl.u.vm_event_op.mode = mode;
+    domctl.u.vm_event_op.nr_frames = nr_frames;
+    set_xen_guest_handle(domctl.u.vm_event_op.frame_list, gfns);
 
     rc = do_domctl(xch, &domctl);
     if ( !rc && port )
         *port = domctl.u.vm_event_op.port;
+
+    xc_hypercall_bounce_post(xch, gfns);
     return rc;
 }
 
+int xc_vm_event_control(xc_interface *xch, domid_t domain_id, unsigned int op,
+                        unsigned int mode, uint32_t *port)
+{
+    return vm_event_control(xch, domain_id, op, mode, 0, NULL, port);
+}
+
 void *xc_vm_event_enable(xc_interface *xch, domid_t domain_id, int param,
                          uint32_t *port)
+{
+    return xc_vm_event_enable_frames(xch, domain_id, param, 1, port);
+}
+
+void *xc_vm_event_enable_frames(xc_interface *xch, domid_t domain_id,
+                                int param, unsigned int nr_frames,
+                                uint32_t *port)
 {
     void *ring_page = NULL;
     uint64_t pfn;
-    xen_pfn_t ring_pfn, mmap_pfn;
-    unsigned int op, mode;
-    int rc1, rc2, saved_errno;
+    xen_pfn_t ring_pfn, mmap_pfn, max_gpfn, *gfns = NULL;
+    int *errs = NULL;
+    unsigned int op, mode, i;
+    int rc1, rc2, saved_errno, extra_frames = 0;
 
-    if ( !port )
+    if ( !port || !nr_frames || nr_frames > XEN_VM_EVENT_MAX_FRAMES )
     {
         errno = EINVAL;
         return NULL;
@@ -96,6 +124,62 @@ void *xc_vm_event_enable(xc_interface *xch, domid_t domain_id, int param,
         }
     }
 
+    /*
+     * The pages after the first are taken from above the highest gfn of
+     * the guest, and leave its physmap with the first once Xen has them.
+     */
+    if ( nr_frames > 1 )
+    {
+        rc1 = -1;
+        munmap(ring_page, XC_PAGE_SIZE);
+        ring_page = NULL;
+
+        gfns = malloc(nr_frames * sizeof(*gfns));
+        errs = malloc(nr_frames * sizeof(*errs));
+        if ( !gfns || !errs )
+        {
+            PERROR("Could not allocate ring frame list");
+            goto out;
+        }
+
+        if ( xc_domain_maximum_gpfn(xch, domain_id, &max_gpfn) < 0 )
+        {
+            PERROR("Failed to get max gpfn");
+            goto out;
+        }
+
+        gfns[0] = ring_pfn;
+        for ( i = 1; i < nr_frames; i++ )
+            gfns[i] = max_gpfn + i;
+
+        rc1 = xc_domain_populate_physmap_exact(xch, domain_id, nr_frames - 1,
+                                               0, 0, &gfns[1]);
+        if ( rc1 != 0 )
+        {
+            PERROR("Failed to populate %u ring pfns", nr_frames - 1);
+            goto out;
+        }
+        extra_frames = 1;
+
+        rc1 = -1;
+        ring_page = xc_map_foreign_bulk(xch, domain_id, PROT_READ | PROT_WRITE,
+                                        gfns, errs, nr_frames);
+        if ( !ring_page )
+        {
+            PERROR("Could not map the ring pages\n");
+            goto out;
+        }
+        for ( i = 0; i < nr_frames; i++ )
+        {
+            if ( errs[i] )
+            {
+                errno = -errs[i];
+                PERROR("Could not map ring page %u\n", i);
+                goto out;
+            }
+        }
+    }
+
     switch ( param )
     {
     case HVM_PARAM_PAGING_RING_PFN:
@@ -123,21 +207,37 @@ void *xc_vm_event_enable(xc_interface *xch, domid_t domain_id, int param,
         goto out;
     }
 
-    rc1 = xc_vm_event_control(xch, domain_id, op, mode, port);
+    if ( nr_frames > 1 )
+        rc1 = vm_event_control(xch, domain_id, op, mode, nr_frames, gfns,
+                               port);
+    else
+        rc1 = xc_vm_event_control(xch, domain_id, op, mode, port);
     if ( rc1 != 0 )
     {
         PERROR("Failed to enable vm_event\n");
         goto out;
     }
 
-    /* Remove the ring_pfn from the guest's physmap */
-    rc1 = xc_domain_decrease_reservation_exact(xch, domain_id, 1, 0, &ring_pfn);
+    /* Remove the ring pfns from the guest's physmap */
+    if ( nr_frames > 1 )
+        rc1 = xc_domain_decrease_reservation_exact(xch, domain_id, nr_frames,
+                                                   0, gfns);
+    else
+        rc1 = xc_domain_decrease_reservation_exact(xch, domain_id, 1, 0,
+                                                   &ring_pfn);
+    extra_frames = 0;
     if ( rc1 != 0 )
         PERROR("Failed to remove ring page from guest physmap");
 
  out:
     saved_errno = errno;
 
+    /* Give the guest its gfns back */
+    if ( extra_frames &&
+         xc_domain_decrease_reservation_exact(xch, domain_id, nr_frames - 1,
+                                              0, &gfns[1]) )
+        PERROR("Failed to remove ring pages from guest physmap");
+
     rc2 = xc_domain_unpause(xch, domain_id);
     if ( rc1 != 0 || rc2 != 0 )
     {
@@ -149,11 +249,13 @@ void *xc_vm_event_enable(xc_interface *xch, domid_t domain_id, int param,
         }
 
         if ( ring_page )
-            munmap(ring_page, XC_PAGE_SIZE);
+            munmap(ring_page, nr_frames * XC_PAGE_SIZE);
         ring_page = NULL;
-
-        errno = saved_errno;
     }
 
+    free(errs);
+    free(gfns);
+    errno = saved_errno;
+
     return ring_page;
 }
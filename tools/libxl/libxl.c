@@ -63,7 +63,9 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     LIBXL_LIST_INIT(&ctx->pollers_idle);
 
     LIBXL_LIST_INIT(&ctx->efds);
-    LIBXL_TAILQ_INIT(&ctx->etimes);
+    ctx->etimes = 0;
+    ctx->netimes = ctx->etimes_size = 0;
+    ctx->etimes_seq = 0;
 
     ctx->watch_slots = 0;
     LIBXL_SLIST_INIT(&ctx->watch_freeslots);
@@ -172,7 +174,7 @@ int libxl_ctx_free(libxl_ctx *ctx)
     /* Now there should be no more events requested from the application: */
 
     assert(LIBXL_LIST_EMPTY(&ctx->efds));
-    assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
+    assert(!ctx->netimes);
     assert(LIBXL_LIST_EMPTY(&ctx->evtchns_waiting));
 
     if (ctx->xch) xc_interface_close(ctx->xch);
@@ -188,6 +190,7 @@ int libxl_ctx_free(libxl_ctx *ctx)
         free(poller);
     }
 
+    free(ctx->etimes);
     free(ctx->watch_slots);
 
     discard_events(&ctx->occurred);
@@ -996,6 +999,114 @@ int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid)
     return 0;
 }
 
+int libxl_domain_fork_vm(libxl_ctx *ctx, uint32_t pdomid, uint32_t *domid_out)
+{
+    GC_INIT(ctx);
+    xc_dominfo_t info;
+    xen_domain_handle_t handle;
+    libxl_uuid uuid;
+    struct xs_permissions noperm[1];
+    xs_transaction_t t = XBT_NULL;
+    unsigned long shadow_mb = 0;
+    uint32_t domid = -1;
+    const char *pname, *dom_path;
+    int ret, rc;
+
+    ret = xc_domain_getinfo(ctx->xch, pdomid, 1, &info);
+    if (ret != 1 || info.domid != pdomid) {
+        LOGE(ERROR, "getting info for domain %u", pdomid);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+    if (!info.hvm) {
+        LOG(ERROR, "domain %u is not HVM, cannot fork it", pdomid);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    /* Xen requires the parent to be paused, and keeps it paused. */
+    if (!info.paused && xc_domain_pause(ctx->xch, pdomid)) {
+        LOGE(ERROR, "pausing domain %u", pdomid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    libxl_uuid_generate(&uuid);
+    libxl_uuid_copy(ctx, (libxl_uuid *)handle, &uuid);
+
+    ret = xc_domain_create(ctx->xch, info.ssidref, handle,
+                           XEN_DOMCTL_CDF_hvm_guest | XEN_DOMCTL_CDF_hap,
+                           &domid);
+    if (ret < 0) {
+        LOGE(ERROR, "creating fork of domain %u", pdomid);
+        domid = -1;
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_cpupool_movedomain(ctx->xch, info.cpupool, domid) ||
+        xc_domain_max_vcpus(ctx->xch, domid, info.max_vcpu_id + 1) ||
+        xc_domain_setmaxmem(ctx->xch, domid, info.max_memkb) ||
+        xc_shadow_control(ctx->xch, pdomid,
+                          XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL) ||
+        xc_shadow_control(ctx->xch, domid,
+                          XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL)) {
+        LOGE(ERROR, "setting up fork %u of domain %u", domid, pdomid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_memshr_fork(ctx->xch, pdomid, domid)) {
+        LOGE(ERROR, "forking domain %u into %u", pdomid, domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* Just enough xenstore for the fork to be listed and destroyed. */
+    pname = libxl__domid_to_name(gc, pdomid);
+    dom_path = libxl__xs_get_dompath(gc, domid);
+    if (!dom_path) {
+        rc = ERROR_FAIL;
+        goto out;
+    }
+    noperm[0].id = 0;
+    noperm[0].perms = XS_PERM_NONE;
+
+    for (;;) {
+        rc = libxl__xs_transaction_start(gc, &t);
+        if (rc) goto out;
+
+        if (!libxl__xs_mkdir(gc, t, dom_path, noperm, ARRAY_SIZE(noperm))) {
+            LOGE(ERROR, "creating %s", dom_path);
+            rc = ERROR_FAIL;
+            goto out;
+        }
+        rc = libxl__xs_write_checked(gc, t, GCSPRINTF("%s/name", dom_path),
+                                     GCSPRINTF("%s-fork%u",
+                                               pname ?: "domain", domid));
+        if (rc) goto out;
+        rc = libxl__xs_write_checked(gc, t, GCSPRINTF("%s/domid", dom_path),
+                                     GCSPRINTF("%u", domid));
+        if (rc) goto out;
+
+        rc = libxl__xs_transaction_commit(gc, &t);
+        if (!rc) break;
+        if (rc < 0) goto out;
+    }
+
+    *domid_out = domid;
+    rc = 0;
+
+ out:
+    libxl__xs_transaction_abort(gc, &t);
+    if (rc && libxl_domid_valid_guest(domid))
+        xc_domain_destroy(ctx->xch, domid);
+    GC_FREE;
+    return rc;
+}
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
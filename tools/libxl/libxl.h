@@ -768,6 +768,13 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, libxl_mac *src);
  */
 #define LIBXL_HAVE_PCITOPOLOGY 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_FORK_VM
+ *
+ * If this is defined, libxl_domain_fork_vm is available.
+ */
+#define LIBXL_HAVE_DOMAIN_FORK_VM 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1072,6 +1079,16 @@ int libxl_domain_rename(libxl_ctx *ctx, uint32_t domid,
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid);
 int libxl_domain_unpause(libxl_ctx *ctx, uint32_t domid);
 
+/*
+ * Creates a fork of HVM domain pdomid: a new, paused domain with the
+ * parent's vCPU and device-model-independent platform state, whose memory
+ * is shared copy-on-write with the parent and filled in on first access.
+ * The parent is paused if it isn't already, and stays paused until all its
+ * forks have been destroyed.  The fork has no devices or device model;
+ * unpause it to run it.
+ */
+int libxl_domain_fork_vm(libxl_ctx *ctx, uint32_t pdomid, uint32_t *domid_out);
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
@@ -521,6 +521,7 @@ int libxl__domain_make(libxl__gc *gc, libxl_domain_config *d_config,
     struct xs_permissions rwperm[1];
     struct xs_permissions noperm[1];
     xs_transaction_t t = 0;
+    struct xs_pipeline *p;
     xen_domain_handle_t handle;
     libxl_vminfo *vm_list;
 
@@ -610,62 +611,70 @@ int libxl__domain_make(libxl__gc *gc, libxl_domain_config *d_config,
 retry_transaction:
     t = xs_transaction_start(ctx->xsh);
 
-    xs_rm(ctx->xsh, t, dom_path);
-    libxl__xs_mkdir(gc, t, dom_path, roperm, ARRAY_SIZE(roperm));
+    p = xs_pipeline_start(ctx->xsh, t);
+    if (!p) {
+        LOGE(ERROR, "cannot create xenstore directories of the domain");
+        rc = ERROR_FAIL;
+        goto out;
+    }
 
-    xs_rm(ctx->xsh, t, vm_path);
-    libxl__xs_mkdir(gc, t, vm_path, roperm, ARRAY_SIZE(roperm));
+    xs_pipeline_rm(p, dom_path);
+    libxl__xs_pipeline_mkdir(p, dom_path, roperm, ARRAY_SIZE(roperm));
 
-    xs_rm(ctx->xsh, t, libxl_path);
-    libxl__xs_mkdir(gc, t, libxl_path, noperm, ARRAY_SIZE(noperm));
+    xs_pipeline_rm(p, vm_path);
+    libxl__xs_pipeline_mkdir(p, vm_path, roperm, ARRAY_SIZE(roperm));
 
-    xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/vm", dom_path), vm_path, strlen(vm_path));
-    rc = libxl__domain_rename(gc, *domid, 0, info->name, t);
-    if (rc)
-        goto out;
+    xs_pipeline_rm(p, libxl_path);
+    libxl__xs_pipeline_mkdir(p, libxl_path, noperm, ARRAY_SIZE(noperm));
 
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/cpu", dom_path),
-                    roperm, ARRAY_SIZE(roperm));
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/memory", dom_path),
-                    roperm, ARRAY_SIZE(roperm));
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/device", dom_path),
-                    roperm, ARRAY_SIZE(roperm));
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/control", dom_path),
-                    roperm, ARRAY_SIZE(roperm));
+    xs_pipeline_write(p, GCSPRINTF("%s/vm", dom_path), vm_path, strlen(vm_path));
+
+    libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/cpu", dom_path),
+                             roperm, ARRAY_SIZE(roperm));
+    libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/memory", dom_path),
+                             roperm, ARRAY_SIZE(roperm));
+    libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/device", dom_path),
+                             roperm, ARRAY_SIZE(roperm));
+    libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/control", dom_path),
+                             roperm, ARRAY_SIZE(roperm));
     if (info->type == LIBXL_DOMAIN_TYPE_HVM)
-        libxl__xs_mkdir(gc, t,
-                        libxl__sprintf(gc, "%s/hvmloader", dom_path),
-                        roperm, ARRAY_SIZE(roperm));
-
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/control/shutdown", dom_path),
-                    rwperm, ARRAY_SIZE(rwperm));
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/device/suspend/event-channel", dom_path),
-                    rwperm, ARRAY_SIZE(rwperm));
-    libxl__xs_mkdir(gc, t,
-                    libxl__sprintf(gc, "%s/data", dom_path),
-                    rwperm, ARRAY_SIZE(rwperm));
+        libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/hvmloader", dom_path),
+                                 roperm, ARRAY_SIZE(roperm));
+
+    libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/control/shutdown", dom_path),
+                             rwperm, ARRAY_SIZE(rwperm));
+    libxl__xs_pipeline_mkdir(p,
+                             GCSPRINTF("%s/device/suspend/event-channel",
+                                       dom_path),
+                             rwperm, ARRAY_SIZE(rwperm));
+    libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/data", dom_path),
+                             rwperm, ARRAY_SIZE(rwperm));
 
     if (libxl_defbool_val(info->driver_domain)) {
         /*
          * Create a local "libxl" directory for each guest, since we might want
          * to use libxl from inside the guest
          */
-        libxl__xs_mkdir(gc, t, GCSPRINTF("%s/libxl", dom_path), rwperm,
-                        ARRAY_SIZE(rwperm));
+        libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/libxl", dom_path), rwperm,
+                                 ARRAY_SIZE(rwperm));
         /*
          * Create a local "device-model" directory for each guest, since we
          * might want to use Qemu from inside the guest
          */
-        libxl__xs_mkdir(gc, t, GCSPRINTF("%s/device-model", dom_path), rwperm,
-                        ARRAY_SIZE(rwperm));
+        libxl__xs_pipeline_mkdir(p, GCSPRINTF("%s/device-model", dom_path),
+                                 rwperm, ARRAY_SIZE(rwperm));
+    }
+
+    if (!xs_pipeline_end(p, false)) {
+        LOGE(ERROR, "failed to create xenstore directories of the domain");
+        rc = ERROR_FAIL;
+        goto out;
     }
 
+    rc = libxl__domain_rename(gc, *domid, 0, info->name, t);
+    if (rc)
+        goto out;
+
     vm_list = libxl_list_vm(ctx, &nb_vm);
     if (!vm_list) {
         LOG(ERROR, "cannot get number of running guests");
@@ -701,14 +710,29 @@ retry_transaction:
         }
     }
 
-    xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/uuid", vm_path), uuid_string, strlen(uuid_string));
-    xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/name", vm_path), info->name, strlen(info->name));
+    p = xs_pipeline_start(ctx->xsh, t);
+    if (!p) {
+        LOGE(ERROR, "cannot write xenstore entries of the domain");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    xs_pipeline_write(p, GCSPRINTF("%s/uuid", vm_path), uuid_string, strlen(uuid_string));
+    xs_pipeline_write(p, GCSPRINTF("%s/name", vm_path), info->name, strlen(info->name));
+
+    libxl__xs_pipeline_writev(gc, p, dom_path, info->xsdata, NULL, 0);
+    libxl__xs_pipeline_writev(gc, p, GCSPRINTF("%s/platform", dom_path),
+                              info->platformdata, NULL, 0);
+
+    xs_pipeline_write(p, GCSPRINTF("%s/control/platform-feature-multiprocessor-suspend", dom_path), "1", 1);
+    xs_pipeline_write(p, GCSPRINTF("%s/control/platform-feature-xs_reset_watches", dom_path), "1", 1);
 
-    libxl__xs_writev(gc, t, dom_path, info->xsdata);
-    libxl__xs_writev(gc, t, libxl__sprintf(gc, "%s/platform", dom_path), info->platformdata);
+    if (!xs_pipeline_end(p, false)) {
+        LOGE(ERROR, "failed to write xenstore entries of the domain");
+        rc = ERROR_FAIL;
+        goto out;
+    }
 
-    xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/control/platform-feature-multiprocessor-suspend", dom_path), "1", 1);
-    xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/control/platform-feature-xs_reset_watches", dom_path), "1", 1);
     if (!xs_transaction_end(ctx->xsh, t, 0)) {
         if (errno == EAGAIN) {
             t = 0;
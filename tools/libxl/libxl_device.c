@@ -109,6 +109,7 @@ int libxl__device_generic_add(libxl__gc *gc, xs_transaction_t t,
     struct xs_permissions frontend_perms[2];
     struct xs_permissions ro_frontend_perms[2];
     struct xs_permissions backend_perms[2];
+    struct xs_pipeline *p;
     int create_transaction = t == XBT_NULL;
 
     frontend_path = libxl__device_frontend_path(gc, device);
@@ -129,37 +130,51 @@ retry_transaction:
         t = xs_transaction_start(ctx->xsh);
     /* FIXME: read frontend_path and check state before removing stuff */
 
+    /* All the requests of the device are sent without waiting for each
+     * reply in turn. */
+    p = xs_pipeline_start(ctx->xsh, t);
+    if (!p) {
+        LOGE(ERROR, "cannot add device to xenstore");
+        goto fail;
+    }
+
     if (fents || ro_fents) {
-        xs_rm(ctx->xsh, t, frontend_path);
-        xs_mkdir(ctx->xsh, t, frontend_path);
+        xs_pipeline_rm(p, frontend_path);
         /* Console 0 is a special case. It doesn't use the regular PV
          * state machine but also the frontend directory has
          * historically contained other information, such as the
          * vnc-port, which we don't want the guest fiddling with.
          */
         if (device->kind == LIBXL__DEVICE_KIND_CONSOLE && device->devid == 0)
-            xs_set_permissions(ctx->xsh, t, frontend_path,
-                               ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
+            libxl__xs_pipeline_mkdir(p, frontend_path, ro_frontend_perms,
+                                     ARRAY_SIZE(ro_frontend_perms));
         else
-            xs_set_permissions(ctx->xsh, t, frontend_path,
-                               frontend_perms, ARRAY_SIZE(frontend_perms));
-        xs_write(ctx->xsh, t, GCSPRINTF("%s/backend", frontend_path),
-                 backend_path, strlen(backend_path));
+            libxl__xs_pipeline_mkdir(p, frontend_path, frontend_perms,
+                                     ARRAY_SIZE(frontend_perms));
+        xs_pipeline_write(p, GCSPRINTF("%s/backend", frontend_path),
+                          backend_path, strlen(backend_path));
         if (fents)
-            libxl__xs_writev_perms(gc, t, frontend_path, fents,
-                                   frontend_perms, ARRAY_SIZE(frontend_perms));
+            libxl__xs_pipeline_writev(gc, p, frontend_path, fents,
+                                      frontend_perms,
+                                      ARRAY_SIZE(frontend_perms));
         if (ro_fents)
-            libxl__xs_writev_perms(gc, t, frontend_path, ro_fents,
-                                   ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
+            libxl__xs_pipeline_writev(gc, p, frontend_path, ro_fents,
+                                      ro_frontend_perms,
+                                      ARRAY_SIZE(ro_frontend_perms));
     }
 
     if (bents) {
-        xs_rm(ctx->xsh, t, backend_path);
-        xs_mkdir(ctx->xsh, t, backend_path);
-        xs_set_permissions(ctx->xsh, t, backend_path, backend_perms, ARRAY_SIZE(backend_perms));
-        xs_write(ctx->xsh, t, GCSPRINTF("%s/frontend", backend_path),
-                 frontend_path, strlen(frontend_path));
-        libxl__xs_writev(gc, t, backend_path, bents);
+        xs_pipeline_rm(p, backend_path);
+        libxl__xs_pipeline_mkdir(p, backend_path, backend_perms,
+                                 ARRAY_SIZE(backend_perms));
+        xs_pipeline_write(p, GCSPRINTF("%s/frontend", backend_path),
+                          frontend_path, strlen(frontend_path));
+        libxl__xs_pipeline_writev(gc, p, backend_path, bents, NULL, 0);
+    }
+
+    if (!xs_pipeline_end(p, false)) {
+        LOGE(ERROR, "failed to add device to xenstore");
+        goto fail;
     }
 
     if (!create_transaction)
@@ -174,6 +189,11 @@ retry_transaction:
         }
     }
     return 0;
+
+ fail:
+    if (create_transaction)
+        xs_transaction_end(ctx->xsh, t, 1);
+    return ERROR_FAIL;
 }
 
 typedef struct {
@@ -290,11 +290,102 @@ static int time_rel_to_abs(libxl__gc *gc, int ms, struct timeval *abs_out)
     return 0;
 }
 
+/*
+ * The finite timeouts are kept in a binary heap, CTX->etimes[0..netimes>,
+ * ordered by abs and then by order of registration, so that the earliest
+ * is always etimes[0].  Each ev knows its own index in the heap, so
+ * that it can be removed without searching for it.
+ */
+
+static bool time_earlier(const libxl__ev_time *a, const libxl__ev_time *b)
+{
+    if (timercmp(&a->abs, &b->abs, !=))
+        return timercmp(&a->abs, &b->abs, <);
+    return a->seq < b->seq;
+}
+
+static void etimes_set(libxl__gc *gc, int i, libxl__ev_time *ev)
+{
+    CTX->etimes[i] = ev;
+    ev->heapidx = i;
+}
+
+static void etimes_sift_up(libxl__gc *gc, int i)
+{
+    libxl__ev_time *ev = CTX->etimes[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!time_earlier(ev, CTX->etimes[parent]))
+            break;
+        etimes_set(gc, i, CTX->etimes[parent]);
+        i = parent;
+    }
+    etimes_set(gc, i, ev);
+}
+
+static void etimes_sift_down(libxl__gc *gc, int i)
+{
+    libxl__ev_time *ev = CTX->etimes[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= CTX->netimes)
+            break;
+        if (child + 1 < CTX->netimes &&
+            time_earlier(CTX->etimes[child + 1], CTX->etimes[child]))
+            child++;
+        if (!time_earlier(CTX->etimes[child], ev))
+            break;
+        etimes_set(gc, i, CTX->etimes[child]);
+        i = child;
+    }
+    etimes_set(gc, i, ev);
+}
+
+static void etimes_insert(libxl__gc *gc, libxl__ev_time *ev)
+{
+    if (CTX->netimes == CTX->etimes_size) {
+        int newsize = CTX->etimes_size ? CTX->etimes_size * 2 : 16;
+        CTX->etimes = libxl__realloc(NOGC, CTX->etimes,
+                                     sizeof(*CTX->etimes) * newsize);
+        CTX->etimes_size = newsize;
+    }
+
+    ev->seq = CTX->etimes_seq++;
+    etimes_set(gc, CTX->netimes++, ev);
+    etimes_sift_up(gc, ev->heapidx);
+}
+
+static void etimes_remove(libxl__gc *gc, libxl__ev_time *ev)
+{
+    int i = ev->heapidx;
+    libxl__ev_time *last;
+
+    assert(i >= 0 && i < CTX->netimes && CTX->etimes[i] == ev);
+
+    last = CTX->etimes[--CTX->netimes];
+    ev->heapidx = -1;
+    if (last == ev)
+        return;
+
+    /* Put the last one in the hole, and move it up or down from there */
+    etimes_set(gc, i, last);
+    if (i > 0 && time_earlier(last, CTX->etimes[(i - 1) / 2]))
+        etimes_sift_up(gc, i);
+    else
+        etimes_sift_down(gc, i);
+}
+
+static libxl__ev_time *etimes_first(libxl__gc *gc)
+{
+    return CTX->netimes ? CTX->etimes[0] : NULL;
+}
+
 static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
                                 struct timeval absolute)
 {
     int rc;
-    libxl__ev_time *evsearch;
 
     rc = OSEVENT_HOOK(timeout,register, alloc, &ev->nexus->for_app_reg,
                       absolute, ev->nexus);
@@ -302,8 +393,7 @@ static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
 
     ev->infinite = 0;
     ev->abs = absolute;
-    LIBXL_TAILQ_INSERT_SORTED(&CTX->etimes, entry, ev, evsearch, /*empty*/,
-                              timercmp(&ev->abs, &evsearch->abs, >));
+    etimes_insert(gc, ev);
 
     return 0;
 }
@@ -317,7 +407,7 @@ static void time_deregister(libxl__gc *gc, libxl__ev_time *ev)
         OSEVENT_HOOK_VOID(timeout,modify,
                           noop /* release nexus in _occurred_ */,
                           &ev->nexus->for_app_reg, right_away);
-        LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+        etimes_remove(gc, ev);
     }
 }
 
@@ -1042,7 +1132,7 @@ static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
 
     *nfds_io = used;
 
-    libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
+    libxl__ev_time *etime = etimes_first(gc);
     if (etime) {
         int our_timeout;
         struct timeval rel;
@@ -1203,7 +1293,7 @@ static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
     }
 
     for (;;) {
-        libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
+        libxl__ev_time *etime = etimes_first(gc);
         if (!etime)
             break;
 
@@ -1239,7 +1329,7 @@ void libxl_osevent_register_hooks(libxl_ctx *ctx,
     GC_INIT(ctx);
     CTX_LOCK;
     assert(LIBXL_LIST_EMPTY(&ctx->efds));
-    assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
+    assert(!ctx->netimes);
     ctx->osevent_hooks = hooks;
     ctx->osevent_user = user;
     CTX_UNLOCK;
@@ -1279,7 +1369,7 @@ void libxl_osevent_occurred_timeout(libxl_ctx *ctx, void *for_libxl)
     if (!ev) goto out;
     assert(!ev->infinite);
 
-    LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+    etimes_remove(gc, ev);
 
     time_occurs(egc, ev);
 
@@ -201,8 +201,9 @@ struct libxl__ev_time {
     /* read-only for caller, who may read only when registered: */
     libxl__ev_time_callback *func;
     /* remainder is private for libxl__ev_time... */
-    int infinite; /* not registered in list or with app if infinite */
-    LIBXL_TAILQ_ENTRY(libxl__ev_time) entry;
+    int infinite; /* not registered in heap or with app if infinite */
+    int heapidx; /* index in CTX->etimes, while registered */
+    uint64_t seq; /* orders timeouts with the same abs */
     struct timeval abs;
     libxl__osevent_hook_nexus *nexus;
 };
@@ -369,7 +370,9 @@ struct libxl__ctx {
     LIBXL_SLIST_HEAD(libxl__osevent_hook_nexi, libxl__osevent_hook_nexus)
         hook_fd_nexi_idle, hook_timeout_nexi_idle;
     LIBXL_LIST_HEAD(, libxl__ev_fd) efds;
-    LIBXL_TAILQ_HEAD(, libxl__ev_time) etimes;
+    libxl__ev_time **etimes; /* binary heap, earliest at [0] */
+    int netimes, etimes_size;
+    uint64_t etimes_seq;
 
     libxl__ev_watch_slot *watch_slots;
     int watch_nslots, nwatches;
@@ -577,6 +580,12 @@ _hidden int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                                    const char *dir, char *kvs[],
                                    struct xs_permissions *perms,
                                    unsigned int num_perms);
+/* as writev_perms, but only queues the writes on pipeline p, see
+ * xs_pipeline_start() */
+_hidden void libxl__xs_pipeline_writev(libxl__gc *gc, struct xs_pipeline *p,
+                                       const char *dir, char *kvs[],
+                                       struct xs_permissions *perms,
+                                       unsigned int num_perms);
 /* _atonce creates a transaction and writes all keys at once */
 _hidden int libxl__xs_writev_atonce(libxl__gc *gc,
                              const char *dir, char **kvs);
@@ -597,6 +606,10 @@ _hidden char **libxl__xs_directory(libxl__gc *gc, xs_transaction_t t,
 _hidden bool libxl__xs_mkdir(libxl__gc *gc, xs_transaction_t t,
                              const char *path, struct xs_permissions *perms,
 			     unsigned int num_perms);
+/* as libxl__xs_mkdir, but only queues the requests on pipeline p */
+_hidden void libxl__xs_pipeline_mkdir(struct xs_pipeline *p, const char *path,
+                                      struct xs_permissions *perms,
+                                      unsigned int num_perms);
 
 _hidden char *libxl__xs_libxl_path(libxl__gc *gc, uint32_t domid);
 
@@ -3402,6 +3415,35 @@ _hidden int libxl__get_numa_candidate(libxl__gc *gc,
                                       libxl__numa_candidate *cndt_out,
                                       int *cndt_found);
 
+/*
+ * What the placement search needs to know about the host, with one entry
+ * per node in each of the arrays: free memory, number of cpus which can
+ * be used for placement (nodes with none are never part of a candidate),
+ * and number of vcpus already able to run there. distance, if not NULL,
+ * is the nr_nodes x nr_nodes matrix of node distances. cpus_per_node is
+ * the number of cpus each node has, or 0 if they are not all the same.
+ */
+typedef struct {
+    int nr_nodes;
+    uint32_t *free_memkb;
+    int *nr_cpus;
+    int *nr_vcpus;
+    uint32_t *distance;
+    int cpus_per_node;
+} libxl__numa_topology;
+
+/*
+ * The search behind libxl__get_numa_candidate(), on a given topology
+ * instead of the host's.  Arguments and results are as described there.
+ */
+_hidden int libxl__numa_place(libxl__gc *gc,
+                              const libxl__numa_topology *topo,
+                              uint32_t min_free_memkb, int min_cpus,
+                              int min_nodes, int max_nodes,
+                              libxl__numa_candidate_cmpf numa_cmpf,
+                              libxl__numa_candidate *cndt_out,
+                              int *cndt_found);
+
 /* Initialization, allocation and deallocation for placement candidates */
 static inline void libxl__numa_candidate_init(libxl__numa_candidate *cndt)
 {
@@ -104,79 +104,6 @@ static int comb_next(comb_iter_t it, int n, int k)
 
 /* NUMA automatic placement (see libxl_internal.h for details) */
 
-/*
- * This function turns a k-combination iterator into a node map,
- * given another map, telling us which nodes should be considered.
- *
- * This means the bits that are set in suitable_nodemap and that
- * corresponds to the indexes of the given combination are the ones
- * that will be set in nodemap.
- *
- * For example, given a fully set suitable_nodemap, if the iterator
- * represents the combination { 0, 2, 4}, nodmeap will have bits #0,
- * #2 and #4 set.
- * On the other hand, if, say,  suitable_nodemap=01011011, the same
- * iterator will cause bits #1, #4 and #7 of nodemap to be set.
- */
-static void comb_get_nodemap(comb_iter_t it, libxl_bitmap *suitable_nodemap,
-                             libxl_bitmap *nodemap, int k)
-{
-    int i, m = 0, n = 0;
-
-    libxl_bitmap_set_none(nodemap);
-    libxl_for_each_set_bit(i, *suitable_nodemap) {
-        /* Check wether the n-th set bit of suitable_nodemap
-         * matches with the m-th element of the iterator (and,
-         * only if it does, advance to the next one) */
-        if (m < k && n == it[m]) {
-            libxl_bitmap_set(nodemap, i);
-            m++;
-        }
-        n++;
-    }
-}
-
-/* Retrieve the number of cpus that the nodes that are part of the nodemap
- * span and are also set in suitable_cpumap. */
-static int nodemap_to_nr_cpus(libxl_cputopology *tinfo, int nr_cpus,
-                              const libxl_bitmap *suitable_cpumap,
-                              const libxl_bitmap *nodemap)
-{
-    int i, nodes_cpus = 0;
-
-    for (i = 0; i < nr_cpus; i++) {
-        if (libxl_bitmap_test(suitable_cpumap, i) &&
-            libxl_bitmap_test(nodemap, tinfo[i].node))
-            nodes_cpus++;
-    }
-    return nodes_cpus;
-}
-
-/* Retrieve the amount of free memory within the nodemap */
-static uint32_t nodemap_to_free_memkb(libxl_numainfo *ninfo,
-                                      libxl_bitmap *nodemap)
-{
-    uint32_t free_memkb = 0;
-    int i;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        free_memkb += ninfo[i].free / 1024;
-
-    return free_memkb;
-}
-
-/* Retrieve the number of vcpus able to run on the nodes in nodemap */
-static int nodemap_to_nr_vcpus(libxl__gc *gc, int vcpus_on_node[],
-                               const libxl_bitmap *nodemap)
-{
-    int i, nr_vcpus = 0;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        nr_vcpus += vcpus_on_node[i];
-
-    return nr_vcpus;
-}
-
 /* Number of vcpus able to run on the cpus of the various nodes
  * (reported by filling the array vcpus_on_node[]). */
 static int nr_vcpus_on_nodes(libxl__gc *gc, libxl_cputopology *tinfo,
@@ -280,102 +207,356 @@ static int count_cpus_per_node(libxl_cputopology *tinfo, int nr_cpus,
 }
 
 /*
- * Looks for the placement candidates that satisfyies some specific
- * conditions and return the best one according to the provided
- * comparison function.
+ * The placement search proper works on a libxl__numa_topology, so that
+ * it can be fed synthetic hosts as well as the real one.
+ *
+ * For every candidate size, if there are no more than NUMA_EXHAUSTIVE_MAX
+ * combinations of suitable nodes, all of them are evaluated, in the same
+ * order (see comb_init() and comb_next()) and with the same outcome as
+ * this has always been done. That covers every size on hosts with up to
+ * 14 nodes.
+ *
+ * Beyond that, evaluating everything gets too expensive (a 16 nodes host
+ * has 12870 candidates with 8 nodes alone), and a bounded search is used
+ * instead, which relies on the node distances to only look at sets of
+ * nodes which are close to each other:
+ *  1. starting from each suitable node in turn, a candidate is grown by
+ *     repeatedly adding the node closest to the ones already in it;
+ *  2. if none of these satisfies the constraints, a depth first search
+ *     of all the combinations, pruned as soon as the remaining nodes can
+ *     not provide enough memory or cpus, looks for one that does;
+ *  3. the best candidate found is then improved by swapping one of its
+ *     nodes with one outside of it, for as long as that makes it better.
+ * Each step is bounded by NUMA_SEARCH_BUDGET candidates (or search tree
+ * nodes) evaluated. Candidates numa_cmpf() considers equivalent are told
+ * apart by how far from each other their nodes are.
  */
-int libxl__get_numa_candidate(libxl__gc *gc,
-                              uint32_t min_free_memkb, int min_cpus,
-                              int min_nodes, int max_nodes,
-                              const libxl_bitmap *suitable_cpumap,
-                              libxl__numa_candidate_cmpf numa_cmpf,
-                              libxl__numa_candidate *cndt_out,
-                              int *cndt_found)
-{
+#define NUMA_EXHAUSTIVE_MAX     4096
+#define NUMA_SEARCH_BUDGET      4096
+
+/* Remote nodes are assumed to be this far if no distances are known. */
+#define NUMA_LOCAL_DISTANCE     10
+#define NUMA_REMOTE_DISTANCE    20
+
+typedef struct {
+    const libxl__numa_topology *topo;
+    uint32_t min_free_memkb;
+    int min_cpus;
+    libxl__numa_candidate_cmpf numa_cmpf;
+    /* Indexes of the suitable nodes, in increasing order */
+    int *suit;
+    int nr_suit;
+    /* Per suitable node sums of memory and cpus from there onwards */
+    uint64_t *suffix_memkb;
+    int *suffix_cpus;
+    libxl_bitmap nodemap;
     libxl__numa_candidate new_cndt;
-    libxl_cputopology *tinfo = NULL;
-    libxl_numainfo *ninfo = NULL;
-    int nr_nodes = 0, nr_suit_nodes, nr_cpus = 0;
-    libxl_bitmap suitable_nodemap, nodemap;
-    int *vcpus_on_node, rc = 0;
+    libxl__numa_candidate *cndt_out;
+    uint64_t best_distance;
+    int *cndt_found;
+    int budget;
+} numa_search;
 
-    libxl_bitmap_init(&nodemap);
-    libxl_bitmap_init(&suitable_nodemap);
-    libxl__numa_candidate_init(&new_cndt);
+static uint32_t numa_distance(const libxl__numa_topology *topo, int i, int j)
+{
+    if (topo->distance)
+        return topo->distance[i * topo->nr_nodes + j];
+    return i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
 
-    /* Get platform info and prepare the map for testing the combinations */
-    ninfo = libxl_get_numainfo(CTX, &nr_nodes);
-    if (ninfo == NULL)
-        return ERROR_FAIL;
+/* Sum of the distances between all the nodes in a set */
+static uint64_t set_distance(const numa_search *s, const int *set, int k)
+{
+    uint64_t dist = 0;
+    int i, j;
 
-    if (nr_nodes <= 1) {
-        *cndt_found = 0;
-        goto out;
+    for (i = 0; i < k; i++)
+        for (j = i + 1; j < k; j++)
+            dist += numa_distance(s->topo, s->suit[set[i]], s->suit[set[j]]);
+
+    return dist;
+}
+
+static uint64_t binomial(int n, int k)
+{
+    uint64_t c = 1;
+    int i;
+
+    if (k > n - k)
+        k = n - k;
+    for (i = 1; i <= k; i++) {
+        c = c * (n - k + i) / i;
+        if (c > NUMA_EXHAUSTIVE_MAX)
+            break;
     }
+    return c;
+}
 
-    GCNEW_ARRAY(vcpus_on_node, nr_nodes);
+/*
+ * Check a set of k suitable nodes (by their index in s->suit) against the
+ * constraints and, if it passes, against the best candidate found so far.
+ * Returns 1 if it is the new best one.
+ */
+static int numa_evaluate(libxl__gc *gc, numa_search *s, const int *set,
+                         int k, int use_distance)
+{
+    const libxl__numa_topology *topo = s->topo;
+    libxl__numa_candidate *cndt = &s->new_cndt;
+    uint32_t nodes_free_memkb = 0;
+    uint64_t dist = 0;
+    int i, nodes_cpus = 0, nr_vcpus = 0, cmp;
+
+    /* If there is not enough memory, or cpus, in this set, skip it */
+    for (i = 0; i < k; i++)
+        nodes_free_memkb += topo->free_memkb[s->suit[set[i]]];
+    if (s->min_free_memkb && nodes_free_memkb < s->min_free_memkb)
+        return 0;
+
+    for (i = 0; i < k; i++)
+        nodes_cpus += topo->nr_cpus[s->suit[set[i]]];
+    if (s->min_cpus && nodes_cpus < s->min_cpus)
+        return 0;
+
+    for (i = 0; i < k; i++)
+        nr_vcpus += topo->nr_vcpus[s->suit[set[i]]];
+
+    libxl_bitmap_set_none(&s->nodemap);
+    for (i = 0; i < k; i++)
+        libxl_bitmap_set(&s->nodemap, s->suit[set[i]]);
+
+    libxl__numa_candidate_put_nodemap(gc, cndt, &s->nodemap);
+    cndt->nr_vcpus = nr_vcpus;
+    cndt->free_memkb = nodes_free_memkb;
+    cndt->nr_nodes = k;
+    cndt->nr_cpus = nodes_cpus;
 
     /*
-     * The good thing about this solution is that it is based on heuristics
-     * (implemented in numa_cmpf() ), but we at least can evaluate it on
-     * all the possible placement candidates. That can happen because the
-     * number of nodes present in current NUMA systems is quite small.
-     * In fact, even if a sum of binomials is involved, if the system has
-     * up to 16 nodes it "only" takes 65535 steps. This is fine, as the
-     * number of nodes the biggest NUMA systems provide at the time of this
-     * writing is 8 (and it will probably continue to be so for a while).
-     * However, computanional complexity would explode on systems bigger
-     * than that, and it's really important we avoid trying to run this
-     * on monsters with 32, 64 or more nodes (if they ever pop into being).
-     * Therefore, here it comes a safety catch that disables the algorithm
-     * for the cases when it wouldn't work well.
+     * Check if the new candidate is better than what we found up to now by
+     * means of the comparison function. If no comparison function is
+     * provided, the first candidate found is the one.
      */
-    if (nr_nodes > 16) {
-        /* Log we did nothing and return 0, as no real error occurred */
-        LOG(WARN, "System has %d NUMA nodes, which is too big for the "
-                  "placement algorithm to work effectively: skipping it. "
-                  "Consider manually pinning the vCPUs and/or looking at "
-                  "cpupools for manually partitioning the system.",
-                  nr_nodes);
-        *cndt_found = 0;
-        goto out;
+    if (*s->cndt_found) {
+        cmp = s->numa_cmpf ? s->numa_cmpf(cndt, s->cndt_out) : 0;
+        if (cmp > 0)
+            return 0;
+        if (cmp == 0) {
+            if (!use_distance || !s->numa_cmpf)
+                return 0;
+            dist = set_distance(s, set, k);
+            if (dist >= s->best_distance)
+                return 0;
+        }
     }
+    if (use_distance && !dist)
+        dist = set_distance(s, set, k);
 
-    tinfo = libxl_get_cpu_topology(CTX, &nr_cpus);
-    if (tinfo == NULL) {
-        rc = ERROR_FAIL;
-        goto out;
+    *s->cndt_found = 1;
+    s->best_distance = dist;
+
+    LOG(DEBUG, "New best NUMA placement candidate found: "
+               "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
+               "free_memkb=%"PRIu32"", cndt->nr_nodes,
+               cndt->nr_cpus, cndt->nr_vcpus,
+               cndt->free_memkb / 1024);
+
+    libxl__numa_candidate_put_nodemap(gc, s->cndt_out, &s->nodemap);
+    s->cndt_out->nr_vcpus = cndt->nr_vcpus;
+    s->cndt_out->free_memkb = cndt->free_memkb;
+    s->cndt_out->nr_nodes = cndt->nr_nodes;
+    s->cndt_out->nr_cpus = cndt->nr_cpus;
+
+    return 1;
+}
+
+static void numa_exhaustive(libxl__gc *gc, numa_search *s, int k)
+{
+    comb_iter_t comb_iter;
+    int comb_ok;
+
+    /*
+     * Each step of this cycle generates a combination of nodes as big as k
+     * mandates, which is checked against the constraints provided by the
+     * caller and can concur to become our best placement iff it passes.
+     */
+    for (comb_ok = comb_init(gc, &comb_iter, s->nr_suit, k);
+         comb_ok;
+         comb_ok = comb_next(comb_iter, s->nr_suit, k)) {
+        if (numa_evaluate(gc, s, comb_iter, k, 0) && s->numa_cmpf == NULL)
+            break;
+    }
+}
+
+/* Grow a set of k nodes from set[0], always adding the closest node. */
+static void numa_grow(numa_search *s, int *set, int k, uint64_t *dist,
+                      char *in_set)
+{
+    const libxl__numa_topology *topo = s->topo;
+    int i, m, best;
+
+    memset(in_set, 0, s->nr_suit);
+    in_set[set[0]] = 1;
+    for (i = 0; i < s->nr_suit; i++)
+        dist[i] = numa_distance(topo, s->suit[set[0]], s->suit[i]);
+
+    for (m = 1; m < k; m++) {
+        best = -1;
+        for (i = 0; i < s->nr_suit; i++) {
+            if (in_set[i])
+                continue;
+            /* Ties go to the node with more free memory. */
+            if (best < 0 || dist[i] < dist[best] ||
+                (dist[i] == dist[best] &&
+                 topo->free_memkb[s->suit[i]] >
+                 topo->free_memkb[s->suit[best]]))
+                best = i;
+        }
+        set[m] = best;
+        in_set[best] = 1;
+        for (i = 0; i < s->nr_suit; i++)
+            dist[i] += numa_distance(topo, s->suit[best], s->suit[i]);
     }
+}
 
-    rc = libxl_node_bitmap_alloc(CTX, &nodemap, 0);
-    if (rc)
-        goto out;
-    rc = libxl__numa_candidate_alloc(gc, &new_cndt);
-    if (rc)
-        goto out;
+/*
+ * Depth first search for a set of k nodes satisfying the constraints,
+ * skipping the subtrees which can not provide enough memory or cpus.
+ * Returns 1 as soon as one is found.
+ */
+static int numa_dfs(libxl__gc *gc, numa_search *s, int *set, int depth,
+                    int k, int next, uint64_t memkb, int cpus)
+{
+    const libxl__numa_topology *topo = s->topo;
+    int j;
 
-    /* Allocate and prepare the map of the node that can be utilized for
-     * placement, basing on the map of suitable cpus. */
-    rc = libxl_node_bitmap_alloc(CTX, &suitable_nodemap, 0);
+    if (depth == k)
+        return numa_evaluate(gc, s, set, k, 1);
+
+    for (j = next; j <= s->nr_suit - (k - depth); j++) {
+        if (--s->budget < 0)
+            return 0;
+        /* Later nodes only have fewer resources left after them. */
+        if (s->min_free_memkb && memkb + s->suffix_memkb[j] < s->min_free_memkb)
+            return 0;
+        if (s->min_cpus && cpus + s->suffix_cpus[j] < s->min_cpus)
+            return 0;
+
+        set[depth] = j;
+        if (numa_dfs(gc, s, set, depth + 1, k, j + 1,
+                     memkb + topo->free_memkb[s->suit[j]],
+                     cpus + topo->nr_cpus[s->suit[j]]))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void numa_bounded(libxl__gc *gc, numa_search *s, int k)
+{
+    int *set, *best_set;
+    uint64_t *dist;
+    char *in_set;
+    int i, p, j, saved, improved;
+
+    GCNEW_ARRAY(set, k);
+    GCNEW_ARRAY(best_set, k);
+    GCNEW_ARRAY(dist, s->nr_suit);
+    GCNEW_ARRAY(in_set, s->nr_suit);
+
+    /* 1. Grow a candidate around each node */
+    for (i = 0; i < s->nr_suit; i++) {
+        set[0] = i;
+        numa_grow(s, set, k, dist, in_set);
+        if (numa_evaluate(gc, s, set, k, 1)) {
+            memcpy(best_set, set, k * sizeof(*set));
+            if (s->numa_cmpf == NULL)
+                return;
+        }
+    }
+
+    /* 2. Nothing close enough fits, look further */
+    if (!*s->cndt_found) {
+        s->budget = NUMA_SEARCH_BUDGET;
+        if (!numa_dfs(gc, s, set, 0, k, 0, 0, 0))
+            return;
+        memcpy(best_set, set, k * sizeof(*set));
+        if (s->numa_cmpf == NULL)
+            return;
+    }
+
+    /* 3. Improve it one swap at a time */
+    s->budget = NUMA_SEARCH_BUDGET;
+    do {
+        improved = 0;
+        memset(in_set, 0, s->nr_suit);
+        for (p = 0; p < k; p++)
+            in_set[best_set[p]] = 1;
+
+        for (p = 0; p < k && !improved; p++) {
+            memcpy(set, best_set, k * sizeof(*set));
+            saved = set[p];
+            for (j = 0; j < s->nr_suit; j++) {
+                if (in_set[j])
+                    continue;
+                if (--s->budget < 0)
+                    return;
+                set[p] = j;
+                if (numa_evaluate(gc, s, set, k, 1)) {
+                    memcpy(best_set, set, k * sizeof(*set));
+                    improved = 1;
+                    break;
+                }
+            }
+            set[p] = saved;
+        }
+    } while (improved);
+}
+
+int libxl__numa_place(libxl__gc *gc, const libxl__numa_topology *topo,
+                      uint32_t min_free_memkb, int min_cpus,
+                      int min_nodes, int max_nodes,
+                      libxl__numa_candidate_cmpf numa_cmpf,
+                      libxl__numa_candidate *cndt_out,
+                      int *cndt_found)
+{
+    numa_search s;
+    int i, nr_suit_nodes, rc;
+
+    memset(&s, 0, sizeof(s));
+    s.topo = topo;
+    s.min_free_memkb = min_free_memkb;
+    s.min_cpus = min_cpus;
+    s.numa_cmpf = numa_cmpf;
+    s.cndt_out = cndt_out;
+    s.cndt_found = cndt_found;
+    libxl_bitmap_init(&s.nodemap);
+    libxl__numa_candidate_init(&s.new_cndt);
+
+    *cndt_found = 0;
+
+    rc = libxl_node_bitmap_alloc(CTX, &s.nodemap, 0);
     if (rc)
         goto out;
-    rc = libxl_cpumap_to_nodemap(CTX, suitable_cpumap, &suitable_nodemap);
+    rc = libxl__numa_candidate_alloc(gc, &s.new_cndt);
     if (rc)
         goto out;
 
-    /*
-     * Later on, we will try to figure out how many vcpus are runnable on
-     * each candidate (as a part of choosing the best one of them). That
-     * requires going through all the vcpus of all the domains and check
-     * their affinities. So, instead of doing that for each candidate,
-     * let's count here the number of vcpus runnable on each node, so that
-     * all we have to do later is summing up the right elements of the
-     * vcpus_on_node array.
-     */
-    rc = nr_vcpus_on_nodes(gc, tinfo, nr_cpus, suitable_cpumap, vcpus_on_node);
-    if (rc)
+    /* Only nodes with cpus we are allowed to use can be considered */
+    GCNEW_ARRAY(s.suit, topo->nr_nodes);
+    for (i = 0; i < topo->nr_nodes; i++)
+        if (topo->nr_cpus[i])
+            s.suit[s.nr_suit++] = i;
+    nr_suit_nodes = s.nr_suit;
+    if (nr_suit_nodes == 0)
         goto out;
 
+    GCNEW_ARRAY(s.suffix_memkb, nr_suit_nodes + 1);
+    GCNEW_ARRAY(s.suffix_cpus, nr_suit_nodes + 1);
+    for (i = nr_suit_nodes - 1; i >= 0; i--) {
+        s.suffix_memkb[i] = s.suffix_memkb[i + 1] +
+                            topo->free_memkb[s.suit[i]];
+        s.suffix_cpus[i] = s.suffix_cpus[i + 1] + topo->nr_cpus[s.suit[i]];
+    }
+
     /*
      * If the minimum number of NUMA nodes is not explicitly specified
      * (i.e., min_nodes == 0), we try to figure out a sensible number of nodes
@@ -385,18 +566,14 @@ int libxl__get_numa_candidate(libxl__gc *gc,
      * won't work properly.
      */
     if (!min_nodes) {
-        int cpus_per_node;
-
-        cpus_per_node = count_cpus_per_node(tinfo, nr_cpus, nr_nodes);
-        if (cpus_per_node == 0)
+        if (topo->cpus_per_node == 0)
             min_nodes = 1;
         else
-            min_nodes = (min_cpus + cpus_per_node - 1) / cpus_per_node;
+            min_nodes = (min_cpus + topo->cpus_per_node - 1) /
+                        topo->cpus_per_node;
     }
     /* We also need to be sure we do not exceed the number of
      * nodes we are allowed to use. */
-    nr_suit_nodes = libxl_bitmap_count_set(&suitable_nodemap);
-
     if (min_nodes > nr_suit_nodes)
         min_nodes = nr_suit_nodes;
     if (!max_nodes || max_nodes > nr_suit_nodes)
@@ -413,95 +590,109 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         goto out;
 
     /*
-     * Consider all the combinations with sizes in [min_nodes, max_nodes]
-     * (see comb_init() and comb_next()). Note that, since the fewer the
-     * number of nodes the better, it is guaranteed that any candidate
-     * found during the i-eth step will be better than any other one we
-     * could find during the (i+1)-eth and all the subsequent steps (they
-     * all will have more nodes). It's thus pointless to keep going if
+     * Consider all the sizes in [min_nodes, max_nodes]. Note that, since the
+     * fewer the number of nodes the better, it is guaranteed that any
+     * candidate found during the i-eth step will be better than any other
+     * one we could find during the (i+1)-eth and all the subsequent steps
+     * (they all will have more nodes). It's thus pointless to keep going if
      * we already found something.
      */
-    *cndt_found = 0;
     while (min_nodes <= max_nodes && *cndt_found == 0) {
-        comb_iter_t comb_iter;
-        int comb_ok;
-
-        /*
-         * And here it is. Each step of this cycle generates a combination of
-         * nodes as big as min_nodes mandates.  Each of these combinations is
-         * checked against the constraints provided by the caller (namely,
-         * amount of free memory and number of cpus) and it can concur to
-         * become our best placement iff it passes the check.
-         */
-        for (comb_ok = comb_init(gc, &comb_iter, nr_suit_nodes, min_nodes);
-             comb_ok;
-             comb_ok = comb_next(comb_iter, nr_suit_nodes, min_nodes)) {
-            uint32_t nodes_free_memkb;
-            int nodes_cpus;
-
-            /* Get the nodemap for the combination, only considering
-             * suitable nodes. */
-            comb_get_nodemap(comb_iter, &suitable_nodemap,
-                             &nodemap, min_nodes);
-
-            /* If there is not enough memory in this combination, skip it
-             * and go generating the next one... */
-            nodes_free_memkb = nodemap_to_free_memkb(ninfo, &nodemap);
-            if (min_free_memkb && nodes_free_memkb < min_free_memkb)
-                continue;
+        if (binomial(nr_suit_nodes, min_nodes) <= NUMA_EXHAUSTIVE_MAX)
+            numa_exhaustive(gc, &s, min_nodes);
+        else
+            numa_bounded(gc, &s, min_nodes);
+        min_nodes++;
+    }
 
-            /* And the same applies if this combination is short in cpus */
-            nodes_cpus = nodemap_to_nr_cpus(tinfo, nr_cpus, suitable_cpumap,
-                                            &nodemap);
-            if (min_cpus && nodes_cpus < min_cpus)
-                continue;
+ out:
+    libxl_bitmap_dispose(&s.nodemap);
+    libxl__numa_candidate_dispose(&s.new_cndt);
+    return rc;
+}
 
-            /*
-             * Conditions are met, we can compare this candidate with the
-             * current best one (if any).
-             */
-            libxl__numa_candidate_put_nodemap(gc, &new_cndt, &nodemap);
-            new_cndt.nr_vcpus = nodemap_to_nr_vcpus(gc, vcpus_on_node,
-                                                    &nodemap);
-            new_cndt.free_memkb = nodes_free_memkb;
-            new_cndt.nr_nodes = libxl_bitmap_count_set(&nodemap);
-            new_cndt.nr_cpus = nodes_cpus;
+/*
+ * Looks for the placement candidates that satisfyies some specific
+ * conditions and return the best one according to the provided
+ * comparison function.
+ */
+int libxl__get_numa_candidate(libxl__gc *gc,
+                              uint32_t min_free_memkb, int min_cpus,
+                              int min_nodes, int max_nodes,
+                              const libxl_bitmap *suitable_cpumap,
+                              libxl__numa_candidate_cmpf numa_cmpf,
+                              libxl__numa_candidate *cndt_out,
+                              int *cndt_found)
+{
+    libxl__numa_topology topo;
+    libxl_cputopology *tinfo = NULL;
+    libxl_numainfo *ninfo = NULL;
+    int nr_nodes = 0, nr_cpus = 0;
+    int i, j, rc = 0;
 
-            /*
-             * Check if the new candidate we is better the what we found up
-             * to now by means of the comparison function. If no comparison
-             * function is provided, just return as soon as we find our first
-             * candidate.
-             */
-            if (*cndt_found == 0 || numa_cmpf(&new_cndt, cndt_out) < 0) {
-                *cndt_found = 1;
-
-                LOG(DEBUG, "New best NUMA placement candidate found: "
-                           "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
-                           "free_memkb=%"PRIu32"", new_cndt.nr_nodes,
-                           new_cndt.nr_cpus, new_cndt.nr_vcpus,
-                           new_cndt.free_memkb / 1024);
-
-                libxl__numa_candidate_put_nodemap(gc, cndt_out, &nodemap);
-                cndt_out->nr_vcpus = new_cndt.nr_vcpus;
-                cndt_out->free_memkb = new_cndt.free_memkb;
-                cndt_out->nr_nodes = new_cndt.nr_nodes;
-                cndt_out->nr_cpus = new_cndt.nr_cpus;
-
-                if (numa_cmpf == NULL)
-                    break;
-            }
-        }
-        min_nodes++;
+    /* Get platform info */
+    ninfo = libxl_get_numainfo(CTX, &nr_nodes);
+    if (ninfo == NULL)
+        return ERROR_FAIL;
+
+    if (nr_nodes <= 1) {
+        *cndt_found = 0;
+        goto out;
+    }
+
+    tinfo = libxl_get_cpu_topology(CTX, &nr_cpus);
+    if (tinfo == NULL) {
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    topo.nr_nodes = nr_nodes;
+    GCNEW_ARRAY(topo.free_memkb, nr_nodes);
+    GCNEW_ARRAY(topo.nr_cpus, nr_nodes);
+    GCNEW_ARRAY(topo.nr_vcpus, nr_nodes);
+    GCNEW_ARRAY(topo.distance, nr_nodes * nr_nodes);
+
+    for (i = 0; i < nr_nodes; i++) {
+        topo.free_memkb[i] = ninfo[i].free / 1024;
+        for (j = 0; j < nr_nodes; j++)
+            topo.distance[i * nr_nodes + j] =
+                j < ninfo[i].num_dists ? ninfo[i].dists[j] :
+                i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
     }
 
+    /* Only the cpus in suitable_cpumap count (e.g., because of cpupools) */
+    for (i = 0; i < nr_cpus; i++) {
+        if (libxl_bitmap_test(suitable_cpumap, i) &&
+            tinfo[i].node < nr_nodes)
+            topo.nr_cpus[tinfo[i].node]++;
+    }
+
+    /*
+     * Later on, we will try to figure out how many vcpus are runnable on
+     * each candidate (as a part of choosing the best one of them). That
+     * requires going through all the vcpus of all the domains and check
+     * their affinities. So, instead of doing that for each candidate,
+     * let's count here the number of vcpus runnable on each node, so that
+     * all we have to do later is summing up the right elements of the
+     * nr_vcpus array.
+     */
+    rc = nr_vcpus_on_nodes(gc, tinfo, nr_cpus, suitable_cpumap,
+                           topo.nr_vcpus);
+    if (rc)
+        goto out;
+
+    topo.cpus_per_node = count_cpus_per_node(tinfo, nr_cpus, nr_nodes);
+
+    rc = libxl__numa_place(gc, &topo, min_free_memkb, min_cpus,
+                           min_nodes, max_nodes, numa_cmpf,
+                           cndt_out, cndt_found);
+    if (rc)
+        goto out;
+
     if (*cndt_found == 0)
         LOG(NOTICE, "NUMA placement failed, performance might be affected");
 
  out:
-    libxl_bitmap_dispose(&nodemap);
-    libxl_bitmap_dispose(&suitable_nodemap);
-    libxl__numa_candidate_dispose(&new_cndt);
     libxl_numainfo_list_free(ninfo, nr_nodes);
     libxl_cputopology_list_free(tinfo, nr_cpus);
     return rc;
@@ -0,0 +1,248 @@
+/*
+ * numaplace test case for the NUMA placement search
+ *
+ * To run this test:
+ *    ./test_numaplace [-v]
+ * Success:
+ *    prints one line per synthetic host and request, with the time the
+ *    search took, and exits 0
+ * Failure:
+ *    prints what went wrong and crashes
+ *
+ * Synthetic hosts from 2 to 64 nodes are built, with a two level distance
+ * matrix (nodes in the same socket are closer), and random amounts of
+ * free memory and vcpus already placed on each node.  For each of them,
+ * placement is asked for domains of various sizes.
+ *
+ * Wherever the number of candidates is small enough, the result must be
+ * exactly the one of an exhaustive evaluation of all the candidates, which
+ * is what placement has always done.  On bigger hosts the result must
+ * satisfy the constraints and, where the exhaustive evaluation is not too
+ * slow to run (up to 16 nodes), use no more nodes than its result does.
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_numaplace.h"
+
+/* Same heuristics as numa_place_domain() */
+static int test_cmpf(const libxl__numa_candidate *c1,
+                     const libxl__numa_candidate *c2)
+{
+    if (c1->nr_vcpus != c2->nr_vcpus)
+        return c1->nr_vcpus - c2->nr_vcpus;
+
+    return c2->free_memkb - c1->free_memkb;
+}
+
+static unsigned int rnd_state;
+
+static unsigned int rnd(unsigned int max)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 16) % max;
+}
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void make_topo(libxl__gc *gc, libxl__numa_topology *topo,
+                      int nr_nodes, int cpus_per_node,
+                      int nodes_per_socket, unsigned int seed)
+{
+    int i, j;
+
+    rnd_state = seed;
+
+    topo->nr_nodes = nr_nodes;
+    topo->cpus_per_node = cpus_per_node;
+    GCNEW_ARRAY(topo->free_memkb, nr_nodes);
+    GCNEW_ARRAY(topo->nr_cpus, nr_nodes);
+    GCNEW_ARRAY(topo->nr_vcpus, nr_nodes);
+    GCNEW_ARRAY(topo->distance, nr_nodes * nr_nodes);
+
+    for (i = 0; i < nr_nodes; i++) {
+        /* Between 1 and 32GB free, in 256MB steps */
+        topo->free_memkb[i] = (1 + rnd(128)) * 256 * 1024;
+        topo->nr_cpus[i] = cpus_per_node;
+        topo->nr_vcpus[i] = rnd(2 * cpus_per_node + 1);
+        for (j = 0; j < nr_nodes; j++)
+            topo->distance[i * nr_nodes + j] =
+                i == j ? 10 :
+                i / nodes_per_socket == j / nodes_per_socket ? 16 :
+                i / (4 * nodes_per_socket) == j / (4 * nodes_per_socket) ?
+                22 : 32;
+    }
+}
+
+/* Placement as it has always been done: evaluate every candidate. */
+static void ref_place(const libxl__numa_topology *topo,
+                      uint32_t min_free_memkb, int min_cpus,
+                      uint64_t *best_map, int *found)
+{
+    int nr_nodes = topo->nr_nodes, k, min_nodes;
+    libxl__numa_candidate best, c;
+    uint64_t map;
+
+    *found = 0;
+    min_nodes = (min_cpus + topo->cpus_per_node - 1) / topo->cpus_per_node;
+    if (min_nodes > nr_nodes)
+        min_nodes = nr_nodes;
+
+    for (k = min_nodes; k <= nr_nodes && !*found; k++) {
+        /* All maps with k bits set, in increasing order */
+        for (map = (1ULL << k) - 1; map < (1ULL << nr_nodes); ) {
+            uint64_t lowest, ripple;
+            int i;
+
+            memset(&c, 0, sizeof(c));
+            c.nr_nodes = k;
+            for (i = 0; i < nr_nodes; i++) {
+                if (!(map & (1ULL << i)))
+                    continue;
+                c.free_memkb += topo->free_memkb[i];
+                c.nr_cpus += topo->nr_cpus[i];
+                c.nr_vcpus += topo->nr_vcpus[i];
+            }
+            if ((!min_free_memkb || c.free_memkb >= min_free_memkb) &&
+                (!min_cpus || c.nr_cpus >= min_cpus) &&
+                (!*found || test_cmpf(&c, &best) < 0)) {
+                best = c;
+                *best_map = map;
+                *found = 1;
+            }
+
+            if (!map)
+                break;
+            lowest = map & -map;
+            ripple = map + lowest;
+            map = (((ripple ^ map) >> 2) / lowest) | ripple;
+        }
+    }
+}
+
+static uint64_t nodemap_to_u64(const libxl_bitmap *nodemap)
+{
+    uint64_t map = 0;
+    int i;
+
+    libxl_for_each_set_bit(i, *nodemap)
+        map |= 1ULL << i;
+
+    return map;
+}
+
+static int check(libxl__gc *gc, const libxl__numa_topology *topo,
+                 int nodes_per_socket, uint32_t memkb, int vcpus,
+                 int verbose)
+{
+    libxl__numa_candidate cndt;
+    uint64_t t, t_new, t_ref = 0, map, ref_map = 0;
+    int found, ref_found = 0, exact, rc = 0;
+    int nr_nodes = topo->nr_nodes;
+
+    /* C(14 7) is the largest number of candidates evaluated exhaustively */
+    exact = nr_nodes <= 14;
+
+    libxl__numa_candidate_init(&cndt);
+
+    t = now_us();
+    rc = libxl__numa_place(gc, topo, memkb, vcpus, 0, 0, test_cmpf,
+                           &cndt, &found);
+    t_new = now_us() - t;
+    if (rc) {
+        fprintf(stderr, "placement failed: %d\n", rc);
+        goto out;
+    }
+    map = found ? nodemap_to_u64(&cndt.nodemap) : 0;
+
+    if (nr_nodes <= 16) {
+        t = now_us();
+        ref_place(topo, memkb, vcpus, &ref_map, &ref_found);
+        t_ref = now_us() - t;
+    }
+
+    printf("%2d nodes (%d/socket) %8"PRIu32"MB %3d vcpus: ", nr_nodes,
+           nodes_per_socket, memkb / 1024, vcpus);
+    if (found)
+        printf("%2d nodes %8"PRIu32"MB %3d vcpus on them, %6"PRIu64"us",
+               cndt.nr_nodes, cndt.free_memkb / 1024, cndt.nr_vcpus, t_new);
+    else
+        printf("%-38s %6"PRIu64"us", "none", t_new);
+    if (nr_nodes <= 16)
+        printf(" (exhaustive %s, %6"PRIu64"us)",
+               ref_found == found && ref_map == map ? "same" : "differs",
+               t_ref);
+    printf("\n");
+    if (verbose && found)
+        printf("    nodemap %#"PRIx64"\n", map);
+
+    rc = ERROR_FAIL;
+    if (nr_nodes <= 16 && found != ref_found) {
+        fprintf(stderr, "found %d, exhaustive search found %d\n",
+                found, ref_found);
+        goto out;
+    }
+    if (exact && map != ref_map) {
+        fprintf(stderr, "nodemap %#"PRIx64", exhaustive search %#"PRIx64"\n",
+                map, ref_map);
+        goto out;
+    }
+    if (found && (cndt.free_memkb < memkb || cndt.nr_cpus < vcpus)) {
+        fprintf(stderr, "candidate does not satisfy the constraints\n");
+        goto out;
+    }
+    if (found && ref_found &&
+        cndt.nr_nodes > __builtin_popcountll(ref_map)) {
+        fprintf(stderr, "candidate has %d nodes, exhaustive search %d\n",
+                cndt.nr_nodes, __builtin_popcountll(ref_map));
+        goto out;
+    }
+    rc = 0;
+
+ out:
+    libxl__numa_candidate_dispose(&cndt);
+    return rc;
+}
+
+int libxl_test_numaplace(libxl_ctx *ctx, int verbose)
+{
+    static const struct {
+        int nr_nodes, cpus_per_node, nodes_per_socket;
+    } hosts[] = {
+        {  2, 8, 1 }, {  4, 8, 2 }, {  8, 6, 2 }, { 12, 8, 4 },
+        { 14, 4, 2 }, { 16, 8, 2 }, { 16, 4, 4 }, { 32, 8, 2 },
+        { 64, 4, 4 },
+    };
+    int h, v, seed, rc = 0;
+
+    GC_INIT(ctx);
+
+    for (h = 0; h < ARRAY_SIZE(hosts) && !rc; h++) {
+        for (seed = 1; seed <= 3 && !rc; seed++) {
+            libxl__numa_topology topo;
+            uint64_t host_memkb = 0;
+            int i, host_cpus;
+
+            make_topo(gc, &topo, hosts[h].nr_nodes, hosts[h].cpus_per_node,
+                      hosts[h].nodes_per_socket, seed * 7919 + h);
+            for (i = 0; i < topo.nr_nodes; i++)
+                host_memkb += topo.free_memkb[i];
+            host_cpus = topo.nr_nodes * topo.cpus_per_node;
+
+            /* Domains from one vcpu and 1GB to most of the host */
+            for (v = 1; v <= host_cpus && !rc; v *= 4)
+                rc = check(gc, &topo, hosts[h].nodes_per_socket,
+                           host_memkb * v / host_cpus / 2 + 1024 * 1024,
+                           v, verbose);
+        }
+    }
+
+    GC_FREE;
+    return rc;
+}
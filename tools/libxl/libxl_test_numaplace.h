@@ -0,0 +1,7 @@
+#ifndef TEST_NUMAPLACE_H
+#define TEST_NUMAPLACE_H
+
+int libxl_test_numaplace(libxl_ctx *ctx, int verbose)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_NUMAPLACE_H*/
@@ -0,0 +1,169 @@
+/*
+ * timestress test case for the libxl event system
+ *
+ * To run this test:
+ *    ./test_timestress
+ * Success:
+ *    program takes a few seconds, prints how long registering and
+ *    deregistering took and exits 0
+ * Failure:
+ *    crash
+ *
+ * register NTIMES timeouts at pseudo-random times up to SPAN_MS ahead,
+ * many of them at exactly the same time
+ * deregister a third of them, and register some of those again
+ * whenever one occurs, check that:
+ *   it is registered, and for the time it was registered for
+ *   it is not earlier than the previous one, nor registered before it
+ *     if they are for the same time
+ * and now and then, from the callback, deregister another one or
+ * register one again
+ * when the last one has occurred, check they all have been deregistered
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_timestress.h"
+
+#define NTIMES  20000
+#define SPAN_MS 2000
+#define STEP_MS 10
+
+enum { IDLE, REGISTERED, OCCURRED, DEREGISTERED };
+
+static libxl__ev_time et[NTIMES];
+static int state[NTIMES];
+static struct timeval abs_of[NTIMES];
+static uint64_t order_of[NTIMES];
+static uint64_t order;
+static int nregistered, noccurred;
+static struct timeval last_abs;
+static uint64_t last_order;
+static libxl__ao *tao;
+static unsigned int rnd_state = 1;
+
+static void occurs(libxl__egc *egc, libxl__ev_time *ev,
+                   const struct timeval *requested_abs);
+
+static unsigned int rnd(unsigned int max)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 16) % max;
+}
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void reg(libxl__gc *gc, int i, const struct timeval *base)
+{
+    /* A multiple of STEP_MS, so that many of them are for the same time */
+    int ms = rnd(SPAN_MS / STEP_MS) * STEP_MS;
+    struct timeval additional = {
+        .tv_sec = ms / 1000,
+        .tv_usec = (ms % 1000) * 1000
+    };
+    int rc;
+
+    assert(state[i] != REGISTERED);
+    timeradd(base, &additional, &abs_of[i]);
+    rc = libxl__ev_time_register_abs(gc, &et[i], occurs, abs_of[i]);
+    assert(!rc);
+    state[i] = REGISTERED;
+    order_of[i] = order++;
+    nregistered++;
+}
+
+static void dereg(libxl__gc *gc, int i)
+{
+    assert(state[i] == REGISTERED);
+    libxl__ev_time_deregister(gc, &et[i]);
+    assert(!libxl__ev_time_isregistered(&et[i]));
+    state[i] = DEREGISTERED;
+    nregistered--;
+}
+
+int libxl_test_timestress(libxl_ctx *ctx, libxl_asyncop_how *ao_how)
+{
+    struct timeval base;
+    uint64_t t;
+    int i, rc;
+    AO_CREATE(ctx, 0, ao_how);
+
+    tao = ao;
+
+    for (i = 0; i < NTIMES; i++)
+        libxl__ev_time_init(&et[i]);
+
+    rc = libxl__gettimeofday(gc, &base);
+    assert(!rc);
+    base.tv_sec += 1;
+
+    t = now_us();
+    for (i = 0; i < NTIMES; i++)
+        reg(gc, i, &base);
+    t = now_us() - t;
+    LOG(INFO, "registered %d timeouts in %"PRIu64"us", NTIMES, t);
+
+    t = now_us();
+    for (i = 0; i < NTIMES; i += 3)
+        dereg(gc, i);
+    t = now_us() - t;
+    LOG(INFO, "deregistered %d timeouts in %"PRIu64"us", (NTIMES + 2) / 3, t);
+
+    for (i = 0; i < NTIMES; i += 12)
+        reg(gc, i, &base);
+
+    /* Deregistering an unregistered timeout is a no-op */
+    libxl__ev_time_deregister(gc, &et[3]);
+
+    return AO_INPROGRESS;
+}
+
+static void occurs(libxl__egc *egc, libxl__ev_time *ev,
+                   const struct timeval *requested_abs)
+{
+    EGC_GC;
+    int i = ev - et, j;
+
+    assert(i >= 0 && i < NTIMES);
+    assert(state[i] == REGISTERED);
+    assert(!libxl__ev_time_isregistered(ev));
+    assert(!timercmp(requested_abs, &abs_of[i], !=));
+
+    /* In order of time, and of registration for the same time */
+    assert(!timercmp(&abs_of[i], &last_abs, <));
+    assert(timercmp(&abs_of[i], &last_abs, !=) || order_of[i] > last_order);
+    last_abs = abs_of[i];
+    last_order = order_of[i];
+
+    state[i] = OCCURRED;
+    nregistered--;
+    noccurred++;
+
+    if (noccurred % 7 == 0) {
+        j = rnd(NTIMES);
+        if (state[j] == REGISTERED)
+            dereg(gc, j);
+    }
+    if (noccurred % 11 == 0) {
+        j = rnd(NTIMES);
+        if (state[j] != REGISTERED)
+            reg(gc, j, requested_abs);
+    }
+
+    if (nregistered)
+        return;
+
+    LOG(INFO, "%d timeouts occurred", noccurred);
+    for (i = 0; i < NTIMES; i++) {
+        assert(state[i] != REGISTERED);
+        assert(!libxl__ev_time_isregistered(&et[i]));
+    }
+    assert(!CTX->netimes);
+    libxl__ao_complete(egc, tao, 0);
+}
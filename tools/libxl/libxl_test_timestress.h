@@ -0,0 +1,9 @@
+#ifndef TEST_TIMESTRESS_H
+#define TEST_TIMESTRESS_H
+
+#include <pthread.h>
+
+int libxl_test_timestress(libxl_ctx *ctx, libxl_asyncop_how *ao_how)
+    LIBXL_EXTERNAL_CALLERS_ONLY;
+
+#endif /*TEST_TIMESTRESS_H*/
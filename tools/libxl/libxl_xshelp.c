@@ -41,27 +41,49 @@ char **libxl__xs_kvs_of_flexarray(libxl__gc *gc, flexarray_t *array, int length)
     return kvs;
 }
 
-int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
-                           const char *dir, char *kvs[],
-                           struct xs_permissions *perms,
-                           unsigned int num_perms)
+void libxl__xs_pipeline_writev(libxl__gc *gc, struct xs_pipeline *p,
+                               const char *dir, char *kvs[],
+                               struct xs_permissions *perms,
+                               unsigned int num_perms)
 {
-    libxl_ctx *ctx = libxl__gc_owner(gc);
     char *path;
     int i;
 
     if (!kvs)
-        return 0;
+        return;
 
     for (i = 0; kvs[i] != NULL; i += 2) {
         path = libxl__sprintf(gc, "%s/%s", dir, kvs[i]);
         if (path && kvs[i + 1]) {
             int length = strlen(kvs[i + 1]);
-            xs_write(ctx->xsh, t, path, kvs[i + 1], length);
+            xs_pipeline_write(p, path, kvs[i + 1], length);
             if (perms)
-                xs_set_permissions(ctx->xsh, t, path, perms, num_perms);
+                xs_pipeline_set_permissions(p, path, perms, num_perms);
         }
     }
+}
+
+int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
+                           const char *dir, char *kvs[],
+                           struct xs_permissions *perms,
+                           unsigned int num_perms)
+{
+    libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_pipeline *p;
+
+    if (!kvs)
+        return 0;
+
+    p = xs_pipeline_start(ctx->xsh, t);
+    if (!p) {
+        LOGE(ERROR, "cannot write to xenstore directory %s", dir);
+        return ERROR_FAIL;
+    }
+    libxl__xs_pipeline_writev(gc, p, dir, kvs, perms, num_perms);
+    if (!xs_pipeline_end(p, false)) {
+        LOGE(ERROR, "failed to write to xenstore directory %s", dir);
+        return ERROR_FAIL;
+    }
     return 0;
 }
 
@@ -158,6 +180,14 @@ bool libxl__xs_mkdir(libxl__gc *gc, xs_transaction_t t,
     return xs_set_permissions(ctx->xsh, t, path, perms, num_perms);
 }
 
+void libxl__xs_pipeline_mkdir(struct xs_pipeline *p, const char *path,
+                              struct xs_permissions *perms,
+                              unsigned int num_perms)
+{
+    xs_pipeline_mkdir(p, path);
+    xs_pipeline_set_permissions(p, path, perms, num_perms);
+}
+
 char *libxl__xs_libxl_path(libxl__gc *gc, uint32_t domid)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
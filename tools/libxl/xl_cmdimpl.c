@@ -4594,6 +4594,35 @@ int main_unpause(int argc, char **argv)
     return 0;
 }
 
+int main_fork_vm(int argc, char **argv)
+{
+    int opt, rc;
+    int paused = 0;
+    uint32_t domid;
+
+    SWITCH_FOREACH_OPT(opt, "p", NULL, "fork-vm", 1) {
+    case 'p':
+        paused = 1;
+        break;
+    }
+
+    rc = libxl_domain_fork_vm(ctx, find_domain(argv[optind]), &domid);
+    if (rc) {
+        fprintf(stderr, "fork-vm: failed to fork domain %s\n", argv[optind]);
+        return 1;
+    }
+
+    if (!paused && libxl_domain_unpause(ctx, domid)) {
+        fprintf(stderr, "fork-vm: failed to unpause fork %u\n", domid);
+        libxl_domain_destroy(ctx, domid, 0);
+        return 1;
+    }
+
+    printf("%u\n", domid);
+
+    return 0;
+}
+
 int main_destroy(int argc, char **argv)
 {
     int opt;
@@ -129,6 +129,12 @@ struct cmd_spec cmd_table[] = {
       "Unpause a paused domain",
       "<Domain>",
     },
+    { "fork-vm",
+      &main_fork_vm, 0, 1,
+      "Fork a paused HVM domain, sharing its memory copy-on-write",
+      "[options] <Domain>",
+      "-p                     Leave the fork paused after creating it."
+    },
     { "console",
       &main_console, 0, 0,
       "Attach to domain's console",
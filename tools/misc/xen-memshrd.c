@@ -0,0 +1,527 @@
+/*
+ * xen-memshrd: content-based page sharing daemon.
+ *
+ * Periodically scans the memory of a set of opted-in HVM domains, hashes
+ * the contents of every page and, for pages whose hashes collide, nominates
+ * both pages, verifies that their contents really are identical and asks
+ * the hypervisor to share them.  The hypervisor takes care of breaking the
+ * sharing (copy-on-write) when either page is subsequently written.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+#define MAX_DOMAINS        64
+#define DEFAULT_BATCH      1024
+#define DEFAULT_INTERVAL   30
+/* Forget which pages we shared every so often, so that pages which have
+ * been unshared behind our back get another chance. */
+#define DEFAULT_RESCAN     8
+
+#define BITS_PER_LONG      (sizeof(unsigned long) * 8)
+
+struct memshrd_domain {
+    domid_t domid;
+    xen_pfn_t max_gpfn;
+    unsigned long *shared;      /* gfns we believe are already shared */
+};
+
+/* A page seen during the current pass, keyed by the hash of its contents. */
+struct memshrd_entry {
+    uint64_t hash;
+    struct memshrd_domain *dom;
+    xen_pfn_t gfn;
+    struct memshrd_entry *next;
+};
+
+struct memshrd_candidate {
+    struct memshrd_entry *source;
+    struct memshrd_domain *dom;
+    xen_pfn_t gfn;
+};
+
+struct memshrd_stats {
+    unsigned long scanned, unmappable, candidates, shared,
+                  mismatched, failed;
+};
+
+static xc_interface *xch;
+static struct memshrd_domain domains[MAX_DOMAINS];
+static unsigned int nr_domains;
+
+static struct memshrd_entry **table;
+static unsigned long table_size;
+static struct memshrd_entry *pool;
+static unsigned long pool_used, pool_size;
+
+static unsigned int batch_size = DEFAULT_BATCH;
+static int verbose;
+static volatile sig_atomic_t interrupted;
+
+static void close_handler(int sig)
+{
+    interrupted = sig;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options] <domid> [<domid> ...]\n", prog);
+    printf("\n");
+    printf("Share identical pages between (and within) the given domains.\n");
+    printf("\n");
+    printf("  -i, --interval=SECS  seconds between two scans (default %d)\n",
+           DEFAULT_INTERVAL);
+    printf("  -b, --batch=PAGES    pages mapped per batch (default %d)\n",
+           DEFAULT_BATCH);
+    printf("  -r, --rescan=PASSES  re-examine pages already shared every\n"
+           "                       PASSES scans (default %d)\n",
+           DEFAULT_RESCAN);
+    printf("  -o, --once           scan once and exit\n");
+    printf("  -v, --verbose        report every share operation\n");
+    printf("  -h, --help           this help\n");
+}
+
+static inline int test_shared(struct memshrd_domain *dom, xen_pfn_t gfn)
+{
+    return !!(dom->shared[gfn / BITS_PER_LONG] & (1UL << (gfn % BITS_PER_LONG)));
+}
+
+static inline void set_shared(struct memshrd_domain *dom, xen_pfn_t gfn)
+{
+    dom->shared[gfn / BITS_PER_LONG] |= 1UL << (gfn % BITS_PER_LONG);
+}
+
+static inline void clear_shared(struct memshrd_domain *dom, xen_pfn_t gfn)
+{
+    dom->shared[gfn / BITS_PER_LONG] &= ~(1UL << (gfn % BITS_PER_LONG));
+}
+
+static unsigned long bitmap_size(xen_pfn_t max_gpfn)
+{
+    return ((max_gpfn + BITS_PER_LONG) / BITS_PER_LONG) *
+        sizeof(unsigned long);
+}
+
+/* 64-bit FNV-1a over the page, a word at a time. */
+static uint64_t hash_page(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < XC_PAGE_SIZE / sizeof(*p); i++ )
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static int table_init(unsigned long nr_pages)
+{
+    table_size = 1;
+    while ( table_size < nr_pages )
+        table_size <<= 1;
+
+    table = calloc(table_size, sizeof(*table));
+    pool_size = nr_pages;
+    pool = malloc(pool_size * sizeof(*pool));
+    if ( !table || !pool )
+    {
+        free(table);
+        free(pool);
+        table = NULL;
+        pool = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void table_reset(void)
+{
+    memset(table, 0, table_size * sizeof(*table));
+    pool_used = 0;
+}
+
+/*
+ * Look up a page by hash.  Returns the page already recorded with this
+ * hash, if any, or records this page and returns NULL.
+ */
+static struct memshrd_entry *table_lookup_insert(uint64_t hash,
+                                                 struct memshrd_domain *dom,
+                                                 xen_pfn_t gfn)
+{
+    struct memshrd_entry **bucket = &table[hash & (table_size - 1)];
+    struct memshrd_entry *e;
+
+    for ( e = *bucket; e; e = e->next )
+        if ( e->hash == hash )
+            return e;
+
+    if ( pool_used == pool_size )
+        return NULL;
+
+    e = &pool[pool_used++];
+    e->hash = hash;
+    e->dom = dom;
+    e->gfn = gfn;
+    e->next = *bucket;
+    *bucket = e;
+
+    return NULL;
+}
+
+/*
+ * Compare two nominated pages.  This has to happen after nomination: from
+ * then on, any write to either page invalidates its handle and the
+ * subsequent share operation fails, so the contents cannot change between
+ * the check and the share.
+ */
+static int pages_identical(struct memshrd_domain *a, xen_pfn_t agfn,
+                           struct memshrd_domain *b, xen_pfn_t bgfn)
+{
+    void *pa, *pb;
+    int same = 0;
+
+    pa = xc_map_foreign_range(xch, a->domid, XC_PAGE_SIZE, PROT_READ, agfn);
+    if ( !pa )
+        return 0;
+
+    pb = xc_map_foreign_range(xch, b->domid, XC_PAGE_SIZE, PROT_READ, bgfn);
+    if ( pb )
+    {
+        same = !memcmp(pa, pb, XC_PAGE_SIZE);
+        munmap(pb, XC_PAGE_SIZE);
+    }
+
+    munmap(pa, XC_PAGE_SIZE);
+
+    return same;
+}
+
+static void share_candidate(struct memshrd_candidate *c,
+                            struct memshrd_stats *stats)
+{
+    struct memshrd_entry *s = c->source;
+    uint64_t sh, ch;
+    int rc;
+
+    /* Both already shared by us: assume they are backed by the same frame. */
+    if ( test_shared(s->dom, s->gfn) && test_shared(c->dom, c->gfn) )
+        return;
+
+    stats->candidates++;
+
+    if ( xc_memshr_nominate_gfn(xch, s->dom->domid, s->gfn, &sh) ||
+         xc_memshr_nominate_gfn(xch, c->dom->domid, c->gfn, &ch) )
+    {
+        stats->failed++;
+        return;
+    }
+
+    if ( !pages_identical(s->dom, s->gfn, c->dom, c->gfn) )
+    {
+        stats->mismatched++;
+        return;
+    }
+
+    rc = xc_memshr_share_gfns(xch, s->dom->domid, s->gfn, sh,
+                              c->dom->domid, c->gfn, ch);
+    if ( rc )
+    {
+        /* The source changed under our feet: let the client take over. */
+        if ( errno == -XENMEM_SHARING_OP_S_HANDLE_INVALID )
+        {
+            s->dom = c->dom;
+            s->gfn = c->gfn;
+        }
+        stats->failed++;
+        return;
+    }
+
+    if ( verbose )
+        printf("shared d%d:%#"PRI_xen_pfn" with d%d:%#"PRI_xen_pfn"\n",
+               c->dom->domid, c->gfn, s->dom->domid, s->gfn);
+
+    set_shared(s->dom, s->gfn);
+    set_shared(c->dom, c->gfn);
+    stats->shared++;
+}
+
+static void scan_batch(struct memshrd_domain *dom, xen_pfn_t *gfns,
+                       int *errs, unsigned int nr,
+                       struct memshrd_candidate *cands,
+                       struct memshrd_stats *stats)
+{
+    unsigned int i, nr_cands = 0;
+    char *map;
+
+    map = xc_map_foreign_bulk(xch, dom->domid, PROT_READ, gfns, errs, nr);
+    if ( !map )
+    {
+        stats->unmappable += nr;
+        return;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct memshrd_entry *e;
+
+        if ( errs[i] )
+        {
+            stats->unmappable++;
+            clear_shared(dom, gfns[i]);
+            continue;
+        }
+
+        stats->scanned++;
+        e = table_lookup_insert(hash_page(map + i * XC_PAGE_SIZE),
+                                dom, gfns[i]);
+        if ( e )
+        {
+            cands[nr_cands].source = e;
+            cands[nr_cands].dom = dom;
+            cands[nr_cands].gfn = gfns[i];
+            nr_cands++;
+        }
+    }
+
+    /* Our own mappings hold references which would make nomination fail. */
+    munmap(map, nr * XC_PAGE_SIZE);
+
+    for ( i = 0; i < nr_cands && !interrupted; i++ )
+        share_candidate(&cands[i], stats);
+}
+
+static int scan_domain(struct memshrd_domain *dom, xen_pfn_t *gfns,
+                       int *errs, struct memshrd_candidate *cands,
+                       struct memshrd_stats *stats)
+{
+    xen_pfn_t gfn = 0, max_gpfn;
+    unsigned int nr;
+
+    if ( xc_domain_maximum_gpfn(xch, dom->domid, &max_gpfn) < 0 )
+    {
+        fprintf(stderr, "d%d: unable to get maximum gpfn: %s\n",
+                dom->domid, strerror(errno));
+        return -1;
+    }
+
+    if ( !dom->shared || max_gpfn > dom->max_gpfn )
+    {
+        unsigned long old = dom->shared ? bitmap_size(dom->max_gpfn) : 0;
+        unsigned long *shared = realloc(dom->shared, bitmap_size(max_gpfn));
+
+        if ( !shared )
+            return -1;
+        memset((char *)shared + old, 0, bitmap_size(max_gpfn) - old);
+        dom->shared = shared;
+        dom->max_gpfn = max_gpfn;
+    }
+
+    while ( gfn <= max_gpfn && !interrupted )
+    {
+        for ( nr = 0; nr < batch_size && gfn <= max_gpfn; nr++ )
+            gfns[nr] = gfn++;
+
+        scan_batch(dom, gfns, errs, nr, cands, stats);
+    }
+
+    return 0;
+}
+
+static void report(const struct memshrd_stats *stats, double secs)
+{
+    long freed = xc_sharing_freed_pages(xch);
+    long used = xc_sharing_used_frames(xch);
+
+    printf("scanned %lu pages in %.2fs (%lu unmappable): "
+           "%lu candidates, %lu shared, %lu mismatched, %lu failed; "
+           "host: %ld frames saved, %ld shared frames in use\n",
+           stats->scanned, secs, stats->unmappable, stats->candidates,
+           stats->shared, stats->mismatched, stats->failed, freed, used);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "batch",    required_argument, NULL, 'b' },
+        { "rescan",   required_argument, NULL, 'r' },
+        { "once",     no_argument,       NULL, 'o' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned int interval = DEFAULT_INTERVAL, rescan = DEFAULT_RESCAN;
+    unsigned int pass, i;
+    int once = 0, ch, rc = 1;
+    xen_pfn_t *gfns = NULL;
+    int *errs = NULL;
+    struct memshrd_candidate *cands = NULL;
+    struct sigaction act;
+    unsigned long nr_pages = 0;
+
+    while ( (ch = getopt_long(argc, argv, "i:b:r:ovh", opts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            rescan = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            once = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( optind == argc || batch_size == 0 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        perror("Failed to open xc interface");
+        return 1;
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        struct memshrd_domain *dom;
+        xc_dominfo_t info;
+
+        if ( nr_domains == MAX_DOMAINS )
+        {
+            fprintf(stderr, "Too many domains (max %d)\n", MAX_DOMAINS);
+            goto out;
+        }
+
+        dom = &domains[nr_domains];
+        dom->domid = strtoul(argv[optind], NULL, 0);
+
+        if ( xc_domain_getinfo(xch, dom->domid, 1, &info) != 1 ||
+             info.domid != dom->domid )
+        {
+            fprintf(stderr, "d%d: no such domain\n", dom->domid);
+            goto out;
+        }
+
+        if ( xc_memshr_control(xch, dom->domid, 1) )
+        {
+            fprintf(stderr, "d%d: unable to enable sharing: %s\n",
+                    dom->domid, strerror(errno));
+            goto out;
+        }
+
+        nr_pages += info.max_memkb >> (XC_PAGE_SHIFT - 10);
+        nr_domains++;
+    }
+
+    gfns = malloc(batch_size * sizeof(*gfns));
+    errs = malloc(batch_size * sizeof(*errs));
+    cands = malloc(batch_size * sizeof(*cands));
+    if ( !gfns || !errs || !cands || table_init(nr_pages) )
+    {
+        perror("Failed to allocate memory");
+        goto out;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = close_handler;
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+
+    for ( pass = 0; !interrupted; pass++ )
+    {
+        struct memshrd_stats stats;
+        struct timeval start, end;
+
+        memset(&stats, 0, sizeof(stats));
+        table_reset();
+        gettimeofday(&start, NULL);
+
+        for ( i = 0; i < nr_domains && !interrupted; i++ )
+        {
+            if ( rescan && pass && !(pass % rescan) && domains[i].shared )
+                memset(domains[i].shared, 0,
+                       bitmap_size(domains[i].max_gpfn));
+
+            scan_domain(&domains[i], gfns, errs, cands, &stats);
+        }
+
+        gettimeofday(&end, NULL);
+        report(&stats, (end.tv_sec - start.tv_sec) +
+                       (end.tv_usec - start.tv_usec) / 1e6);
+
+        if ( once )
+            break;
+
+        for ( i = 0; i < interval && !interrupted; i++ )
+            sleep(1);
+    }
+
+    rc = 0;
+
+ out:
+    for ( i = 0; i < nr_domains; i++ )
+        free(domains[i].shared);
+    free(table);
+    free(pool);
+    free(cands);
+    free(errs);
+    free(gfns);
+    xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,647 @@
+/*
+ * xen-numabalance: keep the memory of HVM guests close to their vCPUs.
+ *
+ * Guests are placed on a NUMA node when they are created, but over time
+ * the scheduler may move their vCPUs elsewhere, leaving all of their
+ * memory remote.  This daemon samples where each guest's vCPUs spend their
+ * time, and where its memory is.  Once a guest's vCPUs have settled on a
+ * node other than the one holding its memory, it points the guest's node
+ * affinity there (so new allocations land on it) and moves the memory
+ * across, a limited amount per interval.
+ *
+ * Every interval it prints, per guest, an estimate of the fraction of
+ * memory accesses which are local: the time each vCPU spent on a node
+ * weighted by the share of the guest's memory on that node.  This assumes
+ * accesses are spread evenly over the guest's memory, but is good enough
+ * to show whether locality is getting better or worse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+#define MAX_DOMAINS          256
+#define DEFAULT_INTERVAL     10
+/* vCPU placement is sampled this many times per interval. */
+#define SAMPLES              10
+#define DEFAULT_RATE_MB      256
+#define DEFAULT_RESERVE_MB   256
+#define DEFAULT_VCPU_SHARE   75
+#define DEFAULT_TARGET       90
+#define DEFAULT_STABLE       2
+
+#define MB_TO_PAGES(mb)      ((uint64_t)(mb) << (20 - XC_PAGE_SHIFT))
+#define PAGES_TO_KB(p)       ((uint64_t)(p) << (XC_PAGE_SHIFT - 10))
+
+struct nb_domain {
+    domid_t domid;
+    int present;                /* seen in the latest domain list */
+    unsigned int nr_vcpus;
+    uint64_t *vcpu_time;        /* cpu_time at the last sample, 0 if none */
+    uint64_t *node_time;        /* ns of vCPU time per node, this interval */
+    uint64_t *node_pages;
+    unsigned int home;          /* node the vCPUs favoured last interval */
+    unsigned int stable;        /* consecutive intervals they did so */
+    unsigned int affinity;      /* node affinity we set, if any */
+    xen_pfn_t next_gfn;         /* where to resume moving memory */
+    uint64_t moved;
+    int first_local, last_local;
+};
+
+static xc_interface *xch;
+static struct nb_domain domains[MAX_DOMAINS];
+static unsigned int nr_domains;
+
+static unsigned int nr_nodes, nr_cpus;
+static unsigned int *cpu_node;
+static xc_meminfo_t *meminfo;
+static uint32_t *distance;
+
+static domid_t only[MAX_DOMAINS];
+static unsigned int nr_only;
+
+static uint64_t rate = MB_TO_PAGES(DEFAULT_RATE_MB);
+static uint64_t reserve = MB_TO_PAGES(DEFAULT_RESERVE_MB);
+static unsigned int vcpu_share = DEFAULT_VCPU_SHARE;
+static unsigned int target = DEFAULT_TARGET;
+static unsigned int stable = DEFAULT_STABLE;
+static int dry_run, pin_soft, verbose;
+static volatile sig_atomic_t interrupted;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options] [<domid> ...]\n", prog);
+    printf("\n");
+    printf("Move the memory of HVM domains to the NUMA node their vCPUs run on.\n");
+    printf("Without domids, all HVM domains are considered.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -i, --interval=SECS   seconds between decisions (default %d)\n",
+           DEFAULT_INTERVAL);
+    printf("  -c, --count=N         stop after N intervals (default: run until\n"
+           "                        interrupted)\n");
+    printf("  -r, --rate=MB         memory to move per domain and interval\n"
+           "                        (default %d)\n", DEFAULT_RATE_MB);
+    printf("  -R, --reserve=MB      memory to leave free on every node\n"
+           "                        (default %d)\n", DEFAULT_RESERVE_MB);
+    printf("  -s, --share=PCT       share of vCPU time a node must have to\n"
+           "                        become a domain's home (default %d)\n",
+           DEFAULT_VCPU_SHARE);
+    printf("  -t, --target=PCT      stop moving once this much memory is on\n"
+           "                        the home node (default %d)\n",
+           DEFAULT_TARGET);
+    printf("  -S, --stable=N        intervals the home node must be stable\n"
+           "                        for before memory is moved (default %d)\n",
+           DEFAULT_STABLE);
+    printf("  -p, --pin             also set the vCPUs' soft affinity to the\n"
+           "                        home node\n");
+    printf("  -n, --dry-run         only report, move nothing\n");
+    printf("  -v, --verbose         also report idle domains\n");
+    printf("  -h, --help            display this help and exit\n");
+}
+
+static void sighandler(int sig)
+{
+    interrupted = 1;
+}
+
+static int topology_init(void)
+{
+    xc_cputopo_t *cputopo;
+    unsigned int max_cpus, max_nodes, i;
+    xc_physinfo_t physinfo = { 0 };
+
+    if ( xc_physinfo(xch, &physinfo) )
+    {
+        perror("xc_physinfo");
+        return -1;
+    }
+
+    max_cpus = nr_cpus = physinfo.max_cpu_id + 1;
+    max_nodes = nr_nodes = physinfo.max_node_id + 1;
+
+    cputopo = calloc(nr_cpus, sizeof(*cputopo));
+    cpu_node = calloc(nr_cpus, sizeof(*cpu_node));
+    meminfo = calloc(nr_nodes, sizeof(*meminfo));
+    distance = calloc(nr_nodes * nr_nodes, sizeof(*distance));
+    if ( !cputopo || !cpu_node || !meminfo || !distance )
+    {
+        fprintf(stderr, "out of memory\n");
+        free(cputopo);
+        return -1;
+    }
+
+    if ( xc_cputopoinfo(xch, &max_cpus, cputopo) )
+    {
+        perror("xc_cputopoinfo");
+        free(cputopo);
+        return -1;
+    }
+
+    for ( i = 0; i < nr_cpus; i++ )
+        cpu_node[i] = i < max_cpus ? cputopo[i].node : XEN_INVALID_NODE_ID;
+    free(cputopo);
+
+    if ( xc_numainfo(xch, &max_nodes, meminfo, distance) )
+    {
+        perror("xc_numainfo");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void domain_free(struct nb_domain *dom)
+{
+    free(dom->vcpu_time);
+    free(dom->node_time);
+    free(dom->node_pages);
+}
+
+static int wanted(domid_t domid)
+{
+    unsigned int i;
+
+    if ( !nr_only )
+        return domid != 0;
+
+    for ( i = 0; i < nr_only; i++ )
+        if ( only[i] == domid )
+            return 1;
+
+    return 0;
+}
+
+/* Pick up new domains and forget about those which have gone away. */
+static int domains_refresh(void)
+{
+    static xc_domaininfo_t info[MAX_DOMAINS];
+    unsigned int i, j;
+    int n;
+
+    n = xc_domain_getinfolist(xch, 0, MAX_DOMAINS, info);
+    if ( n < 0 )
+    {
+        perror("xc_domain_getinfolist");
+        return -1;
+    }
+
+    for ( j = 0; j < nr_domains; j++ )
+        domains[j].present = 0;
+
+    for ( i = 0; i < n; i++ )
+    {
+        struct nb_domain *dom = NULL;
+
+        if ( !(info[i].flags & XEN_DOMINF_hvm_guest) ||
+             (info[i].flags & (XEN_DOMINF_dying | XEN_DOMINF_shutdown)) ||
+             !wanted(info[i].domain) )
+            continue;
+
+        for ( j = 0; j < nr_domains; j++ )
+            if ( domains[j].domid == info[i].domain )
+                dom = &domains[j];
+
+        if ( !dom )
+        {
+            if ( nr_domains == MAX_DOMAINS )
+                continue;
+            dom = &domains[nr_domains++];
+            memset(dom, 0, sizeof(*dom));
+            dom->domid = info[i].domain;
+            dom->nr_vcpus = info[i].max_vcpu_id + 1;
+            dom->affinity = XEN_INVALID_NODE_ID;
+            dom->home = XEN_INVALID_NODE_ID;
+            dom->first_local = -1;
+            dom->vcpu_time = calloc(dom->nr_vcpus, sizeof(*dom->vcpu_time));
+            dom->node_time = calloc(nr_nodes, sizeof(*dom->node_time));
+            dom->node_pages = calloc(nr_nodes, sizeof(*dom->node_pages));
+            if ( !dom->vcpu_time || !dom->node_time || !dom->node_pages )
+            {
+                fprintf(stderr, "out of memory\n");
+                domain_free(dom);
+                nr_domains--;
+                return -1;
+            }
+        }
+
+        dom->present = 1;
+    }
+
+    for ( j = 0; j < nr_domains; )
+    {
+        if ( domains[j].present )
+        {
+            j++;
+            continue;
+        }
+
+        if ( domains[j].first_local >= 0 )
+            printf("d%u: gone, estimated local accesses %d%% -> %d%%, "
+                   "%"PRIu64"K moved\n", domains[j].domid,
+                   domains[j].first_local, domains[j].last_local,
+                   PAGES_TO_KB(domains[j].moved));
+        domain_free(&domains[j]);
+        domains[j] = domains[--nr_domains];
+    }
+
+    return 0;
+}
+
+/* Charge the vCPU time since the last sample to the node of each vCPU. */
+static void sample_vcpus(struct nb_domain *dom)
+{
+    xc_vcpuinfo_t info;
+    unsigned int v;
+
+    for ( v = 0; v < dom->nr_vcpus; v++ )
+    {
+        if ( xc_vcpu_getinfo(xch, dom->domid, v, &info) || !info.online )
+        {
+            dom->vcpu_time[v] = 0;
+            continue;
+        }
+
+        if ( dom->vcpu_time[v] && info.cpu < nr_cpus &&
+             cpu_node[info.cpu] < nr_nodes &&
+             info.cpu_time > dom->vcpu_time[v] )
+            dom->node_time[cpu_node[info.cpu]] +=
+                info.cpu_time - dom->vcpu_time[v];
+
+        dom->vcpu_time[v] = info.cpu_time;
+    }
+}
+
+static int set_affinity(struct nb_domain *dom, unsigned int node)
+{
+    xc_nodemap_t nodemap;
+    xc_cpumap_t cpumap = NULL;
+    unsigned int v, cpu;
+    int rc = -1;
+
+    nodemap = xc_nodemap_alloc(xch);
+    if ( !nodemap )
+        return -1;
+
+    nodemap[node / 8] |= 1 << (node % 8);
+    if ( xc_domain_node_setaffinity(xch, dom->domid, nodemap) )
+    {
+        fprintf(stderr, "d%u: failed to set node affinity: %s\n",
+                dom->domid, strerror(errno));
+        goto out;
+    }
+
+    if ( pin_soft )
+    {
+        cpumap = xc_cpumap_alloc(xch);
+        if ( !cpumap )
+            goto out;
+
+        for ( cpu = 0; cpu < nr_cpus; cpu++ )
+            if ( cpu_node[cpu] == node )
+                cpumap[cpu / 8] |= 1 << (cpu % 8);
+
+        /*
+         * Both maps are updated in place with the effective affinity, so
+         * start from a fresh copy for every vCPU.  Hard affinity is left
+         * alone, its map only needs to be there.
+         */
+        for ( v = 0; v < dom->nr_vcpus; v++ )
+        {
+            xc_cpumap_t hard = xc_cpumap_alloc(xch);
+            xc_cpumap_t soft = xc_cpumap_alloc(xch);
+
+            if ( !hard || !soft )
+            {
+                free(hard);
+                free(soft);
+                goto out;
+            }
+            memcpy(soft, cpumap, (nr_cpus + 7) / 8);
+            if ( xc_vcpu_setaffinity(xch, dom->domid, v, hard, soft,
+                                     XEN_VCPUAFFINITY_SOFT) )
+                fprintf(stderr, "d%u: failed to set soft affinity of vcpu "
+                        "%u: %s\n", dom->domid, v, strerror(errno));
+            free(hard);
+            free(soft);
+        }
+    }
+
+    dom->affinity = node;
+    rc = 0;
+
+ out:
+    free(cpumap);
+    free(nodemap);
+    return rc;
+}
+
+static int balance(struct nb_domain *dom)
+{
+    uint64_t total_time = 0, total_pages = 0, weighted = 0, moved = 0;
+    uint64_t budget, nr_gfns, avail;
+    xen_pfn_t max_gpfn;
+    unsigned int n, home = 0, share, local_mem;
+    const char *action = "";
+    int local, rc = 0;
+
+    for ( n = 0; n < nr_nodes; n++ )
+    {
+        total_time += dom->node_time[n];
+        if ( dom->node_time[n] > dom->node_time[home] )
+            home = n;
+    }
+
+    if ( !total_time )
+    {
+        if ( verbose )
+            printf("d%-5u idle\n", dom->domid);
+        return 0;
+    }
+
+    if ( xc_domain_maximum_gpfn(xch, dom->domid, &max_gpfn) < 0 ||
+         xc_domain_count_node_pages(xch, dom->domid, 0, max_gpfn + 1,
+                                    nr_nodes, dom->node_pages) )
+    {
+        fprintf(stderr, "d%u: failed to get memory placement: %s\n",
+                dom->domid, strerror(errno));
+        return -1;
+    }
+
+    for ( n = 0; n < nr_nodes; n++ )
+    {
+        total_pages += dom->node_pages[n];
+        weighted += (dom->node_time[n] / 1000) * dom->node_pages[n];
+    }
+    if ( !total_pages )
+        return 0;
+
+    local = weighted * 100 / ((total_time / 1000) * total_pages ?: 1);
+    share = dom->node_time[home] * 100 / total_time;
+    local_mem = dom->node_pages[home] * 100 / total_pages;
+
+    if ( dom->first_local < 0 )
+        dom->first_local = local;
+    dom->last_local = local;
+
+    if ( home == dom->home )
+        dom->stable++;
+    else
+    {
+        dom->home = home;
+        dom->stable = 1;
+    }
+
+    if ( share < vcpu_share )
+        action = "vcpus spread";
+    else if ( local_mem >= target )
+        action = "ok";
+    else if ( dom->stable < stable )
+        action = "waiting";
+    else
+    {
+        /* Keep some memory back for the node's own guests. */
+        avail = meminfo[home].memfree >> XC_PAGE_SHIFT;
+        avail = avail > reserve ? avail - reserve : 0;
+        budget = total_pages - dom->node_pages[home];
+        if ( budget > rate )
+            budget = rate;
+        if ( budget > avail )
+            budget = avail;
+
+        if ( !budget )
+            action = "node full";
+        else if ( dry_run )
+            action = "would move";
+        else
+        {
+            if ( dom->affinity != home && set_affinity(dom, home) )
+                return -1;
+
+            if ( dom->next_gfn > max_gpfn )
+                dom->next_gfn = 0;
+            nr_gfns = max_gpfn + 1 - dom->next_gfn;
+            rc = xc_domain_migrate_node_pages(xch, dom->domid, home,
+                                              dom->next_gfn, &nr_gfns,
+                                              budget, &moved);
+            if ( rc && errno != ENOMEM )
+            {
+                fprintf(stderr, "d%u: failed to move memory: %s\n",
+                        dom->domid, strerror(errno));
+                return -1;
+            }
+
+            /* Resume where we stopped, or rescan for stragglers. */
+            dom->next_gfn += nr_gfns;
+            dom->moved += moved;
+            meminfo[home].memfree -= moved << XC_PAGE_SHIFT;
+            action = rc ? "node full" : "moving";
+        }
+    }
+
+    printf("d%-5u node %-3u vcpus %3u%%  memory %3u%%  local %3d%%  "
+           "moved %8"PRIu64"K  %s\n", dom->domid, home, share, local_mem,
+           local, PAGES_TO_KB(moved), action);
+
+    return 0;
+}
+
+static unsigned long parse_ulong(const char *arg, const char *what)
+{
+    char *end;
+    unsigned long val = strtoul(arg, &end, 0);
+
+    if ( *end )
+    {
+        fprintf(stderr, "Invalid %s '%s'\n", what, arg);
+        exit(2);
+    }
+
+    return val;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "count",    required_argument, NULL, 'c' },
+        { "rate",     required_argument, NULL, 'r' },
+        { "reserve",  required_argument, NULL, 'R' },
+        { "share",    required_argument, NULL, 's' },
+        { "target",   required_argument, NULL, 't' },
+        { "stable",   required_argument, NULL, 'S' },
+        { "pin",      no_argument,       NULL, 'p' },
+        { "dry-run",  no_argument,       NULL, 'n' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned int interval = DEFAULT_INTERVAL, i, s;
+    unsigned long count = 0, iter;
+    unsigned int max_nodes;
+    int ch, rc = 0;
+
+    while ( (ch = getopt_long(argc, argv, "i:c:r:R:s:t:S:pnvh",
+                              opts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'i':
+            interval = parse_ulong(optarg, "interval");
+            if ( !interval )
+            {
+                fprintf(stderr, "Invalid interval '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'c':
+            count = parse_ulong(optarg, "count");
+            break;
+        case 'r':
+            rate = MB_TO_PAGES(parse_ulong(optarg, "rate"));
+            break;
+        case 'R':
+            reserve = MB_TO_PAGES(parse_ulong(optarg, "reserve"));
+            break;
+        case 's':
+            vcpu_share = parse_ulong(optarg, "share");
+            break;
+        case 't':
+            target = parse_ulong(optarg, "target");
+            break;
+        case 'S':
+            stable = parse_ulong(optarg, "stable");
+            break;
+        case 'p':
+            pin_soft = 1;
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        unsigned long domid = parse_ulong(argv[optind], "domid");
+
+        if ( domid >= DOMID_FIRST_RESERVED || nr_only == MAX_DOMAINS )
+        {
+            fprintf(stderr, "Invalid domid '%s'\n", argv[optind]);
+            return 2;
+        }
+        only[nr_only++] = domid;
+    }
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if ( topology_init() )
+    {
+        rc = 1;
+        goto out;
+    }
+
+    if ( nr_nodes < 2 )
+    {
+        fprintf(stderr, "Only one NUMA node, nothing to do\n");
+        goto out;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    for ( iter = 0; !interrupted && (!count || iter < count); iter++ )
+    {
+        if ( domains_refresh() )
+        {
+            rc = 1;
+            break;
+        }
+
+        for ( i = 0; i < nr_domains; i++ )
+            memset(domains[i].node_time, 0,
+                   nr_nodes * sizeof(*domains[i].node_time));
+
+        for ( s = 0; s <= SAMPLES && !interrupted; s++ )
+        {
+            for ( i = 0; i < nr_domains; i++ )
+                sample_vcpus(&domains[i]);
+            if ( s < SAMPLES )
+                usleep(interval * 1000000 / SAMPLES);
+        }
+        if ( interrupted )
+            break;
+
+        max_nodes = nr_nodes;
+        if ( xc_numainfo(xch, &max_nodes, meminfo, distance) )
+        {
+            perror("xc_numainfo");
+            rc = 1;
+            break;
+        }
+
+        for ( i = 0; i < nr_domains; i++ )
+            if ( balance(&domains[i]) )
+                rc = 1;
+        fflush(stdout);
+    }
+
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        if ( domains[i].first_local >= 0 )
+            printf("d%u: estimated local accesses %d%% -> %d%%, "
+                   "%"PRIu64"K moved\n", domains[i].domid,
+                   domains[i].first_local, domains[i].last_local,
+                   PAGES_TO_KB(domains[i].moved));
+        domain_free(&domains[i]);
+    }
+
+ out:
+    free(cpu_node);
+    free(meminfo);
+    free(distance);
+    xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,331 @@
+/*
+ * xen-wss: working-set size sampler.
+ *
+ * Periodically harvests (and clears) the EPT accessed bits of a set of HVM
+ * domains and keeps, for every page, the number of sampling intervals since
+ * it was last accessed.  From those idle ages it prints, per interval, a
+ * histogram of the working-set size over increasing windows: the amount of
+ * memory touched in the last 1, 2, 4, ... intervals.  Memory which has not
+ * been touched in the largest window is a good candidate for ballooning out.
+ *
+ * Requires Xen to be booted with EPT A/D bits enabled ("ept=ad").
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+#define MAX_DOMAINS        64
+#define DEFAULT_INTERVAL   5
+/* Windows of 1, 2, 4, ... 2^(NR_WINDOWS-1) intervals. */
+#define NR_WINDOWS         8
+/* Idle ages saturate here; must exceed the largest window. */
+#define AGE_MAX            255
+
+struct wss_domain {
+    domid_t domid;
+    xen_pfn_t max_gpfn;
+    uint8_t *bitmap;            /* accessed bits from the last harvest */
+    uint8_t *age;               /* intervals since each gfn was accessed */
+    unsigned long samples;
+    int failed;
+};
+
+static xc_interface *xch;
+static struct wss_domain domains[MAX_DOMAINS];
+static unsigned int nr_domains;
+
+static int verbose;
+static volatile sig_atomic_t interrupted;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options] <domid> [<domid> ...]\n", prog);
+    printf("\n");
+    printf("Sample the working-set size of HVM domains from EPT accessed bits.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -i, --interval=SECS   seconds between samples (default %d)\n",
+           DEFAULT_INTERVAL);
+    printf("  -c, --count=N         stop after N samples (default: run until\n"
+           "                        interrupted)\n");
+    printf("  -v, --verbose         also report per-sample harvest time\n");
+    printf("  -h, --help            display this help and exit\n");
+}
+
+static void sighandler(int sig)
+{
+    interrupted = 1;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* (Re)size the per-gfn arrays if the guest's physmap has grown. */
+static int wss_resize(struct wss_domain *dom)
+{
+    xen_pfn_t max_gpfn;
+    uint8_t *bitmap, *age;
+    unsigned long old;
+
+    if ( xc_domain_maximum_gpfn(xch, dom->domid, &max_gpfn) < 0 )
+    {
+        fprintf(stderr, "d%u: failed to get maximum gpfn: %s\n",
+                dom->domid, strerror(errno));
+        return -1;
+    }
+
+    if ( dom->age && max_gpfn <= dom->max_gpfn )
+        return 0;
+
+    old = dom->age ? dom->max_gpfn + 1 : 0;
+
+    bitmap = realloc(dom->bitmap, (max_gpfn + 8) / 8);
+    if ( !bitmap )
+        goto nomem;
+    dom->bitmap = bitmap;
+
+    age = realloc(dom->age, max_gpfn + 1);
+    if ( !age )
+        goto nomem;
+    /* Pages we have never seen start out as cold as possible. */
+    memset(age + old, AGE_MAX, max_gpfn + 1 - old);
+    dom->age = age;
+
+    dom->max_gpfn = max_gpfn;
+    return 0;
+
+ nomem:
+    fprintf(stderr, "d%u: out of memory\n", dom->domid);
+    return -1;
+}
+
+static int wss_sample(struct wss_domain *dom)
+{
+    unsigned long window[NR_WINDOWS] = { 0 };
+    unsigned long nr_gfns, gfn, populated = 0;
+    uint64_t accessed;
+    double start, took;
+    unsigned int i;
+
+    if ( wss_resize(dom) )
+        return -1;
+
+    nr_gfns = dom->max_gpfn + 1;
+
+    start = now();
+    if ( xc_domain_harvest_accessed(xch, dom->domid, 0, nr_gfns,
+                                    dom->bitmap, 1, &accessed) )
+    {
+        fprintf(stderr, "d%u: failed to harvest accessed bits: %s\n",
+                dom->domid, strerror(errno));
+        return -1;
+    }
+    took = now() - start;
+
+    for ( gfn = 0; gfn < nr_gfns; gfn++ )
+    {
+        uint8_t *age = &dom->age[gfn];
+
+        if ( dom->bitmap[gfn / 8] & (1 << (gfn % 8)) )
+            *age = 0;
+        else if ( *age < AGE_MAX )
+            (*age)++;
+
+        if ( *age == AGE_MAX )
+            continue;
+
+        populated++;
+        for ( i = 0; i < NR_WINDOWS; i++ )
+            if ( *age < (1u << i) )
+                window[i]++;
+    }
+
+    dom->samples++;
+
+    printf("d%-5u %6lu %10"PRIu64"K", dom->domid, dom->samples,
+           accessed << (XC_PAGE_SHIFT - 10));
+    /* Windows longer than our history would just repeat the last one. */
+    for ( i = 0; i < NR_WINDOWS && (1ul << i) <= dom->samples; i++ )
+        printf(" %10luK", window[i] << (XC_PAGE_SHIFT - 10));
+    if ( verbose )
+        printf("  (%lu gfns seen, harvest %.3fs)", populated, took);
+    printf("\n");
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "count",    required_argument, NULL, 'c' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned int interval = DEFAULT_INTERVAL, i, active;
+    unsigned long count = 0, sample;
+    char *end;
+    int ch, rc = 0;
+
+    while ( (ch = getopt_long(argc, argv, "i:c:vh", opts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'i':
+            interval = strtoul(optarg, &end, 0);
+            if ( *end || !interval )
+            {
+                fprintf(stderr, "Invalid interval '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'c':
+            count = strtoul(optarg, &end, 0);
+            if ( *end )
+            {
+                fprintf(stderr, "Invalid count '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ( optind == argc )
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        unsigned long domid = strtoul(argv[optind], &end, 0);
+
+        if ( *end || domid >= DOMID_FIRST_RESERVED )
+        {
+            fprintf(stderr, "Invalid domid '%s'\n", argv[optind]);
+            return 2;
+        }
+        if ( nr_domains == MAX_DOMAINS )
+        {
+            fprintf(stderr, "Too many domains (max %d)\n", MAX_DOMAINS);
+            return 2;
+        }
+        domains[nr_domains++].domid = domid;
+    }
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    /* Column "lastN": memory accessed within the last N intervals. */
+    printf("%-6s %6s %11s", "domain", "sample", "accessed");
+    for ( i = 0; i < NR_WINDOWS; i++ )
+    {
+        char hdr[16];
+
+        snprintf(hdr, sizeof(hdr), "last%u", 1u << i);
+        printf(" %11s", hdr);
+    }
+    printf("\n");
+
+    /*
+     * The first harvest only clears whatever accessed bits have built up
+     * since boot, so only report from the second one on.
+     */
+    for ( i = 0; i < nr_domains; i++ )
+        if ( wss_resize(&domains[i]) ||
+             xc_domain_harvest_accessed(xch, domains[i].domid, 0,
+                                        domains[i].max_gpfn + 1,
+                                        domains[i].bitmap, 1, NULL) )
+        {
+            fprintf(stderr, "d%u: unable to sample: %s\n",
+                    domains[i].domid, strerror(errno));
+            domains[i].failed = 1;
+        }
+
+    for ( sample = 0; !interrupted && (!count || sample < count); sample++ )
+    {
+        sleep(interval);
+        if ( interrupted )
+            break;
+
+        for ( i = 0, active = 0; i < nr_domains; i++ )
+        {
+            if ( domains[i].failed )
+                continue;
+            if ( wss_sample(&domains[i]) )
+            {
+                domains[i].failed = 1;
+                rc = 1;
+                continue;
+            }
+            active++;
+        }
+
+        if ( !active )
+        {
+            rc = 1;
+            break;
+        }
+        fflush(stdout);
+    }
+
+    for ( i = 0; i < nr_domains; i++ )
+    {
+        free(domains[i].bitmap);
+        free(domains[i].age);
+    }
+    xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,420 @@
+/*
+ * xenlockstat: top-like display of Xen's lock contention statistics.
+ *
+ * Xen accounts lock acquisitions and contention per acquisition site (see
+ * the lock_stats command line option).  This periodically queries those
+ * statistics and shows, for each interval, the sites which spent the most
+ * time waiting for their lock, together with the wait time distribution
+ * and the site which most often held the lock while they waited.
+ *
+ * Acquisition counts are sampled by Xen (one in every lock_stats_rate is
+ * accounted, scaled up) and so are estimates; contention is exact.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+
+#define DEFAULT_DELAY      2
+#define DEFAULT_LIMIT      20
+#define INITIAL_SITES      512
+
+enum sort_key { SORT_WAIT, SORT_CONTENDED, SORT_ACQUIRED };
+
+/* One acquisition site's activity during the last interval. */
+struct lockstat_row {
+    const xc_lockstat_data_t *cur;
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_time;
+    uint64_t wait_hist[XEN_SYSCTL_LOCKSTAT_BUCKETS];
+    int top_holder;
+    uint64_t top_holder_cnt;
+};
+
+static xc_interface *xch;
+static enum sort_key sort_key = SORT_WAIT;
+static volatile sig_atomic_t interrupted;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n", prog);
+    printf("\n");
+    printf("Show the Xen lock acquisition sites with the most contention.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -d, --delay=SECS       seconds between updates (default %d)\n",
+           DEFAULT_DELAY);
+    printf("  -n, --iterations=N     stop after N updates (default: run until\n"
+           "                         interrupted)\n");
+    printf("  -b, --batch            don't clear the screen between updates\n");
+    printf("  -s, --sort=KEY         sort by wait (default), contended or\n"
+           "                         acquired\n");
+    printf("  -l, --limit=N          show at most N sites, 0 for all\n"
+           "                         (default %d)\n", DEFAULT_LIMIT);
+    printf("  -r, --reset            reset the statistics before starting\n");
+    printf("  -h, --help             display this help and exit\n");
+}
+
+static void sighandler(int sig)
+{
+    interrupted = 1;
+}
+
+/* Counters may go backwards if someone else resets the statistics. */
+static uint64_t delta(uint64_t cur, uint64_t prev)
+{
+    return cur >= prev ? cur - prev : cur;
+}
+
+static int cmp_site(const void *a, const void *b)
+{
+    const xc_lockstat_data_t *x = a, *y = b;
+
+    return x->site < y->site ? -1 : x->site > y->site;
+}
+
+static int cmp_row(const void *a, const void *b)
+{
+    const struct lockstat_row *x = a, *y = b;
+    uint64_t kx, ky;
+
+    switch ( sort_key )
+    {
+    case SORT_CONTENDED:
+        kx = x->contended;
+        ky = y->contended;
+        break;
+    case SORT_ACQUIRED:
+        kx = x->acquired;
+        ky = y->acquired;
+        break;
+    default:
+        kx = x->wait_time;
+        ky = y->wait_time;
+        break;
+    }
+
+    return kx > ky ? -1 : kx < ky;
+}
+
+/* Upper bound, in ns, of the wait time below which @pct% of waits fell. */
+static uint64_t percentile(const uint64_t *hist, uint64_t total,
+                           unsigned int pct)
+{
+    uint64_t seen = 0, want = (total * pct + 99) / 100;
+    unsigned int i;
+
+    for ( i = 0; i < XEN_SYSCTL_LOCKSTAT_BUCKETS - 1; i++ )
+    {
+        seen += hist[i];
+        if ( seen >= want )
+            break;
+    }
+
+    return 1ull << (XEN_SYSCTL_LOCKSTAT_BUCKET_SHIFT + i);
+}
+
+static const char *fmt_ns(char *buf, size_t len, uint64_t ns)
+{
+    if ( ns < 10000 )
+        snprintf(buf, len, "%"PRIu64"ns", ns);
+    else if ( ns < 10000000 )
+        snprintf(buf, len, "%"PRIu64"us", ns / 1000);
+    else
+        snprintf(buf, len, "%"PRIu64"ms", ns / 1000000);
+
+    return buf;
+}
+
+static void display(const xc_lockstat_data_t *cur, unsigned int nr_cur,
+                    const xc_lockstat_data_t *prev, unsigned int nr_prev,
+                    struct lockstat_row *rows, double secs,
+                    uint32_t sample_rate, uint64_t overflow,
+                    unsigned int limit, int batch)
+{
+    unsigned int i, j, nr_rows = 0;
+    uint64_t tot_acq = 0, tot_cont = 0, tot_wait = 0;
+    char avg[16], max[16], p50[16], p99[16];
+
+    for ( i = 0; i < nr_cur; i++ )
+    {
+        const xc_lockstat_data_t *c = &cur[i];
+        const xc_lockstat_data_t *p = bsearch(c, prev, nr_prev, sizeof(*prev),
+                                              cmp_site);
+        struct lockstat_row *r = &rows[nr_rows];
+
+        memset(r, 0, sizeof(*r));
+        r->cur = c;
+        r->top_holder = -1;
+        r->acquired = delta(c->nr_acquired, p ? p->nr_acquired : 0);
+        r->contended = delta(c->nr_contended, p ? p->nr_contended : 0);
+        r->wait_time = delta(c->wait_time, p ? p->wait_time : 0);
+        for ( j = 0; j < XEN_SYSCTL_LOCKSTAT_BUCKETS; j++ )
+            r->wait_hist[j] = delta(c->wait_hist[j],
+                                    p ? p->wait_hist[j] : 0);
+        /* Holder slots never move once claimed, so compare by index. */
+        for ( j = 0; j < XEN_SYSCTL_LOCKSTAT_HOLDERS; j++ )
+        {
+            uint64_t n = delta(c->holder[j].count,
+                               p ? p->holder[j].count : 0);
+
+            if ( c->holder[j].name[0] && n > r->top_holder_cnt )
+            {
+                r->top_holder = j;
+                r->top_holder_cnt = n;
+            }
+        }
+
+        tot_acq += r->acquired;
+        tot_cont += r->contended;
+        tot_wait += r->wait_time;
+
+        if ( r->acquired || r->contended )
+            nr_rows++;
+    }
+
+    qsort(rows, nr_rows, sizeof(*rows), cmp_row);
+
+    if ( !batch )
+        printf("\033[H\033[2J");
+
+    printf("%u sites, %.0f acquisitions/s (1 in %u sampled), "
+           "%.0f contended/s, %.3f%% of time waiting",
+           nr_cur, tot_acq / secs, sample_rate, tot_cont / secs,
+           tot_wait / secs / 1e7);
+    if ( overflow )
+        printf(", %"PRIu64" untracked", overflow);
+    printf("\n\n");
+
+    printf("%-36s %10s %9s %6s %8s %8s %8s %8s  %s\n",
+           "site", "acq/s", "cont/s", "%cont", "avg", "p50", "p99", "max",
+           "top holder");
+
+    for ( i = 0; i < nr_rows && (!limit || i < limit); i++ )
+    {
+        const struct lockstat_row *r = &rows[i];
+        char name[48];
+        double pct = r->acquired ? 100.0 * r->contended / r->acquired : 0;
+
+        snprintf(name, sizeof(name), "%s%s", r->cur->name,
+                 r->cur->flags & XEN_SYSCTL_LOCKSTAT_RWLOCK ? " (rw)" : "");
+        printf("%-36.36s %10.0f %9.0f %5.1f%%", name, r->acquired / secs,
+               r->contended / secs, pct > 100 ? 100 : pct);
+        if ( r->contended )
+            printf(" %8s %8s %8s %8s  %s\n",
+                   fmt_ns(avg, sizeof(avg), r->wait_time / r->contended),
+                   fmt_ns(p50, sizeof(p50),
+                          percentile(r->wait_hist, r->contended, 50)),
+                   fmt_ns(p99, sizeof(p99),
+                          percentile(r->wait_hist, r->contended, 99)),
+                   fmt_ns(max, sizeof(max), r->cur->wait_max),
+                   r->top_holder >= 0 ?
+                   r->cur->holder[r->top_holder].name : "-");
+        else
+            printf(" %8s %8s %8s %8s  %s\n", "-", "-", "-", "-", "-");
+    }
+
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "delay",      required_argument, NULL, 'd' },
+        { "iterations", required_argument, NULL, 'n' },
+        { "batch",      no_argument,       NULL, 'b' },
+        { "sort",       required_argument, NULL, 's' },
+        { "limit",      required_argument, NULL, 'l' },
+        { "reset",      no_argument,       NULL, 'r' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    DECLARE_HYPERCALL_BUFFER(xc_lockstat_data_t, data);
+    xc_lockstat_data_t *prev = NULL;
+    struct lockstat_row *rows = NULL;
+    unsigned int delay = DEFAULT_DELAY, limit = DEFAULT_LIMIT;
+    unsigned int size = INITIAL_SITES, nr_prev = 0;
+    unsigned long iterations = 0, iter;
+    uint64_t time, prev_time = 0, overflow;
+    uint32_t nr, sample_rate;
+    int ch, batch = 0, reset = 0, rc = 1;
+    char *end;
+
+    while ( (ch = getopt_long(argc, argv, "d:n:bs:l:rh", opts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'd':
+            delay = strtoul(optarg, &end, 0);
+            if ( *end || !delay )
+            {
+                fprintf(stderr, "Invalid delay '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'n':
+            iterations = strtoul(optarg, &end, 0);
+            if ( *end )
+            {
+                fprintf(stderr, "Invalid iteration count '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 's':
+            if ( !strcmp(optarg, "wait") )
+                sort_key = SORT_WAIT;
+            else if ( !strcmp(optarg, "contended") )
+                sort_key = SORT_CONTENDED;
+            else if ( !strcmp(optarg, "acquired") )
+                sort_key = SORT_ACQUIRED;
+            else
+            {
+                fprintf(stderr, "Invalid sort key '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'l':
+            limit = strtoul(optarg, &end, 0);
+            if ( *end )
+            {
+                fprintf(stderr, "Invalid limit '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'r':
+            reset = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ( optind != argc )
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if ( reset && xc_lockstat_reset(xch) )
+    {
+        fprintf(stderr, "Error resetting lock statistics: %s\n",
+                strerror(errno));
+        goto out;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    /* The first query only provides the baseline for the first interval. */
+    for ( iter = 0; !interrupted; iter++ )
+    {
+        for ( ;; )
+        {
+            if ( !data )
+            {
+                data = xc_hypercall_buffer_alloc(xch, data,
+                                                 sizeof(*data) * size);
+                rows = realloc(rows, sizeof(*rows) * size);
+                if ( !data || !rows )
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    goto out;
+                }
+            }
+
+            nr = size;
+            if ( xc_lockstat_query(xch, &nr, &time, &sample_rate, &overflow,
+                                   HYPERCALL_BUFFER(data)) )
+            {
+                fprintf(stderr, "Error querying lock statistics: %s\n",
+                        errno == EOPNOTSUPP ?
+                        "disabled (see the lock_stats option)" :
+                        strerror(errno));
+                goto out;
+            }
+            if ( nr <= size )
+                break;
+
+            /* More sites than we had room for: grow and retry. */
+            xc_hypercall_buffer_free(xch, data);
+            data = NULL;
+            size = nr + nr / 2;
+        }
+
+        qsort(data, nr, sizeof(*data), cmp_site);
+
+        /* Skip an interval in which the statistics got reset. */
+        if ( iter && time > prev_time )
+            display(data, nr, prev, nr_prev, rows,
+                    (time - prev_time) / 1e9, sample_rate, overflow,
+                    limit, batch);
+
+        free(prev);
+        prev = malloc(sizeof(*prev) * (nr ?: 1));
+        if ( !prev )
+        {
+            fprintf(stderr, "Out of memory\n");
+            goto out;
+        }
+        memcpy(prev, data, sizeof(*prev) * nr);
+        nr_prev = nr;
+        prev_time = time;
+
+        if ( iterations && iter >= iterations )
+            break;
+
+        sleep(delay);
+    }
+
+    rc = 0;
+
+ out:
+    free(prev);
+    free(rows);
+    xc_hypercall_buffer_free(xch, data);
+    xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
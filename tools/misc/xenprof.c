@@ -0,0 +1,827 @@
+/*
+ * xenprof: sampling profiler for the hypervisor.
+ *
+ * Drives the xenoprof performance counter interface directly, without the
+ * oprofile userspace: one counter is programmed to overflow every N events
+ * and, on each overflow NMI, Xen writes the interrupted hypervisor RIP, the
+ * domain/vCPU it was running on behalf of and (if built with frame pointers)
+ * its call chain into a per-physical-CPU buffer shared with dom0.  Samples
+ * are resolved against the xen-syms ELF image and written out either as
+ * folded stacks, ready for flamegraph.pl, or in the text format produced by
+ * "perf script", for the tools which consume that.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xen/xenoprof.h>
+
+#define DEFAULT_PERIOD     1000000
+#define DEFAULT_DEPTH      16
+#define DEFAULT_DURATION   10
+#define DEFAULT_ENTRIES    32768
+#define MAX_DEPTH          64
+#define POLL_MS            100
+#define STACK_HASH_SIZE    4096
+
+/* Unhalted core cycles. */
+#define INTEL_CYCLES       0x3c
+#define AMD_CYCLES         0x76
+
+struct symbol {
+    uint64_t addr, size;
+    const char *name;
+};
+
+struct sample {
+    unsigned int cpu;
+    domid_t domid;
+    uint32_t vcpu;
+    uint64_t ip;
+    unsigned int depth;
+    uint64_t callers[MAX_DEPTH];
+};
+
+struct stack {
+    char *folded;
+    unsigned long count;
+    struct stack *next;
+};
+
+struct cpu_buf {
+    struct xenoprof_buf *buf;
+    size_t mapsize;
+    unsigned long samples;
+};
+
+enum { FORMAT_FOLDED, FORMAT_SCRIPT };
+
+static xc_interface *xch;
+
+static struct symbol *symbols;
+static unsigned long nr_symbols;
+static void *syms_image;
+static size_t syms_size;
+
+static struct cpu_buf *cpus;
+static unsigned int nr_cpus;
+static unsigned int nr_entries;
+
+static struct stack *stacks[STACK_HASH_SIZE];
+
+static FILE *out;
+static int format = FORMAT_FOLDED;
+static int context;
+static unsigned long period = DEFAULT_PERIOD;
+static const char *event_name = "cycles";
+
+static volatile sig_atomic_t interrupted;
+
+/* How far set up we got, for unwinding. */
+static enum {
+    ST_NONE, ST_INIT, ST_BUFFER, ST_RESERVED, ST_VIRQ, ST_STARTED
+} state;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n", prog);
+    printf("\n");
+    printf("Profile the hypervisor by sampling on performance counter overflow.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -x, --xen-syms=FILE     symbol file (default\n"
+           "                          /usr/lib/debug/xen-syms-<version>)\n");
+    printf("  -e, --event=EV[:UMASK]  raw event to sample on (default:\n"
+           "                          unhalted core cycles)\n");
+    printf("  -c, --count=N           sample every N events (default %d)\n",
+           DEFAULT_PERIOD);
+    printf("  -g, --callgraph=DEPTH   call chain depth, 0 to disable "
+           "(default %d)\n", DEFAULT_DEPTH);
+    printf("  -d, --duration=SECS     sampling duration (default %d)\n",
+           DEFAULT_DURATION);
+    printf("  -b, --buffer=N          per-CPU buffer entries (default %d)\n",
+           DEFAULT_ENTRIES);
+    printf("  -f, --format=FMT        'folded' (default) or 'script'\n");
+    printf("  -C, --context           root folded stacks at the domain "
+           "sampled\n");
+    printf("  -o, --output=FILE       write samples to FILE (default "
+           "stdout)\n");
+    printf("  -h, --help              display this help and exit\n");
+    printf("\n");
+    printf("Call chains require a hypervisor built with frame_pointer=y.\n");
+}
+
+static void sighandler(int sig)
+{
+    interrupted = 1;
+}
+
+static int cmp_symbol(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Load the function symbols of an x86-64 ELF image. */
+static int load_symbols(const char *path)
+{
+    const Elf64_Ehdr *ehdr;
+    const Elf64_Shdr *shdr;
+    struct stat st;
+    unsigned int i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 || fstat(fd, &st) < 0 )
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if ( fd >= 0 )
+            close(fd);
+        return -1;
+    }
+
+    syms_size = st.st_size;
+    syms_image = mmap(NULL, syms_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( syms_image == MAP_FAILED )
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    ehdr = syms_image;
+    if ( syms_size < sizeof(*ehdr) ||
+         memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+         ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+         ehdr->e_shentsize != sizeof(*shdr) ||
+         ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(*shdr) > syms_size )
+    {
+        fprintf(stderr, "%s: not a 64-bit ELF image\n", path);
+        return -1;
+    }
+    shdr = syms_image + ehdr->e_shoff;
+
+    for ( i = 0; i < ehdr->e_shnum; i++ )
+    {
+        const Elf64_Shdr *strtab;
+        const Elf64_Sym *sym;
+        unsigned long j, n;
+        const char *strings;
+
+        if ( shdr[i].sh_type != SHT_SYMTAB || shdr[i].sh_link >= ehdr->e_shnum )
+            continue;
+
+        strtab = &shdr[shdr[i].sh_link];
+        if ( shdr[i].sh_offset + shdr[i].sh_size > syms_size ||
+             strtab->sh_offset + strtab->sh_size > syms_size )
+            break;
+
+        sym = syms_image + shdr[i].sh_offset;
+        n = shdr[i].sh_size / sizeof(*sym);
+        strings = syms_image + strtab->sh_offset;
+
+        symbols = calloc(n, sizeof(*symbols));
+        if ( !symbols )
+        {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+
+        for ( j = 0; j < n; j++ )
+        {
+            if ( ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC ||
+                 !sym[j].st_value || sym[j].st_name >= strtab->sh_size )
+                continue;
+
+            symbols[nr_symbols].addr = sym[j].st_value;
+            symbols[nr_symbols].size = sym[j].st_size;
+            symbols[nr_symbols].name = strings + sym[j].st_name;
+            nr_symbols++;
+        }
+        break;
+    }
+
+    if ( !nr_symbols )
+    {
+        fprintf(stderr, "%s: no function symbols found\n", path);
+        return -1;
+    }
+
+    qsort(symbols, nr_symbols, sizeof(*symbols), cmp_symbol);
+
+    return 0;
+}
+
+static const struct symbol *lookup_symbol(uint64_t addr)
+{
+    unsigned long lo = 0, hi = nr_symbols;
+
+    while ( hi - lo > 1 )
+    {
+        unsigned long mid = lo + (hi - lo) / 2;
+
+        if ( symbols[mid].addr <= addr )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if ( symbols[lo].addr > addr ||
+         (symbols[lo].size && addr >= symbols[lo].addr + symbols[lo].size) )
+        return NULL;
+
+    return &symbols[lo];
+}
+
+static const char *symbol_name(uint64_t addr, char *buf, size_t size)
+{
+    const struct symbol *sym = lookup_symbol(addr);
+
+    if ( sym )
+        return sym->name;
+
+    snprintf(buf, size, "[%#"PRIx64"]", addr);
+    return buf;
+}
+
+static void domain_name(domid_t domid, char *buf, size_t size)
+{
+    if ( domid == DOMID_IDLE )
+        snprintf(buf, size, "idle");
+    else
+        snprintf(buf, size, "d%u", domid);
+}
+
+static unsigned long hash_string(const char *s)
+{
+    unsigned long h = 5381;
+
+    while ( *s )
+        h = h * 33 + (unsigned char)*s++;
+
+    return h;
+}
+
+static int record_folded(const struct sample *s)
+{
+    char folded[MAX_DEPTH * 64], name[32];
+    struct stack *st;
+    size_t len = 0;
+    unsigned long h;
+    int i;
+
+    if ( context )
+    {
+        domain_name(s->domid, name, sizeof(name));
+        len += snprintf(folded + len, sizeof(folded) - len, "%s;", name);
+    }
+
+    /* Outermost caller first; return addresses point after the call. */
+    for ( i = s->depth - 1; i >= 0 && len < sizeof(folded); i-- )
+        len += snprintf(folded + len, sizeof(folded) - len, "%s;",
+                        symbol_name(s->callers[i] - 1, name, sizeof(name)));
+    if ( len < sizeof(folded) )
+        snprintf(folded + len, sizeof(folded) - len, "%s",
+                 symbol_name(s->ip, name, sizeof(name)));
+
+    h = hash_string(folded) % STACK_HASH_SIZE;
+    for ( st = stacks[h]; st; st = st->next )
+        if ( !strcmp(st->folded, folded) )
+        {
+            st->count++;
+            return 0;
+        }
+
+    st = malloc(sizeof(*st));
+    if ( !st || !(st->folded = strdup(folded)) )
+    {
+        free(st);
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    st->count = 1;
+    st->next = stacks[h];
+    stacks[h] = st;
+
+    return 0;
+}
+
+static void print_frame(uint64_t addr, uint64_t lookup)
+{
+    const struct symbol *sym = lookup_symbol(lookup);
+
+    if ( sym )
+        fprintf(out, "\t%16"PRIx64" %s+0x%"PRIx64" (xen-syms)\n",
+                addr, sym->name, addr - sym->addr);
+    else
+        fprintf(out, "\t%16"PRIx64" [unknown] (xen-syms)\n", addr);
+}
+
+/* Mimic "perf script" output, so that its consumers can read ours. */
+static void record_script(const struct sample *s)
+{
+    char name[32];
+    unsigned int i;
+
+    domain_name(s->domid, name, sizeof(name));
+    fprintf(out, "xen-%s %5u/%-5u [%03u] %lu %s:\n",
+            name, s->domid, s->vcpu, s->cpu, period, event_name);
+    print_frame(s->ip, s->ip);
+    for ( i = 0; i < s->depth; i++ )
+        print_frame(s->callers[i], s->callers[i] - 1);
+    fprintf(out, "\n");
+}
+
+static int record_sample(const struct sample *s)
+{
+    cpus[s->cpu].samples++;
+
+    if ( format == FORMAT_SCRIPT )
+    {
+        record_script(s);
+        return 0;
+    }
+
+    return record_folded(s);
+}
+
+/*
+ * Consume the complete samples in a CPU's buffer.  Xen moves the head after
+ * every entry, so the last sample may still be being written unless
+ * sampling has stopped (@final); leave it for next time.
+ */
+static int drain_cpu(unsigned int cpu, int final)
+{
+    struct xenoprof_buf *buf = cpus[cpu].buf;
+    struct sample s = { 0 };
+    unsigned int head, tail, start, i;
+    int in_sample = 0, have_ctx = 0, have_ip = 0;
+
+    head = *(volatile uint32_t *)&buf->event_head;
+    xen_rmb();
+    tail = start = buf->event_tail;
+
+    if ( head >= nr_entries || tail >= nr_entries )
+    {
+        fprintf(stderr, "CPU%u: corrupt buffer indices\n", cpu);
+        return -1;
+    }
+
+    for ( i = tail; i != head; i = (i + 1 < nr_entries) ? i + 1 : 0 )
+    {
+        const struct event_log *e = &buf->event_log[i];
+
+        if ( e->eip == XENOPROF_ESCAPE_CODE )
+        {
+            if ( e->event != XENOPROF_XEN_CONTEXT )
+                continue;
+
+            if ( in_sample && have_ip && record_sample(&s) )
+                return -1;
+
+            memset(&s, 0, sizeof(s));
+            s.cpu = cpu;
+            in_sample = 1;
+            have_ctx = have_ip = 0;
+            start = i;
+        }
+        else if ( !in_sample )
+            continue;
+        else if ( !have_ctx )
+        {
+            s.domid = XENOPROF_XEN_CONTEXT_DOMID(e->eip);
+            s.vcpu = XENOPROF_XEN_CONTEXT_VCPU(e->eip);
+            have_ctx = 1;
+        }
+        else if ( !have_ip )
+        {
+            s.ip = e->eip;
+            have_ip = 1;
+        }
+        else if ( s.depth < MAX_DEPTH )
+            s.callers[s.depth++] = e->eip;
+    }
+
+    if ( final )
+    {
+        if ( in_sample && have_ip && record_sample(&s) )
+            return -1;
+        start = head;
+    }
+    else if ( !in_sample )
+        start = head;
+
+    xen_mb();
+    buf->event_tail = start;
+
+    return 0;
+}
+
+static int profile_op(int op, void *arg, size_t size, const char *what)
+{
+    int rc = xc_xenoprof_op(xch, op, arg, size);
+
+    if ( rc < 0 )
+        fprintf(stderr, "xenoprof %s failed: %s\n", what, strerror(errno));
+
+    return rc;
+}
+
+static int map_cpu_buffers(unsigned int entries)
+{
+    xc_physinfo_t physinfo = { 0 };
+    unsigned int cpu;
+
+    if ( xc_physinfo(xch, &physinfo) )
+    {
+        fprintf(stderr, "Failed to get physinfo: %s\n", strerror(errno));
+        return -1;
+    }
+
+    nr_cpus = physinfo.max_cpu_id + 1;
+    cpus = calloc(nr_cpus, sizeof(*cpus));
+    if ( !cpus )
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        struct xenoprof_xen_buffer xbuf = {
+            .cpu = cpu,
+            .max_samples = entries,
+        };
+        struct xenoprof_buf *buf;
+
+        /* Offline CPUs are refused, and have nothing to sample anyway. */
+        if ( xc_xenoprof_op(xch, XENOPROF_get_xen_buffer,
+                            &xbuf, sizeof(xbuf)) < 0 )
+        {
+            if ( errno == EINVAL )
+                continue;
+            fprintf(stderr, "CPU%u: failed to get sample buffer: %s\n",
+                    cpu, strerror(errno));
+            return -1;
+        }
+
+        cpus[cpu].mapsize = (xbuf.bufsize + XC_PAGE_SIZE - 1) &
+                            ~(XC_PAGE_SIZE - 1);
+        buf = xc_map_foreign_range(xch, DOMID_XEN, cpus[cpu].mapsize,
+                                   PROT_READ | PROT_WRITE,
+                                   xbuf.buf_maddr >> XC_PAGE_SHIFT);
+        if ( !buf )
+        {
+            fprintf(stderr, "CPU%u: failed to map sample buffer: %s\n",
+                    cpu, strerror(errno));
+            return -1;
+        }
+
+        /* Every buffer has the size set by the first request. */
+        nr_entries = buf->event_size;
+        cpus[cpu].buf = buf;
+    }
+
+    return 0;
+}
+
+static int setup(unsigned int event, unsigned int umask, int user_event,
+                 unsigned long depth, unsigned int entries)
+{
+    struct xenoprof_init init = { 0 };
+    struct xenoprof_get_buffer get_buffer = { .max_samples = 1 };
+    struct xenoprof_counter counter = { 0 };
+    domid_t self = 0;
+
+    if ( profile_op(XENOPROF_init, &init, sizeof(init), "init") < 0 )
+        return -1;
+    state = ST_INIT;
+
+    if ( !init.is_primary )
+    {
+        fprintf(stderr, "Another domain is already profiling\n");
+        return -1;
+    }
+
+    if ( !user_event )
+        event = strncmp(init.cpu_type, "x86-64/", 7) ? INTEL_CYCLES
+                                                     : AMD_CYCLES;
+
+    /*
+     * We only want hypervisor samples, but xenoprof insists on an active
+     * domain with a buffer of its own: make that us, with a token buffer.
+     */
+    if ( profile_op(XENOPROF_get_buffer, &get_buffer, sizeof(get_buffer),
+                    "get_buffer") < 0 )
+        return -1;
+    state = ST_BUFFER;
+
+    if ( profile_op(XENOPROF_reset_active_list, NULL, 0,
+                    "reset_active_list") < 0 ||
+         profile_op(XENOPROF_reset_passive_list, NULL, 0,
+                    "reset_passive_list") < 0 ||
+         profile_op(XENOPROF_set_active, &self, sizeof(self),
+                    "set_active") < 0 )
+        return -1;
+
+    if ( profile_op(XENOPROF_reserve_counters, NULL, 0,
+                    "reserve_counters") < 0 )
+        return -1;
+    state = ST_RESERVED;
+
+    counter.ind = 0;
+    counter.count = period;
+    counter.enabled = 1;
+    counter.event = event;
+    counter.unit_mask = umask;
+    counter.hypervisor = 1;
+    /* Xen runs in ring 0, which the counters call "kernel". */
+    counter.kernel = 1;
+    counter.user = 0;
+    if ( profile_op(XENOPROF_counter, &counter, sizeof(counter),
+                    "counter") < 0 ||
+         profile_op(XENOPROF_setup_events, NULL, 0, "setup_events") < 0 )
+        return -1;
+
+    if ( depth &&
+         profile_op(XENOPROF_set_backtrace, &depth, sizeof(depth),
+                    "set_backtrace") < 0 )
+        return -1;
+
+    if ( map_cpu_buffers(entries) )
+        return -1;
+
+    if ( profile_op(XENOPROF_enable_virq, NULL, 0, "enable_virq") < 0 )
+        return -1;
+    state = ST_VIRQ;
+
+    if ( profile_op(XENOPROF_start, NULL, 0, "start") < 0 )
+        return -1;
+    state = ST_STARTED;
+
+    return 0;
+}
+
+/* Undo as much of setup() as was done, ignoring errors. */
+static void teardown(void)
+{
+    switch ( state )
+    {
+    case ST_STARTED:
+        xc_xenoprof_op(xch, XENOPROF_stop, NULL, 0);
+        /* fall through */
+    case ST_VIRQ:
+    case ST_RESERVED:
+        xc_xenoprof_op(xch, XENOPROF_release_counters, NULL, 0);
+        /* fall through */
+    case ST_BUFFER:
+        xc_xenoprof_op(xch, XENOPROF_disable_virq, NULL, 0);
+        /* fall through */
+    case ST_INIT:
+        xc_xenoprof_op(xch, XENOPROF_shutdown, NULL, 0);
+        /* fall through */
+    case ST_NONE:
+        break;
+    }
+    state = ST_NONE;
+}
+
+static int default_symbols(char *path, size_t size)
+{
+    xen_extraversion_t extra;
+    int version = xc_version(xch, XENVER_version, NULL);
+
+    if ( version < 0 || xc_version(xch, XENVER_extraversion, &extra) < 0 )
+        return -1;
+    extra[sizeof(extra) - 1] = '\0';
+
+    snprintf(path, size, "/usr/lib/debug/xen-syms-%d.%d%s",
+             version >> 16, version & 0xffff, extra);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "xen-syms",  required_argument, NULL, 'x' },
+        { "event",     required_argument, NULL, 'e' },
+        { "count",     required_argument, NULL, 'c' },
+        { "callgraph", required_argument, NULL, 'g' },
+        { "duration",  required_argument, NULL, 'd' },
+        { "buffer",    required_argument, NULL, 'b' },
+        { "format",    required_argument, NULL, 'f' },
+        { "context",   no_argument,       NULL, 'C' },
+        { "output",    required_argument, NULL, 'o' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *syms_path = NULL, *out_path = NULL;
+    char default_path[256];
+    unsigned int event = 0, umask = 0, entries = DEFAULT_ENTRIES, cpu;
+    unsigned long depth = DEFAULT_DEPTH, duration = DEFAULT_DURATION;
+    unsigned long total = 0, lost = 0, elapsed;
+    int user_event = 0, ch, rc = 1;
+    char *end;
+
+    while ( (ch = getopt_long(argc, argv, "x:e:c:g:d:b:f:Co:h",
+                              opts, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'x':
+            syms_path = optarg;
+            break;
+        case 'e':
+            event = strtoul(optarg, &end, 0);
+            if ( *end == ':' )
+                umask = strtoul(end + 1, &end, 0);
+            if ( *end )
+            {
+                fprintf(stderr, "Invalid event '%s'\n", optarg);
+                return 2;
+            }
+            user_event = 1;
+            event_name = optarg;
+            break;
+        case 'c':
+            period = strtoul(optarg, &end, 0);
+            if ( *end || !period )
+            {
+                fprintf(stderr, "Invalid count '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'g':
+            depth = strtoul(optarg, &end, 0);
+            if ( *end || depth > MAX_DEPTH )
+            {
+                fprintf(stderr, "Invalid call chain depth '%s' (max %d)\n",
+                        optarg, MAX_DEPTH);
+                return 2;
+            }
+            break;
+        case 'd':
+            duration = strtoul(optarg, &end, 0);
+            if ( *end || !duration )
+            {
+                fprintf(stderr, "Invalid duration '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'b':
+            entries = strtoul(optarg, &end, 0);
+            if ( *end || entries < 2 * (MAX_DEPTH + 4) )
+            {
+                fprintf(stderr, "Invalid buffer size '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'f':
+            if ( !strcmp(optarg, "folded") )
+                format = FORMAT_FOLDED;
+            else if ( !strcmp(optarg, "script") )
+                format = FORMAT_SCRIPT;
+            else
+            {
+                fprintf(stderr, "Invalid format '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'C':
+            context = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ( optind != argc )
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if ( !syms_path )
+    {
+        if ( default_symbols(default_path, sizeof(default_path)) )
+        {
+            fprintf(stderr, "Failed to get Xen version, use --xen-syms\n");
+            goto out;
+        }
+        syms_path = default_path;
+    }
+    if ( load_symbols(syms_path) )
+        goto out;
+
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if ( !out )
+    {
+        fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+        goto out;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    if ( setup(event, umask, user_event, depth, entries) )
+        goto out;
+
+    for ( elapsed = 0; !interrupted && elapsed < duration * 1000;
+          elapsed += POLL_MS )
+    {
+        struct timespec ts = { 0, POLL_MS * 1000000L };
+
+        nanosleep(&ts, NULL);
+        for ( cpu = 0; cpu < nr_cpus; cpu++ )
+            if ( cpus[cpu].buf && drain_cpu(cpu, 0) )
+                goto out;
+    }
+
+    xc_xenoprof_op(xch, XENOPROF_stop, NULL, 0);
+    state = ST_VIRQ;
+
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        if ( !cpus[cpu].buf )
+            continue;
+        if ( drain_cpu(cpu, 1) )
+            goto out;
+        total += cpus[cpu].samples;
+        lost += cpus[cpu].buf->lost_samples;
+    }
+
+    if ( format == FORMAT_FOLDED )
+    {
+        unsigned int i;
+        struct stack *st;
+
+        for ( i = 0; i < STACK_HASH_SIZE; i++ )
+            for ( st = stacks[i]; st; st = st->next )
+                fprintf(out, "%s %lu\n", st->folded, st->count);
+    }
+
+    fprintf(stderr, "%lu samples, %lu lost\n", total, lost);
+    rc = 0;
+
+ out:
+    /* Unmap the buffers first, so that shutting down can free them. */
+    if ( cpus )
+        for ( cpu = 0; cpu < nr_cpus; cpu++ )
+            if ( cpus[cpu].buf )
+                munmap(cpus[cpu].buf, cpus[cpu].mapsize);
+    free(cpus);
+
+    teardown();
+    if ( out && out != stdout && fclose(out) )
+        rc = 1;
+    xc_interface_close(xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,83 @@
+/*
+ * bench.h
+ *
+ * Timing and reporting helpers shared by the benchmarks under tools/tests.
+ * Times are taken from CLOCK_MONOTONIC, so that they are not upset by the
+ * wall clock being stepped while a benchmark runs.
+ */
+
+#ifndef __XEN_TESTS_BENCH_H__
+#define __XEN_TESTS_BENCH_H__
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Microseconds since some unspecified point in the past. */
+static inline uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Number per second of n things done in us microseconds. */
+static inline uint64_t bench_rate(uint64_t n, uint64_t us)
+{
+    return us ? n * 1000000 / us : 0;
+}
+
+/*
+ * Print "<what> <n> <unit> in <us>us, <rate> <unit>/s", without the end
+ * of line, so that the caller can add its own figures.
+ */
+static inline void bench_report_rate(const char *what, uint64_t n,
+                                     const char *unit, uint64_t us)
+{
+    printf("%-10s %"PRIu64" %s in %"PRIu64"us, %"PRIu64" %s/s",
+           what, n, unit, us, bench_rate(n, us), unit);
+}
+
+static inline int bench_cmp_us(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the distribution of the n latencies in us, in microseconds, on a
+ * line of its own.  Sorts us.
+ */
+static inline void bench_report_latencies(const char *what, uint64_t *us,
+                                          unsigned int n)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    if ( !n )
+        return;
+
+    for ( i = 0; i < n; i++ )
+        total += us[i];
+    qsort(us, n, sizeof(*us), bench_cmp_us);
+
+    printf("%-10s n %u min %"PRIu64"us avg %"PRIu64"us p50 %"PRIu64"us "
+           "p99 %"PRIu64"us max %"PRIu64"us\n", what, n,
+           us[0], total / n, us[n / 2], us[(n * 99) / 100], us[n - 1]);
+}
+
+#endif /* __XEN_TESTS_BENCH_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,26 @@
+/*
+ * emul.h
+ *
+ * What xc_map_cache.c needs of libxc to be built on its own, for
+ * test_map_cache: the foreign mappings it makes are emulated by the test,
+ * which also keeps track of the mappings it unmaps.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+
+#define PAGE_SIZE XC_PAGE_SIZE
+
+#define PERROR(_m, _a...) \
+    ((void)xch, fprintf(stderr, "xc_map_cache: " _m ": %s\n", ## _a, \
+                        strerror(errno)))
+
+int test_munmap(void *addr, size_t length);
+#define munmap test_munmap
@@ -0,0 +1,228 @@
+/*
+ * map-bench.c
+ *
+ * Measure how fast the pages of an HVM domain can be copied the way the
+ * receiving end of a live migration writes them: every page once, then
+ * a number of iterations over a smaller set of dirty pages, in batches
+ * of MAX_BATCH pages.  The pages are mapped once per batch with
+ * xc_map_foreign_bulk(), then through a mapping cache (xc_map_cache_*),
+ * and the throughput of both is reported.
+ *
+ * The pages are only read, so this can be run against a running domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+
+#include "bench.h"
+
+#define MAX_BATCH 1024
+
+static unsigned int iterations = 8, dirty_pct = 10;
+static unsigned int window_frames, max_windows;
+
+static int usage(const char *prog)
+{
+    printf("usage: %s [-i <iterations>] [-d <dirty%%>] [-w <window frames>]\n"
+           "       [-n <windows>] <domid>\n", prog);
+    printf("  Copies every page of HVM domain <domid>, then <iterations>\n");
+    printf("  (default 8) times <dirty%%> (default 10) of its pages, with\n");
+    printf("  and without a mapping cache of <windows> windows of <window\n");
+    printf("  frames> frames (libxc defaults).\n");
+    return 1;
+}
+
+/* The pages of each iteration, in increasing order like the sender's. */
+static xen_pfn_t *make_pass(xen_pfn_t nr_pfns, unsigned int pct,
+                            unsigned long *nr)
+{
+    xen_pfn_t pfn, *pfns = malloc(nr_pfns * sizeof(*pfns));
+
+    *nr = 0;
+    if ( !pfns )
+        return NULL;
+
+    for ( pfn = 0; pfn < nr_pfns; pfn++ )
+        if ( pct >= 100 || (unsigned int)(rand() % 100) < pct )
+            pfns[(*nr)++] = pfn;
+
+    return pfns;
+}
+
+static int copy_batch(xc_interface *xch, uint32_t domid, xc_map_cache *mc,
+                      const xen_pfn_t *pfns, unsigned int nr, char *buf,
+                      unsigned long *copied)
+{
+    void *pages[MAX_BATCH], *mapping = NULL;
+    int err[MAX_BATCH];
+    unsigned int i;
+
+    if ( mc )
+    {
+        if ( xc_map_cache_pages(mc, pfns, pages, err, nr) )
+            return -1;
+    }
+    else
+    {
+        mapping = xc_map_foreign_bulk(xch, domid, PROT_READ, pfns, err, nr);
+        if ( !mapping )
+            return -1;
+        for ( i = 0; i < nr; i++ )
+            pages[i] = mapping + i * XC_PAGE_SIZE;
+    }
+
+    /* Holes in the physmap are skipped, as the sender would. */
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( err[i] )
+            continue;
+        memcpy(buf, pages[i], XC_PAGE_SIZE);
+        (*copied)++;
+    }
+
+    if ( mc )
+        xc_map_cache_release(mc);
+    else
+        munmap(mapping, nr * XC_PAGE_SIZE);
+
+    return 0;
+}
+
+static int run(xc_interface *xch, uint32_t domid, xen_pfn_t nr_pfns,
+               bool cached)
+{
+    xc_map_cache *mc = NULL;
+    xen_pfn_t *pfns = NULL;
+    unsigned long nr, i, copied = 0;
+    unsigned int it;
+    uint64_t t;
+    char *buf = malloc(XC_PAGE_SIZE);
+    int rc = -1;
+
+    if ( !buf )
+        goto out;
+
+    if ( cached )
+    {
+        mc = xc_map_cache_create(xch, domid, PROT_READ, window_frames,
+                                 max_windows);
+        if ( !mc )
+        {
+            perror("xc_map_cache_create");
+            goto out;
+        }
+    }
+
+    srand(1);
+    t = bench_now_us();
+
+    for ( it = 0; it <= iterations; it++ )
+    {
+        free(pfns);
+        pfns = make_pass(nr_pfns, it ? dirty_pct : 100, &nr);
+        if ( !pfns )
+            goto out;
+
+        for ( i = 0; i < nr; i += MAX_BATCH )
+            if ( copy_batch(xch, domid, mc, pfns + i,
+                            nr - i < MAX_BATCH ? nr - i : MAX_BATCH,
+                            buf, &copied) )
+            {
+                perror("mapping pages");
+                goto out;
+            }
+    }
+
+    t = bench_now_us() - t;
+    bench_report_rate(cached ? "cached" : "uncached", copied, "pages", t);
+    printf(", %"PRIu64" MB/s", t ? (uint64_t)copied * XC_PAGE_SIZE / t : 0);
+    if ( mc )
+    {
+        xc_map_cache_stats_t stats;
+
+        xc_map_cache_get_stats(mc, &stats);
+        printf(", hit rate %"PRIu64"%%, %"PRIu64" windows mapped, "
+               "%"PRIu64" evicted",
+               stats.hits * 100 / ((stats.hits + stats.misses) ? : 1),
+               stats.maps, stats.evictions);
+    }
+    printf("\n");
+    rc = 0;
+
+ out:
+    xc_map_cache_destroy(mc);
+    free(pfns);
+    free(buf);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    xc_interface *xch;
+    xc_dominfo_t info;
+    xen_pfn_t max_gpfn;
+    uint32_t domid;
+    int opt, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "i:d:w:n:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            dirty_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            window_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            max_windows = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if ( optind != argc - 1 )
+        return usage(argv[0]);
+    domid = strtoul(argv[optind], NULL, 0);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 ||
+         info.domid != domid )
+    {
+        fprintf(stderr, "no domain %u\n", domid);
+        goto out;
+    }
+    if ( !info.hvm )
+    {
+        fprintf(stderr, "domain %u is not an HVM domain\n", domid);
+        goto out;
+    }
+    if ( xc_domain_maximum_gpfn(xch, domid, &max_gpfn) < 0 )
+    {
+        perror("xc_domain_maximum_gpfn");
+        goto out;
+    }
+
+    if ( !run(xch, domid, max_gpfn + 1, false) &&
+         !run(xch, domid, max_gpfn + 1, true) )
+        rc = 0;
+
+ out:
+    xc_interface_close(xch);
+    return rc;
+}
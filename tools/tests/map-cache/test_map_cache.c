@@ -0,0 +1,344 @@
+/*
+ * test_map_cache.c
+ *
+ * Tests of the cache of foreign mappings of libxc (xc_map_cache_*), built
+ * with an emulation of xc_map_foreign_bulk(): neither Xen nor a domain is
+ * needed.
+ *
+ * To run this test:
+ *    ./test_map_cache
+ * Success:
+ *    prints the name of each test as it runs and exits 0
+ * Failure:
+ *    an assertion fails, or the test crashes
+ *
+ * The emulated domain has NR_FRAMES frames.  Each mapped frame holds its
+ * gfn and the version of the physmap entry it was mapped from: changing
+ * the physmap of the domain bumps the version of the frames concerned,
+ * which the cache only sees once told with xc_map_cache_invalidate().
+ * Frames can be made holes, which fail to map.  Every mapping made and
+ * unmapped is tracked, to check that the cache neither hands out nor
+ * leaves behind mappings it should not.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+
+#define NR_FRAMES    1024
+#define MAX_MAPPINGS 64
+
+#define WINDOW_FRAMES 16
+#define MAX_WINDOWS   8
+
+struct frame {
+    xen_pfn_t gfn;
+    unsigned int version;
+};
+
+static unsigned int version[NR_FRAMES];
+static bool hole[NR_FRAMES];
+
+static struct {
+    void *addr;
+    size_t length;
+} mappings[MAX_MAPPINGS];
+static unsigned int nr_mappings;
+
+void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
+                          const xen_pfn_t *arr, int *err, unsigned int num)
+{
+    size_t length = (size_t)num * XC_PAGE_SIZE;
+    struct frame *f;
+    unsigned int i;
+    char *addr;
+
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(addr != MAP_FAILED);
+
+    for ( i = 0; i < num; i++ )
+    {
+        if ( arr[i] >= NR_FRAMES || hole[arr[i]] )
+        {
+            err[i] = -ENOENT;
+            continue;
+        }
+        err[i] = 0;
+        f = (struct frame *)(addr + i * XC_PAGE_SIZE);
+        f->gfn = arr[i];
+        f->version = version[arr[i]];
+    }
+    assert(!mprotect(addr, length, PROT_READ));
+
+    assert(nr_mappings < MAX_MAPPINGS);
+    mappings[nr_mappings].addr = addr;
+    mappings[nr_mappings].length = length;
+    nr_mappings++;
+
+    return addr;
+}
+
+int test_munmap(void *addr, size_t length)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_mappings; i++ )
+        if ( mappings[i].addr == addr )
+            break;
+    assert(i < nr_mappings);
+    assert(mappings[i].length == length);
+    mappings[i] = mappings[--nr_mappings];
+
+    return munmap(addr, length);
+}
+
+static bool is_mapped(const void *page)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_mappings; i++ )
+        if ( (const char *)page >= (const char *)mappings[i].addr &&
+             (const char *)page < (const char *)mappings[i].addr +
+                                  mappings[i].length )
+            return true;
+
+    return false;
+}
+
+/*
+ * Look up frames first to first + num - 1, which must all map, and check
+ * the pages returned are mapped, and mapped from the current physmap but
+ * for the frames in [stale, stale + nr_stale).
+ */
+static void lookup(xc_map_cache *mc, xen_pfn_t first, unsigned int num,
+                   xen_pfn_t stale, unsigned int nr_stale, void **pages)
+{
+    xen_pfn_t gfns[num];
+    int err[num];
+    const struct frame *f;
+    unsigned int i;
+
+    for ( i = 0; i < num; i++ )
+        gfns[i] = first + i;
+
+    assert(!xc_map_cache_pages(mc, gfns, pages, err, num));
+
+    for ( i = 0; i < num; i++ )
+    {
+        assert(!err[i]);
+        assert(pages[i] && is_mapped(pages[i]));
+        f = pages[i];
+        assert(f->gfn == gfns[i]);
+        if ( gfns[i] >= stale && gfns[i] < stale + nr_stale )
+            assert(f->version != version[gfns[i]]);
+        else
+            assert(f->version == version[gfns[i]]);
+    }
+}
+
+static xc_map_cache *create(void)
+{
+    xc_map_cache *mc = xc_map_cache_create(NULL, 1, PROT_READ,
+                                           WINDOW_FRAMES, MAX_WINDOWS);
+
+    assert(mc);
+    return mc;
+}
+
+static void test_lookup(void)
+{
+    xc_map_cache_stats_t stats;
+    xc_map_cache *mc = create();
+    void *pages[64];
+
+    printf("lookup\n");
+
+    lookup(mc, 0, 64, 0, 0, pages);
+    xc_map_cache_release(mc);
+    assert(nr_mappings == 4);
+
+    lookup(mc, 0, 64, 0, 0, pages);
+    xc_map_cache_release(mc);
+    assert(nr_mappings == 4);
+
+    xc_map_cache_get_stats(mc, &stats);
+    assert(stats.maps == 4 && stats.misses == 4 && stats.hits == 124);
+    assert(!stats.evictions && !stats.invalidations);
+
+    xc_map_cache_destroy(mc);
+    assert(!nr_mappings);
+}
+
+static void test_invalidate(void)
+{
+    xc_map_cache_stats_t stats;
+    xc_map_cache *mc = create();
+    void *pages[64], *pinned[16];
+    unsigned int i;
+
+    printf("invalidation\n");
+
+    lookup(mc, 0, 64, 0, 0, pages);
+    xc_map_cache_release(mc);
+
+    /* Until it is told, the cache keeps returning the old pages... */
+    version[20]++;
+    lookup(mc, 0, 64, 20, 1, pages);
+    xc_map_cache_release(mc);
+
+    /* ... then it maps the window again, and only that one. */
+    xc_map_cache_invalidate(mc, 20, 1);
+    assert(nr_mappings == 3);
+    lookup(mc, 0, 64, 0, 0, pages);
+    xc_map_cache_release(mc);
+
+    xc_map_cache_get_stats(mc, &stats);
+    assert(stats.maps == 5 && stats.invalidations == 1);
+
+    /* A range across windows drops all of them. */
+    for ( i = 15; i < 49; i++ )
+        version[i]++;
+    xc_map_cache_invalidate(mc, 15, 34);
+    assert(nr_mappings == 0);
+    lookup(mc, 0, 64, 0, 0, pages);
+    xc_map_cache_release(mc);
+
+    /*
+     * The pages returned stay mapped until the release, even if they are
+     * invalidated, and stale windows are not returned again.
+     */
+    lookup(mc, 32, 16, 0, 0, pinned);
+    version[40]++;
+    xc_map_cache_invalidate(mc, 40, 1);
+    assert(nr_mappings == 4);
+    for ( i = 0; i < 16; i++ )
+        assert(is_mapped(pinned[i]) &&
+               ((struct frame *)pinned[i])->gfn == 32 + i);
+    lookup(mc, 32, 16, 0, 0, pages);
+    assert(nr_mappings == 5);
+    xc_map_cache_release(mc);
+    assert(nr_mappings == 4);
+    for ( i = 0; i < 16; i++ )
+        assert(!is_mapped(pinned[i]) && is_mapped(pages[i]));
+
+    /* A range wrapping around ends with the last frame... */
+    xc_map_cache_invalidate(mc, 40, ~0UL);
+    assert(nr_mappings == 2);
+    lookup(mc, 0, 64, 0, 0, pages);
+    xc_map_cache_release(mc);
+
+    /* ... and one larger than the cache still finds every window. */
+    xc_map_cache_invalidate(mc, 0, NR_FRAMES);
+    assert(nr_mappings == 0);
+
+    xc_map_cache_destroy(mc);
+}
+
+static void test_holes(void)
+{
+    xc_map_cache_stats_t stats;
+    xc_map_cache *mc = create();
+    xen_pfn_t gfns[WINDOW_FRAMES];
+    void *pages[WINDOW_FRAMES];
+    int err[WINDOW_FRAMES];
+    unsigned int i;
+
+    printf("holes\n");
+
+    for ( i = 0; i < WINDOW_FRAMES; i++ )
+        gfns[i] = 64 + i;
+    hole[70] = true;
+
+    assert(!xc_map_cache_pages(mc, gfns, pages, err, WINDOW_FRAMES));
+    for ( i = 0; i < WINDOW_FRAMES; i++ )
+    {
+        if ( gfns[i] == 70 )
+            assert(err[i] == -ENOENT && !pages[i]);
+        else
+            assert(!err[i] && ((struct frame *)pages[i])->gfn == gfns[i]);
+    }
+
+    /* Within a batch, the window is not mapped again... */
+    assert(!xc_map_cache_pages(mc, &gfns[6], pages, err, 1));
+    assert(err[0] == -ENOENT);
+    xc_map_cache_get_stats(mc, &stats);
+    assert(stats.maps == 1);
+
+    /* ... but it is in the next one, without being invalidated. */
+    hole[70] = false;
+    xc_map_cache_release(mc);
+    lookup(mc, 64, WINDOW_FRAMES, 0, 0, pages);
+    xc_map_cache_get_stats(mc, &stats);
+    assert(stats.maps == 2);
+    xc_map_cache_release(mc);
+    assert(nr_mappings == 1);
+
+    /* Frames which mapped do not cause the window to be mapped again. */
+    lookup(mc, 64, WINDOW_FRAMES, 0, 0, pages);
+    xc_map_cache_release(mc);
+    xc_map_cache_get_stats(mc, &stats);
+    assert(stats.maps == 2);
+
+    xc_map_cache_destroy(mc);
+    assert(!nr_mappings);
+}
+
+static void test_eviction(void)
+{
+    xc_map_cache_stats_t stats;
+    xc_map_cache *mc = create();
+    void *pages[WINDOW_FRAMES * (MAX_WINDOWS + 4)];
+    unsigned int w;
+
+    printf("eviction\n");
+
+    /* The least recently used windows go first. */
+    for ( w = 0; w < MAX_WINDOWS + 4; w++ )
+    {
+        lookup(mc, w * WINDOW_FRAMES, WINDOW_FRAMES, 0, 0, pages);
+        xc_map_cache_release(mc);
+        assert(nr_mappings == (w < MAX_WINDOWS ? w + 1 : MAX_WINDOWS));
+    }
+    lookup(mc, (MAX_WINDOWS + 3) * WINDOW_FRAMES, WINDOW_FRAMES, 0, 0, pages);
+    lookup(mc, 4 * WINDOW_FRAMES, WINDOW_FRAMES, 0, 0, pages);
+    xc_map_cache_release(mc);
+    xc_map_cache_get_stats(mc, &stats);
+    assert(stats.maps == MAX_WINDOWS + 4 && stats.evictions == 4);
+
+    /* Windows in use are not evicted, even beyond the limit... */
+    lookup(mc, 0, WINDOW_FRAMES * (MAX_WINDOWS + 4), 0, 0, pages);
+    assert(nr_mappings == MAX_WINDOWS + 4);
+
+    /* ... until they are released. */
+    xc_map_cache_release(mc);
+    assert(nr_mappings == MAX_WINDOWS);
+
+    xc_map_cache_destroy(mc);
+    assert(!nr_mappings);
+}
+
+int main(int argc, char **argv)
+{
+    test_lookup();
+    test_invalidate();
+    test_holes();
+    test_eviction();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
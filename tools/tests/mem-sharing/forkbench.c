@@ -0,0 +1,220 @@
+/*
+ * forkbench.c
+ *
+ * Measure how long it takes to fork a paused HVM domain, and how long
+ * the forks take to tear down again.  With 'check', also check the memory
+ * of every fork against its parent's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xentoollog.h>
+#include <libxl.h>
+
+#include "bench.h"
+
+/* Pages of each fork checked against the parent's. */
+#define CHECK_PAGES 64
+
+static int usage(const char *prog)
+{
+    printf("usage: %s <parent-domid> [<forks> [run|check]]\n", prog);
+    printf("  Forks <parent-domid> (default 16 times), reporting the latency\n");
+    printf("  of each fork.  With 'run' every fork is unpaused as soon as it\n");
+    printf("  has been created.  With 'check' the forks stay paused, and\n");
+    printf("  %u pages of each are checked to read as the parent's, and to\n",
+           CHECK_PAGES);
+    printf("  keep what is written to them without the parent seeing it.\n");
+    printf("  All forks are destroyed before exiting.\n");
+    return 1;
+}
+
+/*
+ * Check one page of a fork: it must map if and only if the parent's does,
+ * read the same, and keep a write of its own while the parent's page is
+ * left unchanged.  Returns 0 if the page is as expected.
+ */
+static int check_page(xc_interface *xch, uint32_t parent, uint32_t fork,
+                      unsigned long gfn)
+{
+    unsigned char *pp, *fp = NULL;
+    unsigned int i;
+    int rc = -1;
+
+    pp = xc_map_foreign_range(xch, parent, XC_PAGE_SIZE, PROT_READ, gfn);
+    fp = xc_map_foreign_range(xch, fork, XC_PAGE_SIZE,
+                              PROT_READ | PROT_WRITE, gfn);
+    if ( !pp || !fp )
+    {
+        /* A hole in the parent must be one in the fork too. */
+        if ( pp || fp )
+            fprintf(stderr, "fork %u: gfn %#lx maps in only one of "
+                    "the parent and the fork\n", fork, gfn);
+        else
+            rc = 0;
+        goto out;
+    }
+
+    if ( memcmp(pp, fp, XC_PAGE_SIZE) )
+    {
+        fprintf(stderr, "fork %u: gfn %#lx differs from the parent's\n",
+                fork, gfn);
+        goto out;
+    }
+
+    for ( i = 0; i < XC_PAGE_SIZE; i++ )
+        fp[i] = ~pp[i];
+    for ( i = 0; i < XC_PAGE_SIZE; i++ )
+        if ( fp[i] != (unsigned char)~pp[i] )
+        {
+            fprintf(stderr, "fork %u: write to gfn %#lx %s\n", fork, gfn,
+                    fp[i] == pp[i] ? "reached the parent" : "was lost");
+            goto out;
+        }
+
+    rc = 0;
+
+ out:
+    if ( fp )
+        munmap(fp, XC_PAGE_SIZE);
+    if ( pp )
+        munmap(pp, XC_PAGE_SIZE);
+    return rc;
+}
+
+/* Check CHECK_PAGES pages of fork, spread over the parent's memory. */
+static int check_fork(xc_interface *xch, uint32_t parent, uint32_t fork)
+{
+    xen_pfn_t max_gpfn;
+    unsigned long gfn, stride;
+    int rc = 0;
+
+    if ( xc_domain_maximum_gpfn(xch, parent, &max_gpfn) < 0 )
+    {
+        fprintf(stderr, "cannot get the memory size of domain %u\n", parent);
+        return -1;
+    }
+
+    stride = max_gpfn / CHECK_PAGES + 1;
+    for ( gfn = 0; gfn <= max_gpfn; gfn += stride )
+        if ( check_page(xch, parent, fork, gfn) )
+            rc = -1;
+
+    return rc;
+}
+
+int main(int argc, const char **argv)
+{
+    xentoollog_logger_stdiostream *logger;
+    libxl_ctx *ctx = NULL;
+    xc_interface *xch = NULL;
+    uint32_t parent, *forks;
+    uint64_t *fork_us, *destroy_us, t;
+    unsigned int i, n = 16, created = 0, timed = 0, destroyed = 0;
+    unsigned int checked = 0;
+    int run = 0, check = 0, rc = 1;
+
+    if ( argc < 2 || argc > 4 )
+        return usage(argv[0]);
+
+    parent = strtoul(argv[1], NULL, 0);
+    if ( argc > 2 )
+        n = strtoul(argv[2], NULL, 0);
+    if ( argc > 3 )
+    {
+        if ( !strcmp(argv[3], "run") )
+            run = 1;
+        else if ( !strcmp(argv[3], "check") )
+            check = 1;
+        else
+            return usage(argv[0]);
+    }
+    if ( !n )
+        return usage(argv[0]);
+
+    forks = calloc(n, sizeof(*forks));
+    fork_us = calloc(n, sizeof(*fork_us));
+    destroy_us = calloc(n, sizeof(*destroy_us));
+    if ( !forks || !fork_us || !destroy_us )
+    {
+        perror("calloc");
+        goto out;
+    }
+
+    logger = xtl_createlogger_stdiostream(stderr, XTL_ERROR, 0);
+    if ( !logger )
+        goto out;
+
+    if ( libxl_ctx_alloc(&ctx, LIBXL_VERSION, 0,
+                         (xentoollog_logger *)logger) )
+    {
+        fprintf(stderr, "cannot allocate libxl context\n");
+        goto out_logger;
+    }
+
+    if ( check )
+    {
+        xch = xc_interface_open((xentoollog_logger *)logger, NULL, 0);
+        if ( !xch )
+        {
+            fprintf(stderr, "cannot open the hypervisor interface\n");
+            goto out_ctx;
+        }
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        t = bench_now_us();
+        if ( libxl_domain_fork_vm(ctx, parent, &forks[i]) )
+        {
+            fprintf(stderr, "fork %u of domain %u failed\n", i, parent);
+            break;
+        }
+        if ( run && libxl_domain_unpause(ctx, forks[i]) )
+        {
+            fprintf(stderr, "cannot unpause fork %u\n", forks[i]);
+            created++;
+            break;
+        }
+        fork_us[timed++] = bench_now_us() - t;
+        created++;
+
+        /* Outside of the timing, which the mappings would upset. */
+        if ( check && !check_fork(xch, parent, forks[i]) )
+            checked++;
+    }
+
+    for ( i = 0; i < created; i++ )
+    {
+        t = bench_now_us();
+        if ( libxl_domain_destroy(ctx, forks[i], 0) )
+            fprintf(stderr, "cannot destroy fork %u\n", forks[i]);
+        else
+            destroy_us[destroyed++] = bench_now_us() - t;
+    }
+
+    bench_report_latencies("fork", fork_us, timed);
+    bench_report_latencies("destroy", destroy_us, destroyed);
+    if ( check )
+        printf("%u of %u forks checked out\n", checked, timed);
+
+    if ( timed == n && destroyed == n && (!check || checked == n) )
+        rc = 0;
+
+    if ( xch )
+        xc_interface_close(xch);
+ out_ctx:
+    libxl_ctx_free(ctx);
+ out_logger:
+    xtl_logger_destroy((xentoollog_logger *)logger);
+ out:
+    free(destroy_us);
+    free(fork_us);
+    free(forks);
+    return rc;
+}
@@ -0,0 +1,188 @@
+/*
+ * test_vm_event_ring.c
+ *
+ * Tests of vm_event rings of one or more pages, with the requests
+ * answered as xen-access-bench does (vm-event-ring.h) and Xen's side of
+ * the ring emulated: neither Xen nor a domain is needed.
+ *
+ * To run this test:
+ *    ./test_vm_event_ring
+ * Success:
+ *    prints the size of each ring as it is tested and exits 0
+ * Failure:
+ *    an assertion fails
+ *
+ * For rings of 1 to MAX_FRAMES pages, check that the ring has as many
+ * slots as fit in its pages, then send batches of requests of every size
+ * up to a full ring, for many times round the ring and with the indexes
+ * wrapping around 2^32, checking that:
+ *   every request is answered once, in order, with its own vCPU, gfn and
+ *   flags, the writes being emulated when asked for
+ *   the consumer is asked for a notification whenever it has answered
+ *   every request
+ *   a request of another version of the interface is an error
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xenctrl.h>
+#include <xen/vm_event.h>
+
+#include "vm-event-ring.h"
+
+#define MAX_FRAMES 16
+#define LAPS       10
+
+static vm_event_front_ring_t front;
+static vm_event_back_ring_t back;
+
+/*
+ * Move the indexes of an empty ring to start, as if it had been in use for
+ * a while.
+ */
+static void start_ring(RING_IDX start)
+{
+    front.sring->req_prod = front.sring->rsp_prod = start;
+    front.sring->req_event = front.sring->rsp_event = start + 1;
+    front.req_prod_pvt = front.rsp_cons = start;
+    back.req_cons = back.rsp_prod_pvt = start;
+}
+
+/* Xen's side: send a batch of requests for the gfns seq, seq + 1, ... */
+static void send_requests(uint64_t seq, unsigned int nr)
+{
+    vm_event_request_t *req;
+    unsigned int i;
+    int notify;
+
+    for ( i = 0; i < nr; i++, seq++ )
+    {
+        req = RING_GET_REQUEST(&front, front.req_prod_pvt);
+        memset(req, 0, sizeof(*req));
+        req->version = VM_EVENT_INTERFACE_VERSION;
+        req->reason = VM_EVENT_REASON_MEM_ACCESS;
+        req->vcpu_id = seq % 64;
+        req->flags = seq & 1 ? VM_EVENT_FLAG_VCPU_PAUSED : 0;
+        req->u.mem_access.gfn = seq;
+        front.req_prod_pvt++;
+    }
+
+    /* The consumer has answered everything so far, and waits for more. */
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&front, notify);
+    assert(notify);
+}
+
+/* Xen's side: collect the responses to the batch of requests from seq. */
+static void check_responses(uint64_t seq, unsigned int nr, int emulate)
+{
+    vm_event_response_t *rsp;
+    unsigned int n = 0;
+    int more;
+
+    do {
+        while ( RING_HAS_UNCONSUMED_RESPONSES(&front) )
+        {
+            rsp = RING_GET_RESPONSE(&front, front.rsp_cons);
+            assert(rsp->version == VM_EVENT_INTERFACE_VERSION);
+            assert(rsp->reason == VM_EVENT_REASON_MEM_ACCESS);
+            assert(rsp->u.mem_access.gfn == seq + n);
+            assert(rsp->vcpu_id == (seq + n) % 64);
+            assert(rsp->flags ==
+                   (((seq + n) & 1 ? VM_EVENT_FLAG_VCPU_PAUSED : 0) |
+                    (emulate ? MEM_ACCESS_EMULATE : 0)));
+            front.rsp_cons++;
+            n++;
+        }
+        RING_FINAL_CHECK_FOR_RESPONSES(&front, more);
+    } while ( more );
+
+    assert(n == nr);
+}
+
+static unsigned int test_ring(unsigned int frames)
+{
+    size_t size = frames * XC_PAGE_SIZE;
+    vm_event_sring_t *sring;
+    unsigned int slots, nr, batches = 0;
+    uint64_t seq = 0;
+    int emulate;
+
+    assert(!posix_memalign((void **)&sring, XC_PAGE_SIZE, size));
+    SHARED_RING_INIT(sring);
+    FRONT_RING_INIT(&front, sring, size);
+    BACK_RING_INIT(&back, sring, size);
+
+    /* The largest power of two which fits. */
+    slots = RING_SIZE(&back);
+    assert(slots == RING_SIZE(&front));
+    assert(!(slots & (slots - 1)));
+    assert((char *)&sring->ring[slots] <= (char *)sring + size);
+    assert((char *)&sring->ring[2 * slots] > (char *)sring + size);
+
+    printf("%2u frames, %4u slots\n", frames, slots);
+
+    /* Early on, the indexes wrap around. */
+    start_ring(-(RING_IDX)(LAPS / 2 * slots));
+
+    /* Every size of batch from 1 to a full ring, in turn. */
+    while ( batches < slots || seq < (uint64_t)LAPS * slots )
+    {
+        nr = batches % slots + 1;
+        assert(RING_FREE_REQUESTS(&front) == slots);
+        emulate = batches & 1;
+
+        send_requests(seq, nr);
+        assert(RING_FULL(&front) == (nr == slots));
+
+        assert(answer_requests(&back, emulate) == nr);
+        assert(!RING_HAS_UNCONSUMED_REQUESTS(&back));
+
+        check_responses(seq, nr, emulate);
+
+        /* Nothing is answered twice. */
+        assert(answer_requests(&back, emulate) == 0);
+
+        seq += nr;
+        batches++;
+    }
+
+    /* The indexes wrapped around. */
+    assert(front.req_prod_pvt < -(RING_IDX)(LAPS / 2 * slots));
+
+    /* A request of another interface version is an error. */
+    send_requests(seq, 1);
+    RING_GET_REQUEST(&front, front.req_prod_pvt - 1)->version++;
+    assert(answer_requests(&back, 0) == -1);
+
+    free(sring);
+
+    return slots;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int frames, slots, prev = 0;
+
+    /* Twice the pages, at least twice the slots. */
+    for ( frames = 1; frames <= MAX_FRAMES; frames *= 2 )
+    {
+        slots = test_ring(frames);
+        assert(slots >= 2 * prev);
+        prev = slots;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
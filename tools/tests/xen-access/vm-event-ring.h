@@ -0,0 +1,77 @@
+/*
+ * vm-event-ring.h
+ *
+ * Answering the requests of a vm_event ring the way xen-access-bench
+ * does, shared with test_vm_event_ring which checks it.
+ */
+
+#ifndef __VM_EVENT_RING_H__
+#define __VM_EVENT_RING_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include <xen/vm_event.h>
+
+/*
+ * Answer every request in the ring, emulating the memory accesses if
+ * emulate is set, and push the responses, leaving it to the caller to
+ * notify Xen once for all of them.  Returns the number of requests, or -1
+ * on error.
+ */
+static inline int answer_requests(vm_event_back_ring_t *back_ring,
+                                  int emulate)
+{
+    vm_event_request_t req;
+    vm_event_response_t rsp;
+    RING_IDX cons;
+    int num = 0;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        cons = back_ring->req_cons;
+        memcpy(&req, RING_GET_REQUEST(back_ring, cons), sizeof(req));
+        back_ring->req_cons = ++cons;
+        back_ring->sring->req_event = cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION )
+        {
+            fprintf(stderr, "vm_event interface version mismatch\n");
+            return -1;
+        }
+
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.version = VM_EVENT_INTERFACE_VERSION;
+        rsp.vcpu_id = req.vcpu_id;
+        rsp.flags = req.flags;
+        rsp.reason = req.reason;
+        if ( req.reason == VM_EVENT_REASON_MEM_ACCESS )
+        {
+            rsp.u.mem_access.gfn = req.u.mem_access.gfn;
+            if ( emulate )
+                rsp.flags |= MEM_ACCESS_EMULATE;
+        }
+
+        memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt), &rsp,
+               sizeof(rsp));
+        back_ring->rsp_prod_pvt++;
+        num++;
+    }
+
+    if ( num )
+        RING_PUSH_RESPONSES(back_ring);
+
+    return num;
+}
+
+#endif /* __VM_EVENT_RING_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,287 @@
+/*
+ * xen-access-bench.c
+ *
+ * Measure how many mem_access events per second the monitor ring of a
+ * domain carries, with rings of 1, 2, 4, ... pages.  All the pages of the
+ * guest are made read-only, and each write is emulated by Xen on the
+ * response rather than let through, so the guest keeps sending events for
+ * as long as it writes to memory: run a workload writing memory on each
+ * of its vCPUs meanwhile.  The responses to all the requests found in the
+ * ring are sent with a single notification.
+ *
+ * The number of vCPUs of the guest is reported with the results, to
+ * compare guests of different sizes.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+
+#include <xenctrl.h>
+#include <xen/vm_event.h>
+
+#include "bench.h"
+#include "vm-event-ring.h"
+
+#if defined(__arm__) || defined(__aarch64__)
+#include <xen/arch-arm.h>
+#define START_PFN (GUEST_RAM0_BASE >> 12)
+#elif defined(__i386__) || defined(__x86_64__)
+#define START_PFN 0ULL
+#endif
+
+static unsigned int max_frames = 16, seconds = 5;
+static int interrupted;
+
+struct result {
+    uint64_t events, notifications;
+    unsigned int slots, largest_batch;
+    uint64_t us;
+};
+
+static int usage(const char *prog)
+{
+    printf("usage: %s [-f <frames>] [-t <seconds>] <domid>\n", prog);
+    printf("  Counts the write events of domain <domid> for <seconds>\n");
+    printf("  (default 5) with monitor rings of 1, 2, 4, ... up to <frames>\n");
+    printf("  (default 16) pages.\n");
+    return 1;
+}
+
+static void close_handler(int sig)
+{
+    interrupted = sig;
+}
+
+static int wait_for_event(xc_evtchn *xce, int ms)
+{
+    struct pollfd fd = { .fd = xc_evtchn_fd(xce), .events = POLLIN | POLLERR };
+    int port, rc;
+
+    rc = poll(&fd, 1, ms);
+    if ( rc <= 0 )
+        return rc < 0 && errno != EINTR ? -1 : 0;
+
+    port = xc_evtchn_pending(xce);
+    if ( port == -1 || xc_evtchn_unmask(xce, port) )
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Answer every request in the ring, emulating the writes, and notify Xen
+ * once.  Returns the number of requests, or -1 on error.
+ */
+static int handle_requests(xc_evtchn *xce, int port,
+                           vm_event_back_ring_t *back_ring, int emulate)
+{
+    int num = answer_requests(back_ring, emulate);
+
+    if ( num > 0 && xc_evtchn_notify(xce, port) )
+        return -1;
+
+    return num;
+}
+
+static int set_access(xc_interface *xch, uint32_t domid, xen_pfn_t max_gpfn,
+                      xenmem_access_t access)
+{
+    if ( xc_set_mem_access(xch, domid, access, ~0ull, 0) ||
+         xc_set_mem_access(xch, domid, access, START_PFN,
+                           max_gpfn - START_PFN) )
+        return -1;
+
+    return 0;
+}
+
+static int run(xc_interface *xch, xc_evtchn *xce, uint32_t domid,
+               xen_pfn_t max_gpfn, unsigned int frames, struct result *res)
+{
+    vm_event_back_ring_t back_ring;
+    void *ring;
+    uint32_t evtchn_port;
+    uint64_t start;
+    int port = -1, num, rc = -1;
+
+    memset(res, 0, sizeof(*res));
+
+    ring = frames == 1 ? xc_monitor_enable(xch, domid, &evtchn_port)
+                       : xc_monitor_enable_frames(xch, domid, frames,
+                                                  &evtchn_port);
+    if ( !ring )
+    {
+        perror("Error enabling monitor ring");
+        return -1;
+    }
+
+    port = xc_evtchn_bind_interdomain(xce, domid, evtchn_port);
+    if ( port < 0 )
+    {
+        perror("Error binding event channel");
+        goto out;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)ring);
+    BACK_RING_INIT(&back_ring, (vm_event_sring_t *)ring,
+                   frames * XC_PAGE_SIZE);
+    res->slots = RING_SIZE(&back_ring);
+
+    if ( set_access(xch, domid, max_gpfn, XENMEM_access_rx) )
+    {
+        perror("Error making guest memory read-only");
+        goto out;
+    }
+
+    start = bench_now_us();
+    while ( !interrupted && bench_now_us() - start < seconds * 1000000ULL )
+    {
+        if ( wait_for_event(xce, 100) )
+        {
+            perror("Error getting event");
+            goto restore;
+        }
+
+        num = handle_requests(xce, port, &back_ring, 1);
+        if ( num < 0 )
+        {
+            perror("Error answering requests");
+            goto restore;
+        }
+        if ( !num )
+            continue;
+
+        res->events += num;
+        res->notifications++;
+        if ( num > res->largest_batch )
+            res->largest_batch = num;
+    }
+    res->us = bench_now_us() - start;
+    rc = 0;
+
+ restore:
+    if ( set_access(xch, domid, max_gpfn, XENMEM_access_rwx) )
+        perror("Error restoring guest memory access");
+    /* Let the vCPUs still waiting go */
+    handle_requests(xce, port, &back_ring, 0);
+
+ out:
+    if ( xc_monitor_disable(xch, domid) )
+        perror("Error disabling monitor ring");
+    munmap(ring, frames * XC_PAGE_SIZE);
+    if ( port >= 0 )
+        xc_evtchn_unbind(xce, port);
+
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction act;
+    xc_interface *xch;
+    xc_evtchn *xce = NULL;
+    xc_dominfo_t info;
+    xen_pfn_t max_gpfn;
+    struct result res;
+    unsigned int frames, vcpus;
+    uint32_t domid;
+    int opt, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "f:t:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'f':
+            max_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if ( optind != argc - 1 || !max_frames || !seconds )
+        return usage(argv[0]);
+    domid = strtoul(argv[optind], NULL, 0);
+
+    act.sa_handler = close_handler;
+    act.sa_flags = 0;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGHUP,  &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT,  &act, NULL);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        return 1;
+    }
+
+    if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 ||
+         info.domid != domid )
+    {
+        fprintf(stderr, "no domain %u\n", domid);
+        goto out;
+    }
+    vcpus = info.max_vcpu_id + 1;
+
+    if ( xc_domain_maximum_gpfn(xch, domid, &max_gpfn) < 0 )
+    {
+        perror("xc_domain_maximum_gpfn");
+        goto out;
+    }
+
+    xce = xc_evtchn_open(NULL, 0);
+    if ( !xce )
+    {
+        perror("xc_evtchn_open");
+        goto out;
+    }
+
+    if ( xc_mem_access_enable_emulate(xch, domid) )
+    {
+        perror("xc_mem_access_enable_emulate");
+        goto out;
+    }
+
+    printf("domain %u, %u vCPUs\n", domid, vcpus);
+    for ( frames = 1; frames <= max_frames && !interrupted; frames *= 2 )
+    {
+        if ( run(xch, xce, domid, max_gpfn, frames, &res) )
+            goto disable;
+
+        printf("%2u frames %4u slots: %8"PRIu64" events/s, %7"PRIu64
+               " per vCPU, %5.1f per notification, largest batch %u\n",
+               frames, res.slots, bench_rate(res.events, res.us),
+               bench_rate(res.events, res.us) / vcpus,
+               res.notifications ? (double)res.events / res.notifications : 0,
+               res.largest_batch);
+    }
+    rc = 0;
+
+ disable:
+    xc_mem_access_disable_emulate(xch, domid);
+
+ out:
+    if ( xce )
+        xc_evtchn_close(xce);
+    xc_interface_close(xch);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,827 @@
+/*
+ * test_xenstore.c
+ *
+ * Tests of libxenstore against a minimal xenstore daemon run by a thread
+ * of this program, on a socket of its own (XENSTORED_PATH): neither Xen
+ * nor xenstored is needed.
+ *
+ * To run this test:
+ *    ./test_xenstore
+ * Success:
+ *    prints the name of each test as it runs and exits 0
+ * Failure:
+ *    an assertion fails, or the test hangs
+ *
+ * The daemon keeps its nodes in a flat array.  Writing and creating nodes
+ * under /denied fails with EACCES; reading, removing or setting the
+ * permissions of a missing node fails with ENOENT.  It can be told to
+ * hold its replies back until it has a batch of them, and to send each
+ * batch in reverse order: this checks that replies are matched to their
+ * request, and that pipelined requests really are sent before waiting for
+ * the replies.  A batch still incomplete when no request has arrived for
+ * HOLD_MS is sent all the same.  It can also be told to drop the
+ * connection, to check that the requests waiting for a reply then fail.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <xenstore.h>
+
+#define MAX_NODES 1024
+#define MAX_HELD  64
+#define HOLD_MS   100
+
+static struct {
+    char *path, *value;
+} nodes[MAX_NODES];
+static unsigned int nr_nodes;
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned int hold;          /* size of the batches of replies, or 0 */
+    unsigned int full_batches;  /* batches sent once complete */
+    unsigned int drop_after;    /* requests until the connection is closed */
+} daemon_ctl = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct reply {
+    struct xsd_sockmsg hdr;
+    char body[XENSTORE_PAYLOAD_MAX];
+};
+
+static struct reply held[MAX_HELD];
+
+/* The nodes of the daemon */
+
+static int find_node(const char *path)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_nodes; i++ )
+        if ( !strcmp(nodes[i].path, path) )
+            return i;
+
+    return -1;
+}
+
+static void set_node(const char *path, const char *value, unsigned int len)
+{
+    int i = find_node(path);
+
+    if ( i < 0 )
+    {
+        assert(nr_nodes < MAX_NODES);
+        i = nr_nodes++;
+        nodes[i].path = strdup(path);
+        assert(nodes[i].path);
+    }
+    else
+        free(nodes[i].value);
+
+    nodes[i].value = malloc(len + 1);
+    assert(nodes[i].value);
+    memcpy(nodes[i].value, value, len);
+    nodes[i].value[len] = '\0';
+}
+
+/* Create a node and its missing parents, as xenstored does. */
+static void create_node(const char *path, const char *value, unsigned int len)
+{
+    char parent[XENSTORE_PAYLOAD_MAX];
+    const char *slash;
+
+    for ( slash = strchr(path + 1, '/'); slash;
+          slash = strchr(slash + 1, '/') )
+    {
+        memcpy(parent, path, slash - path);
+        parent[slash - path] = '\0';
+        if ( find_node(parent) < 0 )
+            set_node(parent, "", 0);
+    }
+
+    set_node(path, value, len);
+}
+
+static bool is_below(const char *path, const char *parent)
+{
+    size_t len = strlen(parent);
+
+    return !strncmp(path, parent, len) && path[len] == '/';
+}
+
+static void rm_node(const char *path)
+{
+    unsigned int i = 0;
+
+    while ( i < nr_nodes )
+    {
+        if ( strcmp(nodes[i].path, path) && !is_below(nodes[i].path, path) )
+        {
+            i++;
+            continue;
+        }
+        free(nodes[i].path);
+        free(nodes[i].value);
+        nodes[i] = nodes[--nr_nodes];
+    }
+}
+
+static bool denied(const char *path)
+{
+    return !strcmp(path, "/denied") || is_below(path, "/denied");
+}
+
+/* The daemon */
+
+static void handle_request(const struct xsd_sockmsg *req, const char *body,
+                           struct reply *rep)
+{
+    const char *path = body, *err = NULL;
+    unsigned int i, plen = strnlen(body, req->len) + 1;
+    int n;
+
+    rep->hdr = *req;
+    rep->hdr.len = 0;
+
+    switch ( req->type )
+    {
+    case XS_READ:
+        n = find_node(path);
+        if ( n < 0 )
+        {
+            err = "ENOENT";
+            break;
+        }
+        rep->hdr.len = strlen(nodes[n].value);
+        memcpy(rep->body, nodes[n].value, rep->hdr.len);
+        break;
+
+    case XS_DIRECTORY:
+        if ( find_node(path) < 0 )
+        {
+            err = "ENOENT";
+            break;
+        }
+        for ( i = 0; i < nr_nodes; i++ )
+        {
+            const char *name = nodes[i].path + strlen(path) + 1;
+
+            if ( !is_below(nodes[i].path, path) || strchr(name, '/') )
+                continue;
+            assert(rep->hdr.len + strlen(name) + 1 <= sizeof(rep->body));
+            strcpy(rep->body + rep->hdr.len, name);
+            rep->hdr.len += strlen(name) + 1;
+        }
+        break;
+
+    case XS_WRITE:
+        if ( denied(path) )
+            err = "EACCES";
+        else
+            create_node(path, body + plen, req->len - plen);
+        break;
+
+    case XS_MKDIR:
+        if ( denied(path) )
+            err = "EACCES";
+        else if ( find_node(path) < 0 )
+            create_node(path, "", 0);
+        break;
+
+    case XS_RM:
+        if ( find_node(path) < 0 )
+            err = "ENOENT";
+        else
+            rm_node(path);
+        break;
+
+    case XS_SET_PERMS:
+        if ( find_node(path) < 0 )
+            err = "ENOENT";
+        break;
+
+    default:
+        err = "EINVAL";
+        break;
+    }
+
+    if ( err )
+    {
+        rep->hdr.type = XS_ERROR;
+        rep->hdr.len = strlen(err) + 1;
+        memcpy(rep->body, err, rep->hdr.len);
+    }
+    else if ( req->type != XS_READ && req->type != XS_DIRECTORY )
+    {
+        rep->hdr.len = sizeof("OK");
+        memcpy(rep->body, "OK", rep->hdr.len);
+    }
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *data = buf;
+    ssize_t done;
+
+    while ( len )
+    {
+        done = read(fd, data, len);
+        if ( done < 0 && errno == EINTR )
+            continue;
+        if ( done <= 0 )
+            return false;
+        data += done;
+        len -= done;
+    }
+
+    return true;
+}
+
+static void send_held(int fd, unsigned int *nr_held)
+{
+    struct reply *rep;
+
+    while ( *nr_held )
+    {
+        rep = &held[--*nr_held];
+        if ( write(fd, rep, sizeof(rep->hdr) + rep->hdr.len) !=
+             sizeof(rep->hdr) + rep->hdr.len )
+            return;
+    }
+}
+
+/* Answer the requests of a connection until it is closed. */
+static void serve(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct xsd_sockmsg req;
+    char body[XENSTORE_PAYLOAD_MAX + 1];
+    unsigned int nr_held = 0, hold;
+
+    for ( ; ; )
+    {
+        if ( nr_held && poll(&pfd, 1, HOLD_MS) == 0 )
+        {
+            send_held(fd, &nr_held);
+            continue;
+        }
+
+        if ( !read_all(fd, &req, sizeof(req)) ||
+             req.len > XENSTORE_PAYLOAD_MAX ||
+             !read_all(fd, body, req.len) )
+            break;
+        body[req.len] = '\0';
+
+        pthread_mutex_lock(&daemon_ctl.lock);
+        if ( daemon_ctl.drop_after && !--daemon_ctl.drop_after )
+        {
+            pthread_mutex_unlock(&daemon_ctl.lock);
+            break;
+        }
+        hold = daemon_ctl.hold;
+        handle_request(&req, body, &held[nr_held++]);
+        if ( nr_held >= (hold ? hold : 1) )
+        {
+            if ( hold )
+                daemon_ctl.full_batches++;
+            send_held(fd, &nr_held);
+        }
+        pthread_mutex_unlock(&daemon_ctl.lock);
+    }
+
+    close(fd);
+}
+
+static void *daemon_thread(void *arg)
+{
+    int sock = (long)arg, fd;
+
+    while ( (fd = accept(sock, NULL, NULL)) >= 0 )
+        serve(fd);
+
+    return NULL;
+}
+
+static void set_hold(unsigned int hold)
+{
+    assert(hold <= MAX_HELD);
+    pthread_mutex_lock(&daemon_ctl.lock);
+    daemon_ctl.hold = hold;
+    daemon_ctl.full_batches = 0;
+    pthread_mutex_unlock(&daemon_ctl.lock);
+}
+
+static void drop_after(unsigned int requests)
+{
+    pthread_mutex_lock(&daemon_ctl.lock);
+    daemon_ctl.drop_after = requests;
+    pthread_mutex_unlock(&daemon_ctl.lock);
+}
+
+static unsigned int full_batches(void)
+{
+    unsigned int n;
+
+    pthread_mutex_lock(&daemon_ctl.lock);
+    n = daemon_ctl.full_batches;
+    pthread_mutex_unlock(&daemon_ctl.lock);
+
+    return n;
+}
+
+/* The tests */
+
+/* Check the value of a node, or that it does not exist if value is NULL. */
+static void check_node(struct xs_handle *xsh, const char *path,
+                       const char *value)
+{
+    unsigned int len;
+    char *val;
+
+    errno = 0;
+    val = xs_read(xsh, XBT_NULL, path, &len);
+    if ( !value )
+    {
+        assert(!val && errno == ENOENT);
+        return;
+    }
+
+    assert(val);
+    assert(len == strlen(value) && !strcmp(val, value));
+    free(val);
+}
+
+static void test_sync(struct xs_handle *xsh)
+{
+    printf("synchronous requests\n");
+
+    assert(xs_write(xsh, XBT_NULL, "/sync/a", "1", 1));
+    check_node(xsh, "/sync/a", "1");
+    check_node(xsh, "/sync/missing", NULL);
+
+    errno = 0;
+    assert(!xs_rm(xsh, XBT_NULL, "/sync/missing"));
+    assert(errno == ENOENT);
+
+    errno = 0;
+    assert(!xs_write(xsh, XBT_NULL, "/denied/a", "1", 1));
+    assert(errno == EACCES);
+
+    assert(xs_rm(xsh, XBT_NULL, "/sync"));
+    check_node(xsh, "/sync/a", NULL);
+}
+
+static void test_pipeline(struct xs_handle *xsh)
+{
+    struct xs_permissions perms[2] = {
+        { .id = 0, .perms = XS_PERM_NONE },
+        { .id = 1, .perms = XS_PERM_READ },
+    };
+    struct xs_pipeline *pl;
+
+    printf("pipeline\n");
+
+    /* Removing missing nodes is not a failure in a pipeline. */
+    pl = xs_pipeline_start(xsh, XBT_NULL);
+    assert(pl);
+    xs_pipeline_rm(pl, "/pl/dev");
+    xs_pipeline_mkdir(pl, "/pl/dev");
+    xs_pipeline_set_permissions(pl, "/pl/dev", perms, 2);
+    xs_pipeline_write(pl, "/pl/dev/state", "1", 1);
+    xs_pipeline_write(pl, "/pl/dev/mac", "00:16:3e:00:00:00", 17);
+    xs_pipeline_rm(pl, "/pl/other");
+    assert(xs_pipeline_end(pl, false));
+
+    check_node(xsh, "/pl/dev", "");
+    check_node(xsh, "/pl/dev/state", "1");
+    check_node(xsh, "/pl/dev/mac", "00:16:3e:00:00:00");
+
+    /* The first failure is reported, the following requests are made. */
+    pl = xs_pipeline_start(xsh, XBT_NULL);
+    assert(pl);
+    xs_pipeline_write(pl, "/pl/dev/state", "2", 1);
+    xs_pipeline_write(pl, "/denied/state", "2", 1);
+    xs_pipeline_set_permissions(pl, "/pl/missing", perms, 2);
+    xs_pipeline_write(pl, "/pl/dev/online", "1", 1);
+    errno = 0;
+    assert(!xs_pipeline_end(pl, false));
+    assert(errno == EACCES);
+
+    check_node(xsh, "/pl/dev/state", "2");
+    check_node(xsh, "/pl/dev/online", "1");
+    check_node(xsh, "/denied/state", NULL);
+
+    /* ENOENT is only ignored for removals. */
+    pl = xs_pipeline_start(xsh, XBT_NULL);
+    assert(pl);
+    xs_pipeline_rm(pl, "/pl/missing");
+    xs_pipeline_set_permissions(pl, "/pl/missing", perms, 2);
+    errno = 0;
+    assert(!xs_pipeline_end(pl, false));
+    assert(errno == ENOENT);
+
+    /* Nothing is sent if the pipeline is abandoned... */
+    pl = xs_pipeline_start(xsh, XBT_NULL);
+    assert(pl);
+    xs_pipeline_write(pl, "/pl/abandoned", "1", 1);
+    assert(xs_pipeline_end(pl, true));
+    check_node(xsh, "/pl/abandoned", NULL);
+
+    /* ... or if a request could not be queued. */
+    {
+        static char big[XENSTORE_PAYLOAD_MAX];
+
+        pl = xs_pipeline_start(xsh, XBT_NULL);
+        assert(pl);
+        assert(xs_pipeline_write(pl, "/pl/queued", "1", 1));
+        errno = 0;
+        assert(!xs_pipeline_write(pl, "/pl/big", big, sizeof(big)));
+        assert(errno == E2BIG);
+        assert(!xs_pipeline_write(pl, "/pl/after", "1", 1));
+        errno = 0;
+        assert(!xs_pipeline_end(pl, false));
+        assert(errno == E2BIG);
+        check_node(xsh, "/pl/queued", NULL);
+        check_node(xsh, "/pl/after", NULL);
+    }
+
+    assert(xs_rm(xsh, XBT_NULL, "/pl"));
+}
+
+/*
+ * More requests than are sent at a time, with the daemon answering them
+ * by reversed batches of 16: a pipeline must send a whole window of 64
+ * requests before waiting for the first reply, and match the replies to
+ * the requests.
+ */
+static void test_pipeline_window(struct xs_handle *xsh)
+{
+    struct xs_pipeline *pl;
+    char path[64], val[16];
+    unsigned int i;
+
+    printf("pipeline, replies out of order\n");
+
+    set_hold(16);
+
+    pl = xs_pipeline_start(xsh, XBT_NULL);
+    assert(pl);
+    for ( i = 0; i < 200; i++ )
+    {
+        snprintf(path, sizeof(path), "/window/%u", i);
+        snprintf(val, sizeof(val), "%u", i);
+        assert(xs_pipeline_write(pl, path, val, strlen(val)));
+    }
+    xs_pipeline_write(pl, "/denied/last", "1", 1);
+    errno = 0;
+    assert(!xs_pipeline_end(pl, false));
+    assert(errno == EACCES);
+
+    /* Three windows of 64, then 9 requests answered after HOLD_MS */
+    assert(full_batches() == 12);
+
+    set_hold(0);
+
+    for ( i = 0; i < 200; i++ )
+    {
+        snprintf(path, sizeof(path), "/window/%u", i);
+        snprintf(val, sizeof(val), "%u", i);
+        check_node(xsh, path, val);
+    }
+
+    assert(xs_rm(xsh, XBT_NULL, "/window"));
+}
+
+static void write_nodes(struct xs_handle *xsh, const char *dir,
+                        unsigned int nr)
+{
+    char path[64];
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        snprintf(path, sizeof(path), "%s/%u", dir, i);
+        assert(xs_write(xsh, XBT_NULL, path, path, strlen(path)));
+    }
+}
+
+static struct xs_future *read_node_async(struct xs_handle *xsh,
+                                         const char *dir, unsigned int i)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "%s/%u", dir, i);
+    return xs_read_async(xsh, XBT_NULL, path);
+}
+
+static void check_future(struct xs_future *f, const char *dir, unsigned int i)
+{
+    char path[64], *val;
+    unsigned int len;
+
+    snprintf(path, sizeof(path), "%s/%u", dir, i);
+    val = xs_future_wait(f, &len);
+    assert(val && len == strlen(path) && !strcmp(val, path));
+    free(val);
+}
+
+/*
+ * The daemon answers by reversed batches of 8, and the futures are
+ * collected in yet another order: each must get the reply to its own
+ * request, and the replies read while waiting for one are kept for the
+ * others.
+ */
+static void test_futures(struct xs_handle *xsh)
+{
+    struct xs_future *f[32];
+    unsigned int i, j, order[32];
+
+    printf("futures, replies out of order\n");
+
+    write_nodes(xsh, "/futures", 32);
+
+    set_hold(8);
+
+    for ( i = 0; i < 32; i++ )
+    {
+        f[i] = read_node_async(xsh, "/futures", i);
+        assert(f[i]);
+    }
+
+    /* The last request's reply is the first of the last batch. */
+    check_future(f[31], "/futures", 31);
+    for ( i = 0; i < 24; i++ )
+        assert(xs_future_ready(f[i]));
+
+    for ( i = 0; i < 31; i++ )
+        order[i] = (i * 7) % 31;
+    for ( i = 0; i < 31; i++ )
+    {
+        j = order[i];
+        check_future(f[j], "/futures", j);
+    }
+
+    assert(full_batches() == 4);
+    set_hold(0);
+
+    assert(xs_rm(xsh, XBT_NULL, "/futures"));
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Each kind of request, failing or not, gets its own reply. */
+static void test_future_types(struct xs_handle *xsh)
+{
+    struct xs_future *read, *missing, *write, *denied, *mkdir, *dir, *rm,
+        *rm_missing;
+    unsigned int num, len;
+    char **names, *val;
+
+    printf("futures of each type\n");
+
+    set_hold(8);
+
+    write = xs_write_async(xsh, XBT_NULL, "/types/a", "1", 1);
+    denied = xs_write_async(xsh, XBT_NULL, "/denied/a", "1", 1);
+    mkdir = xs_mkdir_async(xsh, XBT_NULL, "/types/b");
+    read = xs_read_async(xsh, XBT_NULL, "/types/a");
+    missing = xs_read_async(xsh, XBT_NULL, "/types/missing");
+    dir = xs_directory_async(xsh, XBT_NULL, "/types");
+    rm = xs_rm_async(xsh, XBT_NULL, "/types/b");
+    rm_missing = xs_rm_async(xsh, XBT_NULL, "/types/missing");
+    assert(write && denied && mkdir && read && missing && dir && rm &&
+           rm_missing);
+
+    errno = 0;
+    assert(!xs_future_wait_bool(rm_missing));
+    assert(errno == ENOENT);
+    assert(xs_future_wait_bool(rm));
+
+    names = xs_future_wait_directory(dir, &num);
+    assert(names && num == 2);
+    qsort(names, num, sizeof(*names), cmp_str);
+    assert(!strcmp(names[0], "a") && !strcmp(names[1], "b"));
+    free(names);
+
+    errno = 0;
+    assert(!xs_future_wait(missing, &len));
+    assert(errno == ENOENT);
+    val = xs_future_wait(read, &len);
+    assert(val && len == 1 && !strcmp(val, "1"));
+    free(val);
+
+    assert(xs_future_wait_bool(mkdir));
+    errno = 0;
+    assert(!xs_future_wait_bool(denied));
+    assert(errno == EACCES);
+    assert(xs_future_wait_bool(write));
+
+    set_hold(0);
+
+    check_node(xsh, "/types/b", NULL);
+    assert(xs_rm(xsh, XBT_NULL, "/types"));
+}
+
+struct thread_args {
+    struct xs_handle *xsh;
+    unsigned int first;
+};
+
+static void *sync_thread(void *arg)
+{
+    struct thread_args *args = arg;
+    char path[64];
+    unsigned int i;
+
+    for ( i = args->first; i < args->first + 25; i++ )
+    {
+        snprintf(path, sizeof(path), "/threads/%u", i);
+        check_node(args->xsh, path, path);
+    }
+
+    return NULL;
+}
+
+/*
+ * Synchronous requests from several threads, with replies held back until
+ * each thread has made its request: whichever thread reads a reply must
+ * hand it over to the thread which made the request.
+ */
+static void test_threads(struct xs_handle *xsh)
+{
+    struct thread_args args[4];
+    pthread_t tid[4];
+    unsigned int t;
+
+    printf("threads sharing a handle\n");
+
+    write_nodes(xsh, "/threads", 100);
+
+    set_hold(4);
+
+    for ( t = 0; t < 4; t++ )
+    {
+        args[t].xsh = xsh;
+        args[t].first = t * 25;
+        assert(!pthread_create(&tid[t], NULL, sync_thread, &args[t]));
+    }
+    for ( t = 0; t < 4; t++ )
+        pthread_join(tid[t], NULL);
+
+    assert(full_batches());
+    set_hold(0);
+
+    assert(xs_rm(xsh, XBT_NULL, "/threads"));
+}
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int called[32];
+    unsigned int done;
+} cb_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void read_done(struct xs_handle *xsh, struct xs_future *f, void *data)
+{
+    unsigned int i = (unsigned long)data;
+
+    check_future(f, "/callbacks", i);
+
+    pthread_mutex_lock(&cb_state.lock);
+    cb_state.called[i]++;
+    cb_state.done++;
+    pthread_cond_signal(&cb_state.cond);
+    pthread_mutex_unlock(&cb_state.lock);
+}
+
+/* Each callback is called once, with the reply to its request. */
+static void test_callbacks(struct xs_handle *xsh)
+{
+    struct xs_future *f;
+    unsigned long i;
+
+    printf("callbacks\n");
+
+    write_nodes(xsh, "/callbacks", 32);
+
+    set_hold(8);
+
+    for ( i = 0; i < 32; i++ )
+    {
+        f = read_node_async(xsh, "/callbacks", i);
+        assert(f);
+        assert(xs_future_set_callback(f, read_done, (void *)i));
+    }
+
+    pthread_mutex_lock(&cb_state.lock);
+    while ( cb_state.done < 32 )
+        pthread_cond_wait(&cb_state.cond, &cb_state.lock);
+    pthread_mutex_unlock(&cb_state.lock);
+
+    for ( i = 0; i < 32; i++ )
+        assert(cb_state.called[i] == 1);
+
+    set_hold(0);
+
+    assert(xs_rm(xsh, XBT_NULL, "/callbacks"));
+}
+
+/* Requests waiting for a reply fail when the connection is lost. */
+static void test_connection_lost(void)
+{
+    struct xs_handle *xsh;
+    struct xs_future *f[4];
+    unsigned int i;
+
+    printf("connection lost\n");
+
+    xsh = xs_open(XS_OPEN_SOCKETONLY);
+    assert(xsh);
+
+    write_nodes(xsh, "/lost", 4);
+
+    set_hold(8);
+    drop_after(4);
+
+    for ( i = 0; i < 4; i++ )
+    {
+        f[i] = read_node_async(xsh, "/lost", i);
+        assert(f[i]);
+    }
+    for ( i = 0; i < 4; i++ )
+    {
+        errno = 0;
+        assert(!xs_future_wait(f[i], NULL));
+        assert(errno);
+    }
+
+    assert(!xs_read(xsh, XBT_NULL, "/lost/0", NULL));
+
+    set_hold(0);
+    xs_close(xsh);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/test_xenstore.XXXXXX";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct xs_handle *xsh;
+    pthread_t daemon;
+    int sock;
+
+    assert(mkdtemp(dir));
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket", dir);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(sock >= 0);
+    assert(!bind(sock, (struct sockaddr *)&addr, sizeof(addr)));
+    assert(!listen(sock, 1));
+    assert(!pthread_create(&daemon, NULL, daemon_thread, (void *)(long)sock));
+
+    setenv("XENSTORED_PATH", addr.sun_path, 1);
+    xsh = xs_open(XS_OPEN_SOCKETONLY);
+    assert(xsh);
+
+    test_sync(xsh);
+    test_pipeline(xsh);
+    test_pipeline_window(xsh);
+    test_futures(xsh);
+    test_future_types(xsh);
+    test_threads(xsh);
+    test_callbacks(xsh);
+
+    xs_close(xsh);
+
+    test_connection_lost();
+
+    unlink(addr.sun_path);
+    rmdir(dir);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
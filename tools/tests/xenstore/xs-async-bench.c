@@ -0,0 +1,302 @@
+/*
+ * xs-async-bench.c
+ *
+ * Measure the throughput of xenstore reads over a single connection:
+ * with one request at a time, from several threads sharing the handle,
+ * and with many requests in flight from one thread, either waiting for
+ * the futures in turn or having a callback collect each reply and send
+ * the next request.
+ *
+ * Run it against a local xenstored (XENSTORED_PATH selects its socket).
+ * The nodes read are written under /local/domain/<domid>, for an unused
+ * domid, and removed afterwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <xenstore.h>
+
+#include "bench.h"
+
+#define BASE_PATH "/local/domain/30000/bench"
+#define NR_NODES 256
+
+static unsigned int nr_requests = 100000, nr_threads = 8, window = 64;
+
+static int usage(const char *prog)
+{
+    printf("usage: %s [-n <requests>] [-t <threads>] [-w <window>]\n", prog);
+    printf("  Reads <requests> (default 100000) nodes over one connection,\n");
+    printf("  one at a time, from <threads> (default 8) threads, and with\n");
+    printf("  <window> (default 64) asynchronous requests in flight.\n");
+    return 1;
+}
+
+static void node_path(char *path, size_t size, unsigned int i)
+{
+    snprintf(path, size, BASE_PATH "/%u", i % NR_NODES);
+}
+
+static bool read_node(struct xs_handle *xsh, unsigned int i)
+{
+    char path[64], *val;
+
+    node_path(path, sizeof(path), i);
+    val = xs_read(xsh, XBT_NULL, path, NULL);
+    free(val);
+    return val;
+}
+
+struct thread_args {
+    struct xs_handle *xsh;
+    unsigned int first, nr;
+    bool ok;
+};
+
+static void *sync_thread(void *arg)
+{
+    struct thread_args *args = arg;
+    unsigned int i;
+
+    args->ok = true;
+    for ( i = args->first; i < args->first + args->nr; i++ )
+        if ( !read_node(args->xsh, i) )
+        {
+            args->ok = false;
+            break;
+        }
+
+    return NULL;
+}
+
+static bool run_sync(struct xs_handle *xsh, unsigned int threads)
+{
+    pthread_t tid[threads];
+    struct thread_args args[threads];
+    unsigned int t, started;
+    bool ok = true;
+
+    for ( started = 0; started < threads; started++ )
+    {
+        t = started;
+        args[t].xsh = xsh;
+        args[t].first = nr_requests / threads * t;
+        args[t].nr = t == threads - 1 ? nr_requests - args[t].first
+                                      : nr_requests / threads;
+        if ( pthread_create(&tid[t], NULL, sync_thread, &args[t]) )
+        {
+            perror("pthread_create");
+            ok = false;
+            break;
+        }
+    }
+
+    for ( t = 0; t < started; t++ )
+    {
+        pthread_join(tid[t], NULL);
+        ok = ok && args[t].ok;
+    }
+
+    return ok;
+}
+
+static struct xs_future *read_async(struct xs_handle *xsh, unsigned int i)
+{
+    char path[64];
+
+    node_path(path, sizeof(path), i);
+    return xs_read_async(xsh, XBT_NULL, path);
+}
+
+/* Keep a window of requests in flight, waiting for the oldest. */
+static bool run_futures(struct xs_handle *xsh)
+{
+    struct xs_future *f[window];
+    unsigned int sent = 0, done = 0;
+    bool ok = true;
+    void *val;
+
+    while ( done < sent || (ok && sent < nr_requests) )
+    {
+        if ( ok && sent < nr_requests && sent - done < window )
+        {
+            f[sent % window] = read_async(xsh, sent);
+            if ( !f[sent % window] )
+                ok = false;
+            else
+                sent++;
+            continue;
+        }
+
+        val = xs_future_wait(f[done % window], NULL);
+        if ( !val )
+            ok = false;
+        free(val);
+        done++;
+    }
+
+    return ok;
+}
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int sent, done;
+    bool ok;
+} cb_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void read_done(struct xs_handle *xsh, struct xs_future *f, void *data);
+
+/* Send the next request, if any.  Called with cb_state.lock held. */
+static void send_next(struct xs_handle *xsh)
+{
+    struct xs_future *f;
+
+    if ( !cb_state.ok || cb_state.sent == nr_requests )
+        return;
+
+    f = read_async(xsh, cb_state.sent);
+    if ( !f )
+    {
+        cb_state.ok = false;
+        return;
+    }
+    cb_state.sent++;
+
+    pthread_mutex_unlock(&cb_state.lock);
+    if ( !xs_future_set_callback(f, read_done, NULL) )
+    {
+        free(xs_future_wait(f, NULL));
+        pthread_mutex_lock(&cb_state.lock);
+        cb_state.ok = false;
+        cb_state.done++;
+        return;
+    }
+    pthread_mutex_lock(&cb_state.lock);
+}
+
+static void read_done(struct xs_handle *xsh, struct xs_future *f, void *data)
+{
+    void *val = xs_future_wait(f, NULL);
+
+    pthread_mutex_lock(&cb_state.lock);
+    if ( !val )
+        cb_state.ok = false;
+    free(val);
+    cb_state.done++;
+    send_next(xsh);
+    pthread_cond_signal(&cb_state.cond);
+    pthread_mutex_unlock(&cb_state.lock);
+}
+
+/* Keep a window of requests in flight, sending one per reply received. */
+static bool run_callbacks(struct xs_handle *xsh)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&cb_state.lock);
+    cb_state.sent = cb_state.done = 0;
+    cb_state.ok = true;
+    for ( i = 0; i < window; i++ )
+        send_next(xsh);
+    while ( cb_state.done < cb_state.sent )
+        pthread_cond_wait(&cb_state.cond, &cb_state.lock);
+    pthread_mutex_unlock(&cb_state.lock);
+
+    return cb_state.ok;
+}
+
+int main(int argc, char **argv)
+{
+    struct xs_handle *xsh;
+    char path[64], name[32];
+    unsigned int i;
+    uint64_t t;
+    bool ok;
+    int opt, m, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "n:t:w:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr_requests = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            nr_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if ( optind != argc || !nr_requests || !nr_threads || !window )
+        return usage(argv[0]);
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        perror("xs_open");
+        return 1;
+    }
+
+    for ( i = 0; i < NR_NODES; i++ )
+    {
+        node_path(path, sizeof(path), i);
+        if ( !xs_write(xsh, XBT_NULL, path, path, strlen(path)) )
+        {
+            perror("xs_write");
+            goto out;
+        }
+    }
+
+    for ( m = 0; m < 4; m++ )
+    {
+        t = bench_now_us();
+        switch ( m )
+        {
+        case 0:
+            snprintf(name, sizeof(name), "sync");
+            ok = run_sync(xsh, 1);
+            break;
+        case 1:
+            snprintf(name, sizeof(name), "sync x%u", nr_threads);
+            ok = run_sync(xsh, nr_threads);
+            break;
+        case 2:
+            snprintf(name, sizeof(name), "futures");
+            ok = run_futures(xsh);
+            break;
+        default:
+            snprintf(name, sizeof(name), "callbacks");
+            ok = run_callbacks(xsh);
+            break;
+        }
+        t = bench_now_us() - t;
+        if ( !ok )
+        {
+            perror(name);
+            goto out;
+        }
+
+        bench_report_rate(name, nr_requests, "requests", t);
+        printf("\n");
+    }
+
+    rc = 0;
+
+ out:
+    xs_rm(xsh, XBT_NULL, "/local/domain/30000");
+    xs_close(xsh);
+    return rc;
+}
@@ -0,0 +1,306 @@
+/*
+ * xs-bench.c
+ *
+ * Measure how long the xenstore part of creating domains with many
+ * devices takes, writing the nodes of each device the way libxl does:
+ * one transaction per device, in which the frontend and backend
+ * directories are created, given permissions and filled in.  This is
+ * done once with one request at a time, then with the requests of each
+ * transaction pipelined.
+ *
+ * Run it against a local xenstored (XENSTORED_PATH selects its socket).
+ * Several jobs run concurrently to see how the transactions of
+ * simultaneous domain creations conflict.  The nodes are written under
+ * /local/domain/<domid>, for unused domids, and removed afterwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <xenstore.h>
+
+#include "bench.h"
+
+#define BASE_DOMID 30000
+
+static unsigned int nr_domains = 16, nr_devices = 32, nr_jobs = 1;
+
+static int usage(const char *prog)
+{
+    printf("usage: %s [-d <domains>] [-n <devices>] [-j <jobs>]\n", prog);
+    printf("  Each of <jobs> processes (default 1) creates the xenstore\n");
+    printf("  nodes of <domains> (default 16) domains with <devices>\n");
+    printf("  (default 32) devices each, without and with pipelining.\n");
+    return 1;
+}
+
+/* The nodes written for a vif, as by libxl__device_nic_add() */
+static const char *const front_nodes[][2] = {
+    { "backend-id", "0" }, { "state", "1" }, { "handle", "0" },
+    { "mac", "00:16:3e:00:00:00" }, { "mtu", "1500" },
+};
+
+static const char *const back_nodes[][2] = {
+    { "frontend-id", "0" }, { "online", "1" }, { "state", "1" },
+    { "script", "/etc/xen/scripts/vif-bridge" }, { "bridge", "xenbr0" },
+    { "mac", "00:16:3e:00:00:00" }, { "handle", "0" }, { "type", "vif" },
+    { "hotplug-status", "" }, { "mtu", "1500" },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct paths {
+    char fe[64], be[64], link[128];
+};
+
+static void device_paths(struct paths *p, unsigned int domid,
+                         unsigned int devid)
+{
+    snprintf(p->fe, sizeof(p->fe), "/local/domain/%u/device/vif/%u",
+             domid, devid);
+    snprintf(p->be, sizeof(p->be), "/local/domain/0/backend/vif/%u/%u",
+             domid, devid);
+    snprintf(p->link, sizeof(p->link), "%s/frontend", p->be);
+}
+
+static bool add_device_sync(struct xs_handle *xsh, xs_transaction_t t,
+                            unsigned int domid, unsigned int devid)
+{
+    struct xs_permissions fe_perms[2] = {
+        { .id = domid, .perms = XS_PERM_NONE },
+        { .id = 0, .perms = XS_PERM_READ },
+    }, ro_perms[2] = {
+        { .id = 0, .perms = XS_PERM_NONE },
+        { .id = domid, .perms = XS_PERM_READ },
+    };
+    char path[128];
+    struct paths p;
+    unsigned int i;
+
+    device_paths(&p, domid, devid);
+
+    xs_rm(xsh, t, p.fe);
+    xs_rm(xsh, t, p.be);
+    if ( !xs_mkdir(xsh, t, p.fe) ||
+         !xs_set_permissions(xsh, t, p.fe, fe_perms, 2) ||
+         !xs_mkdir(xsh, t, p.be) ||
+         !xs_set_permissions(xsh, t, p.be, ro_perms, 2) ||
+         !xs_write(xsh, t, p.link, p.fe, strlen(p.fe)) )
+        return false;
+
+    for ( i = 0; i < ARRAY_SIZE(front_nodes); i++ )
+    {
+        snprintf(path, sizeof(path), "%s/%s", p.fe, front_nodes[i][0]);
+        if ( !xs_write(xsh, t, path, front_nodes[i][1],
+                       strlen(front_nodes[i][1])) )
+            return false;
+    }
+    for ( i = 0; i < ARRAY_SIZE(back_nodes); i++ )
+    {
+        snprintf(path, sizeof(path), "%s/%s", p.be, back_nodes[i][0]);
+        if ( !xs_write(xsh, t, path, back_nodes[i][1],
+                       strlen(back_nodes[i][1])) )
+            return false;
+    }
+
+    return true;
+}
+
+static bool add_device_pipelined(struct xs_handle *xsh, xs_transaction_t t,
+                                 unsigned int domid, unsigned int devid)
+{
+    struct xs_permissions fe_perms[2] = {
+        { .id = domid, .perms = XS_PERM_NONE },
+        { .id = 0, .perms = XS_PERM_READ },
+    }, ro_perms[2] = {
+        { .id = 0, .perms = XS_PERM_NONE },
+        { .id = domid, .perms = XS_PERM_READ },
+    };
+    struct xs_pipeline *pl;
+    char path[128];
+    struct paths p;
+    unsigned int i;
+
+    pl = xs_pipeline_start(xsh, t);
+    if ( !pl )
+        return false;
+
+    device_paths(&p, domid, devid);
+
+    xs_pipeline_rm(pl, p.fe);
+    xs_pipeline_rm(pl, p.be);
+    xs_pipeline_mkdir(pl, p.fe);
+    xs_pipeline_set_permissions(pl, p.fe, fe_perms, 2);
+    xs_pipeline_mkdir(pl, p.be);
+    xs_pipeline_set_permissions(pl, p.be, ro_perms, 2);
+    xs_pipeline_write(pl, p.link, p.fe, strlen(p.fe));
+
+    for ( i = 0; i < ARRAY_SIZE(front_nodes); i++ )
+    {
+        snprintf(path, sizeof(path), "%s/%s", p.fe, front_nodes[i][0]);
+        xs_pipeline_write(pl, path, front_nodes[i][1],
+                          strlen(front_nodes[i][1]));
+    }
+    for ( i = 0; i < ARRAY_SIZE(back_nodes); i++ )
+    {
+        snprintf(path, sizeof(path), "%s/%s", p.be, back_nodes[i][0]);
+        xs_pipeline_write(pl, path, back_nodes[i][1],
+                          strlen(back_nodes[i][1]));
+    }
+
+    return xs_pipeline_end(pl, false);
+}
+
+/*
+ * Create the devices of the domains of a job, each in a transaction,
+ * retried on conflict.  Returns the number of retries, or -1 on failure.
+ */
+static int run_job(unsigned int job, bool pipelined)
+{
+    struct xs_handle *xsh = xs_open(0);
+    unsigned int d, n, domid;
+    xs_transaction_t t;
+    char path[64];
+    bool ok;
+    int retries = 0;
+
+    if ( !xsh )
+    {
+        perror("xs_open");
+        return -1;
+    }
+
+    for ( d = 0; d < nr_domains; d++ )
+    {
+        domid = BASE_DOMID + job * nr_domains + d;
+        for ( n = 0; n < nr_devices; n++ )
+        {
+            for ( ; ; )
+            {
+                t = xs_transaction_start(xsh);
+                if ( t == XBT_NULL )
+                    goto fail;
+                ok = pipelined ? add_device_pipelined(xsh, t, domid, n)
+                               : add_device_sync(xsh, t, domid, n);
+                if ( !ok )
+                {
+                    xs_transaction_end(xsh, t, true);
+                    goto fail;
+                }
+                if ( xs_transaction_end(xsh, t, false) )
+                    break;
+                if ( errno != EAGAIN )
+                    goto fail;
+                retries++;
+            }
+        }
+    }
+
+    for ( d = 0; d < nr_domains; d++ )
+    {
+        domid = BASE_DOMID + job * nr_domains + d;
+        snprintf(path, sizeof(path), "/local/domain/%u", domid);
+        xs_rm(xsh, XBT_NULL, path);
+        snprintf(path, sizeof(path), "/local/domain/0/backend/vif/%u", domid);
+        xs_rm(xsh, XBT_NULL, path);
+    }
+
+    xs_close(xsh);
+    return retries;
+
+ fail:
+    perror("xenstore");
+    xs_close(xsh);
+    return -1;
+}
+
+/* Run the jobs in child processes, reporting their retries in the exit
+ * status.  Returns the total number of retries, or -1 on failure. */
+static int run(bool pipelined)
+{
+    unsigned int j, started = 0;
+    int status, retries = 0;
+    pid_t pid;
+
+    if ( nr_jobs == 1 )
+        return run_job(0, pipelined);
+
+    for ( j = 0; j < nr_jobs; j++ )
+    {
+        pid = fork();
+        if ( pid < 0 )
+        {
+            perror("fork");
+            retries = -1;
+            break;
+        }
+        if ( !pid )
+        {
+            int rc = run_job(j, pipelined);
+
+            _exit(rc < 0 ? 255 : rc > 254 ? 254 : rc);
+        }
+        started++;
+    }
+
+    for ( j = 0; j < started; j++ )
+    {
+        if ( wait(&status) < 0 || !WIFEXITED(status) ||
+             WEXITSTATUS(status) == 255 )
+            retries = -1;
+        else if ( retries >= 0 )
+            retries += WEXITSTATUS(status);
+    }
+
+    return retries;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const modes[] = { "sync", "pipelined" };
+    unsigned int devices;
+    uint64_t t;
+    int opt, m, retries;
+
+    while ( (opt = getopt(argc, argv, "d:n:j:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            nr_domains = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_devices = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            nr_jobs = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if ( optind != argc || !nr_domains || !nr_devices || !nr_jobs )
+        return usage(argv[0]);
+
+    devices = nr_jobs * nr_domains * nr_devices;
+
+    for ( m = 0; m < ARRAY_SIZE(modes); m++ )
+    {
+        t = bench_now_us();
+        retries = run(m);
+        t = bench_now_us() - t;
+        if ( retries < 0 )
+            return 1;
+
+        bench_report_rate(modes[m], devices, "devices", t);
+        printf(", %"PRIu64"us per device, %"PRIu64"us per domain, "
+               "%d retries\n", t / devices, t * nr_devices / devices, retries);
+    }
+
+    return 0;
+}
@@ -21,8 +21,11 @@
 
 
 #include <unistd.h>
+#include <pthread.h>
 #include <xc_private.h>
 
+#include "file_ops.h"
+
 static int file_op(int fd, void *page, int i,
                    ssize_t (*fn)(int, void *, size_t))
 {
@@ -61,6 +64,211 @@ int write_page(int fd, void *page, int i)
     return file_op(fd, page, i, &my_write);
 }
 
+/*
+ * Pages are written out by a thread, from one of two buffers, so that the
+ * next batch can be evicted into the other meanwhile.
+ */
+#define WRITER_BUFFERS 2
+
+struct page_writer {
+    int fd;
+    unsigned int max_pages;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Buffers and their slots, used in turn */
+    void *buffer[WRITER_BUFFERS];
+    int *slots[WRITER_BUFFERS];
+    unsigned int num[WRITER_BUFFERS];
+    /* Next buffer to fill, and number of buffers queued for writing */
+    unsigned int next, queued;
+    /* errno of the first failed write */
+    int err;
+    int stop;
+};
+
+static int write_run(int fd, char *buf, int slot, unsigned int num)
+{
+    off_t offset = (off_t)slot << PAGE_SHIFT;
+    size_t len = (size_t)num << PAGE_SHIFT;
+    ssize_t bytes;
+
+    while ( len )
+    {
+        bytes = pwrite(fd, buf, len, offset);
+        if ( bytes <= 0 )
+        {
+            if ( bytes < 0 && errno == EINTR )
+                continue;
+            return -1;
+        }
+        buf += bytes;
+        offset += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+static void *page_writer_thread(void *arg)
+{
+    struct page_writer *w = arg;
+    unsigned int b, i, run;
+    int *slots, rc = 0;
+    char *buf;
+
+    pthread_mutex_lock(&w->mutex);
+    for ( ; ; )
+    {
+        while ( !w->queued && !w->stop )
+            pthread_cond_wait(&w->cond, &w->mutex);
+        if ( !w->queued )
+            break;
+
+        /* The oldest buffer queued */
+        b = (w->next + WRITER_BUFFERS - w->queued) % WRITER_BUFFERS;
+        pthread_mutex_unlock(&w->mutex);
+
+        buf = w->buffer[b];
+        slots = w->slots[b];
+        /* Write each run of consecutive slots at once */
+        for ( i = 0; i < w->num[b] && !rc; i += run )
+        {
+            for ( run = 1; i + run < w->num[b]; run++ )
+                if ( slots[i + run] != slots[i] + run )
+                    break;
+            rc = write_run(w->fd, buf + ((size_t)i << PAGE_SHIFT), slots[i],
+                           run);
+        }
+
+        pthread_mutex_lock(&w->mutex);
+        if ( rc && !w->err )
+            w->err = errno ? : EIO;
+        rc = 0;
+        w->queued--;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+struct page_writer *page_writer_create(int fd, unsigned int max_pages)
+{
+    struct page_writer *w = calloc(1, sizeof(*w));
+    unsigned int b;
+
+    if ( !w )
+        return NULL;
+
+    w->fd = fd;
+    w->max_pages = max_pages;
+    for ( b = 0; b < WRITER_BUFFERS; b++ )
+    {
+        errno = posix_memalign(&w->buffer[b], PAGE_SIZE,
+                               (size_t)max_pages << PAGE_SHIFT);
+        if ( errno )
+        {
+            w->buffer[b] = NULL;
+            goto err;
+        }
+        w->slots[b] = malloc(max_pages * sizeof(*w->slots[b]));
+        if ( !w->slots[b] )
+            goto err;
+    }
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    errno = pthread_create(&w->thread, NULL, page_writer_thread, w);
+    if ( errno )
+        goto err;
+
+    return w;
+
+ err:
+    for ( b = 0; b < WRITER_BUFFERS; b++ )
+    {
+        free(w->buffer[b]);
+        free(w->slots[b]);
+    }
+    free(w);
+    return NULL;
+}
+
+void *page_writer_buffer(struct page_writer *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    while ( w->queued == WRITER_BUFFERS )
+        pthread_cond_wait(&w->cond, &w->mutex);
+    pthread_mutex_unlock(&w->mutex);
+
+    return w->buffer[w->next];
+}
+
+int page_writer_submit(struct page_writer *w, const int *slots,
+                       unsigned int num)
+{
+    int err;
+
+    if ( num > w->max_pages )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    err = w->err;
+    if ( num )
+    {
+        memcpy(w->slots[w->next], slots, num * sizeof(*slots));
+        w->num[w->next] = num;
+        w->next = (w->next + 1) % WRITER_BUFFERS;
+        w->queued++;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+
+    errno = err;
+    return err ? -1 : 0;
+}
+
+int page_writer_flush(struct page_writer *w)
+{
+    int err;
+
+    pthread_mutex_lock(&w->mutex);
+    while ( w->queued )
+        pthread_cond_wait(&w->cond, &w->mutex);
+    err = w->err;
+    pthread_mutex_unlock(&w->mutex);
+
+    errno = err;
+    return err ? -1 : 0;
+}
+
+void page_writer_destroy(struct page_writer *w)
+{
+    unsigned int b;
+
+    if ( !w )
+        return;
+
+    pthread_mutex_lock(&w->mutex);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+
+    for ( b = 0; b < WRITER_BUFFERS; b++ )
+    {
+        free(w->buffer[b]);
+        free(w->slots[b]);
+    }
+    free(w);
+}
+
 
 /*
  * Local variables:
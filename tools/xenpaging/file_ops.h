@@ -28,6 +28,22 @@
 int read_page(int fd, void *page, int i);
 int write_page(int fd, void *page, int i);
 
+/*
+ * Asynchronous writes of batches of pages: a batch is copied into the
+ * buffer returned by page_writer_buffer(), then page_writer_submit() has
+ * it written to the given slots in the background.  The pages must not be
+ * read back before page_writer_flush() has returned.  Write errors are
+ * reported by the next page_writer_submit() or page_writer_flush().
+ */
+struct page_writer;
+
+struct page_writer *page_writer_create(int fd, unsigned int max_pages);
+void *page_writer_buffer(struct page_writer *w);
+int page_writer_submit(struct page_writer *w, const int *slots,
+                       unsigned int num);
+int page_writer_flush(struct page_writer *w);
+void page_writer_destroy(struct page_writer *w);
+
 
 #endif
 
@@ -19,12 +19,24 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+/*
+ * CLOCK policy: the hand goes round the gfns, and a page whose reference
+ * bit is set gets a second chance, with the bit cleared.  The bit is set
+ * when a page is paged in again.  With access sampling, a second hand
+ * runs paging->access_sample gfns ahead, clearing the reference bits and
+ * revoking all access to the pages: the first access by the guest is
+ * reported by a mem_access event, which sets the reference bit again.
+ * Pages the guest has not touched by the time the hand reaches them are
+ * evicted first.
+ */
 
 #include "xc_bitops.h"
 #include "policy.h"
 
 
 #define DEFAULT_MRU_SIZE (1024 * 16)
+/* Most gfns whose access is revoked in one hypercall */
+#define ARM_BATCH 512
 
 
 static unsigned long *mru;
@@ -35,6 +47,67 @@ static unsigned long *unconsumed;
 static unsigned int unconsumed_cleared;
 static unsigned long current_gfn;
 static unsigned long max_pages;
+static unsigned long *referenced;
+static unsigned long *armed;
+static unsigned long sample_gfn;
+static unsigned long sample_ahead;
+
+/* Revoke access to a run of gfns */
+static int arm_run(struct xenpaging *paging, unsigned long start,
+                   unsigned long nr)
+{
+    xc_interface *xch = paging->xc_handle;
+    int rc;
+
+    if ( !nr )
+        return 0;
+
+    rc = xc_set_mem_access(xch, paging->vm_event.domain_id, XENMEM_access_n,
+                           start, nr);
+    if ( rc < 0 )
+    {
+        PERROR("Error revoking access to gfns %lx-%lx, stopping sampling",
+               start, start + nr - 1);
+        paging->access_sample = 0;
+    }
+    return rc;
+}
+
+/* Move the sampling hand up to access_sample gfns ahead of the hand */
+static void arm_ahead(struct xenpaging *paging)
+{
+    unsigned long start = 0, nr = 0;
+
+    while ( paging->access_sample && sample_ahead < paging->access_sample )
+    {
+        sample_gfn++;
+        if ( sample_gfn >= max_pages )
+            sample_gfn = 0;
+        sample_ahead++;
+
+        if ( test_bit(sample_gfn, bitmap) || test_bit(sample_gfn, armed) )
+        {
+            arm_run(paging, start, nr);
+            nr = 0;
+            continue;
+        }
+
+        set_bit(sample_gfn, armed);
+        clear_bit(sample_gfn, referenced);
+
+        if ( nr && start + nr == sample_gfn && nr < ARM_BATCH )
+        {
+            nr++;
+            continue;
+        }
+        arm_run(paging, start, nr);
+        start = sample_gfn;
+        nr = 1;
+    }
+
+    if ( paging->access_sample )
+        arm_run(paging, start, nr);
+}
 
 
 int policy_init(struct xenpaging *paging)
@@ -52,6 +125,11 @@ int policy_init(struct xenpaging *paging)
     unconsumed = bitmap_alloc(max_pages);
     if ( !unconsumed )
         goto out;
+    /* Allocate bitmaps of the CLOCK reference bits and sampled pages */
+    referenced = bitmap_alloc(max_pages);
+    armed = bitmap_alloc(max_pages);
+    if ( !referenced || !armed )
+        goto out;
 
     /* Initialise MRU list of paged in pages */
     if ( paging->policy_mru_size > 0 )
@@ -72,6 +150,10 @@ int policy_init(struct xenpaging *paging)
     /* Start in the middle to avoid paging during BIOS startup */
     current_gfn = max_pages / 2;
 
+    /* Give the first pages sampled time to be accessed */
+    sample_gfn = current_gfn;
+    arm_ahead(paging);
+
     rc = 0;
  out:
     return rc;
@@ -82,8 +164,11 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
     xc_interface *xch = paging->xc_handle;
     unsigned long i;
 
-    /* One iteration over all possible gfns */
-    for ( i = 0; i < max_pages; i++ )
+    arm_ahead(paging);
+
+    /* Two iterations over all possible gfns, the first may clear the
+     * reference bits */
+    for ( i = 0; i < 2 * max_pages; i++ )
     {
         /* Try next gfn */
         current_gfn++;
@@ -92,6 +177,12 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
         if ( current_gfn >= max_pages )
             current_gfn = 0;
 
+        /* The sampling hand is pushed along when caught up with */
+        if ( sample_ahead )
+            sample_ahead--;
+        else
+            sample_gfn = current_gfn;
+
         if ( (current_gfn & (BITS_PER_LONG - 1)) == 0 )
         {
             /* All gfns busy */
@@ -99,6 +190,13 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
             {
                 current_gfn += BITS_PER_LONG;
                 i += BITS_PER_LONG;
+                if ( sample_ahead > BITS_PER_LONG )
+                    sample_ahead -= BITS_PER_LONG;
+                else
+                {
+                    sample_ahead = 0;
+                    sample_gfn = current_gfn;
+                }
                 continue;
             }
         }
@@ -111,12 +209,16 @@ unsigned long policy_choose_victim(struct xenpaging *paging)
         if ( test_bit(current_gfn, unconsumed) )
             continue;
 
+        /* gfn used since the hand last passed, give it a second chance */
+        if ( test_and_clear_bit(current_gfn, referenced) )
+            continue;
+
         /* gfn found */
         break;
     }
 
     /* Could not nominate any gfn */
-    if ( i >= max_pages )
+    if ( i >= 2 * max_pages )
     {
         /* No more pages, wait in poll */
         paging->use_poll_timeout = 1;
@@ -141,6 +243,7 @@ void policy_notify_paged_out(unsigned long gfn)
 {
     set_bit(gfn, bitmap);
     clear_bit(gfn, unconsumed);
+    clear_bit(gfn, referenced);
 }
 
 static void policy_handle_paged_in(unsigned long gfn, int do_mru)
@@ -157,6 +260,9 @@ static void policy_handle_paged_in(unsigned long gfn, int do_mru)
         mru[i_mru & (mru_size - 1)] = INVALID_MFN;
     }
 
+    /* A page wanted back was evicted too early */
+    set_bit(gfn, referenced);
+
     i_mru++;
 }
 
@@ -173,6 +279,16 @@ void policy_notify_paged_in_nomru(unsigned long gfn)
 void policy_notify_dropped(unsigned long gfn)
 {
     clear_bit(gfn, bitmap);
+    clear_bit(gfn, referenced);
+}
+
+void policy_notify_accessed(unsigned long gfn)
+{
+    if ( gfn >= max_pages )
+        return;
+
+    clear_bit(gfn, armed);
+    set_bit(gfn, referenced);
 }
 
 
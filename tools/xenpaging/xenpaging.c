@@ -39,12 +39,28 @@
 
 /* Defines number of mfns a guest should use at a time, in KiB */
 #define WATCH_TARGETPAGES "memory/target-tot_pages"
+#define WATCH_PREFETCH "memory/paging-prefetch"
 static char *watch_target_tot_pages;
+static char *watch_prefetch;
 static char *dom_path;
 static char watch_token[16];
 static char *filename;
 static int interrupted;
 
+/* Seconds between reports of the statistics */
+#define STATS_INTERVAL 10
+
+/* Default most pages read ahead of a page-in */
+#define DEFAULT_PREFETCH_MAX 64
+/* First readahead, once a second page-in follows the first */
+#define READAHEAD_MIN 4
+/* How far a page-in may be from the end of the last readahead */
+#define READAHEAD_LOCALITY 16
+
+static int xenpaging_access_init(struct xenpaging *paging);
+static int xenpaging_handle_access(struct xenpaging *paging);
+static void xenpaging_access_teardown(struct xenpaging *paging);
+
 static void unlink_pagefile(void)
 {
     if ( filename && filename[0] )
@@ -140,6 +156,36 @@ static int xenpaging_wait_for_event_or_timeout(struct xenpaging *paging)
                     free(val);
                 }
             }
+            else if ( strcmp(vec[XS_WATCH_PATH], watch_prefetch) == 0 )
+            {
+                unsigned long first_gfn, nr;
+                char *end;
+
+                /* Gone once the last request was done */
+                val = xs_read(paging->xs_handle, XBT_NULL, vec[XS_WATCH_PATH], NULL);
+                if ( val )
+                {
+                    /* Either "<first gfn> <number of gfns>" or all gfns */
+                    first_gfn = 0;
+                    nr = paging->max_pages;
+                    if ( val[0] && strcmp(val, "all") != 0 )
+                    {
+                        first_gfn = strtoul(val, &end, 0);
+                        nr = strtoul(end, &end, 0);
+                    }
+                    if ( first_gfn < paging->max_pages && nr )
+                    {
+                        paging->prefetch_gfn = first_gfn;
+                        paging->prefetch_end = nr < paging->max_pages - first_gfn ?
+                                               first_gfn + nr : paging->max_pages;
+                        /* Disable poll() delay while pages are read in */
+                        paging->use_poll_timeout = 0;
+                        DPRINTF("prefetch gfns %lx-%lx\n",
+                                paging->prefetch_gfn, paging->prefetch_end - 1);
+                    }
+                    free(val);
+                }
+            }
             free(vec);
         }
     }
@@ -210,6 +256,8 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -a <num>       --access_sample=<num>    sample accesses to <num> pages ahead of eviction.\n");
+    printf(" -p <num>       --prefetch=<num>         read up to <num> pages ahead of sequential page-ins.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -217,16 +265,20 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:a:p:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
         {"mru_size", 1, NULL, 'm'},
+        {"access_sample", 1, NULL, 'a'},
+        {"prefetch", 1, NULL, 'p'},
         { }
     };
 
+    paging->prefetch_max = DEFAULT_PREFETCH_MAX;
+
     while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1)
     {
         switch(ch) {
@@ -243,6 +295,12 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 'a':
+            paging->access_sample = atoi(optarg);
+            break;
+        case 'p':
+            paging->prefetch_max = atoi(optarg);
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -338,6 +396,19 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
+    /* Watch requests of the toolstack to page in gfns */
+    if ( asprintf(&watch_prefetch, "%s/%s", dom_path, WATCH_PREFETCH) < 0 )
+    {
+        PERROR("Could not alloc watch path\n");
+        goto err;
+    }
+    DPRINTF("watching '%s'\n", watch_prefetch);
+    if ( xs_watch(paging->xs_handle, watch_prefetch, "") == false )
+    {
+        PERROR("Could not bind to xenpaging prefetch watch\n");
+        goto err;
+    }
+
     /* Map the ring page */
     xc_get_hvm_param(xch, paging->vm_event.domain_id, 
                         HVM_PARAM_PAGING_RING_PFN, &ring_pfn);
@@ -424,6 +495,13 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
                     paging->vm_event.domain_id, 1, 0, &ring_pfn) )
         PERROR("Failed to remove ring from guest physmap");
 
+    /* Sampling is best effort: the guest may lack EPT, or have a monitor */
+    if ( paging->access_sample > 0 && xenpaging_access_init(paging) )
+    {
+        ERROR("Access sampling not available, paging without");
+        paging->access_sample = 0;
+    }
+
     /* Get max_pages from guest if not provided via cmdline */
     if ( !paging->max_pages )
     {
@@ -459,6 +537,11 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
     if ( !paging->free_slot_stack )
         goto err;
 
+    /* Allocate eviction sequence numbers, to tell refaults apart */
+    paging->evict_seq = calloc(paging->max_pages, sizeof(*paging->evict_seq));
+    if ( !paging->evict_seq )
+        goto err;
+
     /* Initialise policy */
     rc = policy_init(paging);
     if ( rc != 0 )
@@ -482,6 +565,15 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         goto err;
     }
 
+    paging->writer = page_writer_create(paging->fd, XENPAGING_EVICT_BATCH);
+    if ( !paging->writer )
+    {
+        PERROR("Error creating pagefile writer");
+        goto err;
+    }
+
+    paging->stats.last_report = time(NULL);
+
     return paging;
 
  err:
@@ -504,6 +596,8 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
 
         free(dom_path);
         free(watch_target_tot_pages);
+        free(watch_prefetch);
+        free(paging->evict_seq);
         free(paging->free_slot_stack);
         free(paging->slot_to_gfn);
         free(paging->gfn_to_slot);
@@ -520,8 +614,11 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xc_interface *xch = paging->xc_handle;
 
     xs_unwatch(paging->xs_handle, watch_target_tot_pages, "");
+    xs_unwatch(paging->xs_handle, watch_prefetch, "");
     xs_unwatch(paging->xs_handle, "@releaseDomain", watch_token);
 
+    xenpaging_access_teardown(paging);
+
     paging->xc_handle = NULL;
     /* Tear down domain paging in Xen */
     munmap(paging->vm_event.ring_page, PAGE_SIZE);
@@ -592,83 +689,129 @@ static void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
- * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
- */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
+/* Set up a monitor ring to be told which armed pages the guest accessed */
+static int xenpaging_access_init(struct xenpaging *paging)
 {
     xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
+    struct vm_event *access = &paging->access;
+    int rc;
 
-    DECLARE_DOMCTL;
+    access->domain_id = paging->vm_event.domain_id;
+    access->xce_handle = paging->vm_event.xce_handle;
 
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    access->ring_page = xc_monitor_enable(xch, access->domain_id,
+                                          &access->evtchn_port);
+    if ( access->ring_page == NULL )
     {
-        /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
-            PERROR("Error nominating page %lx", gfn);
-        goto out;
+        PERROR("Error enabling access events");
+        return -1;
     }
 
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
+    rc = xc_evtchn_bind_interdomain(access->xce_handle, access->domain_id,
+                                    access->evtchn_port);
+    if ( rc < 0 )
     {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
+        PERROR("Failed to bind access event channel");
+        xc_monitor_disable(xch, access->domain_id);
+        munmap(access->ring_page, PAGE_SIZE);
+        access->ring_page = NULL;
+        return -1;
     }
 
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
-    {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, PAGE_SIZE);
-        ret = -1;
-        goto out;
-    }
+    access->port = rc;
 
-    /* Release page */
-    munmap(page, PAGE_SIZE);
+    SHARED_RING_INIT((vm_event_sring_t *)access->ring_page);
+    BACK_RING_INIT(&access->back_ring,
+                   (vm_event_sring_t *)access->ring_page,
+                   PAGE_SIZE);
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
+    return 0;
+}
+
+/* Restore the access of the pages armed for sampling and let go of them
+ * Returns < 0 on fatal error
+ */
+static int xenpaging_handle_access(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct vm_event *access = &paging->access;
+    vm_event_request_t req;
+    vm_event_response_t rsp;
+    int handled = 0;
+
+    if ( access->ring_page == NULL )
+        return 0;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&access->back_ring) )
     {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
+        get_request(access, &req);
+
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.version = VM_EVENT_INTERFACE_VERSION;
+        rsp.vcpu_id = req.vcpu_id;
+        rsp.flags = req.flags;
+        rsp.reason = req.reason;
+
+        if ( req.reason == VM_EVENT_REASON_MEM_ACCESS )
         {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
-            PERROR("Error evicting page %lx", gfn);
-        goto out;
+            if ( xc_set_mem_access(xch, access->domain_id, XENMEM_access_rwx,
+                                   req.u.mem_access.gfn, 1) < 0 )
+            {
+                PERROR("Error restoring access to page %"PRIx64"",
+                       req.u.mem_access.gfn);
+                return -1;
+            }
+
+            /* Notify policy of page being accessed */
+            policy_notify_accessed(req.u.mem_access.gfn);
+            paging->stats.accessed++;
+
+            rsp.u.mem_access.gfn = req.u.mem_access.gfn;
+        }
+
+        put_response(access, &rsp);
+        handled++;
+    }
+
+    if ( handled && xc_evtchn_notify(access->xce_handle, access->port) < 0 )
+    {
+        PERROR("Error resuming vcpus after access events");
+        return -1;
     }
 
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
+    return 0;
+}
+
+static void xenpaging_access_teardown(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct vm_event *access = &paging->access;
+    int rc;
+
+    if ( access->ring_page == NULL )
+        return;
 
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
+    /* Give the guest back its access before the events stop */
+    rc = xc_set_mem_access(xch, access->domain_id, XENMEM_access_rwx, ~0ull, 0);
+    if ( rc == 0 )
+        rc = xc_set_mem_access(xch, access->domain_id, XENMEM_access_rwx, 0,
+                               paging->max_pages);
+    if ( rc != 0 )
+        PERROR("Error restoring access to guest pages");
 
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
+    /* Resume the vcpus still waiting for a response */
+    xenpaging_handle_access(paging);
 
-    ret = 0;
+    rc = xc_monitor_disable(xch, access->domain_id);
+    if ( rc != 0 )
+        PERROR("Error tearing down access events");
+    munmap(access->ring_page, PAGE_SIZE);
+    access->ring_page = NULL;
 
- out:
-    return ret;
+    rc = xc_evtchn_unbind(access->xce_handle, access->port);
+    if ( rc != 0 )
+        PERROR("Error unbinding access event port");
+    access->port = -1;
 }
 
 static int xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *rsp, int notify_policy)
@@ -704,6 +847,14 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
 
     DPRINTF("populate_page < gfn %lx pageslot %d\n", gfn, i);
 
+    /* The page may still be on its way to the paging file */
+    ret = page_writer_flush(paging->writer);
+    if ( ret != 0 )
+    {
+        PERROR("Error writing pages to pagefile");
+        goto out;
+    }
+
     /* Read page */
     ret = read_page(paging->fd, paging->paging_buffer, i);
     if ( ret != 0 )
@@ -737,6 +888,167 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
     return ret;
 }
 
+/* Page in a gfn no vcpu is waiting for
+ * Returns < 0 on fatal error
+ * Returns 0 on successful page-in
+ * Returns > 0 if gfn was not paged in, with errno ENOMEM if Xen is short
+ * of memory
+ */
+static int xenpaging_prefetch_page(struct xenpaging *paging, unsigned long gfn)
+{
+    xc_interface *xch = paging->xc_handle;
+    int slot, ret;
+
+    if ( !test_bit(gfn, paging->bitmap) )
+    {
+        errno = 0;
+        return 1;
+    }
+
+    slot = paging->gfn_to_slot[gfn];
+
+    /* Read page */
+    ret = read_page(paging->fd, paging->paging_buffer, slot);
+    if ( ret != 0 )
+    {
+        PERROR("Error reading page");
+        return -1;
+    }
+
+    /* Tell Xen to allocate a page for the domain, no response is needed */
+    ret = xc_mem_paging_load(xch, paging->vm_event.domain_id, gfn, paging->paging_buffer);
+    if ( ret < 0 )
+    {
+        /* A gfn dropped meanwhile is left to its drop request */
+        if ( errno == ENOENT || errno == ENOMEM )
+            return 1;
+        PERROR("Error loading %lx during prefetch", gfn);
+        return -1;
+    }
+
+    DPRINTF("prefetch_page < gfn %lx pageslot %d\n", gfn, slot);
+
+    /* A request of the guest for the gfn finds it populated already */
+    clear_bit(gfn, paging->bitmap);
+
+    /* Notify policy of page being paged in */
+    policy_notify_paged_in_nomru(gfn);
+    paging->num_paged_out--;
+    paging->stats.prefetched++;
+
+    /* Clear this pagefile slot */
+    paging->slot_to_gfn[slot] = 0;
+
+    /* Record this free slot */
+    paging->free_slot_stack[paging->stack_count++] = slot;
+
+    return 0;
+}
+
+/* Read ahead of a page-in continuing a run of nearby page-ins
+ * The window doubles with each page-in near the end of the last one, up to
+ * prefetch_max pages, and starts over at a page-in elsewhere.
+ * Returns < 0 on fatal error
+ */
+static int xenpaging_readahead(struct xenpaging *paging, unsigned long gfn)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct xenpaging_readahead *ra = &paging->readahead;
+    unsigned long next;
+    unsigned int i;
+    int dir, ret;
+
+    if ( paging->prefetch_max <= 0 )
+        return 0;
+
+    if ( gfn + READAHEAD_LOCALITY >= ra->next &&
+         gfn <= ra->next + READAHEAD_LOCALITY )
+    {
+        ra->window = ra->window ? 2 * ra->window : READAHEAD_MIN;
+        if ( ra->window > paging->prefetch_max )
+            ra->window = paging->prefetch_max;
+    }
+    else
+        ra->window = 0;
+
+    /* Follow the guest downwards as well */
+    dir = gfn >= ra->last ? 1 : -1;
+    ra->last = gfn;
+    ra->next = dir > 0 ? gfn + ra->window + 1 : gfn - ra->window - 1;
+
+    if ( !ra->window )
+        return 0;
+
+    /* The pages may still be on their way to the paging file */
+    if ( page_writer_flush(paging->writer) != 0 )
+    {
+        PERROR("Error writing pages to pagefile");
+        return -1;
+    }
+
+    for ( i = 0, next = gfn; i < ra->window; i++ )
+    {
+        next += dir;
+        if ( next >= paging->max_pages )
+            break;
+
+        ret = xenpaging_prefetch_page(paging, next);
+        if ( ret < 0 )
+            return -1;
+        if ( ret > 0 && errno == ENOMEM )
+            break;
+    }
+
+    return 0;
+}
+
+/* Page in a batch of the gfns the toolstack asked for
+ * Returns < 0 on fatal error
+ */
+static int xenpaging_prefetch_range(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    int num = 0, ret;
+
+    /* The pages may still be on their way to the paging file */
+    if ( page_writer_flush(paging->writer) != 0 )
+    {
+        PERROR("Error writing pages to pagefile");
+        return -1;
+    }
+
+    while ( paging->prefetch_gfn < paging->prefetch_end &&
+            num < XENPAGING_PAGEIN_QUEUE_SIZE )
+    {
+        ret = xenpaging_prefetch_page(paging, paging->prefetch_gfn);
+        if ( ret < 0 )
+            return -1;
+        if ( ret > 0 && errno == ENOMEM )
+        {
+            /* Try again after a while */
+            paging->use_poll_timeout = 1;
+            return 0;
+        }
+        if ( ret == 0 )
+            num++;
+        paging->prefetch_gfn++;
+    }
+
+    if ( paging->prefetch_gfn < paging->prefetch_end )
+    {
+        /* Disable poll() delay while pages are read in */
+        paging->use_poll_timeout = 0;
+        return 0;
+    }
+
+    /* Tell the toolstack the gfns are in */
+    DPRINTF("prefetch done, %d pages paged out\n", paging->num_paged_out);
+    paging->prefetch_end = 0;
+    xs_rm(paging->xs_handle, XBT_NULL, watch_prefetch);
+
+    return 0;
+}
+
 /* Trigger a page-in for a batch of pages */
 static void resume_pages(struct xenpaging *paging, int num_pages)
 {
@@ -758,12 +1070,12 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
+/* Choose a gfn and nominate it for eviction
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
+ * Returns 0 on successful nomination
  * Returns > 0 if no gfn can be evicted
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int nominate_victim(struct xenpaging *paging, unsigned long *gfn_r)
 {
     xc_interface *xch = paging->xc_handle;
     unsigned long gfn;
@@ -796,22 +1108,51 @@ static int evict_victim(struct xenpaging *paging, int slot)
             goto out;
         }
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
+        ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
         if ( ret < 0 )
-            goto out;
+        {
+            /* unpageable gfn is indicated by EBUSY */
+            if ( errno != EBUSY )
+            {
+                PERROR("Error nominating page %lx", gfn);
+                goto out;
+            }
+            ret = 1;
+        }
     }
     while ( ret );
 
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
-
-    ret = 0;
+    *gfn_r = gfn;
 
  out:
     return ret;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
+/* Take a free slot in the paging file, known free ones first */
+static int get_free_slot(struct xenpaging *paging)
+{
+    int i, slot;
+
+    if ( paging->stack_count > 0 )
+        return paging->free_slot_stack[--paging->stack_count];
+
+    for ( i = 0; i < paging->max_pages; i++ )
+    {
+        slot = paging->next_slot++;
+        if ( paging->next_slot >= paging->max_pages )
+            paging->next_slot = 0;
+
+        /* Slot is not allocated */
+        if ( !paging->slot_to_gfn[slot] )
+            return slot;
+    }
+
+    return -1;
+}
+
+/* Evict a batch of pages and write them to free slots in the paging file
+ * The pages are nominated, mapped and copied at once, then evicted, and
+ * written out while the next batch is evicted.
  * Returns < 0 on fatal error
  * Returns 0 if no gfn can be evicted
  * Returns > 0 on successful evict
@@ -819,38 +1160,139 @@ static int evict_victim(struct xenpaging *paging, int slot)
 static int evict_pages(struct xenpaging *paging, int num_pages)
 {
     xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    domid_t domain_id = paging->vm_event.domain_id;
+    xen_pfn_t gfns[XENPAGING_EVICT_BATCH];
+    int err[XENPAGING_EVICT_BATCH], slots[XENPAGING_EVICT_BATCH];
+    unsigned long gfn;
+    char *mapping, *buffer;
+    int i, slot, rc = 0, num = 0, done = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    if ( num_pages > XENPAGING_EVICT_BATCH )
+        num_pages = XENPAGING_EVICT_BATCH;
+
+    /* Nominate pages */
+    while ( num < num_pages )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
+        rc = nominate_victim(paging, &gfn);
         if ( rc )
+            break;
+        gfns[num++] = gfn;
+    }
+    if ( rc < 0 )
+        return -1;
+    if ( !num )
+        return 0;
+
+    /* Copy pages, pages which can not be mapped are left nominated */
+    mapping = xc_map_foreign_bulk(xch, domain_id, PROT_READ, gfns, err, num);
+    if ( mapping == NULL )
+    {
+        PERROR("Error mapping %d pages", num);
+        return -1;
+    }
+
+    buffer = page_writer_buffer(paging->writer);
+    for ( i = 0; i < num; i++ )
+    {
+        if ( err[i] )
         {
-            num = rc < 0 ? -1 : num;
-            return num;
+            DPRINTF("Error mapping page %"PRI_xen_pfn": %d\n", gfns[i], err[i]);
+            continue;
         }
-        num++;
+        memcpy(buffer + done * PAGE_SIZE, mapping + i * PAGE_SIZE, PAGE_SIZE);
+        gfns[done++] = gfns[i];
     }
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
+    /* Release pages */
+    munmap(mapping, num * PAGE_SIZE);
+
+    /* Tell Xen to evict pages */
+    num = done;
+    done = 0;
+    for ( i = 0; i < num; i++ )
     {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        gfn = gfns[i];
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        slot = get_free_slot(paging);
+        if ( slot < 0 )
+        {
+            ERROR("No free slot in pagefile for page %lx", gfn);
+            rc = -1;
+            break;
+        }
+
+        if ( xc_mem_paging_evict(xch, domain_id, gfn) < 0 )
         {
-            num = rc < 0 ? -1 : num;
+            paging->free_slot_stack[paging->stack_count++] = slot;
+
+            /* A gfn in use is indicated by EBUSY */
+            if ( errno == EBUSY )
+            {
+                DPRINTF("Nominated page %lx busy", gfn);
+                continue;
+            }
+            PERROR("Error evicting page %lx", gfn);
+            rc = -1;
             break;
         }
 
-        num++;
+        DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
+
+        if ( i != done )
+            memcpy(buffer + done * PAGE_SIZE, buffer + i * PAGE_SIZE, PAGE_SIZE);
+        slots[done++] = slot;
+
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfn);
+
+        /* Update index */
+        paging->slot_to_gfn[slot] = gfn;
+        paging->gfn_to_slot[gfn] = slot;
+
+        if ( test_and_set_bit(gfn, paging->bitmap) )
+            ERROR("Page %lx has been evicted before", gfn);
+
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
+        paging->stats.evicted++;
+        paging->evict_seq[gfn] = paging->stats.evicted;
     }
-    return num;
+
+    /* Write pages to the paging file in the background */
+    if ( page_writer_submit(paging->writer, slots, done) < 0 )
+    {
+        PERROR("Error writing pages to pagefile");
+        return -1;
+    }
+
+    return rc < 0 ? -1 : done;
+}
+
+static void report_stats(struct xenpaging *paging, int force)
+{
+    xc_interface *xch = paging->xc_handle;
+    struct xenpaging_stats *stats = &paging->stats;
+    time_t now = time(NULL);
+    long secs = now - stats->last_report;
+
+    if ( !force && (secs < STATS_INTERVAL ||
+                    (stats->evicted == stats->last_evicted &&
+                     stats->paged_in == stats->last_paged_in)) )
+        return;
+
+    if ( secs <= 0 )
+        secs = 1;
+    DPRINTF("%lu pages evicted (%lu/s), %lu paged in (%lu/s), "
+            "%lu prefetched, %lu hot refaults, %lu accesses sampled, "
+            "%d paged out\n",
+            stats->evicted, (stats->evicted - stats->last_evicted) / secs,
+            stats->paged_in, (stats->paged_in - stats->last_paged_in) / secs,
+            stats->prefetched, stats->refaults_hot, stats->accessed,
+            paging->num_paged_out);
+
+    stats->last_report = now;
+    stats->last_evicted = stats->evicted;
+    stats->last_paged_in = stats->paged_in;
 }
 
 int main(int argc, char *argv[])
@@ -860,7 +1302,7 @@ int main(int argc, char *argv[])
     vm_event_request_t req;
     vm_event_response_t rsp;
     int num, prev_num = 0;
-    int slot;
+    int slot, populated;
     int tot_pages;
     int rc;
     xc_interface *xch;
@@ -908,6 +1350,7 @@ int main(int argc, char *argv[])
         {
             /* Indicate possible error */
             rc = 1;
+            populated = 0;
 
             get_request(&paging->vm_event, &req);
 
@@ -947,6 +1390,13 @@ int main(int argc, char *argv[])
                         ERROR("Error populating page %"PRIx64"", req.u.mem_paging.gfn);
                         goto out;
                     }
+
+                    /* Wanted back before the pages paged out after it */
+                    paging->stats.paged_in++;
+                    if ( paging->stats.evicted - paging->evict_seq[req.u.mem_paging.gfn] <
+                         paging->num_paged_out )
+                        paging->stats.refaults_hot++;
+                    populated = 1;
                 }
 
                 /* Prepare the response */
@@ -965,6 +1415,13 @@ int main(int argc, char *argv[])
 
                 /* Record this free slot */
                 paging->free_slot_stack[paging->stack_count++] = slot;
+
+                /* With the vcpu running again, read the next pages ahead */
+                if ( populated && xenpaging_readahead(paging, req.u.mem_paging.gfn) < 0 )
+                {
+                    ERROR("Error reading ahead of page %"PRIx64"", req.u.mem_paging.gfn);
+                    goto out;
+                }
             }
             else
             {
@@ -993,6 +1450,22 @@ int main(int argc, char *argv[])
             }
         }
 
+        /* Note the pages the guest accessed */
+        if ( xenpaging_handle_access(paging) < 0 )
+        {
+            ERROR("Error handling access events");
+            goto out;
+        }
+
+        /* Page in what the toolstack asked for */
+        if ( paging->prefetch_end && xenpaging_prefetch_range(paging) < 0 )
+        {
+            ERROR("Error prefetching pages");
+            goto out;
+        }
+
+        report_stats(paging, 0);
+
         /* If interrupted, write all pages back into the guest */
         if ( interrupted == SIGTERM || interrupted == SIGINT )
         {
@@ -1035,10 +1508,10 @@ int main(int argc, char *argv[])
                 prev_num = num;
             }
             /* Limit the number of evicts to be able to process page-in requests */
-            if ( num > 42 )
+            if ( num > XENPAGING_EVICT_BATCH )
             {
                 paging->use_poll_timeout = 0;
-                num = 42;
+                num = XENPAGING_EVICT_BATCH;
             }
             if ( evict_pages(paging, num) < 0 )
                 goto out;
@@ -1068,6 +1541,9 @@ int main(int argc, char *argv[])
     DPRINTF("xenpaging got signal %d\n", interrupted);
 
  out:
+    report_stats(paging, 1);
+
+    page_writer_destroy(paging->writer);
     close(paging->fd);
     unlink_pagefile();
 
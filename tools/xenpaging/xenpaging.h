@@ -30,6 +30,7 @@
 #include <xen/vm_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+#define XENPAGING_EVICT_BATCH 64
 
 struct vm_event {
     domid_t domain_id;
@@ -40,6 +41,26 @@ struct vm_event {
     void *ring_page;
 };
 
+struct xenpaging_stats {
+    unsigned long evicted;
+    unsigned long paged_in;
+    /* Paged in before as many pages as are paged out were evicted after */
+    unsigned long refaults_hot;
+    /* Accesses seen by sampling */
+    unsigned long accessed;
+    /* Paged in ahead of the guest */
+    unsigned long prefetched;
+
+    time_t last_report;
+    unsigned long last_evicted, last_paged_in;
+};
+
+struct xenpaging_readahead {
+    /* Last gfn paged in for the guest, and where its readahead ended */
+    unsigned long last, next;
+    unsigned int window;
+};
+
 struct xenpaging {
     xc_interface *xc_handle;
     struct xs_handle *xs_handle;
@@ -52,7 +73,11 @@ struct xenpaging {
     void *paging_buffer;
 
     struct vm_event vm_event;
+    /* mem_access events of the pages sampled, if access_sample */
+    struct vm_event access;
+    int access_sample;
     int fd;
+    struct page_writer *writer;
     /* number of pages for which data structures were allocated */
     int max_pages;
     int num_paged_out;
@@ -62,7 +87,18 @@ struct xenpaging {
     int debug;
     int stack_count;
     int *free_slot_stack;
+    int next_slot;
     unsigned long pagein_queue[XENPAGING_PAGEIN_QUEUE_SIZE];
+
+    /* most pages read ahead of a page-in */
+    int prefetch_max;
+    struct xenpaging_readahead readahead;
+    /* gfns left to page in for the toolstack */
+    unsigned long prefetch_gfn, prefetch_end;
+
+    /* Value of stats.evicted when each gfn was evicted */
+    unsigned long *evict_seq;
+    struct xenpaging_stats stats;
 };
 
 extern void create_page_in_thread(struct xenpaging *paging);
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xenstat_priv.h"
@@ -62,6 +63,13 @@ static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
+static void xenstat_check_watches(xenstat_handle * handle);
+static xenstat_domain_cache *xenstat_cache_find(xenstat_handle * handle,
+						unsigned int domain_id);
+static xenstat_domain_cache *xenstat_cache_domain(xenstat_handle * handle,
+						  xc_domaininfo_t * info);
+static void xenstat_cache_sweep(xenstat_handle * handle);
+static void xenstat_compute_rates(xenstat_node * node);
 
 static xenstat_collector collectors[] = {
 	{ XENSTAT_VCPU, xenstat_collect_vcpus,
@@ -126,6 +134,9 @@ void xenstat_uninit(xenstat_handle * handle)
 			collectors[i].uninit(handle);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
+		for (i = 0; i < handle->cache_len; i++)
+			free(handle->cache[i].name);
+		free(handle->cache);
 		free(handle->priv);
 		free(handle);
 	}
@@ -145,6 +156,15 @@ static inline unsigned long long parse(char *s, char *match)
 	return ret;
 }
 
+static unsigned long long xenstat_now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 {
 	char buffer[4096];
@@ -166,7 +186,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
 	int new_domains;
 	unsigned int i;
-	int rc;
+	int rc, tmem_enabled;
 
 	/* Create the node */
 	node = (xenstat_node *) calloc(1, sizeof(xenstat_node));
@@ -193,6 +213,8 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	rc = xc_tmem_control(handle->xc_handle, -1,
                          TMEMC_QUERY_FREEABLE_MB, -1, 0, 0, 0, NULL);
 	node->freeable_mb = (rc < 0) ? 0 : rc;
+	/* Without tmem there are no per-domain statistics to ask for */
+	tmem_enabled = rc >= 0;
 	/* malloc(0) is not portable, so allocate a single domain.  This will
 	 * be resized below. */
 	node->domains = malloc(sizeof(xenstat_domain));
@@ -201,6 +223,10 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		return NULL;
 	}
 
+	/* Find out what changed in the cached domain data */
+	xenstat_check_watches(handle);
+
+	node->time_ns = xenstat_now_ns();
 	node->num_domains = 0;
 	do {
 		xenstat_domain *domain, *tmp;
@@ -226,11 +252,12 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		memset(domain, 0, new_domains * sizeof(xenstat_domain));
 
 		for (i = 0; i < new_domains; i++) {
+			xenstat_domain_cache *entry;
+
 			/* Fill in domain using domaininfo[i] */
 			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
-			if (domain->name == NULL) {
+			entry = xenstat_cache_domain(handle, &domaininfo[i]);
+			if (entry == NULL) {
 				if (errno == ENOMEM) {
 					/* fatal error */
 					xenstat_free_node(node);
@@ -243,6 +270,12 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 					continue;
 				}
 			}
+			domain->name = strdup(entry->name);
+			if (domain->name == NULL) {
+				xenstat_free_node(node);
+				return NULL;
+			}
+			memcpy(domain->uuid, entry->uuid, sizeof(domain->uuid));
 			domain->state = domaininfo[i].flags;
 			domain->cpu_ns = domaininfo[i].cpu_time;
 			domain->num_vcpus = (domaininfo[i].max_vcpu_id+1);
@@ -260,13 +293,16 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
+			if (tmem_enabled)
+				domain_get_tmem_stats(handle,domain);
 
 			domain++;
 			node->num_domains++;
 		}
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
+	/* Forget about the domains which are gone */
+	xenstat_cache_sweep(handle);
 
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
@@ -280,6 +316,8 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		}
 	}
 
+	xenstat_compute_rates(node);
+
 	return node;
 err:
 	free(node->domains);
@@ -308,13 +346,19 @@ void xenstat_free_node(xenstat_node * node)
 
 xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
 {
-	unsigned int i;
+	unsigned int lo = 0, hi = node->num_domains;
 
-	/* FIXME: binary search */
-	/* Find the appropriate domain entry in the node struct. */
-	for (i = 0; i < node->num_domains; i++) {
-		if (node->domains[i].id == domid)
-			return &(node->domains[i]);
+	/* Find the appropriate domain entry in the node struct.  Domains
+	 * are sorted by id, as xc_domain_getinfolist returns them. */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (node->domains[mid].id == domid)
+			return &(node->domains[mid]);
+		if (node->domains[mid].id < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 	return NULL;
 }
@@ -363,6 +407,12 @@ unsigned long long xenstat_node_cpu_hz(xenstat_node * node)
 	return node->cpu_hz;
 }
 
+/* Get the time the node information was collected at */
+unsigned long long xenstat_node_time_ns(xenstat_node * node)
+{
+	return node->time_ns;
+}
+
 /* Get the domain ID for this domain */
 unsigned xenstat_domain_id(xenstat_domain * domain)
 {
@@ -375,6 +425,12 @@ char *xenstat_domain_name(xenstat_domain * domain)
 	return domain->name;
 }
 
+/* Get the UUID of the domain */
+const char *xenstat_domain_uuid(xenstat_domain * domain)
+{
+	return domain->uuid;
+}
+
 /* Get information about how much CPU time has been used */
 unsigned long long xenstat_domain_cpu_ns(xenstat_domain * domain)
 {
@@ -477,6 +533,127 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 	return NULL;
 }
 
+/*
+ * Rate functions
+ */
+
+/* Get the CPU usage, in percent of one physical CPU */
+double xenstat_domain_cpu_pct(xenstat_domain * domain)
+{
+	return domain->cpu_pct;
+}
+
+/* Get the bytes per second received by all the networks */
+double xenstat_domain_net_rbytes_rate(xenstat_domain * domain)
+{
+	return domain->net_rbytes_rate;
+}
+
+/* Get the bytes per second transmitted by all the networks */
+double xenstat_domain_net_tbytes_rate(xenstat_domain * domain)
+{
+	return domain->net_tbytes_rate;
+}
+
+/* Get the READ requests per second of all the VBDs */
+double xenstat_domain_vbd_rd_reqs_rate(xenstat_domain * domain)
+{
+	return domain->vbd_rd_reqs_rate;
+}
+
+/* Get the WRITE requests per second of all the VBDs */
+double xenstat_domain_vbd_wr_reqs_rate(xenstat_domain * domain)
+{
+	return domain->vbd_wr_reqs_rate;
+}
+
+/* Get the READ sectors per second of all the VBDs */
+double xenstat_domain_vbd_rd_sects_rate(xenstat_domain * domain)
+{
+	return domain->vbd_rd_sects_rate;
+}
+
+/* Get the WRITE sectors per second of all the VBDs */
+double xenstat_domain_vbd_wr_sects_rate(xenstat_domain * domain)
+{
+	return domain->vbd_wr_sects_rate;
+}
+
+/* Rate of a counter over ns nanoseconds */
+static double xenstat_rate(unsigned long long now, unsigned long long then,
+			   unsigned long long ns)
+{
+	/* A counter going backwards has been reset */
+	if (now < then)
+		return 0;
+	return (now - then) * 1e9 / ns;
+}
+
+/* Compute the rates of all the domains against the previous collection,
+ * and remember the counters for the next one */
+static void xenstat_compute_rates(xenstat_node * node)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+		xenstat_domain_cache *entry;
+		unsigned long long net_rbytes = 0, net_tbytes = 0;
+		unsigned long long rd_reqs = 0, wr_reqs = 0;
+		unsigned long long rd_sects = 0, wr_sects = 0;
+
+		entry = xenstat_cache_find(node->handle, domain->id);
+		if (entry == NULL)
+			continue;
+
+		for (j = 0; j < domain->num_networks; j++) {
+			net_rbytes += domain->networks[j].rbytes;
+			net_tbytes += domain->networks[j].tbytes;
+		}
+		for (j = 0; j < domain->num_vbds; j++) {
+			rd_reqs += domain->vbds[j].rd_reqs;
+			wr_reqs += domain->vbds[j].wr_reqs;
+			rd_sects += domain->vbds[j].rd_sects;
+			wr_sects += domain->vbds[j].wr_sects;
+		}
+
+		if (entry->time_ns != 0 && node->time_ns > entry->time_ns) {
+			unsigned long long ns = node->time_ns - entry->time_ns;
+			unsigned int flags = node->flags & entry->flags;
+
+			/* ns of CPU time per s, in percent */
+			domain->cpu_pct = xenstat_rate(domain->cpu_ns,
+						       entry->cpu_ns, ns) / 1e7;
+			if (flags & XENSTAT_NETWORK) {
+				domain->net_rbytes_rate =
+				    xenstat_rate(net_rbytes, entry->net_rbytes, ns);
+				domain->net_tbytes_rate =
+				    xenstat_rate(net_tbytes, entry->net_tbytes, ns);
+			}
+			if (flags & XENSTAT_VBD) {
+				domain->vbd_rd_reqs_rate =
+				    xenstat_rate(rd_reqs, entry->vbd_rd_reqs, ns);
+				domain->vbd_wr_reqs_rate =
+				    xenstat_rate(wr_reqs, entry->vbd_wr_reqs, ns);
+				domain->vbd_rd_sects_rate =
+				    xenstat_rate(rd_sects, entry->vbd_rd_sects, ns);
+				domain->vbd_wr_sects_rate =
+				    xenstat_rate(wr_sects, entry->vbd_wr_sects, ns);
+			}
+		}
+
+		entry->flags = node->flags;
+		entry->time_ns = node->time_ns;
+		entry->cpu_ns = domain->cpu_ns;
+		entry->net_rbytes = net_rbytes;
+		entry->net_tbytes = net_tbytes;
+		entry->vbd_rd_reqs = rd_reqs;
+		entry->vbd_wr_reqs = wr_reqs;
+		entry->vbd_rd_sects = rd_sects;
+		entry->vbd_wr_sects = wr_sects;
+	}
+}
+
 /*
  * VCPU functions
  */
@@ -772,6 +949,191 @@ static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain
 	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
 }
 
+/*
+ * Domain cache functions
+ *
+ * Names and UUIDs of the domains are kept in the handle, so that a refresh
+ * does not have to go to xenstore for each domain.  A watch on the name of
+ * each domain tells when it must be read again; a watch on the introduction
+ * and release of domains tells the collectors when the domains they know
+ * about may have changed.  If watches are not available, the names are
+ * read on every refresh.
+ */
+
+#define DOMAIN_WATCH_TOKEN "xenstat-domain"
+#define NAME_WATCH_TOKEN "xenstat-name"
+
+/* Find the position of a domain in the cache, or where it would go */
+static unsigned int xenstat_cache_pos(xenstat_handle *handle,
+				      unsigned int domain_id)
+{
+	unsigned int lo = 0, hi = handle->cache_len;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (handle->cache[mid].id < domain_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static xenstat_domain_cache *xenstat_cache_find(xenstat_handle *handle,
+						unsigned int domain_id)
+{
+	unsigned int pos = xenstat_cache_pos(handle, domain_id);
+
+	if (pos < handle->cache_len && handle->cache[pos].id == domain_id)
+		return &handle->cache[pos];
+	return NULL;
+}
+
+static void xenstat_cache_set_handle(xenstat_domain_cache *entry,
+				     xen_domain_handle_t handle)
+{
+	const uint8_t *h = handle;
+
+	memcpy(entry->handle, handle, sizeof(entry->handle));
+	snprintf(entry->uuid, sizeof(entry->uuid),
+		 "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+		 "%02x%02x%02x%02x%02x%02x",
+		 h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+		 h[8], h[9], h[10], h[11], h[12], h[13], h[14], h[15]);
+}
+
+/* Find or create the cache entry for a domain, and make sure its name is
+ * up to date.  Returns NULL, with errno set, if the name cannot be read. */
+static xenstat_domain_cache *xenstat_cache_domain(xenstat_handle *handle,
+						  xc_domaininfo_t *info)
+{
+	unsigned int pos = xenstat_cache_pos(handle, info->domain);
+	xenstat_domain_cache *entry;
+	char path[80];
+	char *name;
+
+	if (pos == handle->cache_len || handle->cache[pos].id != info->domain) {
+		if (handle->cache_len == handle->cache_size) {
+			unsigned int size = handle->cache_size ?
+			    2 * handle->cache_size : DOMAIN_CHUNK_SIZE;
+
+			entry = realloc(handle->cache, size * sizeof(*entry));
+			if (entry == NULL) {
+				errno = ENOMEM;
+				return NULL;
+			}
+			handle->cache = entry;
+			handle->cache_size = size;
+		}
+
+		/* Domains are mostly seen in order, so this is an append */
+		entry = &handle->cache[pos];
+		memmove(entry + 1, entry,
+			(handle->cache_len - pos) * sizeof(*entry));
+		handle->cache_len++;
+
+		memset(entry, 0, sizeof(*entry));
+		entry->id = info->domain;
+		xenstat_cache_set_handle(entry, info->handle);
+		if (handle->watching > 0) {
+			snprintf(path, sizeof(path), "/local/domain/%u/name",
+				 entry->id);
+			entry->watched = xs_watch(handle->xshandle, path,
+						  NAME_WATCH_TOKEN);
+		}
+	} else {
+		entry = &handle->cache[pos];
+		if (memcmp(entry->handle, info->handle,
+			   sizeof(entry->handle)) != 0) {
+			/* The domain id has been reused by another domain */
+			xenstat_cache_set_handle(entry, info->handle);
+			entry->stale = 1;
+			entry->time_ns = 0;
+		}
+	}
+
+	if (entry->name == NULL || entry->stale || !entry->watched) {
+		name = xenstat_get_domain_name(handle, entry->id);
+		if (name == NULL)
+			return NULL;
+		free(entry->name);
+		entry->name = name;
+		entry->stale = 0;
+	}
+
+	entry->seen = 1;
+	return entry;
+}
+
+/* Drop the cache entries of the domains not seen by this refresh */
+static void xenstat_cache_sweep(xenstat_handle *handle)
+{
+	xenstat_domain_cache *entry;
+	unsigned int i, j;
+	char path[80];
+
+	for (i = j = 0; i < handle->cache_len; i++) {
+		entry = &handle->cache[i];
+		if (!entry->seen) {
+			if (entry->watched) {
+				snprintf(path, sizeof(path),
+					 "/local/domain/%u/name", entry->id);
+				xs_unwatch(handle->xshandle, path,
+					   NAME_WATCH_TOKEN);
+			}
+			free(entry->name);
+			continue;
+		}
+		entry->seen = 0;
+		handle->cache[j++] = *entry;
+	}
+	handle->cache_len = j;
+}
+
+/* Set up the watches if not done yet, and go through the events they have
+ * reported since the last refresh */
+static void xenstat_check_watches(xenstat_handle *handle)
+{
+	xenstat_domain_cache *entry;
+	unsigned int domid;
+	char **vec;
+
+	if (handle->watching == 0) {
+		handle->watching = -1;
+		if (xs_watch(handle->xshandle, "@introduceDomain",
+			     DOMAIN_WATCH_TOKEN)) {
+			if (xs_watch(handle->xshandle, "@releaseDomain",
+				     DOMAIN_WATCH_TOKEN))
+				handle->watching = 1;
+			else
+				xs_unwatch(handle->xshandle, "@introduceDomain",
+					   DOMAIN_WATCH_TOKEN);
+		}
+	}
+
+	if (handle->watching < 0) {
+		/* Nothing tells when domains come and go: assume they do */
+		handle->generation++;
+		return;
+	}
+
+	while ((vec = xs_check_watch(handle->xshandle)) != NULL) {
+		if (strcmp(vec[XS_WATCH_TOKEN], DOMAIN_WATCH_TOKEN) == 0)
+			handle->generation++;
+		else if (sscanf(vec[XS_WATCH_PATH], "/local/domain/%u/name",
+				&domid) == 1 &&
+			 (entry = xenstat_cache_find(handle, domid)) != NULL) {
+			/* A watch fires once when it is set up; the name
+			 * has been read after that anyway. */
+			if (entry->primed)
+				entry->stale = 1;
+			entry->primed = 1;
+		}
+		free(vec);
+	}
+}
+
 /* Remove specified entry from list of domains */
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
 {
@@ -20,6 +20,8 @@
 #ifndef XENSTAT_H
 #define XENSTAT_H
 
+#include <stdio.h>
+
 /* Opaque handles */
 typedef struct xenstat_handle xenstat_handle;
 typedef struct xenstat_domain xenstat_domain;
@@ -82,6 +84,14 @@ unsigned int xenstat_node_num_cpus(xenstat_node * node);
 /* Get information about the CPU speed */
 unsigned long long xenstat_node_cpu_hz(xenstat_node * node);
 
+/* Get the time (CLOCK_MONOTONIC, in nanoseconds) the node information was
+ * collected at */
+unsigned long long xenstat_node_time_ns(xenstat_node * node);
+
+/* Write the node information to f as metrics, in the Prometheus text
+ * exposition format.  Returns 0 on success, -1 if writing failed. */
+int xenstat_node_write_metrics(xenstat_node * node, FILE * f);
+
 /*
  * Domain functions - extract information from a xenstat_domain
  */
@@ -92,6 +102,9 @@ unsigned xenstat_domain_id(xenstat_domain * domain);
 /* Set the domain name for the domain */
 char *xenstat_domain_name(xenstat_domain * domain);
 
+/* Get the UUID of the domain, as a string */
+const char *xenstat_domain_uuid(xenstat_domain * domain);
+
 /* Get information about how much CPU time has been used */
 unsigned long long xenstat_domain_cpu_ns(xenstat_domain * domain);
 
@@ -136,6 +149,25 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
+/*
+ * Rates - computed against the previous xenstat_get_node() on the same
+ * handle.  They are 0 for a domain which was not there at that time, and
+ * for network and VBD rates if those were not collected both times.
+ */
+
+/* Get the CPU usage, in percent of one physical CPU */
+double xenstat_domain_cpu_pct(xenstat_domain * domain);
+
+/* Get the bytes per second received/transmitted by all the networks */
+double xenstat_domain_net_rbytes_rate(xenstat_domain * domain);
+double xenstat_domain_net_tbytes_rate(xenstat_domain * domain);
+
+/* Get the RD/WR requests and sectors per second of all the VBDs */
+double xenstat_domain_vbd_rd_reqs_rate(xenstat_domain * domain);
+double xenstat_domain_vbd_wr_reqs_rate(xenstat_domain * domain);
+double xenstat_domain_vbd_rd_sects_rate(xenstat_domain * domain);
+double xenstat_domain_vbd_wr_sects_rate(xenstat_domain * domain);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
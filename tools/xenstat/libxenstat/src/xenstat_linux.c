@@ -34,9 +34,25 @@
 
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
 
+/* Which domain and network an interface belongs to */
+struct iface_map {
+	char iface[16];
+	unsigned int domid;
+	unsigned int netid;
+	int is_vif;
+};
+
 struct priv_data {
 	FILE *procnetdev;
 	DIR *sysfsvbd;
+	/* What is known about the interfaces, until domains come or go */
+	int ifaces_valid;
+	unsigned int ifaces_generation;
+	char bridge[16];
+	struct iface_map *ifaces;
+	unsigned int nr_ifaces;
+	unsigned int size_ifaces;
+	unsigned int next_iface;
 };
 
 static struct priv_data *
@@ -45,13 +61,10 @@ get_priv_data(xenstat_handle *handle)
 	if (handle->priv != NULL)
 		return handle->priv;
 
-	handle->priv = malloc(sizeof(struct priv_data));
+	handle->priv = calloc(1, sizeof(struct priv_data));
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
-	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
-
 	return handle->priv;
 }
 
@@ -100,7 +113,8 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	int ret;
 	char *tmp;
 	int i = 0, x = 0, col = 0;
-	regex_t r;
+	static regex_t r;
+	static int r_compiled;
 	regmatch_t matches[19];
 	int num = 19;
 
@@ -145,9 +159,13 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	if (txComp != NULL)
 		*txComp = 0;
 
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
+	/* Compiling the expression costs more than matching a line */
+	if (!r_compiled) {
+		if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
+			regfree(&r);
+			return ret;
+		}
+		r_compiled = 1;
 	}
 
 	tmp = (char *)malloc( sizeof(char) );
@@ -228,7 +246,6 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	}
 
 	free(tmp);
-	regfree(&r);
 
 	return 0;
 }
@@ -256,12 +273,50 @@ static int get_iface_domid_network(const char *iface, unsigned int *domid_p, uns
 	return 0;
 }
 
+/* Same as get_iface_domid_network(), remembering the answers in priv */
+static int lookup_iface_domid_network(struct priv_data *priv, const char *iface,
+				      unsigned int *domid_p, unsigned int *netid_p)
+{
+	struct iface_map *map;
+	unsigned int i;
+
+	/* /proc/net/dev lists the interfaces in the same order every time,
+	 * so start looking after the last one found */
+	for (i = 0; i < priv->nr_ifaces; i++) {
+		map = &priv->ifaces[(priv->next_iface + i) % priv->nr_ifaces];
+		if (strcmp(map->iface, iface) == 0)
+			goto found;
+	}
+
+	if (priv->nr_ifaces == priv->size_ifaces) {
+		unsigned int size = priv->size_ifaces ? 2 * priv->size_ifaces : 64;
+
+		map = realloc(priv->ifaces, size * sizeof(*map));
+		if (map == NULL)
+			return get_iface_domid_network(iface, domid_p, netid_p);
+		priv->ifaces = map;
+		priv->size_ifaces = size;
+	}
+
+	map = &priv->ifaces[priv->nr_ifaces++];
+	strncpy(map->iface, iface, sizeof(map->iface) - 1);
+	map->iface[sizeof(map->iface) - 1] = '\0';
+	map->is_vif = get_iface_domid_network(iface, &map->domid, &map->netid);
+
+ found:
+	priv->next_iface = (map - priv->ifaces + 1) % priv->nr_ifaces;
+	*domid_p = map->domid;
+	*netid_p = map->netid;
+	return map->is_vif;
+}
+
 /* Collect information about networks */
 int xenstat_collect_networks(xenstat_node * node)
 {
 	/* Helper variables for parseNetDevLine() function defined above */
 	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	char line[512] = { 0 }, iface[16] = { 0 }, devNoBridge[16] = { 0 };
+	char *devBridge;
 	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
 
 	struct priv_data *priv = get_priv_data(node->handle);
@@ -299,8 +354,19 @@ int xenstat_collect_networks(xenstat_node * node)
 	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
 	      SEEK_SET);
 
-	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
-	getBridge("vir", devBridge, sizeof(devBridge));
+	/* Interfaces only change owner when domains come or go */
+	if (!priv->ifaces_valid ||
+	    priv->ifaces_generation != node->handle->generation) {
+		priv->ifaces_valid = 1;
+		priv->ifaces_generation = node->handle->generation;
+		priv->nr_ifaces = 0;
+		priv->next_iface = 0;
+
+		/* We get the bridge devices for use with bonding interface to get bonding interface stats */
+		memset(priv->bridge, 0, sizeof(priv->bridge));
+		getBridge("vir", priv->bridge, sizeof(priv->bridge));
+	}
+	devBridge = priv->bridge;
 	snprintf(devNoBridge, 16, "p%s", devBridge);
 
 	while (fgets(line, 512, priv->procnetdev)) {
@@ -332,7 +398,7 @@ int xenstat_collect_networks(xenstat_node * node)
 			}
 		}
 		else /* Otherwise we need to preserve old behaviour */
-		if (get_iface_domid_network(iface, &domid, &net.id)) {
+		if (lookup_iface_domid_network(priv, iface, &domid, &net.id)) {
 
 			net.tbytes = txBytes;
 			net.tpackets = txPackets;
@@ -380,6 +446,8 @@ void xenstat_uninit_networks(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->procnetdev != NULL)
 		fclose(priv->procnetdev);
+	if (priv != NULL)
+		free(priv->ifaces);
 }
 
 static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
@@ -0,0 +1,312 @@
+/* libxenstat: statistics-collection library for Xen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Node information as metrics, in the Prometheus text exposition format:
+ *
+ *   # HELP xen_domain_cpu_seconds_total CPU time used by the domain.
+ *   # TYPE xen_domain_cpu_seconds_total counter
+ *   xen_domain_cpu_seconds_total{domid="1",name="guest",uuid="..."} 12.5
+ *
+ * Counters are exported as they are, for the scraper to compute its own
+ * rates; the rates computed by the library against the previous refresh
+ * are exported as gauges.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xenstat_priv.h"
+
+/* A metric with one value per domain */
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	unsigned int flag;	/* Collector needed, 0 for none */
+	double (*get)(xenstat_domain *domain);
+} domain_metric;
+
+/* A metric with one value per network or VBD of each domain */
+typedef struct {
+	const char *name;
+	const char *help;
+	unsigned long long (*get)(void *dev);
+} device_metric;
+
+static double domain_cpu_seconds(xenstat_domain *domain)
+{
+	return domain->cpu_ns / 1e9;
+}
+
+static double domain_vcpus(xenstat_domain *domain)
+{
+	return domain->num_vcpus;
+}
+
+static double domain_online_vcpus(xenstat_domain *domain)
+{
+	unsigned int i, online = 0;
+
+	for (i = 0; i < domain->num_vcpus; i++)
+		online += domain->vcpus[i].online;
+	return online;
+}
+
+static double domain_memory(xenstat_domain *domain)
+{
+	return domain->cur_mem;
+}
+
+static double domain_max_memory(xenstat_domain *domain)
+{
+	/* No limit is -1, like with the metrics of cgroups */
+	return domain->max_mem == (unsigned long long)-1 ? -1 : domain->max_mem;
+}
+
+static double domain_running(xenstat_domain *domain)
+{
+	return xenstat_domain_running(domain);
+}
+
+static double domain_blocked(xenstat_domain *domain)
+{
+	return xenstat_domain_blocked(domain);
+}
+
+static double domain_paused(xenstat_domain *domain)
+{
+	return xenstat_domain_paused(domain);
+}
+
+static double domain_shutdown(xenstat_domain *domain)
+{
+	return xenstat_domain_shutdown(domain);
+}
+
+static double domain_crashed(xenstat_domain *domain)
+{
+	return xenstat_domain_crashed(domain);
+}
+
+static double domain_dying(xenstat_domain *domain)
+{
+	return xenstat_domain_dying(domain);
+}
+
+static double domain_cpu_ratio(xenstat_domain *domain)
+{
+	return domain->cpu_pct / 100;
+}
+
+static const domain_metric domain_metrics[] = {
+	{ "xen_domain_cpu_seconds_total", "counter",
+	  "CPU time used by the domain.", 0, domain_cpu_seconds },
+	{ "xen_domain_cpu_usage_ratio", "gauge",
+	  "CPU time used per second since the previous refresh.",
+	  0, domain_cpu_ratio },
+	{ "xen_domain_vcpus", "gauge",
+	  "VCPUs configured for the domain.", 0, domain_vcpus },
+	{ "xen_domain_vcpus_online", "gauge",
+	  "VCPUs online in the domain.", XENSTAT_VCPU, domain_online_vcpus },
+	{ "xen_domain_memory_bytes", "gauge",
+	  "Current memory reservation of the domain.", 0, domain_memory },
+	{ "xen_domain_memory_max_bytes", "gauge",
+	  "Maximum memory reservation of the domain, -1 if unlimited.",
+	  0, domain_max_memory },
+	{ "xen_domain_running", "gauge",
+	  "Whether the domain is running.", 0, domain_running },
+	{ "xen_domain_blocked", "gauge",
+	  "Whether the domain is blocked.", 0, domain_blocked },
+	{ "xen_domain_paused", "gauge",
+	  "Whether the domain is paused.", 0, domain_paused },
+	{ "xen_domain_shutdown", "gauge",
+	  "Whether the domain has shut down.", 0, domain_shutdown },
+	{ "xen_domain_crashed", "gauge",
+	  "Whether the domain has crashed.", 0, domain_crashed },
+	{ "xen_domain_dying", "gauge",
+	  "Whether the domain is dying.", 0, domain_dying },
+	{ "xen_domain_network_receive_bytes_per_second", "gauge",
+	  "Bytes received by all the networks since the previous refresh.",
+	  XENSTAT_NETWORK, xenstat_domain_net_rbytes_rate },
+	{ "xen_domain_network_transmit_bytes_per_second", "gauge",
+	  "Bytes transmitted by all the networks since the previous refresh.",
+	  XENSTAT_NETWORK, xenstat_domain_net_tbytes_rate },
+	{ "xen_domain_vbd_read_requests_per_second", "gauge",
+	  "READ requests of all the VBDs since the previous refresh.",
+	  XENSTAT_VBD, xenstat_domain_vbd_rd_reqs_rate },
+	{ "xen_domain_vbd_write_requests_per_second", "gauge",
+	  "WRITE requests of all the VBDs since the previous refresh.",
+	  XENSTAT_VBD, xenstat_domain_vbd_wr_reqs_rate },
+	{ "xen_domain_vbd_read_sectors_per_second", "gauge",
+	  "Sectors read by all the VBDs since the previous refresh.",
+	  XENSTAT_VBD, xenstat_domain_vbd_rd_sects_rate },
+	{ "xen_domain_vbd_write_sectors_per_second", "gauge",
+	  "Sectors written by all the VBDs since the previous refresh.",
+	  XENSTAT_VBD, xenstat_domain_vbd_wr_sects_rate },
+};
+
+#define NETWORK_METRIC(field)						\
+	static unsigned long long network_##field(void *dev)		\
+	{								\
+		return ((xenstat_network *)dev)->field;			\
+	}
+NETWORK_METRIC(rbytes)
+NETWORK_METRIC(rpackets)
+NETWORK_METRIC(rerrs)
+NETWORK_METRIC(rdrop)
+NETWORK_METRIC(tbytes)
+NETWORK_METRIC(tpackets)
+NETWORK_METRIC(terrs)
+NETWORK_METRIC(tdrop)
+#undef NETWORK_METRIC
+
+static const device_metric network_metrics[] = {
+	{ "xen_domain_network_receive_bytes_total",
+	  "Bytes received by the network.", network_rbytes },
+	{ "xen_domain_network_receive_packets_total",
+	  "Packets received by the network.", network_rpackets },
+	{ "xen_domain_network_receive_errors_total",
+	  "Receive errors of the network.", network_rerrs },
+	{ "xen_domain_network_receive_drops_total",
+	  "Received packets dropped by the network.", network_rdrop },
+	{ "xen_domain_network_transmit_bytes_total",
+	  "Bytes transmitted by the network.", network_tbytes },
+	{ "xen_domain_network_transmit_packets_total",
+	  "Packets transmitted by the network.", network_tpackets },
+	{ "xen_domain_network_transmit_errors_total",
+	  "Transmit errors of the network.", network_terrs },
+	{ "xen_domain_network_transmit_drops_total",
+	  "Transmitted packets dropped by the network.", network_tdrop },
+};
+
+#define VBD_METRIC(field)						\
+	static unsigned long long vbd_##field(void *dev)		\
+	{								\
+		return ((xenstat_vbd *)dev)->field;			\
+	}
+VBD_METRIC(oo_reqs)
+VBD_METRIC(rd_reqs)
+VBD_METRIC(wr_reqs)
+VBD_METRIC(rd_sects)
+VBD_METRIC(wr_sects)
+#undef VBD_METRIC
+
+static const device_metric vbd_metrics[] = {
+	{ "xen_domain_vbd_out_of_requests_total",
+	  "Times the VBD ran out of requests.", vbd_oo_reqs },
+	{ "xen_domain_vbd_read_requests_total",
+	  "READ requests of the VBD.", vbd_rd_reqs },
+	{ "xen_domain_vbd_write_requests_total",
+	  "WRITE requests of the VBD.", vbd_wr_reqs },
+	{ "xen_domain_vbd_read_sectors_total",
+	  "Sectors read by the VBD.", vbd_rd_sects },
+	{ "xen_domain_vbd_write_sectors_total",
+	  "Sectors written by the VBD.", vbd_wr_sects },
+};
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static void write_header(FILE *f, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Label values are quoted, with \, " and newlines escaped */
+static void write_domain_labels(FILE *f, xenstat_domain *domain)
+{
+	const char *p;
+
+	fprintf(f, "domid=\"%u\",name=\"", domain->id);
+	for (p = domain->name; *p; p++) {
+		if (*p == '\\' || *p == '"')
+			fprintf(f, "\\%c", *p);
+		else if (*p == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*p, f);
+	}
+	fprintf(f, "\",uuid=\"%s\"", domain->uuid);
+}
+
+int xenstat_node_write_metrics(xenstat_node * node, FILE * f)
+{
+	xenstat_domain *domain;
+	unsigned int i, j, m;
+
+	write_header(f, "xen_node_cpus", "gauge", "Physical CPUs.");
+	fprintf(f, "xen_node_cpus %u\n", node->num_cpus);
+	write_header(f, "xen_node_cpu_hz", "gauge", "Speed of the CPUs.");
+	fprintf(f, "xen_node_cpu_hz %llu\n", node->cpu_hz);
+	write_header(f, "xen_node_memory_total_bytes", "gauge",
+		     "Memory of the node.");
+	fprintf(f, "xen_node_memory_total_bytes %llu\n", node->tot_mem);
+	write_header(f, "xen_node_memory_free_bytes", "gauge",
+		     "Memory not used by any domain.");
+	fprintf(f, "xen_node_memory_free_bytes %llu\n", node->free_mem);
+	write_header(f, "xen_node_domains", "gauge", "Domains on the node.");
+	fprintf(f, "xen_node_domains %u\n", node->num_domains);
+
+	for (m = 0; m < ARRAY_LEN(domain_metrics); m++) {
+		const domain_metric *metric = &domain_metrics[m];
+
+		if ((node->flags & metric->flag) != metric->flag)
+			continue;
+		write_header(f, metric->name, metric->type, metric->help);
+		for (i = 0; i < node->num_domains; i++) {
+			domain = &node->domains[i];
+			fprintf(f, "%s{", metric->name);
+			write_domain_labels(f, domain);
+			fprintf(f, "} %.17g\n", metric->get(domain));
+		}
+	}
+
+	for (m = 0; m < ARRAY_LEN(network_metrics) &&
+		    (node->flags & XENSTAT_NETWORK); m++) {
+		const device_metric *metric = &network_metrics[m];
+
+		write_header(f, metric->name, "counter", metric->help);
+		for (i = 0; i < node->num_domains; i++) {
+			domain = &node->domains[i];
+			for (j = 0; j < domain->num_networks; j++) {
+				fprintf(f, "%s{", metric->name);
+				write_domain_labels(f, domain);
+				fprintf(f, ",vif=\"%u\"} %llu\n",
+					domain->networks[j].id,
+					metric->get(&domain->networks[j]));
+			}
+		}
+	}
+
+	for (m = 0; m < ARRAY_LEN(vbd_metrics) &&
+		    (node->flags & XENSTAT_VBD); m++) {
+		const device_metric *metric = &vbd_metrics[m];
+
+		write_header(f, metric->name, "counter", metric->help);
+		for (i = 0; i < node->num_domains; i++) {
+			domain = &node->domains[i];
+			for (j = 0; j < domain->num_vbds; j++) {
+				fprintf(f, "%s{", metric->name);
+				write_domain_labels(f, domain);
+				fprintf(f, ",vbd=\"%u\",type=\"%s\"} %llu\n",
+					domain->vbds[j].dev,
+					domain->vbds[j].back_type == 1 ?
+					"vbd" : "tap",
+					metric->get(&domain->vbds[j]));
+			}
+		}
+	}
+
+	return ferror(f) ? -1 : 0;
+}
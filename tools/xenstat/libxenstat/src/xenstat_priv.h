@@ -32,12 +32,42 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+#define UUID_STR_LEN 36
+
+/* Per-domain information kept in the handle from one xenstat_get_node()
+ * to the next: the data which does not change while the domain lives,
+ * and the counters of the last collection, to compute rates against. */
+typedef struct xenstat_domain_cache {
+	unsigned int id;
+	xen_domain_handle_t handle;
+	char uuid[UUID_STR_LEN + 1];
+	char *name;			/* NULL until read from xenstore */
+	unsigned int seen:1;		/* Domain found by the current refresh */
+	unsigned int watched:1;		/* Name watch registered */
+	unsigned int primed:1;		/* Name watch fired once already */
+	unsigned int stale:1;		/* Name must be read again */
+	unsigned int flags;		/* Collectors run for the counters below */
+	unsigned long long time_ns;
+	unsigned long long cpu_ns;
+	unsigned long long net_rbytes;
+	unsigned long long net_tbytes;
+	unsigned long long vbd_rd_reqs;
+	unsigned long long vbd_wr_reqs;
+	unsigned long long vbd_rd_sects;
+	unsigned long long vbd_wr_sects;
+} xenstat_domain_cache;
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	int watching;		/* 1 if domain watches work, -1 if not, 0 untried */
+	unsigned int generation; /* Changes whenever domains come or go */
+	xenstat_domain_cache *cache;	/* Sorted by domain id */
+	unsigned int cache_len;
+	unsigned int cache_size;
 };
 
 struct xenstat_node {
@@ -50,6 +80,7 @@ struct xenstat_node {
 	unsigned int num_domains;
 	xenstat_domain *domains;	/* Array of length num_domains */
 	long freeable_mb;
+	unsigned long long time_ns;	/* CLOCK_MONOTONIC at collection */
 };
 
 struct xenstat_tmem {
@@ -62,6 +93,7 @@ struct xenstat_tmem {
 struct xenstat_domain {
 	unsigned int id;
 	char *name;
+	char uuid[UUID_STR_LEN + 1];
 	unsigned int state;
 	unsigned long long cpu_ns;
 	unsigned int num_vcpus;		/* No. vcpus configured for domain */
@@ -74,6 +106,14 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	/* Rates against the previous collection, per second */
+	double cpu_pct;
+	double net_rbytes_rate;
+	double net_tbytes_rate;
+	double vbd_rd_reqs_rate;
+	double vbd_wr_reqs_rate;
+	double vbd_rd_sects_rate;
+	double vbd_wr_sects_rate;
 };
 
 struct xenstat_vcpu {
@@ -357,17 +357,6 @@ static int qmp_connect(char *path)
 }
 
 /* Get up to 1024 active domains */
-static xc_domaininfo_t *get_domain_ids(xc_interface *xc_handle, int *num_doms)
-{
-	xc_domaininfo_t *dominfo;
-
-	dominfo = calloc(1024, sizeof(xc_domaininfo_t));
-	if (dominfo == NULL)
-		return NULL;
-	*num_doms = xc_domain_getinfolist(xc_handle, 0, 1024, dominfo);
-	return dominfo;
-}
-
 /* Gather the qdisk statistics by querying QMP
    Resources: http://wiki.qemu.org/QMP and qmp-commands.hx from the qemu code
    QMP Syntax for entering command mode. This command must be issued before
@@ -398,27 +387,25 @@ void read_attributes_qdisk(xenstat_node * node)
 {
 	char *cmd_mode = "{ \"execute\": \"qmp_capabilities\" }";
 	char *query_blockstats_cmd = "{ \"execute\": \"query-blockstats\" }";
-	xc_domaininfo_t *dominfo = NULL;
-	unsigned char *qmp_stats, *val;
-	char path[80];
-	int i, qfd, num_doms;
-
-	dominfo = get_domain_ids(node->handle->xc_handle, &num_doms);
-	if (dominfo == NULL)
+	unsigned char *qmp_stats;
+	char path[80], **doms, *end;
+	unsigned int i, num_doms, domid;
+	int qfd;
+
+	/* The VMs which use qdisk disks, with one xenstore request */
+	doms = xs_directory(node->handle->xshandle, XBT_NULL,
+			    "/local/domain/0/backend/qdisk", &num_doms);
+	if (doms == NULL)
 		return;
 
 	for (i=0; i<num_doms; i++) {
-		if (dominfo[i].domain <= 0)
-			continue;
-
-		/* Verify that qdisk disks are used with this VM */
-		snprintf(path, sizeof(path),"/local/domain/0/backend/qdisk/%i", dominfo[i].domain);
-		if ((val = xs_read(node->handle->xshandle, XBT_NULL, path, NULL)) == NULL)
+		domid = strtoul(doms[i], &end, 10);
+		if (*end != '\0' || domid == 0 ||
+		    xenstat_node_domain(node, domid) == NULL)
 			continue;
-		free(val);
 
 		/* Connect to this VMs QMP socket */
-		snprintf(path, sizeof(path), "/var/run/xen/qmp-libxenstat-%i", dominfo[i].domain);
+		snprintf(path, sizeof(path), "/var/run/xen/qmp-libxenstat-%u", domid);
 		if ((qfd = qmp_connect(path)) < 0) {
 			continue;
 		}
@@ -428,14 +415,14 @@ void read_attributes_qdisk(xenstat_node * node)
 			free(qmp_stats);
 			/* Query QMP for this VMs blockstats */
 			if ((qmp_stats = qmp_query(qfd, query_blockstats_cmd)) != NULL) {
-				qmp_parse_stats(node, dominfo[i].domain, qmp_stats, qfd);
+				qmp_parse_stats(node, domid, qmp_stats, qfd);
 				free(qmp_stats);
 			}
 		}
 		close(qfd);
 	}
 
-	free(dominfo);
+	free(doms);
 }
 
 #else /* !HAVE_YAJL_V2 */
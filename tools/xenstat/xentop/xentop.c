@@ -36,6 +36,9 @@
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #if defined(__linux__)
 #include <linux/kdev_t.h>
 #endif
@@ -141,6 +144,7 @@ static void do_domain(xenstat_domain *);
 static void do_vcpu(xenstat_domain *);
 static void do_network(xenstat_domain *);
 static void do_vbd(xenstat_domain *);
+static void refresh_node(void);
 static void top(void);
 
 /* Field types */
@@ -216,6 +220,7 @@ int show_vbds = 0;
 int show_tmem = 0;
 int repeat_header = 0;
 int show_full_name = 0;
+const char *metrics_path = NULL;
 #define PROMPT_VAL_LEN 80
 char *prompt = NULL;
 char prompt_val[PROMPT_VAL_LEN];
@@ -245,6 +250,7 @@ static void usage(const char *program)
 	       "-b, --batch	     output in batch mode, no user input accepted\n"
 	       "-i, --iterations     number of iterations before exiting\n"
 	       "-f, --full-name      output the full domain name (not truncated)\n"
+	       "-m, --metrics=PATH   serve metrics on the UNIX socket PATH instead\n"
 	       "\n" XENTOP_BUGSTO,
 	       program);
 	return;
@@ -1107,18 +1113,24 @@ void do_tmem(xenstat_domain *domain)
 
 }
 
-static void top(void)
+/* Get new node information, keeping the previous one */
+static void refresh_node(void)
 {
-	xenstat_domain **domains;
-	unsigned int i, num_domains = 0;
-
-	/* Now get the node information */
 	if (prev_node != NULL)
 		xenstat_free_node(prev_node);
 	prev_node = cur_node;
 	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
 	if (cur_node == NULL)
 		fail("Failed to retrieve statistics from libxenstat\n");
+}
+
+static void top(void)
+{
+	xenstat_domain **domains;
+	unsigned int i, num_domains = 0;
+
+	/* Now get the node information */
+	refresh_node();
 
 	/* dump summary top information */
 	if (!batch)
@@ -1176,6 +1188,60 @@ static void signal_exit_handler(int sig)
 	signal_exit = 1;
 }
 
+/* Refresh the node information every delay seconds, and write it as
+ * metrics to whoever connects to the socket at metrics_path */
+static void serve_metrics(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct timeval timeout = { .tv_sec = 1 };
+	struct pollfd pfd;
+	int fd;
+	FILE *f;
+
+	if (strlen(metrics_path) >= sizeof(addr.sun_path))
+		fail("Metrics socket path too long\n");
+	strcpy(addr.sun_path, metrics_path);
+	unlink(metrics_path);
+
+	pfd.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 ||
+	    bind(pfd.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(pfd.fd, 16) < 0)
+		fail("Failed to listen on the metrics socket\n");
+
+	do {
+		gettimeofday(&curtime, NULL);
+		if (cur_node == NULL ||
+		    (curtime.tv_sec - oldtime.tv_sec) >= delay) {
+			refresh_node();
+			oldtime = curtime;
+			if ((!loop) && !(--iterations))
+				break;
+		}
+
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		fd = accept(pfd.fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		/* Do not let a stuck reader hold up the refreshes */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
+		f = fdopen(fd, "w");
+		if (f == NULL) {
+			close(fd);
+			continue;
+		}
+		xenstat_node_write_metrics(cur_node, f);
+		fclose(f);
+	} while (!signal_exit);
+
+	close(pfd.fd);
+	unlink(metrics_path);
+}
+
 int main(int argc, char **argv)
 {
 	int opt, optind = 0;
@@ -1192,9 +1258,10 @@ int main(int argc, char **argv)
 		{ "batch",	   no_argument,	      NULL, 'b' },
 		{ "iterations",	   required_argument, NULL, 'i' },
 		{ "full-name",     no_argument,       NULL, 'f' },
+		{ "metrics",       required_argument, NULL, 'm' },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVnxrvd:bi:f";
+	const char *sopts = "hVnxrvd:bi:fm:";
 
 	if (atexit(cleanup) != 0)
 		fail("Failed to install cleanup handler.\n");
@@ -1236,6 +1303,9 @@ int main(int argc, char **argv)
 		case 'f':
 			show_full_name = 1;
 			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
 		case 't':
 			show_tmem = 1;
 			break;
@@ -1247,7 +1317,19 @@ int main(int argc, char **argv)
 	if (xhandle == NULL)
 		fail("Failed to initialize xenstat library\n");
 
-	if (!batch) {
+	if (metrics_path != NULL) {
+		struct sigaction sa = {
+			.sa_handler = signal_exit_handler,
+			.sa_flags = 0
+		};
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		/* Readers going away must not kill us */
+		signal(SIGPIPE, SIG_IGN);
+
+		serve_metrics();
+	} else if (!batch) {
 		/* Begin curses stuff */
 		cwin = initscr();
 		start_color();
@@ -230,6 +230,107 @@ xs_transaction_t xs_transaction_start(struct xs_handle *h);
 bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 			bool abort);
 
+/* Asynchronous requests.
+ * The xs_*_async functions send a request and return at once, with a
+ * future for its reply (NULL and errno set if the request could not be
+ * sent).  Any number of requests, from any number of threads, can be
+ * waiting for their reply on the same handle; the daemon answers the
+ * requests of a connection in order.
+ *
+ * The reply is collected, and the future freed, with the xs_future_wait*
+ * function matching the request, which blocks until the reply arrives
+ * and returns what the synchronous function would have.  Every future
+ * must be collected exactly once, before the handle is closed.
+ */
+struct xs_future;
+
+/* Called when the reply to a request arrives, from the thread reading the
+ * replies: the callback must collect the reply with xs_future_wait*(),
+ * which then does not block, and may send asynchronous requests, but must
+ * not wait for any other reply.
+ */
+typedef void xs_future_cb(struct xs_handle *h, struct xs_future *f,
+			  void *data);
+
+/* Asynchronous xs_read(), xs_directory(), xs_write(), xs_mkdir() and
+ * xs_rm(). */
+struct xs_future *xs_read_async(struct xs_handle *h, xs_transaction_t t,
+				const char *path);
+struct xs_future *xs_directory_async(struct xs_handle *h, xs_transaction_t t,
+				     const char *path);
+struct xs_future *xs_write_async(struct xs_handle *h, xs_transaction_t t,
+				 const char *path, const void *data,
+				 unsigned int len);
+struct xs_future *xs_mkdir_async(struct xs_handle *h, xs_transaction_t t,
+				 const char *path);
+struct xs_future *xs_rm_async(struct xs_handle *h, xs_transaction_t t,
+			      const char *path);
+
+/* Returns true if the reply has arrived, without blocking. */
+bool xs_future_ready(struct xs_future *f);
+
+/* Collect the reply of xs_read_async(): malloced data, with the length
+ * in len if not NULL, or NULL and errno set on failure. */
+void *xs_future_wait(struct xs_future *f, unsigned int *len);
+
+/* Collect the reply of xs_directory_async(), as xs_directory(). */
+char **xs_future_wait_directory(struct xs_future *f, unsigned int *num);
+
+/* Collect the reply of xs_write_async(), xs_mkdir_async() or
+ * xs_rm_async(): false and errno set on failure. */
+bool xs_future_wait_bool(struct xs_future *f);
+
+/* Have cb called when the reply arrives, or at once if it has already.
+ * This starts the thread reading the replies, like xs_watch().  Returns
+ * false, and cb is not called, on failure (ENOSYS without thread
+ * support).
+ */
+bool xs_future_set_callback(struct xs_future *f, xs_future_cb *cb,
+			    void *data);
+
+/* Pipelined requests.
+ * Requests added to a pipeline are only queued; xs_pipeline_end() sends
+ * them to the daemon without waiting for each reply in turn, which saves
+ * a round trip per request.  This is meant for populating a directory
+ * with many nodes, typically inside a transaction.
+ *
+ * The requests are made in order, and xs_pipeline_end() only returns
+ * once all of them have been answered.  The xs_pipeline_* functions
+ * return false if a request could not be queued, in which case nothing
+ * is sent and xs_pipeline_end() fails with the same errno.  Checking
+ * xs_pipeline_end() only is enough.
+ */
+struct xs_pipeline;
+
+/* Start a pipeline of requests for transaction t (may be XBT_NULL).
+ * Returns NULL on failure.
+ */
+struct xs_pipeline *xs_pipeline_start(struct xs_handle *h, xs_transaction_t t);
+
+/* Queue an xs_write(). */
+bool xs_pipeline_write(struct xs_pipeline *p, const char *path,
+		       const void *data, unsigned int len);
+
+/* Queue an xs_mkdir(). */
+bool xs_pipeline_mkdir(struct xs_pipeline *p, const char *path);
+
+/* Queue an xs_rm(): unlike with xs_rm(), the node not existing is not
+ * a failure.
+ */
+bool xs_pipeline_rm(struct xs_pipeline *p, const char *path);
+
+/* Queue an xs_set_permissions(). */
+bool xs_pipeline_set_permissions(struct xs_pipeline *p, const char *path,
+				 struct xs_permissions *perms,
+				 unsigned int num_perms);
+
+/* Send the requests and free the pipeline.
+ * If abandon is true, the requests are discarded instead of sent.
+ * Returns false if any request failed, with errno set from the first
+ * failure; the requests following a failed one have still been made.
+ */
+bool xs_pipeline_end(struct xs_pipeline *p, bool abandon);
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page, event channel and
  * store path associated with a domain: the domain uses these to communicate.
@@ -42,6 +42,24 @@ struct xs_stored_msg {
 	char *body;
 };
 
+/* A request sent to the daemon, and its reply once it has arrived. */
+struct xs_future {
+	struct list_head list;
+	struct xs_handle *h;
+	uint32_t req_id;
+	enum xsd_sockmsg_type type;
+
+	bool done;
+	/* Set if the connection failed before the reply arrived. */
+	int err;
+	enum xsd_sockmsg_type reply_type;
+	char *body;
+	unsigned int len;
+
+	xs_future_cb *cb;
+	void *cb_data;
+};
+
 #ifdef USE_PTHREAD
 
 #include <pthread.h>
@@ -71,23 +89,29 @@ struct xs_handle {
 	bool unwatch_filter;
 
 	/*
-         * A list of replies. Currently only one will ever be outstanding
-         * because we serialise requests. The requester can wait on the
-         * conditional variable for its response.
+         * The requests waiting for a reply, in the order they were sent.
+         * Each has its own req_id, which the daemon copies into the reply.
+         * Requesters wait on the conditional variable for their reply.
+         * Without a read thread, one of them at a time (the one which set
+         * reading) reads the comms channel on behalf of all of them.
          */
-	struct list_head reply_list;
+	struct list_head pending;
+	uint32_t next_req_id;
+	bool reading;
 	pthread_mutex_t reply_mutex;
 	pthread_cond_t reply_condvar;
 
-	/* One request at a time. */
+	/* One request written at a time. */
 	pthread_mutex_t request_mutex;
 
 	/* Lock discipline:
 	 *  Only holder of the request lock may write to h->fd.
-	 *  Only holder of the request lock may access read_thr_exists.
-	 *  If read_thr_exists==0, only holder of request lock may read h->fd;
+	 *  Only holder of the request lock may access next_req_id.
+	 *  Only holder of the reply lock may access read_thr_exists, reading
+	 *  and pending.
+	 *  If read_thr_exists==0, only the thread which set reading may read
+	 *  h->fd;
 	 *  If read_thr_exists==1, only the read thread may read h->fd.
-	 *  Only holder of the reply lock may access reply_list.
 	 *  Only holder of the watch lock may access watch_list.
 	 * Lock hierarchy:
 	 *  The order in which to acquire locks is
@@ -100,6 +124,7 @@ struct xs_handle {
 #define mutex_lock(m)		pthread_mutex_lock(m)
 #define mutex_unlock(m)		pthread_mutex_unlock(m)
 #define condvar_signal(c)	pthread_cond_signal(c)
+#define condvar_broadcast(c)	pthread_cond_broadcast(c)
 #define condvar_wait(c,m)	pthread_cond_wait(c,m)
 #define cleanup_push(f, a)	\
     pthread_cleanup_push((void (*)(void *))(f), (void *)(a))
@@ -123,7 +148,9 @@ static void *read_thread(void *arg);
 
 struct xs_handle {
 	int fd;
-	struct list_head reply_list;
+	struct list_head pending;
+	uint32_t next_req_id;
+	bool reading;
 	struct list_head watch_list;
 	/* Clients can select() on this pipe to wait for a watch to fire. */
 	int watch_pipe[2];
@@ -134,6 +161,7 @@ struct xs_handle {
 #define mutex_lock(m)		((void)0)
 #define mutex_unlock(m)		((void)0)
 #define condvar_signal(c)	((void)0)
+#define condvar_broadcast(c)	((void)0)
 #define condvar_wait(c,m)	((void)0)
 #define cleanup_push(f, a)	((void)0)
 #define cleanup_pop(run)	((void)0)
@@ -145,6 +173,7 @@ struct xs_handle {
 #endif
 
 static int read_message(struct xs_handle *h, int nonblocking);
+static void fail_pending(struct xs_handle *h, int err);
 
 static bool setnonblock(int fd, int nonblock) {
 	int flags = fcntl(fd, F_GETFL);
@@ -249,7 +278,7 @@ static struct xs_handle *get_handle(const char *connect_to)
 
 	h->fd = fd;
 
-	INIT_LIST_HEAD(&h->reply_list);
+	INIT_LIST_HEAD(&h->pending);
 	INIT_LIST_HEAD(&h->watch_list);
 
 	/* Watch pipe is allocated on demand in xs_fileno(). */
@@ -306,11 +335,6 @@ struct xs_handle *xs_open(unsigned long flags)
 static void close_free_msgs(struct xs_handle *h) {
 	struct xs_stored_msg *msg, *tmsg;
 
-	list_for_each_entry_safe(msg, tmsg, &h->reply_list, list) {
-		free(msg->body);
-		free(msg);
-	}
-
 	list_for_each_entry_safe(msg, tmsg, &h->watch_list, list) {
 		free(msg->body);
 		free(msg);
@@ -343,6 +367,9 @@ void xs_daemon_close(struct xs_handle *h)
 	}
 #endif
 
+	/* Callbacks still waiting for a reply get an error. */
+	fail_pending(h, EBADF);
+
 	mutex_lock(&h->request_mutex);
 	mutex_lock(&h->reply_mutex);
 	mutex_lock(&h->watch_mutex);
@@ -419,69 +446,109 @@ static int get_error(const char *errorstring)
 	return xsd_errors[i].errnum;
 }
 
-/* Adds extra nul terminator, because we generally (always?) hold strings. */
-static void *read_reply(
-	struct xs_handle *h, enum xsd_sockmsg_type *type, unsigned int *len)
+static void run_callback(struct xs_future *f)
 {
-	struct xs_stored_msg *msg;
-	char *body;
-	int read_from_thread;
-
-	read_from_thread = read_thread_exists(h);
+#ifdef USE_PTHREAD
+	int state;
+
+	/* The read thread must not be cancelled while the callback runs. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	f->cb(f->h, f, f->cb_data);
+	pthread_setcancelstate(state, NULL);
+#else
+	f->cb(f->h, f, f->cb_data);
+#endif
+}
 
-	/* Read from comms channel ourselves if there is no reader thread. */
-	if (!read_from_thread && (read_message(h, 0) == -1))
-		return NULL;
+/* Complete the pending requests with an error, after losing the
+ * connection or on closing the handle. */
+static void fail_pending(struct xs_handle *h, int err)
+{
+	struct xs_future *f, *tmp;
+	LIST_HEAD(callbacks);
 
 	mutex_lock(&h->reply_mutex);
-#ifdef USE_PTHREAD
-	while (list_empty(&h->reply_list) && read_from_thread && h->fd != -1)
-		condvar_wait(&h->reply_condvar, &h->reply_mutex);
-#endif
-	if (list_empty(&h->reply_list)) {
-		mutex_unlock(&h->reply_mutex);
-		errno = EINVAL;
-		return NULL;
+	list_for_each_entry_safe(f, tmp, &h->pending, list) {
+		list_del(&f->list);
+		f->err = err;
+		f->done = true;
+		if (f->cb)
+			list_add_tail(&f->list, &callbacks);
 	}
-	msg = list_top(&h->reply_list, struct xs_stored_msg, list);
-	list_del(&msg->list);
-	assert(list_empty(&h->reply_list));
+	condvar_broadcast(&h->reply_condvar);
 	mutex_unlock(&h->reply_mutex);
 
-	*type = msg->hdr.type;
-	if (len)
-		*len = msg->hdr.len;
-	body = msg->body;
+	list_for_each_entry_safe(f, tmp, &callbacks, list)
+		run_callback(f);
+}
 
-	free(msg);
+/* We're in a bad state, so close fd. */
+static void close_fd(struct xs_handle *h)
+{
+	int fd = h->fd;
 
-	return body;
+	if (fd != -1) {
+		h->fd = -1;
+		close(fd);
+	}
 }
 
-/* Send message to xs, get malloc'ed reply.  NULL and set errno on error. */
-static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
-		      enum xsd_sockmsg_type type,
-		      const struct iovec *iovec,
-		      unsigned int num_vecs,
-		      unsigned int *len)
+/* Hand a reply over to the request it answers. */
+static void complete_request(struct xs_handle *h, struct xs_stored_msg *msg)
 {
-	struct xsd_sockmsg msg;
-	void *ret = NULL;
+	struct xs_future *f;
+	xs_future_cb *cb = NULL;
+	bool found = false;
+
+	mutex_lock(&h->reply_mutex);
+	/* Replies come in the order of the requests: this finds the first. */
+	list_for_each_entry(f, &h->pending, list) {
+		if (f->req_id == msg->hdr.req_id) {
+			found = true;
+			break;
+		}
+	}
+	if (found) {
+		list_del(&f->list);
+		f->reply_type = msg->hdr.type;
+		f->body = msg->body;
+		f->len = msg->hdr.len;
+		f->done = true;
+		/* Without a callback, the waiter may free f as soon as we
+		 * unlock. */
+		cb = f->cb;
+		if (!cb)
+			condvar_broadcast(&h->reply_condvar);
+	}
+	mutex_unlock(&h->reply_mutex);
+
+	if (!found)
+		free(msg->body);
+	else if (cb)
+		run_callback(f);
+	free(msg);
+}
+
+/*
+ * Write a request to the daemon, and return the future of its reply, or
+ * NULL and set errno on error.  The header is filled in but for the
+ * payload length, which must be known to fit.
+ */
+static struct xs_future *xs_send(struct xs_handle *h,
+				 struct xsd_sockmsg *msg,
+				 const struct iovec *iovec,
+				 unsigned int num_vecs)
+{
+	struct xs_future *f;
+	struct sigaction ignorepipe, oldact;
 	int saved_errno;
 	unsigned int i;
-	struct sigaction ignorepipe, oldact;
-
-	msg.tx_id = t;
-	msg.req_id = 0;
-	msg.type = type;
-	msg.len = 0;
-	for (i = 0; i < num_vecs; i++)
-		msg.len += iovec[i].iov_len;
 
-	if (msg.len > XENSTORE_PAYLOAD_MAX) {
-		errno = E2BIG;
-		return 0;
-	}
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+	f->h = h;
+	f->type = msg->type;
 
 	ignorepipe.sa_handler = SIG_IGN;
 	sigemptyset(&ignorepipe.sa_mask);
@@ -490,46 +557,168 @@ static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
 
 	mutex_lock(&h->request_mutex);
 
-	if (!xs_write_all(h->fd, &msg, sizeof(msg)))
+	f->req_id = msg->req_id = h->next_req_id++;
+	mutex_lock(&h->reply_mutex);
+	list_add_tail(&f->list, &h->pending);
+	mutex_unlock(&h->reply_mutex);
+
+	if (!xs_write_all(h->fd, msg, sizeof(*msg)))
 		goto fail;
 
 	for (i = 0; i < num_vecs; i++)
 		if (!xs_write_all(h->fd, iovec[i].iov_base, iovec[i].iov_len))
 			goto fail;
 
-	ret = read_reply(h, &msg.type, len);
-	if (!ret)
-		goto fail;
-
 	mutex_unlock(&h->request_mutex);
 
 	sigaction(SIGPIPE, &oldact, NULL);
-	if (msg.type == XS_ERROR) {
-		saved_errno = get_error(ret);
-		free(ret);
-		errno = saved_errno;
-		return NULL;
-	}
-
-	if (msg.type != type) {
-		free(ret);
-		saved_errno = EBADF;
-		goto close_fd;
-	}
-	return ret;
+	return f;
 
 fail:
-	/* We're in a bad state, so close fd. */
 	saved_errno = errno;
+	mutex_lock(&h->reply_mutex);
+	if (!f->done)
+		list_del(&f->list);
+	mutex_unlock(&h->reply_mutex);
+	close_fd(h);
 	mutex_unlock(&h->request_mutex);
 	sigaction(SIGPIPE, &oldact, NULL);
-close_fd:
-	close(h->fd);
-	h->fd = -1;
+	free(f);
 	errno = saved_errno;
 	return NULL;
 }
 
+static struct xs_future *xs_sendv(struct xs_handle *h, xs_transaction_t t,
+				  enum xsd_sockmsg_type type,
+				  const struct iovec *iovec,
+				  unsigned int num_vecs)
+{
+	struct xsd_sockmsg msg;
+	unsigned int i;
+
+	msg.tx_id = t;
+	msg.type = type;
+	msg.len = 0;
+	for (i = 0; i < num_vecs; i++)
+		msg.len += iovec[i].iov_len;
+
+	if (msg.len > XENSTORE_PAYLOAD_MAX) {
+		errno = E2BIG;
+		return NULL;
+	}
+
+	return xs_send(h, &msg, iovec, num_vecs);
+}
+
+/*
+ * Wait for the reply to a request, called with the reply lock held.
+ * Without a read thread, the waiter which finds nobody reading the comms
+ * channel reads the next message, whichever request it answers, and lets
+ * the others know when it is done.
+ */
+static void wait_reply(struct xs_future *f, int nonblocking)
+{
+	struct xs_handle *h = f->h;
+	int ret, saved_errno;
+
+	while (!f->done) {
+		if (read_thread_exists(h) || h->reading) {
+			if (nonblocking)
+				break;
+			condvar_wait(&h->reply_condvar, &h->reply_mutex);
+			continue;
+		}
+
+		h->reading = true;
+		mutex_unlock(&h->reply_mutex);
+
+		ret = read_message(h, nonblocking);
+		if (ret == -1) {
+			saved_errno = errno;
+			if (!nonblocking || saved_errno != EAGAIN) {
+				close_fd(h);
+				fail_pending(h, saved_errno);
+			}
+		}
+
+		mutex_lock(&h->reply_mutex);
+		h->reading = false;
+		condvar_broadcast(&h->reply_condvar);
+		if (ret == -1)
+			break;
+	}
+}
+
+/* Wait for the reply to a request and free the future.  Returns the
+ * reply, with an extra nul terminator because we generally (always?) hold
+ * strings, or NULL and sets errno if the connection failed. */
+static void *read_reply(struct xs_future *f,
+			enum xsd_sockmsg_type *type, unsigned int *len)
+{
+	char *body;
+	int err;
+
+	mutex_lock(&f->h->reply_mutex);
+	wait_reply(f, 0);
+	mutex_unlock(&f->h->reply_mutex);
+
+	body = f->body;
+	err = f->err;
+	*type = f->reply_type;
+	if (len)
+		*len = f->len;
+	free(f);
+
+	if (!body)
+		errno = err ? : EINVAL;
+	return body;
+}
+
+/* Turn an error reply into errno. */
+static void *check_reply(struct xs_handle *h, enum xsd_sockmsg_type type,
+			 enum xsd_sockmsg_type reply_type, char *reply)
+{
+	int saved_errno;
+
+	if (!reply)
+		return NULL;
+
+	if (reply_type == XS_ERROR) {
+		saved_errno = get_error(reply);
+		free(reply);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	if (reply_type != type) {
+		free(reply);
+		close_fd(h);
+		errno = EBADF;
+		return NULL;
+	}
+
+	return reply;
+}
+
+/* Send message to xs, get malloc'ed reply.  NULL and set errno on error. */
+static void *xs_talkv(struct xs_handle *h, xs_transaction_t t,
+		      enum xsd_sockmsg_type type,
+		      const struct iovec *iovec,
+		      unsigned int num_vecs,
+		      unsigned int *len)
+{
+	struct xs_future *f;
+	enum xsd_sockmsg_type reply_type;
+	void *reply;
+
+	f = xs_sendv(h, t, type, iovec, num_vecs);
+	if (!f)
+		return NULL;
+
+	reply = read_reply(f, &reply_type, len);
+	return check_reply(h, type, reply_type, reply);
+}
+
 /* free(), but don't change errno. */
 static void free_no_errno(void *p)
 {
@@ -559,13 +748,12 @@ static bool xs_bool(char *reply)
 	return true;
 }
 
-char **xs_directory(struct xs_handle *h, xs_transaction_t t,
-		    const char *path, unsigned int *num)
+/* Split the reply to XS_DIRECTORY into an array of strings. */
+static char **directory_strings(char *strings, unsigned int len,
+				unsigned int *num)
 {
-	char *strings, *p, **ret;
-	unsigned int len;
+	char *p, **ret;
 
-	strings = xs_single(h, t, XS_DIRECTORY, path, &len);
 	if (!strings)
 		return NULL;
 
@@ -587,6 +775,16 @@ char **xs_directory(struct xs_handle *h, xs_transaction_t t,
 	return ret;
 }
 
+char **xs_directory(struct xs_handle *h, xs_transaction_t t,
+		    const char *path, unsigned int *num)
+{
+	char *strings;
+	unsigned int len;
+
+	strings = xs_single(h, t, XS_DIRECTORY, path, &len);
+	return directory_strings(strings, len, num);
+}
+
 /* Get the value of a single file, nul terminated.
  * Returns a malloced value: call free() on it after use.
  * len indicates length in bytes, not including the nul.
@@ -714,51 +912,72 @@ bool xs_restrict(struct xs_handle *h, unsigned domid)
 	return xs_bool(xs_single(h, XBT_NULL, XS_RESTRICT, buf, NULL));
 }
 
-/* Watch a node for changes (poll on fd to detect, or call read_watch()).
- * When the node (or any child) changes, fd will become readable.
- * Token is returned when watch is read, to allow matching.
- * Returns false on failure.
- */
-bool xs_watch(struct xs_handle *h, const char *path, const char *token)
-{
-	struct iovec iov[2];
-
 #ifdef USE_PTHREAD
 #define DEFAULT_THREAD_STACKSIZE (16 * 1024)
 #define READ_THREAD_STACKSIZE 					\
 	((DEFAULT_THREAD_STACKSIZE < PTHREAD_STACK_MIN) ? 	\
 	PTHREAD_STACK_MIN : DEFAULT_THREAD_STACKSIZE)
 
-	/* We dynamically create a reader thread on demand. */
-	mutex_lock(&h->request_mutex);
-	if (!h->read_thr_exists) {
-		sigset_t set, old_set;
-		pthread_attr_t attr;
+/* We dynamically create a reader thread on demand. */
+static bool start_read_thread(struct xs_handle *h)
+{
+	sigset_t set, old_set;
+	pthread_attr_t attr;
+	int err = 0;
 
-		if (pthread_attr_init(&attr) != 0) {
-			mutex_unlock(&h->request_mutex);
-			return false;
-		}
-		if (pthread_attr_setstacksize(&attr, READ_THREAD_STACKSIZE) != 0) {
-			pthread_attr_destroy(&attr);
-			mutex_unlock(&h->request_mutex);
-			return false;
-		}
+	/* Wait for whoever reads the comms channel, and keep it to us. */
+	mutex_lock(&h->reply_mutex);
+	while (h->reading)
+		condvar_wait(&h->reply_condvar, &h->reply_mutex);
+	if (h->read_thr_exists) {
+		mutex_unlock(&h->reply_mutex);
+		return true;
+	}
+	h->reading = true;
+	mutex_unlock(&h->reply_mutex);
 
-		sigfillset(&set);
-		pthread_sigmask(SIG_SETMASK, &set, &old_set);
+	if (pthread_attr_init(&attr) != 0) {
+		err = ENOMEM;
+		goto out;
+	}
+	if (pthread_attr_setstacksize(&attr, READ_THREAD_STACKSIZE) != 0) {
+		err = EINVAL;
+		goto out_attr;
+	}
 
-		if (pthread_create(&h->read_thr, &attr, read_thread, h) != 0) {
-			pthread_sigmask(SIG_SETMASK, &old_set, NULL);
-			pthread_attr_destroy(&attr);
-			mutex_unlock(&h->request_mutex);
-			return false;
-		}
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old_set);
+	err = pthread_create(&h->read_thr, &attr, read_thread, h);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+out_attr:
+	pthread_attr_destroy(&attr);
+out:
+	mutex_lock(&h->reply_mutex);
+	if (!err)
 		h->read_thr_exists = 1;
-		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
-		pthread_attr_destroy(&attr);
-	}
-	mutex_unlock(&h->request_mutex);
+	h->reading = false;
+	condvar_broadcast(&h->reply_condvar);
+	mutex_unlock(&h->reply_mutex);
+
+	if (err)
+		errno = err;
+	return !err;
+}
+#endif
+
+/* Watch a node for changes (poll on fd to detect, or call read_watch()).
+ * When the node (or any child) changes, fd will become readable.
+ * Token is returned when watch is read, to allow matching.
+ * Returns false on failure.
+ */
+bool xs_watch(struct xs_handle *h, const char *path, const char *token)
+{
+	struct iovec iov[2];
+
+#ifdef USE_PTHREAD
+	if (!start_read_thread(h))
+		return false;
 #endif
 
 	iov[0].iov_base = (void *)path;
@@ -978,6 +1197,361 @@ bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_TRANSACTION_END, abortstr, NULL));
 }
 
+static struct xs_future *xs_single_async(struct xs_handle *h,
+					 xs_transaction_t t,
+					 enum xsd_sockmsg_type type,
+					 const char *string)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)string;
+	iovec.iov_len = strlen(string) + 1;
+	return xs_sendv(h, t, type, &iovec, 1);
+}
+
+struct xs_future *xs_read_async(struct xs_handle *h, xs_transaction_t t,
+				const char *path)
+{
+	return xs_single_async(h, t, XS_READ, path);
+}
+
+struct xs_future *xs_directory_async(struct xs_handle *h, xs_transaction_t t,
+				     const char *path)
+{
+	return xs_single_async(h, t, XS_DIRECTORY, path);
+}
+
+struct xs_future *xs_write_async(struct xs_handle *h, xs_transaction_t t,
+				 const char *path, const void *data,
+				 unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return xs_sendv(h, t, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+struct xs_future *xs_mkdir_async(struct xs_handle *h, xs_transaction_t t,
+				 const char *path)
+{
+	return xs_single_async(h, t, XS_MKDIR, path);
+}
+
+struct xs_future *xs_rm_async(struct xs_handle *h, xs_transaction_t t,
+			      const char *path)
+{
+	return xs_single_async(h, t, XS_RM, path);
+}
+
+bool xs_future_ready(struct xs_future *f)
+{
+	bool done;
+
+	mutex_lock(&f->h->reply_mutex);
+	wait_reply(f, 1);
+	done = f->done;
+	mutex_unlock(&f->h->reply_mutex);
+
+	return done;
+}
+
+void *xs_future_wait(struct xs_future *f, unsigned int *len)
+{
+	struct xs_handle *h = f->h;
+	enum xsd_sockmsg_type type = f->type, reply_type;
+	void *reply;
+
+	reply = read_reply(f, &reply_type, len);
+	return check_reply(h, type, reply_type, reply);
+}
+
+char **xs_future_wait_directory(struct xs_future *f, unsigned int *num)
+{
+	char *strings;
+	unsigned int len;
+
+	strings = xs_future_wait(f, &len);
+	return directory_strings(strings, len, num);
+}
+
+bool xs_future_wait_bool(struct xs_future *f)
+{
+	return xs_bool(xs_future_wait(f, NULL));
+}
+
+bool xs_future_set_callback(struct xs_future *f, xs_future_cb *cb, void *data)
+{
+#ifdef USE_PTHREAD
+	struct xs_handle *h = f->h;
+	bool done;
+
+	if (!start_read_thread(h))
+		return false;
+
+	mutex_lock(&h->reply_mutex);
+	done = f->done;
+	if (!done) {
+		f->cb = cb;
+		f->cb_data = data;
+	}
+	mutex_unlock(&h->reply_mutex);
+
+	if (done)
+		cb(h, f, data);
+	return true;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+/*
+ * Pipelined requests: the messages are queued in one buffer, and sent
+ * PIPELINE_WINDOW at a time before waiting for their replies.  The window
+ * bounds what the daemon has to buffer for us.
+ */
+#define PIPELINE_WINDOW 64
+
+struct xs_pipeline {
+	struct xs_handle *h;
+	xs_transaction_t t;
+	/* Error queueing a request, reported by xs_pipeline_end() */
+	int err;
+	char *buf;
+	unsigned int buf_len, buf_size;
+	/* Offset of each message in buf, and whether ENOENT is ignored */
+	struct {
+		unsigned int off;
+		bool ignore_enoent;
+	} *reqs;
+	unsigned int num_reqs, reqs_size;
+};
+
+struct xs_pipeline *xs_pipeline_start(struct xs_handle *h, xs_transaction_t t)
+{
+	struct xs_pipeline *p = calloc(1, sizeof(*p));
+
+	if (!p)
+		return NULL;
+	p->h = h;
+	p->t = t;
+	return p;
+}
+
+static bool xs_pipeline_queue(struct xs_pipeline *p,
+			      enum xsd_sockmsg_type type,
+			      const struct iovec *iovec, unsigned int num_vecs,
+			      bool ignore_enoent)
+{
+	struct xsd_sockmsg msg;
+	unsigned int i, need;
+
+	if (p->err) {
+		errno = p->err;
+		return false;
+	}
+
+	msg.tx_id = p->t;
+	msg.req_id = 0;
+	msg.type = type;
+	msg.len = 0;
+	for (i = 0; i < num_vecs; i++)
+		msg.len += iovec[i].iov_len;
+
+	if (msg.len > XENSTORE_PAYLOAD_MAX) {
+		p->err = E2BIG;
+		goto fail;
+	}
+
+	if (p->num_reqs == p->reqs_size) {
+		unsigned int size = p->reqs_size ? p->reqs_size * 2 : 16;
+		void *reqs = realloc(p->reqs, size * sizeof(*p->reqs));
+
+		if (!reqs)
+			goto nomem;
+		p->reqs = reqs;
+		p->reqs_size = size;
+	}
+
+	need = p->buf_len + sizeof(msg) + msg.len;
+	if (need > p->buf_size) {
+		unsigned int size = p->buf_size ? p->buf_size : 4096;
+		char *buf;
+
+		while (size < need)
+			size *= 2;
+		buf = realloc(p->buf, size);
+		if (!buf)
+			goto nomem;
+		p->buf = buf;
+		p->buf_size = size;
+	}
+
+	p->reqs[p->num_reqs].off = p->buf_len;
+	p->reqs[p->num_reqs].ignore_enoent = ignore_enoent;
+	p->num_reqs++;
+
+	memcpy(p->buf + p->buf_len, &msg, sizeof(msg));
+	p->buf_len += sizeof(msg);
+	for (i = 0; i < num_vecs; i++) {
+		memcpy(p->buf + p->buf_len, iovec[i].iov_base,
+		       iovec[i].iov_len);
+		p->buf_len += iovec[i].iov_len;
+	}
+	return true;
+
+nomem:
+	p->err = ENOMEM;
+fail:
+	errno = p->err;
+	return false;
+}
+
+bool xs_pipeline_write(struct xs_pipeline *p, const char *path,
+		       const void *data, unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return xs_pipeline_queue(p, XS_WRITE, iovec, ARRAY_SIZE(iovec), false);
+}
+
+bool xs_pipeline_mkdir(struct xs_pipeline *p, const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+
+	return xs_pipeline_queue(p, XS_MKDIR, &iovec, 1, false);
+}
+
+bool xs_pipeline_rm(struct xs_pipeline *p, const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+
+	return xs_pipeline_queue(p, XS_RM, &iovec, 1, true);
+}
+
+bool xs_pipeline_set_permissions(struct xs_pipeline *p, const char *path,
+				 struct xs_permissions *perms,
+				 unsigned int num_perms)
+{
+	unsigned int i;
+	struct iovec iov[1+num_perms];
+	char buffer[num_perms ? : 1][MAX_STRLEN(unsigned int)+1];
+
+	iov[0].iov_base = (void *)path;
+	iov[0].iov_len = strlen(path) + 1;
+
+	for (i = 0; i < num_perms; i++) {
+		if (!xs_perm_to_string(&perms[i], buffer[i],
+				       sizeof(buffer[i]))) {
+			if (!p->err)
+				p->err = EINVAL;
+			errno = p->err;
+			return false;
+		}
+		iov[i+1].iov_base = buffer[i];
+		iov[i+1].iov_len = strlen(buffer[i]) + 1;
+	}
+
+	return xs_pipeline_queue(p, XS_SET_PERMS, iov, 1+num_perms, false);
+}
+
+static void xs_pipeline_free(struct xs_pipeline *p)
+{
+	free(p->buf);
+	free(p->reqs);
+	free(p);
+}
+
+/* Send the requests of a pipeline.  Returns the first error reply, or
+ * -1 and sets errno if the connection failed. */
+static int xs_pipeline_send(struct xs_pipeline *p)
+{
+	struct xs_handle *h = p->h;
+	struct xs_future *f[PIPELINE_WINDOW];
+	struct xsd_sockmsg *msg;
+	enum xsd_sockmsg_type type;
+	struct iovec iovec;
+	unsigned int i, j, end, sent;
+	char *reply;
+	int err = 0, reply_err, failed = 0;
+
+	for (i = 0; i < p->num_reqs && !failed; i = end) {
+		end = i + PIPELINE_WINDOW;
+		if (end > p->num_reqs)
+			end = p->num_reqs;
+
+		for (sent = i; sent < end; sent++) {
+			msg = (struct xsd_sockmsg *)(p->buf + p->reqs[sent].off);
+			iovec.iov_base = msg + 1;
+			iovec.iov_len = msg->len;
+			f[sent - i] = xs_send(h, msg, &iovec, 1);
+			if (!f[sent - i]) {
+				failed = errno;
+				break;
+			}
+		}
+
+		/* The replies of the requests sent are waited for anyway. */
+		for (j = i; j < sent; j++) {
+			msg = (struct xsd_sockmsg *)(p->buf + p->reqs[j].off);
+			reply = read_reply(f[j - i], &type, NULL);
+			if (!reply) {
+				if (!failed)
+					failed = errno;
+				continue;
+			}
+			if (type == XS_ERROR) {
+				reply_err = get_error(reply);
+				if (!err && !(reply_err == ENOENT &&
+					      p->reqs[j].ignore_enoent))
+					err = reply_err;
+			} else if (type != msg->type && !failed) {
+				close_fd(h);
+				failed = EBADF;
+			}
+			free(reply);
+		}
+	}
+
+	if (failed) {
+		errno = failed;
+		return -1;
+	}
+	return err;
+}
+
+bool xs_pipeline_end(struct xs_pipeline *p, bool abandon)
+{
+	int err = p->err;
+
+	if (abandon || err || !p->num_reqs)
+		goto out;
+
+	err = xs_pipeline_send(p);
+	if (err < 0)
+		err = errno;
+
+out:
+	xs_pipeline_free(p);
+	errno = err;
+	return !err;
+}
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page and event channel
  * associated with a domain: the domain uses these to communicate.
@@ -1127,8 +1701,8 @@ char *xs_debug_command(struct xs_handle *h, const char *cmd,
 
 static int read_message(struct xs_handle *h, int nonblocking)
 {
-	/* IMPORTANT: It is forbidden to call this function without
-	 * acquiring the request lock and checking that h->read_thr_exists
+	/* IMPORTANT: It is forbidden to call this function but from the
+	 * read thread, or after setting h->reading while h->read_thr_exists
 	 * is false.  See "Lock discipline" in struct xs_handle, above. */
 
 	/* If nonblocking==1, this function will always read either
@@ -1186,19 +1760,7 @@ static int read_message(struct xs_handle *h, int nonblocking)
 
 		cleanup_pop(1);
 	} else {
-		mutex_lock(&h->reply_mutex);
-
-		/* There should only ever be one response pending! */
-		if (!list_empty(&h->reply_list)) {
-			mutex_unlock(&h->reply_mutex);
-			saved_errno = EEXIST;
-			goto error_freebody;
-		}
-
-		list_add_tail(&msg->list, &h->reply_list);
-		condvar_signal(&h->reply_condvar);
-
-		mutex_unlock(&h->reply_mutex);
+		complete_request(h, msg);
 	}
 
 	ret = 0;
@@ -1217,7 +1779,7 @@ error:
 static void *read_thread(void *arg)
 {
 	struct xs_handle *h = arg;
-	int fd;
+	int fd, saved_errno;
 
 	while (read_message(h, 0) != -1)
 		continue;
@@ -1227,14 +1789,13 @@ static void *read_thread(void *arg)
 	 * it, or (more commonly) the other end has closed the connection.
 	 * Since further communication is unsafe, close the socket.
 	 */
+	saved_errno = errno;
 	fd = h->fd;
 	h->fd = -1;
 	close(fd);
 
 	/* wake up all waiters */
-	pthread_mutex_lock(&h->reply_mutex);
-	pthread_cond_broadcast(&h->reply_condvar);
-	pthread_mutex_unlock(&h->reply_mutex);
+	fail_pending(h, saved_errno);
 
 	pthread_mutex_lock(&h->watch_mutex);
 	pthread_cond_broadcast(&h->watch_condvar);
@@ -2008,6 +2008,9 @@ int domain_relinquish_resources(struct domain *d)
             ret = relinquish_shared_pages(d);
             if ( ret )
                 return ret;
+
+            /* A fork no longer needs its parent once its memory is gone. */
+            mem_sharing_fork_teardown(d);
         }
 
         d->arch.relmem = RELMEM_xen;
@@ -1286,6 +1286,148 @@ long arch_do_domctl(
         }
         break;
 
+    case XEN_DOMCTL_harvest_accessed:
+    {
+        struct xen_domctl_harvest_accessed *ha = &domctl->u.harvest_accessed;
+        unsigned long *bitmap, done = 0;
+        const unsigned long chunk = 8 * PAGE_SIZE;
+
+        ret = -EINVAL;
+        if ( d == currd || !has_hvm_container_domain(d) ||
+             (ha->flags & ~XEN_DOMCTL_HARVEST_ACCESSED_CLEAR) || ha->pad )
+            break;
+
+        ret = -ENOMEM;
+        bitmap = xmalloc_array(unsigned long, chunk / BITS_PER_LONG);
+        if ( !bitmap )
+            break;
+
+        ha->nr_accessed = 0;
+        ret = 0;
+        while ( done < ha->nr_gfns )
+        {
+            unsigned long nr = min_t(uint64_t, ha->nr_gfns - done, chunk);
+            long rc;
+
+            memset(bitmap, 0, chunk / 8);
+            rc = p2m_harvest_accessed(d, ha->start_gfn + done, nr, bitmap,
+                                      ha->flags &
+                                      XEN_DOMCTL_HARVEST_ACCESSED_CLEAR);
+            if ( rc < 0 )
+            {
+                ret = rc;
+                break;
+            }
+
+            if ( copy_to_guest_offset(ha->bitmap, done / 8,
+                                      (uint8_t *)bitmap,
+                                      DIV_ROUND_UP(nr, 8)) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+
+            ha->nr_accessed += rc;
+            done += nr;
+
+            if ( done < ha->nr_gfns && hypercall_preempt_check() )
+                break;
+        }
+
+        xfree(bitmap);
+        ha->nr_gfns = done;
+        copyback = 1;
+        break;
+    }
+
+    case XEN_DOMCTL_node_pages:
+    {
+        struct xen_domctl_node_pages *np = &domctl->u.node_pages;
+        unsigned long done = 0;
+
+        ret = -EINVAL;
+        if ( d == currd || !has_hvm_container_domain(d) || np->pad )
+            break;
+
+        switch ( np->op )
+        {
+        case XEN_DOMCTL_NODE_PAGES_COUNT:
+        {
+            const unsigned long chunk = 32768;
+            uint64_t *pages;
+
+            ret = -ENOMEM;
+            pages = xzalloc_array(uint64_t, MAX_NUMNODES);
+            if ( !pages )
+                break;
+
+            ret = 0;
+            while ( done < np->nr_gfns )
+            {
+                unsigned long nr = min_t(uint64_t, np->nr_gfns - done, chunk);
+
+                p2m_count_node_pages(d, np->start_gfn + done, nr, pages);
+                done += nr;
+
+                if ( done < np->nr_gfns && hypercall_preempt_check() )
+                    break;
+            }
+
+            if ( copy_to_guest(np->pages, pages,
+                               min_t(uint32_t, np->nr_nodes, MAX_NUMNODES)) )
+                ret = -EFAULT;
+
+            xfree(pages);
+            break;
+        }
+
+        case XEN_DOMCTL_NODE_PAGES_MIGRATE:
+        {
+            /* Keep each pause of the guest short. */
+            const unsigned long batch = 1024;
+
+            if ( np->node >= MAX_NUMNODES || !node_online(np->node) )
+                break;
+
+            ret = -EOPNOTSUPP;
+            if ( !hap_enabled(d) || need_iommu(d) )
+                break;
+
+            domain_pause(d);
+
+            np->nr_moved = 0;
+            ret = 0;
+            while ( done < np->nr_gfns )
+            {
+                unsigned long gfn = np->start_gfn + done;
+                unsigned int order;
+                int rc = p2m_migrate_gfn(d, gfn, np->node, &order);
+
+                if ( rc < 0 )
+                {
+                    ret = rc;
+                    break;
+                }
+
+                np->nr_moved += rc;
+                done += min_t(uint64_t, np->nr_gfns - done,
+                              (1UL << order) - (gfn & ((1UL << order) - 1)));
+
+                if ( done < np->nr_gfns &&
+                     (np->nr_moved >= batch || hypercall_preempt_check()) )
+                    break;
+            }
+
+            domain_unpause(d);
+            break;
+        }
+        }
+
+        np->nr_gfns = done;
+        copyback = 1;
+        break;
+    }
+
     default:
         ret = iommu_do_domctl(domctl, d, u_domctl);
         break;
@@ -5668,33 +5668,11 @@ static int hvm_allow_set_param(struct domain *d,
     return rc;
 }
 
-static int hvmop_set_param(
-    XEN_GUEST_HANDLE_PARAM(xen_hvm_param_t) arg)
+static int hvm_set_param(struct domain *d, uint32_t index, uint64_t value)
 {
-    struct domain *curr_d = current->domain;
-    struct xen_hvm_param a;
-    struct domain *d;
+    struct xen_hvm_param a = { .index = index, .value = value };
     struct vcpu *v;
-    int rc;
-
-    if ( copy_from_guest(&a, arg, 1) )
-        return -EFAULT;
-
-    if ( a.index >= HVM_NR_PARAMS )
-        return -EINVAL;
-
-    d = rcu_lock_domain_by_any_id(a.domid);
-    if ( d == NULL )
-        return -ESRCH;
-
-    rc = -EINVAL;
-    if ( !has_hvm_container_domain(d) ||
-         (is_pvh_domain(d) && (a.index != HVM_PARAM_CALLBACK_IRQ)) )
-        goto out;
-
-    rc = hvm_allow_set_param(d, &a);
-    if ( rc )
-        goto out;
+    int rc = 0;
 
     switch ( a.index )
     {
@@ -5741,9 +5719,6 @@ static int hvmop_set_param(
         domctl_lock_release();
         break;
     case HVM_PARAM_DM_DOMAIN:
-        if ( a.value == DOMID_SELF )
-            a.value = curr_d->domain_id;
-
         rc = hvm_set_dm_domain(d, a.value);
         break;
     case HVM_PARAM_ACPI_S_STATE:
@@ -5818,18 +5793,102 @@ static int hvmop_set_param(
     }
 
     if ( rc != 0 )
-        goto out;
+        return rc;
 
     d->arch.hvm_domain.params[a.index] = a.value;
 
     HVM_DBG_LOG(DBG_LEVEL_HCALL, "set param %u = %"PRIx64,
                 a.index, a.value);
 
+    return 0;
+}
+
+static int hvmop_set_param(
+    XEN_GUEST_HANDLE_PARAM(xen_hvm_param_t) arg)
+{
+    struct xen_hvm_param a;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&a, arg, 1) )
+        return -EFAULT;
+
+    if ( a.index >= HVM_NR_PARAMS )
+        return -EINVAL;
+
+    d = rcu_lock_domain_by_any_id(a.domid);
+    if ( d == NULL )
+        return -ESRCH;
+
+    rc = -EINVAL;
+    if ( !has_hvm_container_domain(d) ||
+         (is_pvh_domain(d) && (a.index != HVM_PARAM_CALLBACK_IRQ)) )
+        goto out;
+
+    rc = hvm_allow_set_param(d, &a);
+    if ( rc )
+        goto out;
+
+    if ( a.index == HVM_PARAM_DM_DOMAIN && a.value == DOMID_SELF )
+        a.value = current->domain->domain_id;
+
+    rc = hvm_set_param(d, a.index, a.value);
+
  out:
     rcu_unlock_domain(d);
     return rc;
 }
 
+/*
+ * Give @dst the HVM parameters and the full saved HVM state (vCPU
+ * registers, LAPICs, platform timers, ...) of @src.  Both domains must
+ * be paused.  Used to build VM forks.
+ */
+int hvm_copy_context_and_params(struct domain *dst, struct domain *src)
+{
+    struct hvm_domain_context c = { .size = hvm_save_size(src) };
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < HVM_NR_PARAMS; i++ )
+    {
+        uint64_t value = src->arch.hvm_domain.params[i];
+
+        switch ( i )
+        {
+        /* Tied to the source's event channels or current power state. */
+        case HVM_PARAM_BUFIOREQ_EVTCHN:
+        case HVM_PARAM_ACPI_S_STATE:
+            continue;
+        /* Picked up by the vCPUs when their state is loaded below. */
+        case HVM_PARAM_IDENT_PT:
+            dst->arch.hvm_domain.params[i] = value;
+            continue;
+        }
+
+        if ( value == 0 )
+            continue;
+
+        rc = hvm_set_param(dst, i, value);
+        if ( rc )
+            return rc;
+    }
+
+    if ( (c.data = xmalloc_bytes(c.size)) == NULL )
+        return -ENOMEM;
+
+    rc = hvm_save(src, &c);
+    if ( !rc )
+    {
+        c.size = c.cur;
+        c.cur = 0;
+        rc = hvm_load(dst, &c);
+    }
+
+    xfree(c.data);
+    return rc;
+}
+
 static int hvm_allow_get_param(struct domain *d,
                                const struct xen_hvm_param *a)
 {
@@ -1033,8 +1033,11 @@ err_out:
     return ret;
 }
 
-int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle_t sh,
-                            struct domain *cd, unsigned long cgfn) 
+/* lazy: cgfn is being filled in on demand for a VM fork. Holes read
+ * back with no access rights under EPT, so use the default instead. */
+static int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn,
+                                      shr_handle_t sh, struct domain *cd,
+                                      unsigned long cgfn, bool_t lazy)
 {
     struct page_info *spage;
     int ret = -EINVAL;
@@ -1078,7 +1081,8 @@ int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle
         goto err_unlock;
     }
 
-    ret = p2m_set_entry(p2m, cgfn, smfn, PAGE_ORDER_4K, p2m_ram_shared, a);
+    ret = p2m_set_entry(p2m, cgfn, smfn, PAGE_ORDER_4K, p2m_ram_shared,
+                        lazy ? p2m->default_access : a);
 
     /* Tempted to turn this into an assert */
     if ( ret )
@@ -1294,6 +1298,226 @@ int relinquish_shared_pages(struct domain *d)
     return rc;
 }
 
+/*
+ * VM forks.  A fork starts out with an empty p2m; every gfn is filled in
+ * from its parent the first time it is looked up with P2M_ALLOC (see
+ * __get_gfn_type_access()), so creating one costs only the vCPU and
+ * platform state.  Reads end up sharing the parent's page, writes (and
+ * pages that can't be shared) get a private copy.  The parent must not
+ * change underneath, so it is kept paused for as long as a fork exists.
+ */
+int mem_sharing_fork_page(struct domain *d, unsigned long gfn,
+                          bool_t unsharing)
+{
+    struct domain *pd = d->arch.hvm_domain.fork_parent;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct page_info *page, *new_page;
+    p2m_type_t p2mt;
+    shr_handle_t handle;
+    mfn_t new_mfn;
+    int rc;
+
+    ASSERT(gfn_locked_by_me(p2m, gfn));
+
+    if ( !pd || pd->is_dying )
+        return -ENOENT;
+
+    /* Leave MMIO, grant and other non-RAM holes of the parent alone. */
+    page = get_page_from_gfn(pd, gfn, &p2mt, P2M_ALLOC);
+    if ( !page )
+        return -ENOENT;
+    if ( !p2m_is_ram(p2mt) || is_xen_heap_page(page) )
+    {
+        put_page(page);
+        return -ENOENT;
+    }
+
+    if ( !unsharing )
+    {
+        /* Nomination needs the page free of our transient reference. */
+        put_page(page);
+
+        rc = mem_sharing_nominate_page(pd, gfn, 0, &handle);
+        if ( !rc )
+            rc = mem_sharing_add_to_physmap(pd, gfn, handle, d, gfn, 1);
+        if ( !rc )
+            return 0;
+
+        page = get_page_from_gfn(pd, gfn, &p2mt, P2M_ALLOC);
+        if ( !page )
+            return -ENOENT;
+    }
+
+    new_page = alloc_domheap_page(d, 0);
+    if ( !new_page )
+    {
+        put_page(page);
+        return -ENOMEM;
+    }
+    new_mfn = page_to_mfn(new_page);
+
+    copy_domain_page(mfn_x(new_mfn), __page_to_mfn(page));
+    put_page(page);
+
+    rc = p2m_set_entry(p2m, gfn, new_mfn, PAGE_ORDER_4K, p2m_ram_rw,
+                       p2m->default_access);
+    if ( rc )
+    {
+        if ( test_and_clear_bit(_PGC_allocated, &new_page->count_info) )
+            put_page(new_page);
+        return rc;
+    }
+
+    set_gpfn_from_mfn(mfn_x(new_mfn), gfn);
+    return 0;
+}
+
+/*
+ * The shared info page and any per-vCPU vcpu_info pages are Xen's view
+ * of the guest, so they can't be filled in lazily: give the fork its own,
+ * at the parent's gfns and with the parent's contents.  Must run before
+ * the vCPUs are brought up by loading the HVM context.
+ */
+static int fork_shared_info(struct domain *cd, struct domain *pd)
+{
+    unsigned long gfn = get_gpfn_from_mfn(virt_to_mfn(pd->shared_info));
+    struct vcpu *pv, *cv;
+    int rc;
+
+    copy_domain_page(virt_to_mfn(cd->shared_info),
+                     virt_to_mfn(pd->shared_info));
+
+    if ( VALID_M2P(gfn) )
+    {
+        rc = xenmem_add_to_physmap_one(cd, XENMAPSPACE_shared_info,
+                                       DOMID_INVALID, 0, gfn);
+        if ( rc )
+            return rc;
+    }
+
+    for_each_vcpu ( pd, pv )
+    {
+        unsigned long offset;
+        p2m_type_t p2mt;
+
+        cv = cd->vcpu[pv->vcpu_id];
+        if ( pv->vcpu_info_mfn == INVALID_MFN )
+            continue;
+
+        gfn = get_gpfn_from_mfn(pv->vcpu_info_mfn);
+        if ( !VALID_M2P(gfn) )
+            return -EINVAL;
+        offset = (unsigned long)pv->vcpu_info & ~PAGE_MASK;
+
+        /* A private copy, since Xen needs a writable mapping of it. */
+        get_gfn_unshare(cd, gfn, &p2mt);
+        put_gfn(cd, gfn);
+
+        rc = map_vcpu_info(cv, gfn, offset);
+        if ( rc )
+            return rc;
+        memcpy(cv->vcpu_info, pv->vcpu_info, sizeof(*cv->vcpu_info));
+    }
+
+    return 0;
+}
+
+/* Undo as much of fork_shared_info() as was done. */
+static void fork_shared_info_undo(struct domain *cd, struct domain *pd)
+{
+    unsigned long gfn = get_gpfn_from_mfn(virt_to_mfn(pd->shared_info));
+    struct vcpu *cv;
+    p2m_type_t p2mt;
+
+    for_each_vcpu ( cd, cv )
+    {
+        unsigned long info_gfn;
+
+        if ( cv->vcpu_info_mfn == INVALID_MFN )
+            continue;
+
+        info_gfn = get_gpfn_from_mfn(cv->vcpu_info_mfn);
+        unmap_vcpu_info(cv);
+        if ( VALID_M2P(info_gfn) )
+            guest_remove_page(cd, info_gfn);
+    }
+
+    if ( VALID_M2P(gfn) &&
+         mfn_x(get_gfn_query_unlocked(cd, gfn, &p2mt)) ==
+         virt_to_mfn(cd->shared_info) )
+        guest_physmap_remove_page(cd, gfn, virt_to_mfn(cd->shared_info), 0);
+}
+
+static int mem_sharing_fork(struct domain *pd, struct domain *cd)
+{
+    struct vcpu *pv;
+    uint64_t elapsed_nsec;
+    uint32_t tsc_mode, gtsc_khz, incarnation;
+    int rc;
+
+    if ( pd == cd || !hap_enabled(pd) || !hap_enabled(cd) )
+        return -EINVAL;
+
+    /* The parent's memory must not change while forks refer to it. */
+    if ( !pd->controller_pause_count )
+        return -EBUSY;
+
+    if ( cd->arch.hvm_domain.fork_parent || cd->tot_pages )
+        return -EEXIST;
+
+    if ( cd->max_vcpus != pd->max_vcpus )
+        return -EINVAL;
+    for_each_vcpu ( pd, pv )
+        if ( !cd->vcpu[pv->vcpu_id] )
+            return -EINVAL;
+
+    if ( need_iommu(pd) || need_iommu(cd) )
+        return -EXDEV;
+
+    pd->arch.hvm_domain.mem_sharing_enabled = 1;
+    cd->arch.hvm_domain.mem_sharing_enabled = 1;
+
+    /*
+     * From here on the fork fills in its memory from the parent.  The
+     * references are dropped by mem_sharing_fork_teardown() when the fork
+     * is destroyed, or right away if forking fails part-way.
+     */
+    get_knownalive_domain(pd);
+    domain_pause(pd);
+    cd->arch.hvm_domain.fork_parent = pd;
+
+    rc = fork_shared_info(cd, pd);
+    if ( !rc )
+    {
+        tsc_get_info(pd, &tsc_mode, &elapsed_nsec, &gtsc_khz, &incarnation);
+        tsc_set_info(cd, tsc_mode, elapsed_nsec, gtsc_khz, incarnation);
+        domain_set_time_offset(cd, pd->time_offset_seconds);
+
+        rc = hvm_copy_context_and_params(cd, pd);
+    }
+
+    if ( rc )
+    {
+        fork_shared_info_undo(cd, pd);
+        mem_sharing_fork_teardown(cd);
+    }
+
+    return rc;
+}
+
+void mem_sharing_fork_teardown(struct domain *d)
+{
+    struct domain *pd;
+
+    if ( !mem_sharing_is_fork(d) )
+        return;
+
+    pd = d->arch.hvm_domain.fork_parent;
+    d->arch.hvm_domain.fork_parent = NULL;
+    domain_unpause(pd);
+    put_domain(pd);
+}
+
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
 {
     int rc;
@@ -1315,6 +1539,28 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
     if ( rc )
         goto out;
 
+    if ( mso.op == XENMEM_sharing_op_fork )
+    {
+        struct domain *pd;
+
+        rc = -EINVAL;
+        if ( mso.u.fork._pad[0] || mso.u.fork._pad[1] ||
+             mso.u.fork._pad[2] )
+            goto out;
+
+        rc = rcu_lock_live_remote_domain_by_id(mso.u.fork.parent_domain,
+                                               &pd);
+        if ( rc )
+            goto out;
+
+        rc = xsm_mem_sharing_op(XSM_DM_PRIV, pd, d, mso.op);
+        if ( !rc )
+            rc = mem_sharing_fork(pd, d);
+
+        rcu_unlock_domain(pd);
+        goto out;
+    }
+
     /* Only HAP is supported */
     rc = -ENODEV;
     if ( !hap_enabled(d) || !d->arch.hvm_domain.mem_sharing_enabled )
@@ -1466,7 +1712,7 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
             sh      = mso.u.share.source_handle;
             cgfn    = mso.u.share.client_gfn;
 
-            rc = mem_sharing_add_to_physmap(d, sgfn, sh, cd, cgfn); 
+            rc = mem_sharing_add_to_physmap(d, sgfn, sh, cd, cgfn, 0);
 
             rcu_unlock_domain(cd);
         }
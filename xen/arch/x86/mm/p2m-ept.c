@@ -39,6 +39,8 @@
 
 #define is_epte_present(ept_entry)      ((ept_entry)->epte & 0x7)
 #define is_epte_superpage(ept_entry)    ((ept_entry)->sp)
+#define EPTE_A_SHIFT                    8
+
 static inline bool_t is_epte_valid(ept_entry_t *e)
 {
     return (e->epte != 0 && e->sa_p2mt != p2m_invalid);
@@ -1089,6 +1091,80 @@ void ept_sync_domain(struct p2m_domain *p2m)
                      __ept_sync_domain, p2m, 1);
 }
 
+/*
+ * Walk the leaf entries covering [gfn, gfn + nr), recording in @bitmap
+ * those whose accessed bit is set and, if @clear, atomically clearing it so
+ * that the next walk only reports accesses made in between.  A superpage
+ * only has one accessed bit, which is reported for all of its gfns.
+ */
+static unsigned long ept_harvest_accessed(struct p2m_domain *p2m,
+                                          unsigned long gfn,
+                                          unsigned long nr,
+                                          unsigned long *bitmap,
+                                          bool_t clear)
+{
+    struct ept_data *ept = &p2m->ept;
+    unsigned long done = 0, accessed = 0;
+    bool_t flush = 0;
+
+    ASSERT(p2m_locked_by_me(p2m));
+
+    while ( done < nr && gfn + done <= p2m->max_mapped_pfn )
+    {
+        ept_entry_t *table =
+            map_domain_page(pagetable_get_pfn(p2m_get_pagetable(p2m)));
+        unsigned long gfn_remainder = gfn + done;
+        unsigned long span;
+        unsigned int index;
+        int i;
+
+        for ( i = ept_get_wl(ept); i > 0; i-- )
+            if ( ept_next_level(p2m, 1, &table, &gfn_remainder, i) !=
+                 GUEST_TABLE_NORMAL_PAGE )
+                break;
+
+        /*
+         * Entry @index at level @i is either a leaf or not present.  Carry
+         * on through the rest of this table until hitting an entry which
+         * needs walking further down.
+         */
+        span = 1UL << (i * EPT_TABLE_ORDER);
+        for ( index = gfn_remainder >> (i * EPT_TABLE_ORDER);
+              index < EPT_PAGETABLE_ENTRIES && done < nr; index++ )
+        {
+            ept_entry_t *e = table + index;
+            unsigned long count =
+                min(span - ((gfn + done) & (span - 1)), nr - done);
+
+            if ( i && is_epte_present(e) && !is_epte_superpage(e) )
+                break;
+
+            if ( is_epte_present(e) && e->a )
+            {
+                if ( clear )
+                {
+                    test_and_clear_bit(EPTE_A_SHIFT, &e->epte);
+                    flush = 1;
+                }
+
+                accessed += count;
+                while ( count-- )
+                    __set_bit(done++, bitmap);
+            }
+            else
+                done += count;
+        }
+
+        unmap_domain_page(table);
+    }
+
+    /* Cached translations would hide further accesses. */
+    if ( flush )
+        ept_sync_domain(p2m);
+
+    return accessed;
+}
+
 static void ept_enable_pml(struct p2m_domain *p2m)
 {
     /*
@@ -1126,10 +1202,18 @@ int ept_p2m_init(struct p2m_domain *p2m)
     /* set EPT page-walk length, now it's actual walk length - 1, i.e. 3 */
     ept->ept_wl = 3;
 
+    /*
+     * Enable EPT A/D bits if we are going to use PML, or if asked to so that
+     * accessed bits can be harvested.
+     */
+    if ( cpu_has_vmx_pml || (opt_ept_ad && cpu_has_vmx_ept_ad) )
+    {
+        ept->ept_ad = 1;
+        p2m->harvest_accessed = ept_harvest_accessed;
+    }
+
     if ( cpu_has_vmx_pml )
     {
-        /* Enable EPT A/D bits if we are going to use PML. */
-        ept->ept_ad = cpu_has_vmx_pml ? 1 : 0;
         p2m->enable_hardware_log_dirty = ept_enable_pml;
         p2m->disable_hardware_log_dirty = ept_disable_pml;
         p2m->flush_hardware_cached_dirty = ept_flush_pml_buffers;
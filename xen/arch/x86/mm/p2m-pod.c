@@ -23,6 +23,7 @@
 #include <xen/iommu.h>
 #include <xen/vm_event.h>
 #include <xen/event.h>
+#include <xen/softirq.h>
 #include <public/vm_event.h>
 #include <asm/domain.h>
 #include <asm/page.h>
@@ -641,6 +642,14 @@ void p2m_pod_dump_data(struct domain *d)
 
     printk("    PoD entries=%ld cachesize=%ld\n",
            p2m->pod.entry_count, p2m->pod.count);
+    printk("    PoD reclaim: runs=%lu single=%lu super=%lu"
+           " time=%"PRI_stime"us max=%"PRI_stime"us\n",
+           p2m->pod.stats.bg_runs, p2m->pod.stats.bg_single,
+           p2m->pod.stats.bg_super, p2m->pod.stats.bg_time / MICROSECS(1),
+           p2m->pod.stats.bg_max / MICROSECS(1));
+    printk("    PoD sweeps=%lu time=%"PRI_stime"us max=%"PRI_stime"us\n",
+           p2m->pod.stats.sweeps, p2m->pod.stats.sweep_time / MICROSECS(1),
+           p2m->pod.stats.sweep_max / MICROSECS(1));
 }
 
 
@@ -976,6 +985,170 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 
 }
 
+/*
+ * Background reclaim.
+ *
+ * Once the cache runs low, waiting for it to run dry means that the next
+ * fault has to do an emergency sweep on the faulting vcpu.  Instead, kick
+ * a tasklet which scans the p2m in superpage-sized chunks (trying a
+ * superpage reclaim first, then 4k pages) until the cache is back above a
+ * high watermark or a per-run budget is exhausted.  Runs are throttled by
+ * a timer so that the guest is never starved by its own reclaimer.
+ */
+static bool_t __read_mostly opt_pod_reclaim = 1;
+boolean_param("pod_reclaim", opt_pod_reclaim);
+
+/* Minimum time between two background runs, in milliseconds */
+static unsigned int __read_mostly opt_pod_reclaim_interval = 10;
+integer_param("pod_reclaim_interval", opt_pod_reclaim_interval);
+
+#define POD_RECLAIM_LOW_WATER   (16 * SUPERPAGE_PAGES)
+#define POD_RECLAIM_HIGH_WATER  (64 * SUPERPAGE_PAGES)
+#define POD_RECLAIM_BUDGET      (64 * SUPERPAGE_PAGES) /* gfns per run */
+
+/* Is there outstanding PoD debt not covered by a healthy cache? */
+static inline bool_t
+p2m_pod_reclaim_wanted(struct p2m_domain *p2m, long water)
+{
+    return p2m->pod.entry_count > p2m->pod.count && p2m->pod.count < water;
+}
+
+/* Scan one superpage-aligned chunk.  Must be called w/ p2m and pod locks
+ * held. */
+static void
+p2m_pod_reclaim_chunk(struct p2m_domain *p2m, unsigned long gfn)
+{
+    unsigned long gfns[POD_SWEEP_STRIDE];
+    unsigned int i, j = 0;
+    long before = p2m->pod.count;
+    p2m_access_t a;
+    p2m_type_t t;
+
+    ASSERT(superpage_aligned(gfn));
+
+    (void)p2m->get_entry(p2m, gfn, &t, &a, 0, NULL);
+    if ( p2m_is_ram(t) && p2m_pod_zero_check_superpage(p2m, gfn) )
+    {
+        p2m->pod.stats.bg_super += SUPERPAGE_PAGES;
+        return;
+    }
+
+    for ( i = 0; i < SUPERPAGE_PAGES; i++ )
+    {
+        (void)p2m->get_entry(p2m, gfn + i, &t, &a, 0, NULL);
+        if ( !p2m_is_ram(t) )
+            continue;
+        gfns[j++] = gfn + i;
+        if ( j == POD_SWEEP_STRIDE )
+        {
+            p2m_pod_zero_check(p2m, gfns, j);
+            j = 0;
+        }
+    }
+
+    if ( j )
+        p2m_pod_zero_check(p2m, gfns, j);
+
+    p2m->pod.stats.bg_single += p2m->pod.count - before;
+}
+
+static void
+p2m_pod_reclaim_tasklet(unsigned long data)
+{
+    struct p2m_domain *p2m = (struct p2m_domain *)data;
+    struct domain *d = p2m->domain;
+    unsigned long scanned;
+    s_time_t start = NOW(), elapsed;
+
+    for ( scanned = 0; scanned < POD_RECLAIM_BUDGET;
+          scanned += SUPERPAGE_PAGES )
+    {
+        unsigned long gfn;
+
+        p2m_lock(p2m);
+        pod_lock(p2m);
+
+        if ( d->is_dying ||
+             !p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_HIGH_WATER) )
+        {
+            pod_unlock(p2m);
+            p2m_unlock(p2m);
+            break;
+        }
+
+        /* Walk downwards from the top of the p2m, wrapping around. */
+        if ( p2m->pod.reclaim_gfn == 0 ||
+             p2m->pod.reclaim_gfn > p2m->max_mapped_pfn )
+            p2m->pod.reclaim_gfn = p2m->max_mapped_pfn | (SUPERPAGE_PAGES - 1);
+        gfn = p2m->pod.reclaim_gfn & ~(SUPERPAGE_PAGES - 1UL);
+        p2m->pod.reclaim_gfn = gfn ? gfn - 1 : 0;
+
+        p2m_pod_reclaim_chunk(p2m, gfn);
+
+        pod_unlock(p2m);
+        p2m_unlock(p2m);
+
+        process_pending_softirqs();
+    }
+
+    elapsed = NOW() - start;
+
+    pod_lock(p2m);
+    p2m->pod.stats.bg_runs++;
+    p2m->pod.stats.bg_time += elapsed;
+    if ( elapsed > p2m->pod.stats.bg_max )
+        p2m->pod.stats.bg_max = elapsed;
+    p2m->pod.reclaim_next = NOW() + MILLISECS(opt_pod_reclaim_interval);
+    /* Still short once the budget is used up?  Come back later. */
+    p2m->pod.reclaim_pending = !d->is_dying &&
+        p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_HIGH_WATER);
+    if ( p2m->pod.reclaim_pending )
+        set_timer(&p2m->pod.reclaim_timer, p2m->pod.reclaim_next);
+    pod_unlock(p2m);
+}
+
+static void
+p2m_pod_reclaim_timer_fn(void *data)
+{
+    struct p2m_domain *p2m = data;
+
+    tasklet_schedule(&p2m->pod.reclaim_tasklet);
+}
+
+/* Schedule a background run if the cache is low.  Must be called w/ pod
+ * lock held. */
+static void
+p2m_pod_reclaim_kick(struct p2m_domain *p2m)
+{
+    ASSERT(pod_locked_by_me(p2m));
+
+    if ( !opt_pod_reclaim || p2m->pod.reclaim_pending ||
+         !p2m_pod_reclaim_wanted(p2m, POD_RECLAIM_LOW_WATER) )
+        return;
+
+    p2m->pod.reclaim_pending = 1;
+    if ( NOW() >= p2m->pod.reclaim_next )
+        tasklet_schedule(&p2m->pod.reclaim_tasklet);
+    else
+        set_timer(&p2m->pod.reclaim_timer, p2m->pod.reclaim_next);
+}
+
+void
+p2m_pod_reclaim_init(struct p2m_domain *p2m)
+{
+    tasklet_init(&p2m->pod.reclaim_tasklet, p2m_pod_reclaim_tasklet,
+                 (unsigned long)p2m);
+    init_timer(&p2m->pod.reclaim_timer, p2m_pod_reclaim_timer_fn, p2m,
+               smp_processor_id());
+}
+
+void
+p2m_pod_reclaim_teardown(struct p2m_domain *p2m)
+{
+    kill_timer(&p2m->pod.reclaim_timer);
+    tasklet_kill(&p2m->pod.reclaim_tasklet);
+}
+
 int
 p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
                         unsigned int order,
@@ -1019,8 +1192,18 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     /* Only sweep if we're actually out of memory.  Doing anything else
      * causes unnecessary time and fragmentation of superpages in the p2m. */
     if ( p2m->pod.count == 0 )
+    {
+        s_time_t start = NOW(), elapsed;
+
         p2m_pod_emergency_sweep(p2m);
 
+        elapsed = NOW() - start;
+        p2m->pod.stats.sweeps++;
+        p2m->pod.stats.sweep_time += elapsed;
+        if ( elapsed > p2m->pod.stats.sweep_max )
+            p2m->pod.stats.sweep_max = elapsed;
+    }
+
     /* If the sweep failed, give up. */
     if ( p2m->pod.count == 0 )
         goto out_of_memory;
@@ -1073,6 +1256,9 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
          && (q & P2M_ALLOC) )
         p2m_pod_check_last_super(p2m, gfn_aligned);
 
+    /* Refill the cache in the background before it runs dry. */
+    p2m_pod_reclaim_kick(p2m);
+
     pod_unlock(p2m);
     return 0;
 out_of_memory:
@@ -122,6 +122,7 @@ static int p2m_init_hostp2m(struct domain *d)
                                             RANGESETF_prettyprint_hex);
         if ( p2m->logdirty_ranges )
         {
+            p2m_pod_reclaim_init(p2m);
             d->arch.p2m = p2m;
             return 0;
         }
@@ -137,6 +138,7 @@ static void p2m_teardown_hostp2m(struct domain *d)
 
     if ( p2m )
     {
+        p2m_pod_reclaim_teardown(p2m);
         rangeset_destroy(p2m->logdirty_ranges);
         p2m_free_one(p2m);
         d->arch.p2m = NULL;
@@ -275,6 +277,216 @@ void p2m_flush_hardware_cached_dirty(struct domain *d)
     }
 }
 
+long p2m_harvest_accessed(struct domain *d, unsigned long gfn,
+                          unsigned long nr, unsigned long *bitmap,
+                          bool_t clear)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long accessed;
+
+    if ( !p2m->harvest_accessed )
+        return -EOPNOTSUPP;
+
+    p2m_lock(p2m);
+    accessed = p2m->harvest_accessed(p2m, gfn, nr, bitmap, clear);
+    p2m_unlock(p2m);
+
+    return accessed;
+}
+
+void p2m_count_node_pages(struct domain *d, unsigned long gfn,
+                          unsigned long nr, uint64_t *pages)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long end = gfn + nr;
+
+    p2m_lock(p2m);
+    while ( gfn < end )
+    {
+        unsigned long mask, count;
+        unsigned int order;
+        p2m_type_t t;
+        p2m_access_t a;
+        mfn_t mfn;
+
+        mfn = p2m->get_entry(p2m, gfn, &t, &a, 0, &order);
+        mask = (1UL << order) - 1;
+        count = min((gfn | mask) + 1, end) - gfn;
+
+        /* An extent never straddles a node boundary. */
+        if ( p2m_is_ram(t) && mfn_valid(mfn) )
+            pages[phys_to_nid(pfn_to_paddr(mfn_x(mfn)))] += count;
+
+        gfn += count;
+    }
+    p2m_unlock(p2m);
+}
+
+/* Free a page taken with steal_page(), which still has PGC_allocated. */
+static void p2m_free_stolen(struct page_info *page)
+{
+    if ( !test_and_clear_bit(_PGC_allocated, &page->count_info) )
+        BUG();
+    put_page(page);
+}
+
+/* Give pages taken with steal_page() back to their domain. */
+static void p2m_return_stolen(struct domain *d, struct page_info *page,
+                              unsigned long nr)
+{
+    unsigned long i;
+
+    for ( i = 0; i < nr; i++ )
+        if ( assign_pages(d, page + i, 0, MEMF_no_refcount) )
+            p2m_free_stolen(page + i);
+}
+
+/*
+ * Copy the 2^order pages mapped at gfn from mfn to new_page and map those
+ * instead.  Returns the number of pages moved, 0 if any of them is in use
+ * by someone other than the guest (new_page is then freed), or a negative
+ * errno.
+ */
+static int p2m_move_pages(struct domain *d, struct p2m_domain *p2m,
+                          unsigned long gfn, unsigned long mfn,
+                          struct page_info *new_page, unsigned int order,
+                          p2m_type_t t, p2m_access_t a)
+{
+    struct page_info *page = __mfn_to_page(mfn);
+    unsigned long i, nr = 1UL << order, new_mfn = __page_to_mfn(new_page);
+    int rc;
+
+    /*
+     * Only pages the guest alone holds a reference to can be moved: anyone
+     * else (grant and foreign mappings, Xen's own mappings of ring pages
+     * and the like) knows the page by its mfn.  Check without the lock
+     * first, as steal_page() is noisy about failures.
+     */
+    for ( i = 0; i < nr; i++ )
+        if ( (page[i].count_info & (PGC_count_mask | PGC_allocated)) !=
+             (1 | PGC_allocated) )
+            break;
+    if ( i == nr )
+        for ( i = 0; i < nr; i++ )
+            if ( steal_page(d, page + i, MEMF_no_refcount) )
+                break;
+    if ( i < nr )
+    {
+        p2m_return_stolen(d, page, i);
+        free_domheap_pages(new_page, order);
+        return 0;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        copy_domain_page(new_mfn + i, mfn + i);
+
+    if ( assign_pages(d, new_page, order, MEMF_no_refcount) )
+    {
+        free_domheap_pages(new_page, order);
+        p2m_return_stolen(d, page, nr);
+        return -ESRCH;
+    }
+
+    rc = p2m_set_entry(p2m, gfn, _mfn(new_mfn), order, t, a);
+    if ( rc )
+    {
+        for ( i = 0; i < nr; i++ )
+            if ( !steal_page(d, new_page + i, MEMF_no_refcount) )
+                p2m_free_stolen(new_page + i);
+        p2m_return_stolen(d, page, nr);
+        return rc;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        set_gpfn_from_mfn(new_mfn + i, gfn + i);
+        paging_mark_dirty(d, new_mfn + i);
+        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+        p2m_free_stolen(page + i);
+    }
+
+    return nr;
+}
+
+int p2m_migrate_gfn(struct domain *d, unsigned long gfn, nodeid_t node,
+                    unsigned int *order)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct page_info *new_page;
+    unsigned long i, nr, base_gfn, mfn, moved = 0;
+    p2m_type_t t;
+    p2m_access_t a;
+    mfn_t omfn;
+    int rc = 0;
+
+    gfn_lock(p2m, gfn, 0);
+
+    omfn = p2m->get_entry(p2m, gfn, &t, &a, 0, order);
+    if ( t != p2m_ram_rw || !mfn_valid(omfn) ||
+         phys_to_nid(pfn_to_paddr(mfn_x(omfn))) == node )
+        goto out;
+
+    /* 1G mappings are moved as 2M pieces. */
+    if ( *order > PAGE_ORDER_2M )
+        *order = PAGE_ORDER_2M;
+
+    nr = 1UL << *order;
+    base_gfn = gfn & ~(nr - 1);
+    mfn = mfn_x(omfn) - (gfn - base_gfn);
+
+    /*
+     * Move a superpage as a whole if the node has a free extent of the
+     * same size, so that the guest keeps its large mappings.
+     */
+    if ( *order )
+    {
+        new_page = alloc_domheap_pages(NULL, *order,
+                                       MEMF_node(node) | MEMF_exact_node);
+        if ( new_page )
+        {
+            rc = p2m_move_pages(d, p2m, base_gfn, mfn, new_page, *order, t, a);
+            if ( rc )
+                goto out;
+        }
+    }
+
+    /*
+     * Otherwise split it, moving the pages from gfn to the end of the
+     * extent one at a time and leaving those in use by others behind.
+     */
+    for ( i = gfn - base_gfn; i < nr; i++ )
+    {
+        new_page = alloc_domheap_page(NULL, MEMF_node(node) | MEMF_exact_node);
+        if ( !new_page )
+        {
+            rc = -ENOMEM;
+            break;
+        }
+
+        rc = p2m_move_pages(d, p2m, base_gfn + i, mfn + i, new_page,
+                            PAGE_ORDER_4K, t, a);
+        if ( rc < 0 )
+            break;
+        moved += rc;
+    }
+
+    /*
+     * Report what was moved before a failure; the moved pages are skipped
+     * when the caller comes back to the next gfn, and the failure recurs.
+     */
+    if ( rc < 0 && moved )
+    {
+        *order = PAGE_ORDER_4K;
+        rc = 0;
+    }
+    if ( rc >= 0 )
+        rc = moved;
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+    return rc;
+}
+
 mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn,
                     p2m_type_t *t, p2m_access_t *a, p2m_query_t q,
                     unsigned int *page_order, bool_t locked)
@@ -299,6 +511,13 @@ mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn,
 
     mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order);
 
+    /* Fill in holes of a VM fork from its parent on first use. */
+    if ( locked && (q & P2M_ALLOC) && p2m_is_hostp2m(p2m) &&
+         (*t == p2m_invalid || *t == p2m_mmio_dm) &&
+         mem_sharing_is_fork(p2m->domain) &&
+         !mem_sharing_fork_page(p2m->domain, gfn, !!(q & P2M_UNSHARE)) )
+        mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order);
+
     if ( (q & P2M_UNSHARE) && p2m_is_shared(*t) )
     {
         ASSERT(p2m_is_hostp2m(p2m));
@@ -372,7 +591,8 @@ struct page_info *get_page_from_gfn_p2m(
             return page;
 
         /* Error path: not a suitable GFN at all */
-        if ( !p2m_is_ram(*t) && !p2m_is_paging(*t) && !p2m_is_pod(*t) )
+        if ( !p2m_is_ram(*t) && !p2m_is_paging(*t) && !p2m_is_pod(*t) &&
+             !((q & P2M_ALLOC) && mem_sharing_is_fork(d)) )
             return NULL;
     }
 
@@ -381,7 +601,9 @@ struct page_info *get_page_from_gfn_p2m(
     if ( p2m_is_ram(*t) && mfn_valid(mfn) )
     {
         page = mfn_to_page(mfn);
-        if ( !get_page(page, d) )
+        if ( !get_page(page, d)
+             /* Page could be shared, e.g. just filled in for a fork */
+             && !get_page(page, dom_cow) )
             page = NULL;
     }
     put_gfn(d, gfn);
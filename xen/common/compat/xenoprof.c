@@ -27,6 +27,10 @@ CHECK_TYPE(domid);
 CHECK_oprof_passive;
 #undef xen_oprof_passive
 
+#define xen_oprof_xen_buffer xenoprof_xen_buffer
+CHECK_oprof_xen_buffer;
+#undef xen_oprof_xen_buffer
+
 #define xenoprof_counter compat_oprof_counter
 
 #include "../xenoprof.c"
@@ -1183,13 +1183,11 @@ void destroy_ring_for_helper(
     }
 }
 
-int prepare_ring_for_helper(
-    struct domain *d, unsigned long gmfn, struct page_info **_page,
-    void **_va)
+int get_ring_page_for_helper(
+    struct domain *d, unsigned long gmfn, struct page_info **_page)
 {
     struct page_info *page;
     p2m_type_t p2mt;
-    void *va;
 
     page = get_page_from_gfn(d, gmfn, &p2mt, P2M_UNSHARE);
 
@@ -1220,6 +1218,23 @@ int prepare_ring_for_helper(
         return -EINVAL;
     }
 
+    *_page = page;
+
+    return 0;
+}
+
+int prepare_ring_for_helper(
+    struct domain *d, unsigned long gmfn, struct page_info **_page,
+    void **_va)
+{
+    struct page_info *page;
+    void *va;
+    int rc;
+
+    rc = get_ring_page_for_helper(d, gmfn, &page);
+    if ( rc )
+        return rc;
+
     va = __map_domain_page_global(page);
     if ( va == NULL )
     {
@@ -6,6 +6,9 @@
 #include <xen/spinlock.h>
 #include <xen/guest_access.h>
 #include <xen/preempt.h>
+#include <xen/init.h>
+#include <xen/kernel.h>
+#include <xen/percpu.h>
 #include <public/sysctl.h>
 #include <asm/processor.h>
 #include <asm/atomic.h>
@@ -115,23 +118,183 @@ void spin_debug_disable(void)
 
 #endif
 
+/*
+ * Lock contention statistics.
+ *
+ * Unlike LOCK_PROFILE these are cheap enough to be always enabled.  An
+ * acquisition records where the lock was taken, in the lock itself, and
+ * bumps a per-CPU counter so that one acquisition in lock_stats_rate gets
+ * accounted to the acquiring location.  Only contended acquisitions, which
+ * are spinning anyway, get timed, and those are all accounted in full along
+ * with where whoever we waited for took the lock.
+ */
+static bool_t __initdata opt_lock_stats = 1;
+boolean_param("lock_stats", opt_lock_stats);
+static unsigned int __read_mostly lock_stats_rate = 64;
+integer_param("lock_stats_rate", lock_stats_rate);
+
+static bool_t __read_mostly lock_stats_active;
+
+#define LOCK_STATS_ORDER   9
+#define LOCK_STATS_CLASSES (1u << LOCK_STATS_ORDER)
+#define LOCK_STATS_PROBES  16
+
+/* Everything about the locks taken at one location (site). */
+struct lock_stats_class {
+    unsigned long site;
+    unsigned long lock;
+    unsigned int flags;
+    u64 acquired;
+    u64 contended;
+    u64 wait_time;
+    u64 wait_max;
+    u64 wait_hist[XEN_SYSCTL_LOCKSTAT_BUCKETS];
+    u32 holder[XEN_SYSCTL_LOCKSTAT_HOLDERS];
+    u64 holder_cnt[XEN_SYSCTL_LOCKSTAT_HOLDERS];
+};
+
+static struct lock_stats_class lock_stats[LOCK_STATS_CLASSES];
+static u64 lock_stats_overflow;
+static s_time_t lock_stats_start;
+static DEFINE_PER_CPU(unsigned int, lock_stats_count);
+
+/* Look up, or claim, the class of @site in a lockless open hash table. */
+static struct lock_stats_class *lock_stats_class(unsigned long site,
+                                                 unsigned int flags)
+{
+    unsigned int i, idx = ((u32)site * 0x9e3779b1u) >> (32 - LOCK_STATS_ORDER);
+
+    for ( i = 0; i < LOCK_STATS_PROBES; i++ )
+    {
+        struct lock_stats_class *c =
+            &lock_stats[(idx + i) & (LOCK_STATS_CLASSES - 1)];
+        unsigned long s = read_atomic(&c->site);
+
+        if ( s == 0 )
+        {
+            s = cmpxchg(&c->site, 0, site);
+            if ( s == 0 )
+            {
+                c->flags = flags;
+                return c;
+            }
+        }
+        if ( s == site )
+            return c;
+    }
+
+    arch_fetch_and_add(&lock_stats_overflow, 1);
+    return NULL;
+}
+
+static void lock_stats_sample(unsigned long site, unsigned int flags)
+{
+    struct lock_stats_class *c = lock_stats_class(site, flags);
+
+    if ( c )
+        arch_fetch_and_add(&c->acquired, lock_stats_rate);
+}
+
+static void lock_stats_contended(const void *lock, unsigned long site,
+                                 unsigned int flags, s_time_t wait,
+                                 u32 holder)
+{
+    struct lock_stats_class *c = lock_stats_class(site, flags);
+    u64 max, old;
+    unsigned int i;
+
+    if ( !c )
+        return;
+
+    if ( wait < 0 )
+        wait = 0;
+
+    write_atomic(&c->lock, (unsigned long)lock);
+    arch_fetch_and_add(&c->contended, 1);
+    arch_fetch_and_add(&c->wait_time, wait);
+    for ( max = read_atomic(&c->wait_max); wait > max; max = old )
+    {
+        old = cmpxchg(&c->wait_max, max, wait);
+        if ( old == max )
+            break;
+    }
+
+    for ( i = 0; i < XEN_SYSCTL_LOCKSTAT_BUCKETS - 1 &&
+                 (wait >> (XEN_SYSCTL_LOCKSTAT_BUCKET_SHIFT + i)); i++ )
+        continue;
+    arch_fetch_and_add(&c->wait_hist[i], 1);
+
+    if ( !holder )
+        return;
+    for ( i = 0; i < XEN_SYSCTL_LOCKSTAT_HOLDERS; i++ )
+    {
+        u32 h = read_atomic(&c->holder[i]);
+
+        if ( h == 0 )
+            h = cmpxchg(&c->holder[i], 0, holder) ?: holder;
+        if ( h == holder )
+        {
+            arch_fetch_and_add(&c->holder_cnt[i], 1);
+            break;
+        }
+    }
+}
+
+static always_inline void lock_stats_got(
+    const void *lock, u32 *holder, unsigned int flags, unsigned long site,
+    s_time_t block, u32 blocker)
+{
+    if ( !lock_stats_active )
+        return;
+
+    if ( holder )
+        *holder = site - (unsigned long)_stext;
+
+    if ( unlikely(++this_cpu(lock_stats_count) >= lock_stats_rate) )
+    {
+        this_cpu(lock_stats_count) = 0;
+        lock_stats_sample(site, flags);
+    }
+
+    if ( unlikely(block) )
+        lock_stats_contended(lock, site, flags, NOW() - block, blocker);
+}
+
+#define LOCK_STATS_VAR      s_time_t stats_block = 0; u32 stats_blocker = 0
+#define LOCK_STATS_BLOCK(h)                                                  \
+    if ( lock_stats_active && !stats_block )                                 \
+    {                                                                        \
+        stats_block = NOW();                                                 \
+        stats_blocker = (h);                                                 \
+    }
+#define LOCK_STATS_GOT(l, h, f)                                              \
+    lock_stats_got(l, h, f, (unsigned long)__builtin_return_address(0),      \
+                   stats_block, stats_blocker)
+#define LOCK_STATS_SPIN_GOT(l)  LOCK_STATS_GOT(l, &(l)->holder, 0)
+#define LOCK_STATS_RW_GOT(l)                                                 \
+    LOCK_STATS_GOT(l, NULL, XEN_SYSCTL_LOCKSTAT_RWLOCK)
+
 void _spin_lock(spinlock_t *lock)
 {
+    LOCK_STATS_VAR;
     LOCK_PROFILE_VAR;
 
     check_lock(&lock->debug);
     while ( unlikely(!_raw_spin_trylock(&lock->raw)) )
     {
         LOCK_PROFILE_BLOCK;
+        LOCK_STATS_BLOCK(lock->holder);
         while ( likely(_raw_spin_is_locked(&lock->raw)) )
             cpu_relax();
     }
     LOCK_PROFILE_GOT;
+    LOCK_STATS_SPIN_GOT(lock);
     preempt_disable();
 }
 
 void _spin_lock_irq(spinlock_t *lock)
 {
+    LOCK_STATS_VAR;
     LOCK_PROFILE_VAR;
 
     ASSERT(local_irq_is_enabled());
@@ -140,18 +303,21 @@ void _spin_lock_irq(spinlock_t *lock)
     while ( unlikely(!_raw_spin_trylock(&lock->raw)) )
     {
         LOCK_PROFILE_BLOCK;
+        LOCK_STATS_BLOCK(lock->holder);
         local_irq_enable();
         while ( likely(_raw_spin_is_locked(&lock->raw)) )
             cpu_relax();
         local_irq_disable();
     }
     LOCK_PROFILE_GOT;
+    LOCK_STATS_SPIN_GOT(lock);
     preempt_disable();
 }
 
 unsigned long _spin_lock_irqsave(spinlock_t *lock)
 {
     unsigned long flags;
+    LOCK_STATS_VAR;
     LOCK_PROFILE_VAR;
 
     local_irq_save(flags);
@@ -159,12 +325,14 @@ unsigned long _spin_lock_irqsave(spinlock_t *lock)
     while ( unlikely(!_raw_spin_trylock(&lock->raw)) )
     {
         LOCK_PROFILE_BLOCK;
+        LOCK_STATS_BLOCK(lock->holder);
         local_irq_restore(flags);
         while ( likely(_raw_spin_is_locked(&lock->raw)) )
             cpu_relax();
         local_irq_disable();
     }
     LOCK_PROFILE_GOT;
+    LOCK_STATS_SPIN_GOT(lock);
     preempt_disable();
     return flags;
 }
@@ -198,7 +366,8 @@ int _spin_is_locked(spinlock_t *lock)
     return _raw_spin_is_locked(&lock->raw);
 }
 
-int _spin_trylock(spinlock_t *lock)
+static always_inline int spin_trylock_site(spinlock_t *lock,
+                                           unsigned long site)
 {
     check_lock(&lock->debug);
     if ( !_raw_spin_trylock(&lock->raw) )
@@ -207,10 +376,16 @@ int _spin_trylock(spinlock_t *lock)
     if (lock->profile)
         lock->profile->time_locked = NOW();
 #endif
+    lock_stats_got(lock, &lock->holder, 0, site, 0, 0);
     preempt_disable();
     return 1;
 }
 
+int _spin_trylock(spinlock_t *lock)
+{
+    return spin_trylock_site(lock, (unsigned long)__builtin_return_address(0));
+}
+
 void _spin_barrier(spinlock_t *lock)
 {
 #ifdef LOCK_PROFILE
@@ -231,7 +406,8 @@ void _spin_barrier(spinlock_t *lock)
     smp_mb();
 }
 
-int _spin_trylock_recursive(spinlock_t *lock)
+static always_inline int spin_trylock_recursive_site(spinlock_t *lock,
+                                                     unsigned long site)
 {
     int cpu = smp_processor_id();
 
@@ -242,7 +418,7 @@ int _spin_trylock_recursive(spinlock_t *lock)
 
     if ( likely(lock->recurse_cpu != cpu) )
     {
-        if ( !spin_trylock(lock) )
+        if ( !spin_trylock_site(lock, site) )
             return 0;
         lock->recurse_cpu = cpu;
     }
@@ -254,10 +430,27 @@ int _spin_trylock_recursive(spinlock_t *lock)
     return 1;
 }
 
+int _spin_trylock_recursive(spinlock_t *lock)
+{
+    return spin_trylock_recursive_site(
+        lock, (unsigned long)__builtin_return_address(0));
+}
+
 void _spin_lock_recursive(spinlock_t *lock)
 {
-    while ( !spin_trylock_recursive(lock) )
+    unsigned long site = (unsigned long)__builtin_return_address(0);
+    LOCK_STATS_VAR;
+
+    while ( !spin_trylock_recursive_site(lock, site) )
+    {
+        LOCK_STATS_BLOCK(lock->holder);
         cpu_relax();
+    }
+
+    /* The acquisition itself was accounted by the trylock. */
+    if ( unlikely(stats_block) )
+        lock_stats_contended(lock, site, 0, NOW() - stats_block,
+                             stats_blocker);
 }
 
 void _spin_unlock_recursive(spinlock_t *lock)
@@ -272,18 +465,24 @@ void _spin_unlock_recursive(spinlock_t *lock)
 void _read_lock(rwlock_t *lock)
 {
     uint32_t x;
+    LOCK_STATS_VAR;
 
     check_lock(&lock->debug);
     do {
         while ( (x = lock->lock) & RW_WRITE_FLAG )
+        {
+            LOCK_STATS_BLOCK(0);
             cpu_relax();
+        }
     } while ( cmpxchg(&lock->lock, x, x+1) != x );
+    LOCK_STATS_RW_GOT(lock);
     preempt_disable();
 }
 
 void _read_lock_irq(rwlock_t *lock)
 {
     uint32_t x;
+    LOCK_STATS_VAR;
 
     ASSERT(local_irq_is_enabled());
     local_irq_disable();
@@ -291,12 +490,14 @@ void _read_lock_irq(rwlock_t *lock)
     do {
         if ( (x = lock->lock) & RW_WRITE_FLAG )
         {
+            LOCK_STATS_BLOCK(0);
             local_irq_enable();
             while ( (x = lock->lock) & RW_WRITE_FLAG )
                 cpu_relax();
             local_irq_disable();
         }
     } while ( cmpxchg(&lock->lock, x, x+1) != x );
+    LOCK_STATS_RW_GOT(lock);
     preempt_disable();
 }
 
@@ -304,18 +505,21 @@ unsigned long _read_lock_irqsave(rwlock_t *lock)
 {
     uint32_t x;
     unsigned long flags;
+    LOCK_STATS_VAR;
 
     local_irq_save(flags);
     check_lock(&lock->debug);
     do {
         if ( (x = lock->lock) & RW_WRITE_FLAG )
         {
+            LOCK_STATS_BLOCK(0);
             local_irq_restore(flags);
             while ( (x = lock->lock) & RW_WRITE_FLAG )
                 cpu_relax();
             local_irq_disable();
         }
     } while ( cmpxchg(&lock->lock, x, x+1) != x );
+    LOCK_STATS_RW_GOT(lock);
     preempt_disable();
     return flags;
 }
@@ -362,23 +566,30 @@ void _read_unlock_irqrestore(rwlock_t *lock, unsigned long flags)
 void _write_lock(rwlock_t *lock)
 {
     uint32_t x;
+    LOCK_STATS_VAR;
 
     check_lock(&lock->debug);
     do {
         while ( (x = lock->lock) & RW_WRITE_FLAG )
+        {
+            LOCK_STATS_BLOCK(0);
             cpu_relax();
+        }
     } while ( cmpxchg(&lock->lock, x, x|RW_WRITE_FLAG) != x );
     while ( x != 0 )
     {
+        LOCK_STATS_BLOCK(0);
         cpu_relax();
         x = lock->lock & ~RW_WRITE_FLAG;
     }
+    LOCK_STATS_RW_GOT(lock);
     preempt_disable();
 }
 
 void _write_lock_irq(rwlock_t *lock)
 {
     uint32_t x;
+    LOCK_STATS_VAR;
 
     ASSERT(local_irq_is_enabled());
     local_irq_disable();
@@ -386,6 +597,7 @@ void _write_lock_irq(rwlock_t *lock)
     do {
         if ( (x = lock->lock) & RW_WRITE_FLAG )
         {
+            LOCK_STATS_BLOCK(0);
             local_irq_enable();
             while ( (x = lock->lock) & RW_WRITE_FLAG )
                 cpu_relax();
@@ -394,9 +606,11 @@ void _write_lock_irq(rwlock_t *lock)
     } while ( cmpxchg(&lock->lock, x, x|RW_WRITE_FLAG) != x );
     while ( x != 0 )
     {
+        LOCK_STATS_BLOCK(0);
         cpu_relax();
         x = lock->lock & ~RW_WRITE_FLAG;
     }
+    LOCK_STATS_RW_GOT(lock);
     preempt_disable();
 }
 
@@ -404,12 +618,14 @@ unsigned long _write_lock_irqsave(rwlock_t *lock)
 {
     uint32_t x;
     unsigned long flags;
+    LOCK_STATS_VAR;
 
     local_irq_save(flags);
     check_lock(&lock->debug);
     do {
         if ( (x = lock->lock) & RW_WRITE_FLAG )
         {
+            LOCK_STATS_BLOCK(0);
             local_irq_restore(flags);
             while ( (x = lock->lock) & RW_WRITE_FLAG )
                 cpu_relax();
@@ -418,9 +634,11 @@ unsigned long _write_lock_irqsave(rwlock_t *lock)
     } while ( cmpxchg(&lock->lock, x, x|RW_WRITE_FLAG) != x );
     while ( x != 0 )
     {
+        LOCK_STATS_BLOCK(0);
         cpu_relax();
         x = lock->lock & ~RW_WRITE_FLAG;
     }
+    LOCK_STATS_RW_GOT(lock);
     preempt_disable();
     return flags;
 }
@@ -656,3 +874,89 @@ static int __init lock_prof_init(void)
 __initcall(lock_prof_init);
 
 #endif /* LOCK_PROFILE */
+
+/* Dom0 control of lock statistics */
+int lock_stats_control(struct xen_sysctl_lockstat_op *op)
+{
+    xen_sysctl_lockstat_data_t elem;
+    unsigned int i, j;
+
+    if ( !lock_stats_active )
+        return -EOPNOTSUPP;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_LOCKSTAT_reset:
+        /* Keep the classes, their sites are still valid. */
+        for ( i = 0; i < LOCK_STATS_CLASSES; i++ )
+        {
+            struct lock_stats_class *c = &lock_stats[i];
+
+            c->acquired = c->contended = 0;
+            c->wait_time = c->wait_max = 0;
+            memset(c->wait_hist, 0, sizeof(c->wait_hist));
+            memset(c->holder_cnt, 0, sizeof(c->holder_cnt));
+        }
+        lock_stats_overflow = 0;
+        lock_stats_start = NOW();
+        break;
+
+    case XEN_SYSCTL_LOCKSTAT_query:
+        op->nr_elem = 0;
+        for ( i = 0; i < LOCK_STATS_CLASSES; i++ )
+        {
+            const struct lock_stats_class *c = &lock_stats[i];
+
+            if ( !read_atomic(&c->site) )
+                continue;
+
+            if ( op->nr_elem < op->max_elem )
+            {
+                memset(&elem, 0, sizeof(elem));
+                snprintf(elem.name, sizeof(elem.name), "%pS",
+                         (void *)c->site);
+                elem.site = c->site;
+                elem.lock = c->lock;
+                elem.flags = c->flags;
+                elem.nr_acquired = c->acquired;
+                elem.nr_contended = c->contended;
+                elem.wait_time = c->wait_time;
+                elem.wait_max = c->wait_max;
+                memcpy(elem.wait_hist, c->wait_hist, sizeof(elem.wait_hist));
+                for ( j = 0; j < XEN_SYSCTL_LOCKSTAT_HOLDERS; j++ )
+                {
+                    if ( !c->holder[j] )
+                        break;
+                    snprintf(elem.holder[j].name, sizeof(elem.holder[j].name),
+                             "%pS", _stext + c->holder[j]);
+                    elem.holder[j].count = c->holder_cnt[j];
+                }
+                if ( copy_to_guest_offset(op->data, op->nr_elem, &elem, 1) )
+                    return -EFAULT;
+            }
+            op->nr_elem++;
+        }
+        op->time = NOW() - lock_stats_start;
+        op->sample_rate = lock_stats_rate;
+        op->overflow = lock_stats_overflow;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int __init lock_stats_init(void)
+{
+    /* Locks taken before now are early boot noise: start from here. */
+    if ( opt_lock_stats && lock_stats_rate )
+    {
+        lock_stats_start = NOW();
+        lock_stats_active = 1;
+    }
+
+    return 0;
+}
+__initcall(lock_stats_init);
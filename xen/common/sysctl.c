@@ -124,6 +124,10 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         ret = spinlock_profile_control(&op->u.lockprof_op);
         break;
 #endif
+
+    case XEN_SYSCTL_lockstat_op:
+        ret = lock_stats_control(&op->u.lockstat_op);
+        break;
     case XEN_SYSCTL_debug_keys:
     {
         char c;
@@ -23,6 +23,8 @@
 
 #include <xen/sched.h>
 #include <xen/event.h>
+#include <xen/guest_access.h>
+#include <xen/vmap.h>
 #include <xen/wait.h>
 #include <xen/vm_event.h>
 #include <xen/mem_access.h>
@@ -38,6 +40,71 @@
 #define vm_event_ring_lock(_ved)       spin_lock(&(_ved)->ring_lock)
 #define vm_event_ring_unlock(_ved)     spin_unlock(&(_ved)->ring_lock)
 
+static void vm_event_unmap_ring(struct vm_event_domain *ved)
+{
+    unsigned int i;
+
+    if ( ved->ring_page == NULL )
+        return;
+
+    if ( ved->nr_frames == 1 )
+        unmap_domain_page_global(ved->ring_page);
+    else
+        vunmap(ved->ring_page);
+    ved->ring_page = NULL;
+
+    for ( i = 0; i < ved->nr_frames; i++ )
+        put_page_and_type(ved->ring_pg_structs[i]);
+    xfree(ved->ring_pg_structs);
+    ved->ring_pg_structs = NULL;
+    ved->nr_frames = 0;
+}
+
+/* Take the ring pages from the guest and map them contiguously. */
+static int vm_event_map_ring(struct domain *d, struct vm_event_domain *ved,
+                             const xen_pfn_t *gfns, unsigned int nr)
+{
+    unsigned long *mfns = NULL;
+    unsigned int i;
+    int rc = -ENOMEM;
+
+    ved->ring_pg_structs = xzalloc_array(struct page_info *, nr);
+    if ( nr > 1 )
+        mfns = xmalloc_array(unsigned long, nr);
+    if ( !ved->ring_pg_structs || (nr > 1 && !mfns) )
+        goto err;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        rc = get_ring_page_for_helper(d, gfns[i], &ved->ring_pg_structs[i]);
+        if ( rc < 0 )
+            goto err;
+        ved->nr_frames++;
+        if ( mfns )
+            mfns[i] = page_to_mfn(ved->ring_pg_structs[i]);
+    }
+
+    rc = -ENOMEM;
+    if ( nr == 1 )
+        ved->ring_page = __map_domain_page_global(ved->ring_pg_structs[0]);
+    else
+        ved->ring_page = vmap(mfns, nr);
+    if ( ved->ring_page == NULL )
+        goto err;
+
+    xfree(mfns);
+    return 0;
+
+ err:
+    for ( i = 0; i < ved->nr_frames; i++ )
+        put_page_and_type(ved->ring_pg_structs[i]);
+    xfree(ved->ring_pg_structs);
+    ved->ring_pg_structs = NULL;
+    ved->nr_frames = 0;
+    xfree(mfns);
+    return rc;
+}
+
 static int vm_event_enable(
     struct domain *d,
     xen_domctl_vm_event_op_t *vec,
@@ -47,7 +114,9 @@ static int vm_event_enable(
     xen_event_channel_notification_t notification_fn)
 {
     int rc;
-    unsigned long ring_gfn = d->arch.hvm_domain.params[param];
+    xen_pfn_t ring_gfn = d->arch.hvm_domain.params[param];
+    xen_pfn_t *gfns = &ring_gfn;
+    unsigned int nr_frames = 1;
 
     /* Only one helper at a time. If the helper crashed,
      * the ring is in an undefined state and so is the guest.
@@ -60,11 +129,48 @@ static int vm_event_enable(
     if ( ring_gfn == 0 )
         return -ENOSYS;
 
+    if ( vec->nr_frames > XEN_VM_EVENT_MAX_FRAMES )
+        return -EINVAL;
+
+    if ( vec->nr_frames > 1 )
+    {
+        unsigned int i, j;
+
+        nr_frames = vec->nr_frames;
+        gfns = xmalloc_array(xen_pfn_t, nr_frames);
+        if ( !gfns )
+            return -ENOMEM;
+        if ( copy_from_guest(gfns, vec->frame_list, nr_frames) )
+        {
+            xfree(gfns);
+            return -EFAULT;
+        }
+
+        /*
+         * The ring starts at the page of the HVM param, and each of its
+         * frames must be a distinct page.
+         */
+        rc = gfns[0] == ring_gfn ? 0 : -EINVAL;
+        for ( i = 1; !rc && i < nr_frames; i++ )
+            for ( j = 0; j < i; j++ )
+                if ( gfns[i] == gfns[j] )
+                {
+                    rc = -EINVAL;
+                    break;
+                }
+        if ( rc )
+        {
+            xfree(gfns);
+            return rc;
+        }
+    }
+
     vm_event_ring_lock_init(ved);
     vm_event_ring_lock(ved);
 
-    rc = prepare_ring_for_helper(d, ring_gfn, &ved->ring_pg_struct,
-                                    &ved->ring_page);
+    rc = vm_event_map_ring(d, ved, gfns, nr_frames);
+    if ( gfns != &ring_gfn )
+        xfree(gfns);
     if ( rc < 0 )
         goto err;
 
@@ -82,7 +188,7 @@ static int vm_event_enable(
     /* Prepare ring buffer */
     FRONT_RING_INIT(&ved->front_ring,
                     (vm_event_sring_t *)ved->ring_page,
-                    PAGE_SIZE);
+                    PAGE_SIZE * nr_frames);
 
     /* Save the pause flag for this particular ring. */
     ved->pause_flag = pause_flag;
@@ -94,8 +200,7 @@ static int vm_event_enable(
     return 0;
 
  err:
-    destroy_ring_for_helper(&ved->ring_page,
-                            ved->ring_pg_struct);
+    vm_event_unmap_ring(ved);
     vm_event_ring_unlock(ved);
 
     return rc;
@@ -223,8 +328,7 @@ static int vm_event_disable(struct domain *d, struct vm_event_domain *ved)
             }
         }
 
-        destroy_ring_for_helper(&ved->ring_page,
-                                ved->ring_pg_struct);
+        vm_event_unmap_ring(ved);
         vm_event_ring_unlock(ved);
     }
 
@@ -340,10 +444,6 @@ int vm_event_get_response(struct domain *d, struct vm_event_domain *ved,
     front_ring->rsp_cons = rsp_cons;
     front_ring->sring->rsp_event = rsp_cons + 1;
 
-    /* Kick any waiters -- since we've just consumed an event,
-     * there may be additional space available in the ring. */
-    vm_event_wake(d, ved);
-
     vm_event_ring_unlock(ved);
 
     return 1;
@@ -356,16 +456,22 @@ int vm_event_get_response(struct domain *d, struct vm_event_domain *ved,
  *
  * Note: responses are handled the same way regardless of which ring they
  * arrive on.
+ *
+ * The vCPUs waiting for room in the ring are woken once, when all the
+ * responses of the batch have been pulled.
  */
 void vm_event_resume(struct domain *d, struct vm_event_domain *ved)
 {
     vm_event_response_t rsp;
+    unsigned int handled = 0;
 
     /* Pull all responses off the ring. */
     while ( vm_event_get_response(d, ved, &rsp) )
     {
         struct vcpu *v;
 
+        handled++;
+
         if ( rsp.version != VM_EVENT_INTERFACE_VERSION )
         {
             printk(XENLOG_G_WARNING "vm_event interface version mismatch\n");
@@ -403,6 +509,15 @@ void vm_event_resume(struct domain *d, struct vm_event_domain *ved)
         if ( rsp.flags & VM_EVENT_FLAG_VCPU_PAUSED )
             vm_event_vcpu_unpause(v);
     }
+
+    /* Kick any waiters -- since we've just consumed events,
+     * there may be additional space available in the ring. */
+    if ( handled )
+    {
+        vm_event_ring_lock(ved);
+        vm_event_wake(d, ved);
+        vm_event_ring_unlock(ved);
+    }
 }
 
 void vm_event_cancel_slot(struct domain *d, struct vm_event_domain *ved)
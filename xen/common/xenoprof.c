@@ -21,6 +21,8 @@
 
 /* Limit amount of pages used for shared buffer (per domain) */
 #define MAX_OPROF_SHARED_PAGES 32
+/* Limit amount of pages used for each per-CPU hypervisor sample buffer */
+#define MAX_XEN_SHARED_PAGES   64
 
 /* Lock protecting the following global state */
 static DEFINE_SPINLOCK(xenoprof_lock);
@@ -50,6 +52,16 @@ static u64 passive_samples;
 static u64 idle_samples;
 static u64 others_samples;
 
+/*
+ * Per-CPU buffers for samples of hypervisor code (XENOPROF_get_xen_buffer).
+ * A CPU sends its hypervisor samples there once the profiler has asked for
+ * its buffer, and to the profiled domains' buffers as before until then.
+ */
+static DEFINE_PER_CPU(struct xenoprof_buf *, xen_sample_buf);
+static DEFINE_PER_CPU(unsigned int, xen_sample_buf_entries);
+static DEFINE_PER_CPU(bool_t, xen_sampling);
+static unsigned int xen_sample_entries;   /* of this session's buffers */
+
 int acquire_pmu_ownership(int pmu_ownship)
 {
     spin_lock(&pmu_owner_lock);
@@ -514,10 +526,96 @@ static int xenoprof_add_sample(struct domain *d, xenoprof_buf_t *buf,
     return 1;
 }
 
+/*
+ * The per-CPU hypervisor sample buffers are only ever written by their own
+ * CPU, from NMI context.  Use our own copy of the size rather than trusting
+ * the one in the shared page.
+ */
+static int xen_buf_space(const struct xenoprof_buf *buf)
+{
+    unsigned int head = buf->event_head, tail = buf->event_tail;
+
+    if ( (head >= xen_sample_entries) || (tail >= xen_sample_entries) )
+        return -1;
+
+    return ((tail > head) ? 0 : xen_sample_entries) + tail - head - 1;
+}
+
+static int xen_buf_add(struct xenoprof_buf *buf, uint64_t eip, int event)
+{
+    unsigned int head = buf->event_head;
+
+    if ( xen_buf_space(buf) <= 0 )
+        return 0;
+
+    buf->event_log[head].eip = eip;
+    buf->event_log[head].mode = 2;
+    buf->event_log[head].event = event;
+    smp_wmb();
+    buf->event_head = (head + 1 < xen_sample_entries) ? head + 1 : 0;
+
+    return 1;
+}
+
+static void xenoprof_log_xen_event(struct vcpu *vcpu,
+                                   const struct cpu_user_regs *regs,
+                                   uint64_t pc, int event)
+{
+    struct xenoprof_buf *buf = this_cpu(xen_sample_buf);
+    int space;
+
+    if ( buf == NULL )
+    {
+        invalid_buffer_samples++;
+        return;
+    }
+
+    space = xen_buf_space(buf);
+    if ( space < 0 )
+    {
+        corrupted_buffer_samples++;
+        return;
+    }
+    if ( space < (backtrace_depth ? 4 : 3) )
+    {
+        buf->lost_samples++;
+        lost_samples++;
+        return;
+    }
+
+    xen_buf_add(buf, XENOPROF_ESCAPE_CODE, XENOPROF_XEN_CONTEXT);
+    xen_buf_add(buf, ((uint64_t)vcpu->domain->domain_id << 32) |
+                     vcpu->vcpu_id, 0);
+    if ( backtrace_depth > 0 )
+        xen_buf_add(buf, XENOPROF_ESCAPE_CODE, XENOPROF_TRACE_BEGIN);
+    xen_buf_add(buf, pc, event);
+    buf->xen_samples++;
+
+    /* Frames which do not fit are silently dropped. */
+    if ( backtrace_depth > 0 )
+        xenoprof_backtrace(vcpu, regs, backtrace_depth, 2);
+}
+
+static void xenoprof_reset_xen_bufs(void)
+{
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct xenoprof_buf *buf = per_cpu(xen_sample_buf, cpu);
+
+        if ( buf != NULL )
+        {
+            buf->event_head = 0;
+            buf->event_tail = 0;
+        }
+    }
+}
+
 int xenoprof_add_trace(struct vcpu *vcpu, uint64_t pc, int mode)
 {
     struct domain *d = vcpu->domain;
-    xenoprof_buf_t *buf = d->xenoprof->vcpu[vcpu->vcpu_id].buffer;
+    xenoprof_buf_t *buf;
 
     /* Do not accidentally write an escape code due to a broken frame. */
     if ( pc == XENOPROF_ESCAPE_CODE )
@@ -526,6 +624,12 @@ int xenoprof_add_trace(struct vcpu *vcpu, uint64_t pc, int mode)
         return 0;
     }
 
+    if ( mode == 2 && this_cpu(xen_sampling) )
+        return this_cpu(xen_sample_buf) ?
+               xen_buf_add(this_cpu(xen_sample_buf), pc, 0) : 0;
+
+    buf = d->xenoprof->vcpu[vcpu->vcpu_id].buffer;
+
     return xenoprof_add_sample(d, buf, pc, mode, 0);
 }
 
@@ -538,6 +642,13 @@ void xenoprof_log_event(struct vcpu *vcpu, const struct cpu_user_regs *regs,
 
     total_samples++;
 
+    /* Hypervisor samples go to the CPU's buffer, whoever was running. */
+    if ( mode == 2 && this_cpu(xen_sampling) )
+    {
+        xenoprof_log_xen_event(vcpu, regs, pc, event);
+        return;
+    }
+
     /* Ignore samples of un-monitored domains. */
     if ( !is_profiled(d) )
     {
@@ -616,6 +727,126 @@ static int xenoprof_op_init(XEN_GUEST_HANDLE_PARAM(void) arg)
     return __copy_to_guest(arg, &xenoprof_init, 1) ? -EFAULT : 0;
 }
 
+static unsigned int xen_buf_order(unsigned int entries)
+{
+    return get_order_from_bytes(sizeof(struct xenoprof_buf) +
+                                (entries - 1) * sizeof(struct event_log));
+}
+
+/*
+ * Free a CPU's buffer, unless a domain still has it mapped: it is then
+ * kept, to be reused by a session asking for the same size or freed at
+ * the end of a later one.
+ */
+static int xen_buf_free(unsigned int cpu)
+{
+    struct xenoprof_buf *buf = per_cpu(xen_sample_buf, cpu);
+    struct page_info *pg;
+    unsigned int i, order;
+
+    if ( buf == NULL )
+        return 0;
+
+    order = xen_buf_order(per_cpu(xen_sample_buf_entries, cpu));
+    pg = virt_to_page(buf);
+
+    for ( i = 0; i < (1u << order); i++ )
+        if ( (pg[i].count_info & PGC_count_mask) != 1 )
+            return -EBUSY;
+
+    per_cpu(xen_sample_buf, cpu) = NULL;
+    per_cpu(xen_sample_buf_entries, cpu) = 0;
+
+    for ( i = 0; i < (1u << order); i++ )
+        if ( test_and_clear_bit(_PGC_allocated, &pg[i].count_info) )
+            put_page(&pg[i]);
+    free_xenheap_pages(buf, order);
+
+    return 0;
+}
+
+static void xen_bufs_release(void)
+{
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+    {
+        per_cpu(xen_sampling, cpu) = 0;
+        xen_buf_free(cpu);
+    }
+
+    xen_sample_entries = 0;
+}
+
+static int xenoprof_op_get_xen_buffer(XEN_GUEST_HANDLE_PARAM(void) arg)
+{
+    struct xenoprof_xen_buffer xen_buffer;
+    struct xenoprof_buf *buf;
+    unsigned int cpu, order, i;
+
+    if ( copy_from_guest(&xen_buffer, arg, 1) )
+        return -EFAULT;
+
+    cpu = xen_buffer.cpu;
+    if ( (xen_buffer.cpu < 0) || (cpu >= nr_cpu_ids) || !cpu_online(cpu) )
+        return -EINVAL;
+
+    /* All buffers get the size asked for by the first request. */
+    if ( xen_sample_entries == 0 )
+    {
+        unsigned int max_entries =
+            (MAX_XEN_SHARED_PAGES * PAGE_SIZE - sizeof(struct xenoprof_buf)) /
+            sizeof(struct event_log) + 1;
+
+        if ( xen_buffer.max_samples < 2 )
+            return -EINVAL;
+        xen_sample_entries = min_t(unsigned int, xen_buffer.max_samples,
+                                   max_entries);
+    }
+
+    xen_buffer.bufsize = sizeof(struct xenoprof_buf) +
+                         (xen_sample_entries - 1) * sizeof(struct event_log);
+    order = xen_buf_order(xen_sample_entries);
+
+    /* A buffer an earlier session left mapped, of another size? */
+    if ( (per_cpu(xen_sample_buf, cpu) != NULL) &&
+         (per_cpu(xen_sample_buf_entries, cpu) != xen_sample_entries) &&
+         xen_buf_free(cpu) )
+        return -EBUSY;
+
+    buf = per_cpu(xen_sample_buf, cpu);
+    if ( buf == NULL )
+    {
+        buf = alloc_xenheap_pages(order, MEMF_node(cpu_to_node(cpu)));
+        if ( buf == NULL )
+            return -ENOMEM;
+
+        memset(buf, 0, PAGE_SIZE << order);
+        buf->event_size = xen_sample_entries;
+        buf->vcpu_id = cpu;
+        for ( i = 0; i < (1u << order); i++ )
+            share_xen_page_with_privileged_guests(virt_to_page(buf) + i,
+                                                  XENSHARE_writable);
+
+        per_cpu(xen_sample_buf_entries, cpu) = xen_sample_entries;
+        smp_wmb();
+        per_cpu(xen_sample_buf, cpu) = buf;
+    }
+    else if ( !per_cpu(xen_sampling, cpu) )
+    {
+        /* Kept from an earlier session: start it afresh. */
+        memset(buf, 0, sizeof(*buf));
+        buf->event_size = xen_sample_entries;
+        buf->vcpu_id = cpu;
+    }
+
+    smp_wmb();
+    per_cpu(xen_sampling, cpu) = 1;
+    xen_buffer.buf_maddr = __pa(buf);
+
+    return __copy_to_guest(arg, &xen_buffer, 1) ? -EFAULT : 0;
+}
+
 #define ret_t long
 
 #endif /* !COMPAT */
@@ -793,6 +1024,7 @@ ret_t do_xenoprof_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
             xenoprof_reset_stat();
             for ( i = 0; i < pdomains; i++ )
                 xenoprof_reset_buf(passive_domains[i]);
+            xenoprof_reset_xen_bufs();
         }
         xenoprof_reset_buf(current->domain);
         ret = set_active(current->domain);
@@ -872,9 +1104,19 @@ ret_t do_xenoprof_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
             adomains=0;
             xenoprof_primary_profiler = NULL;
             backtrace_depth=0;
+            xen_bufs_release();
             ret = 0;
         }
         break;
+
+    case XENOPROF_get_xen_buffer:
+        /* Samples of Xen itself are for the primary profiler alone. */
+        ret = -EPERM;
+        if ( (current->domain == xenoprof_primary_profiler) &&
+             (xenoprof_state != XENOPROF_IDLE) &&
+             (xenoprof_state != XENOPROF_PROFILING) )
+            ret = xenoprof_op_get_xen_buffer(arg);
+        break;
                 
     case XENOPROF_set_backtrace:
         ret = 0;
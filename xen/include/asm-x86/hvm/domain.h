@@ -132,6 +132,8 @@ struct hvm_domain {
 
     bool_t                 hap_enabled;
     bool_t                 mem_sharing_enabled;
+    /* Parent of a VM fork, kept paused and referenced while we exist. */
+    struct domain         *fork_parent;
     bool_t                 qemu_mapcache_invalidate;
     bool_t                 is_s3_suspended;
 
@@ -55,6 +55,9 @@ struct page_sharing_info
 #define sharing_supported(_d) \
     (is_hvm_domain(_d) && paging_mode_hap(_d)) 
 
+#define mem_sharing_is_fork(_d) \
+    (is_hvm_domain(_d) && (_d)->arch.hvm_domain.fork_parent != NULL)
+
 unsigned int mem_sharing_get_nr_saved_mfns(void);
 unsigned int mem_sharing_get_nr_shared_mfns(void);
 int mem_sharing_nominate_page(struct domain *d, 
@@ -102,4 +105,14 @@ void mem_sharing_init(void);
  */
 int relinquish_shared_pages(struct domain *d);
 
+/* Fill a hole at gfn in a VM fork from the same gfn of its parent: by
+ * sharing the parent's page, or with a private copy of it if unsharing
+ * is set or the page can't be shared.  Called with the fork's gfn lock
+ * held.  Fails with -ENOENT if the parent has no RAM there.
+ */
+int mem_sharing_fork_page(struct domain *d, unsigned long gfn,
+                          bool_t unsharing);
+/* Drop a dying fork's hold on its parent. */
+void mem_sharing_fork_teardown(struct domain *d);
+
 #endif /* __MEM_SHARING_H__ */
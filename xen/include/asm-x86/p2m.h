@@ -30,6 +30,8 @@
 #include <xen/config.h>
 #include <xen/paging.h>
 #include <xen/p2m-common.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
@@ -244,6 +246,11 @@ struct p2m_domain {
                                                   unsigned long first_gfn,
                                                   unsigned long last_gfn);
     void               (*memory_type_changed)(struct p2m_domain *p2m);
+    unsigned long      (*harvest_accessed)(struct p2m_domain *p2m,
+                                           unsigned long gfn,
+                                           unsigned long nr,
+                                           unsigned long *bitmap,
+                                           bool_t clear);
     
     void               (*write_p2m_entry)(struct p2m_domain *p2m,
                                           unsigned long gfn, l1_pgentry_t *p,
@@ -286,6 +293,21 @@ struct p2m_domain {
         unsigned int     last_populated_index;
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
+        /* Background zero-page reclaim.  The tasklet and timer are only
+         * touched by their own APIs; everything else is pod-locked. */
+        struct tasklet   reclaim_tasklet;
+        struct timer     reclaim_timer;
+        unsigned long    reclaim_gfn;  /* Next gpfn of a background scan */
+        s_time_t         reclaim_next; /* Earliest time of the next run */
+        bool_t           reclaim_pending;
+        struct {
+            unsigned long bg_runs,     /* Background tasklet runs          */
+                          bg_single,   /* 4k pages reclaimed in background */
+                          bg_super,    /* Pages reclaimed as superpages    */
+                          sweeps;      /* Synchronous emergency sweeps     */
+            s_time_t      bg_time, bg_max,       /* Time spent (ns) */
+                          sweep_time, sweep_max;
+        } stats;
     } pod;
     union {
         struct ept_data ept;
@@ -519,6 +541,33 @@ void p2m_disable_hardware_log_dirty(struct domain *d);
 /* Flush hardware cached dirty GFNs */
 void p2m_flush_hardware_cached_dirty(struct domain *d);
 
+/*
+ * Report (and optionally clear) the hardware accessed bits of the p2m
+ * entries covering [gfn, gfn + nr): bit i of bitmap is set if gfn + i has
+ * been accessed.  Returns the number of accessed gfns found, or -EOPNOTSUPP
+ * if the p2m does not track accessed bits.
+ */
+long p2m_harvest_accessed(struct domain *d, unsigned long gfn,
+                          unsigned long nr, unsigned long *bitmap,
+                          bool_t clear);
+
+/*
+ * Add the number of RAM pages backing [gfn, gfn + nr) on each NUMA node
+ * to pages[], which must have MAX_NUMNODES entries.
+ */
+void p2m_count_node_pages(struct domain *d, unsigned long gfn,
+                          unsigned long nr, uint64_t *pages);
+
+/*
+ * Move the memory backing gfn to node.  On return *order says how many
+ * gfns the operation covered (the whole extent it examined), and the
+ * return value is the number of pages moved: 0 if there was nothing to
+ * do or the pages are in use by someone other than the guest, or -ENOMEM
+ * if node has no memory left.  The domain must be paused.
+ */
+int p2m_migrate_gfn(struct domain *d, unsigned long gfn, nodeid_t node,
+                    unsigned int *order);
+
 /* Change types across all p2m entries in a domain */
 void p2m_change_entry_type_global(struct domain *d, 
                                   p2m_type_t ot, p2m_type_t nt);
@@ -554,6 +603,10 @@ int p2m_add_foreign(struct domain *tdom, unsigned long fgfn,
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
+/* Set up and tear down the background zero-page reclaimer */
+void p2m_pod_reclaim_init(struct p2m_domain *p2m);
+void p2m_pod_reclaim_teardown(struct p2m_domain *p2m);
+
 /* Move all pages from the populate-on-demand cache to the domain page_list
  * (usually in preparation for domain destruction) */
 void p2m_pod_empty_cache(struct domain *d);
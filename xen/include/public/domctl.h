@@ -37,7 +37,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000b
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000c
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -832,6 +832,16 @@ struct xen_domctl_gdbsx_domstatus {
  */
 #define XEN_DOMCTL_VM_EVENT_OP_SHARING           3
 
+/*
+ * A ring is one page by default, at the gfn of the HVM param of the mode,
+ * with room for 8 requests.  With nr_frames > 1, XEN_VM_EVENT_ENABLE sets
+ * up a ring of nr_frames pages instead, the gfns of which are listed in
+ * frame_list, so that a guest with many vcpus does not pause them all
+ * waiting for the helper.  The first of them must be the gfn of the HVM
+ * param, and no gfn may be listed twice.
+ */
+#define XEN_VM_EVENT_MAX_FRAMES          64
+
 /* Use for teardown/setup of helper<->hypervisor interface for paging, 
  * access and sharing.*/
 struct xen_domctl_vm_event_op {
@@ -839,6 +849,8 @@ struct xen_domctl_vm_event_op {
     uint32_t       mode;         /* XEN_DOMCTL_VM_EVENT_OP_* */
 
     uint32_t port;              /* OUT: event channel for ring */
+    uint32_t nr_frames;         /* IN: pages of the ring, 0 for the default */
+    XEN_GUEST_HANDLE_64(xen_pfn_t) frame_list; /* IN: gfns of the ring */
 };
 typedef struct xen_domctl_vm_event_op xen_domctl_vm_event_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_vm_event_op_t);
@@ -1065,6 +1077,76 @@ struct xen_domctl_monitor_op {
 typedef struct xen_domctl__op xen_domctl_monitor_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_monitor_op_t);
 
+/*
+ * XEN_DOMCTL_harvest_accessed: report which gfns of an HVM guest have been
+ * accessed since their accessed bit was last cleared, as tracked by the
+ * hardware in the p2m (requires EPT A/D bits, see the "ept=ad" boot
+ * option).  Useful for sampling a guest's working set.
+ *
+ * The operation may be preempted, in which case nr_gfns is updated to the
+ * number of gfns processed and the caller should reissue it for the rest.
+ */
+struct xen_domctl_harvest_accessed {
+    /* IN: First gfn to examine. */
+    uint64_aligned_t start_gfn;
+    /* IN: Number of gfns to examine.  OUT: Number of gfns examined. */
+    uint64_aligned_t nr_gfns;
+    /* OUT: Number of accessed gfns found. */
+    uint64_aligned_t nr_accessed;
+    /* OUT: Bit i set if start_gfn + i was accessed. */
+    XEN_GUEST_HANDLE_64(uint8) bitmap;
+    /* IN: XEN_DOMCTL_HARVEST_ACCESSED_* */
+#define XEN_DOMCTL_HARVEST_ACCESSED_CLEAR  (1U << 0) /* Clear reported bits. */
+    uint32_t flags;
+    uint32_t pad;
+};
+typedef struct xen_domctl_harvest_accessed xen_domctl_harvest_accessed_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_harvest_accessed_t);
+
+/*
+ * XEN_DOMCTL_node_pages: find out on which NUMA nodes the memory of an HVM
+ * guest lives, or move it to another node.
+ *
+ * XEN_DOMCTL_NODE_PAGES_COUNT adds up, per node, the RAM pages backing the
+ * gfn range and returns the totals in pages[], which has nr_nodes entries.
+ * Pages on nodes beyond nr_nodes are not reported.
+ *
+ * XEN_DOMCTL_NODE_PAGES_MIGRATE moves the pages in the range which are not
+ * on node to it.  The guest is paused while a batch of pages is moved.
+ * Pages which are shared, paged out or in use by anyone other than the
+ * guest (grant or foreign mappings, for instance) are left where they are.
+ * Superpages are moved whole where node has a free extent of that size,
+ * and are otherwise split, as they are when some of their pages can not
+ * be moved.
+ * Only HAP guests without passthrough devices are supported, as DMA to a
+ * page which is being moved cannot be fenced.  Returns -ENOMEM once node
+ * runs out of memory.
+ *
+ * Either operation may stop early, in which case nr_gfns is updated to the
+ * number of gfns processed and the caller should reissue it for the rest.
+ */
+struct xen_domctl_node_pages {
+#define XEN_DOMCTL_NODE_PAGES_COUNT    0
+#define XEN_DOMCTL_NODE_PAGES_MIGRATE  1
+    /* IN: XEN_DOMCTL_NODE_PAGES_* */
+    uint32_t op;
+    /* IN: MIGRATE: Destination node. */
+    uint32_t node;
+    /* IN: First gfn to examine. */
+    uint64_aligned_t start_gfn;
+    /* IN: Number of gfns to examine.  OUT: Number of gfns examined. */
+    uint64_aligned_t nr_gfns;
+    /* OUT: MIGRATE: Number of pages moved. */
+    uint64_aligned_t nr_moved;
+    /* OUT: COUNT: Number of pages found on each node. */
+    XEN_GUEST_HANDLE_64(uint64) pages;
+    /* IN: COUNT: Number of entries in pages[]. */
+    uint32_t nr_nodes;
+    uint32_t pad;
+};
+typedef struct xen_domctl_node_pages xen_domctl_node_pages_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_node_pages_t);
+
 struct xen_domctl {
     uint32_t cmd;
 #define XEN_DOMCTL_createdomain                   1
@@ -1140,6 +1222,8 @@ struct xen_domctl {
 #define XEN_DOMCTL_setvnumainfo                  74
 #define XEN_DOMCTL_psr_cmt_op                    75
 #define XEN_DOMCTL_monitor_op                    77
+#define XEN_DOMCTL_harvest_accessed              78
+#define XEN_DOMCTL_node_pages                    79
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -1203,6 +1287,8 @@ struct xen_domctl {
         struct xen_domctl_vnuma             vnuma;
         struct xen_domctl_psr_cmt_op        psr_cmt_op;
         struct xen_domctl_monitor_op        monitor_op;
+        struct xen_domctl_harvest_accessed  harvest_accessed;
+        struct xen_domctl_node_pages        node_pages;
         uint8_t                             pad[128];
     } u;
 };
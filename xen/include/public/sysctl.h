@@ -463,6 +463,60 @@ struct xen_sysctl_lockprof_op {
 typedef struct xen_sysctl_lockprof_op xen_sysctl_lockprof_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_op_t);
 
+/*
+ * XEN_SYSCTL_lockstat_op
+ *
+ * Lock contention statistics, gathered in all builds unless disabled with
+ * the "lock_stats" boot option.  Locks are classed by the code location
+ * acquiring them.  Acquisitions are only counted one in sample_rate, so
+ * nr_acquired is an estimate; every contended acquisition is recorded.
+ */
+/* Sub-operations: */
+#define XEN_SYSCTL_LOCKSTAT_reset 1   /* Reset all statistics to zero. */
+#define XEN_SYSCTL_LOCKSTAT_query 2   /* Get lock statistics. */
+/* Wait-time histogram: bucket i counts waits < 2^(i + SHIFT) ns, the last
+ * bucket all longer ones. */
+#define XEN_SYSCTL_LOCKSTAT_BUCKETS       16
+#define XEN_SYSCTL_LOCKSTAT_BUCKET_SHIFT  8
+/* Number of distinct lock holder locations tracked per class. */
+#define XEN_SYSCTL_LOCKSTAT_HOLDERS       4
+#define XEN_SYSCTL_LOCKSTAT_NAME_LEN      48
+struct xen_sysctl_lockstat_holder {
+    char     name[XEN_SYSCTL_LOCKSTAT_NAME_LEN]; /* holder location */
+    uint64_aligned_t count;       /* # of contentions with this holder */
+};
+struct xen_sysctl_lockstat_data {
+    char     name[XEN_SYSCTL_LOCKSTAT_NAME_LEN]; /* acquiring location */
+    uint64_aligned_t site;        /* address of acquiring location */
+    uint64_aligned_t lock;        /* address of last contended lock */
+#define XEN_SYSCTL_LOCKSTAT_RWLOCK (1U << 0)
+    uint32_t flags;
+    uint32_t pad;
+    uint64_aligned_t nr_acquired;  /* estimated # of acquisitions */
+    uint64_aligned_t nr_contended; /* # of acquisitions which waited */
+    uint64_aligned_t wait_time;    /* nsecs waited in total */
+    uint64_aligned_t wait_max;     /* longest wait in nsecs */
+    uint64_aligned_t wait_hist[XEN_SYSCTL_LOCKSTAT_BUCKETS];
+    /* Where the lock was taken by whoever we waited for (spinlocks only). */
+    struct xen_sysctl_lockstat_holder holder[XEN_SYSCTL_LOCKSTAT_HOLDERS];
+};
+typedef struct xen_sysctl_lockstat_data xen_sysctl_lockstat_data_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockstat_data_t);
+struct xen_sysctl_lockstat_op {
+    /* IN variables. */
+    uint32_t       cmd;               /* XEN_SYSCTL_LOCKSTAT_??? */
+    uint32_t       max_elem;          /* size of output buffer */
+    /* OUT variables (query only). */
+    uint32_t       nr_elem;           /* number of elements available */
+    uint32_t       sample_rate;       /* 1 in how many acquisitions counted */
+    uint64_aligned_t time;            /* nsecs of measurement */
+    uint64_aligned_t overflow;        /* events lost for lack of classes */
+    /* statistics (or NULL) */
+    XEN_GUEST_HANDLE_64(xen_sysctl_lockstat_data_t) data;
+};
+typedef struct xen_sysctl_lockstat_op xen_sysctl_lockstat_op_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockstat_op_t);
+
 /* XEN_SYSCTL_cputopoinfo */
 #define XEN_INVALID_CORE_ID     (~0U)
 #define XEN_INVALID_SOCKET_ID   (~0U)
@@ -717,6 +771,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_coverage_op                   20
 #define XEN_SYSCTL_psr_cmt_op                    21
 #define XEN_SYSCTL_pcitopoinfo                   22
+#define XEN_SYSCTL_lockstat_op                   23
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -740,6 +795,7 @@ struct xen_sysctl {
         struct xen_sysctl_scheduler_op      scheduler_op;
         struct xen_sysctl_coverage_op       coverage_op;
         struct xen_sysctl_psr_cmt_op        psr_cmt_op;
+        struct xen_sysctl_lockstat_op       lockstat_op;
         uint8_t                             pad[128];
     } u;
 };
@@ -54,7 +54,9 @@
 /* AMD IBS support */
 #define XENOPROF_get_ibs_caps       16
 #define XENOPROF_ibs_counter        17
-#define XENOPROF_last_op            17
+/* Per-physical-CPU hypervisor sample buffers */
+#define XENOPROF_get_xen_buffer     18
+#define XENOPROF_last_op            18
 
 #define MAX_OPROF_EVENTS    32
 #define MAX_OPROF_DOMAINS   25
@@ -71,6 +73,13 @@ struct event_log {
 #define XENOPROF_ESCAPE_CODE (~0ULL)
 /* Transient events for the xenoprof->oprofile cpu buf */
 #define XENOPROF_TRACE_BEGIN 1
+/*
+ * Start of a hypervisor sample in a per-CPU buffer: the next entry's eip
+ * holds the interrupted context, see XENOPROF_XEN_CONTEXT_*().
+ */
+#define XENOPROF_XEN_CONTEXT 2
+#define XENOPROF_XEN_CONTEXT_DOMID(eip)   ((uint16_t)((eip) >> 32))
+#define XENOPROF_XEN_CONTEXT_VCPU(eip)    ((uint32_t)(eip))
 
 /* Xenoprof buffer shared between Xen and domain - 1 per VCPU */
 struct xenoprof_buf {
@@ -128,6 +137,31 @@ typedef struct xenoprof_passive {
 } xenoprof_passive_t;
 DEFINE_XEN_GUEST_HANDLE(xenoprof_passive_t);
 
+/*
+ * XENOPROF_get_xen_buffer: set up (on first use) and return the sample
+ * buffer of physical CPU @cpu.  From then on, samples taken while @cpu runs
+ * hypervisor code are written to that buffer, whichever domain was current,
+ * rather than to the per-vCPU buffers of profiled domains.  Each sample is
+ * laid out as
+ *
+ *   [ESCAPE, XENOPROF_XEN_CONTEXT] [domid/vcpu] ([ESCAPE, TRACE_BEGIN])
+ *   [rip] [caller]...
+ *
+ * The buffers are shared with privileged guests, which map them as
+ * DOMID_XEN pages, and always use the native layout.  XENOPROF_shutdown
+ * frees those no longer mapped; one still mapped is kept for a later
+ * session, which gets -EBUSY if it asks for another size.
+ */
+struct xenoprof_xen_buffer {
+    int32_t  cpu;           /* IN */
+    int32_t  max_samples;   /* IN: entries to allocate on first use */
+    int32_t  bufsize;       /* OUT: buffer size in bytes */
+    int32_t  pad;
+    uint64_t buf_maddr;     /* OUT */
+};
+typedef struct xenoprof_xen_buffer xenoprof_xen_buffer_t;
+DEFINE_XEN_GUEST_HANDLE(xenoprof_xen_buffer_t);
+
 struct xenoprof_ibs_counter {
     uint64_t op_enabled;
     uint64_t fetch_enabled;
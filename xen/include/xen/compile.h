@@ -0,0 +1,15 @@
+#define XEN_COMPILE_DATE	"Mon Oct 19 19:46:15 UTC 2026"
+#define XEN_COMPILE_TIME	"19:46:15"
+#define XEN_COMPILE_BY		""
+#define XEN_COMPILE_DOMAIN	""
+#define XEN_COMPILE_HOST	"vm"
+#define XEN_COMPILER		"gcc (Debian 12.2.0-14+deb12u1) 12.2.0"
+
+#define XEN_VERSION		4
+#define XEN_SUBVERSION		6
+#define XEN_EXTRAVERSION	"-unstable"
+
+#define XEN_CHANGESET		"Mon Oct 19 19:45:41 2026 +0000 git:bda65c8-dirty"
+#define XEN_BANNER		\
+"\040\130\145\156\040\064\056\066\055\165\156\163\164\141\142\154\145\012" \
+""
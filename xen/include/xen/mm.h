@@ -413,5 +413,9 @@ int page_is_ram_type(unsigned long mfn, unsigned long mem_type);
 int prepare_ring_for_helper(struct domain *d, unsigned long gmfn,
                             struct page_info **_page, void **_va);
 void destroy_ring_for_helper(void **_va, struct page_info *page);
+/* Take the references of prepare_ring_for_helper() without mapping the
+ * page, for rings of several pages.  Released with put_page_and_type(). */
+int get_ring_page_for_helper(struct domain *d, unsigned long gmfn,
+                             struct page_info **_page);
 
 #endif /* __XEN_MM_H__ */
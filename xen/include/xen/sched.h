@@ -262,12 +262,13 @@ struct vm_event_domain
 {
     /* ring lock */
     spinlock_t ring_lock;
-    /* The ring has 64 entries */
-    unsigned char foreign_producers;
-    unsigned char target_producers;
-    /* shared ring page */
+    /* slots claimed in the ring */
+    unsigned int foreign_producers;
+    unsigned int target_producers;
+    /* shared ring pages, mapped contiguously */
     void *ring_page;
-    struct page_info *ring_pg_struct;
+    struct page_info **ring_pg_structs;
+    unsigned int nr_frames;
     /* front-end ring */
     vm_event_front_ring_t front_ring;
     /* event channel port (vcpu0 only) */
@@ -81,7 +81,7 @@ struct lock_profile_qhead {
     __used_section(".lockprofile.data") =                                     \
     &__lock_profile_data_##name
 #define _SPIN_LOCK_UNLOCKED(x) { _RAW_SPIN_LOCK_UNLOCKED, 0xfffu, 0,          \
-                                 _LOCK_DEBUG, x }
+                                 _LOCK_DEBUG, 0, x }
 #define SPIN_LOCK_UNLOCKED _SPIN_LOCK_UNLOCKED(NULL)
 #define DEFINE_SPINLOCK(l)                                                    \
     spinlock_t l = _SPIN_LOCK_UNLOCKED(NULL);                                 \
@@ -132,6 +132,7 @@ typedef struct spinlock {
     u16 recurse_cpu:12;
     u16 recurse_cnt:4;
     struct lock_debug debug;
+    u32 holder;                 /* lock statistics: where last taken */
 #ifdef LOCK_PROFILE
     struct lock_profile *profile;
 #endif
@@ -140,6 +141,9 @@ typedef struct spinlock {
 
 #define spin_lock_init(l) (*(l) = (spinlock_t)SPIN_LOCK_UNLOCKED)
 
+struct xen_sysctl_lockstat_op;
+int lock_stats_control(struct xen_sysctl_lockstat_op *op);
+
 typedef struct {
     volatile uint32_t lock;
     struct lock_debug debug;
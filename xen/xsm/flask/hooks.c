@@ -451,6 +451,7 @@ static int flask_profile(struct domain *d, int op)
     case XENOPROF_stop:
     case XENOPROF_release_counters:
     case XENOPROF_shutdown:
+    case XENOPROF_get_xen_buffer:
         perm = XEN__PRIVPROFILE;
         break;
     default:
@@ -611,6 +612,7 @@ static int flask_domctl(struct domain *d, int cmd)
 
     case XEN_DOMCTL_setvcpuaffinity:
     case XEN_DOMCTL_setnodeaffinity:
+    case XEN_DOMCTL_node_pages:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__SETAFFINITY);
 
     case XEN_DOMCTL_getvcpuaffinity:
@@ -647,6 +649,7 @@ static int flask_domctl(struct domain *d, int cmd)
     case XEN_DOMCTL_getpageframeinfo:
     case XEN_DOMCTL_getpageframeinfo2:
     case XEN_DOMCTL_getpageframeinfo3:
+    case XEN_DOMCTL_harvest_accessed:
         return current_has_perm(d, SECCLASS_MMU, MMU__PAGEINFO);
 
     case XEN_DOMCTL_getmemlist:
@@ -782,6 +785,7 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__PM_OP);
 
     case XEN_SYSCTL_lockprof_op:
+    case XEN_SYSCTL_lockstat_op:
         return domain_has_xen(current->domain, XEN__LOCKPROF);
 
     case XEN_SYSCTL_cpupool_op: